@@ -1,257 +1,1076 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
 #include "dictionary.h"
 #include "allocate.h"
+#include "intern.h"
+#include "region.h"
+#include "isolate.h"
+#include "compile.h"
+#include "task.h"
 
-data *data_heap;
-static unsigned int *data_heap_allocation;
-static unsigned int *data_heap_locations;
-static unsigned int data_heap_size;
-unsigned int num_allocated;
-scope *global_scope;
-scope *current_scope;
-static shadow_stack *stack;
-static unsigned int shadow_stack_size = 0;
-
-int initialize_heap(int num_entries){
+heap *create_heap(int num_entries){
+	heap *h;
 	int i;
 
-	data_heap = malloc(sizeof(data)*num_entries);
-	if(!data_heap){
-		return 0;
+	h = malloc(sizeof(heap));
+	if(!h){
+		return NULL;
 	}
-	data_heap_size = num_entries;
-	data_heap_allocation = malloc(sizeof(unsigned int)*num_entries);
-	if(!data_heap_allocation){
-		free(data_heap);
-		return 0;
+	h->data_heap = malloc(sizeof(data)*num_entries);
+	if(!h->data_heap){
+		free(h);
+		return NULL;
 	}
-	data_heap_locations = malloc(sizeof(unsigned int)*num_entries);
-	if(!data_heap_locations){
-		free(data_heap);
-		free(data_heap_allocation);
-		return 0;
+	h->data_heap_size = num_entries;
+	h->data_heap_allocation = malloc(sizeof(unsigned int)*num_entries);
+	if(!h->data_heap_allocation){
+		free(h->data_heap);
+		free(h);
+		return NULL;
+	}
+	h->data_heap_locations = malloc(sizeof(unsigned int)*num_entries);
+	if(!h->data_heap_locations){
+		free(h->data_heap);
+		free(h->data_heap_allocation);
+		free(h);
+		return NULL;
 	}
-	num_allocated = 0;
+	h->mark_stack = malloc(sizeof(int)*num_entries);
+	if(!h->mark_stack){
+		free(h->data_heap);
+		free(h->data_heap_allocation);
+		free(h->data_heap_locations);
+		free(h);
+		return NULL;
+	}
+	h->num_allocated = 0;
 	for(i = 0; i < num_entries; i++){
-		data_heap[i].type = NONE_DATA;
-		data_heap[i].num_references = 0;
-		data_heap_allocation[i] = i;
-		data_heap_locations[i] = i;
+		h->data_heap[i].type = NONE_DATA;
+		h->data_heap[i].num_references = 0;
+		h->data_heap[i].flags = 0;
+		h->data_heap_allocation[i] = i;
+		h->data_heap_locations[i] = i;
 	}
-	stack = NULL;
+	h->global_scope = NULL;
+	h->global_none = -1;
+	h->threads = NULL;
+	h->num_threads = 0;
+	h->num_parked = 0;
+	h->gc_pending = 0;
+	memset(&h->metrics, 0, sizeof(metrics));
+	h->profile = create_dictionary(NULL);
+	h->allocation_sites = NULL;
+	h->cell_generations = NULL;
+	h->sites = NULL;
+	h->num_sites = 0;
+	h->sites_size = 0;
+	h->site_buckets = NULL;
+	h->num_site_buckets = 0;
+	h->stack_limit = DEFAULT_STACK_LIMIT;
+	h->parallel_workers = 0;
+	h->isolate = NULL;
+	h->intern_buckets = NULL;
+	h->intern_next = NULL;
+	h->num_intern_buckets = 0;
+	h->compiled_buckets = NULL;
+	h->num_compiled_buckets = 0;
+	h->num_compiled = 0;
+	h->compact_pending = 0;
+	h->compact_after_collection = 0;
+	pthread_mutex_init(&h->intern_lock, NULL);
+	pthread_mutex_init(&h->compiled_lock, NULL);
+	pthread_mutex_init(&h->heap_lock, NULL);
+	pthread_cond_init(&h->parked_cond, NULL);
+	pthread_cond_init(&h->resume_cond, NULL);
+	pthread_rwlock_init(&h->global_scope_lock, NULL);
 
-	return 1;
+	return h;
 }
 
-int create_global_scope(){
-	global_scope = malloc(sizeof(scope));
-	if(!global_scope){
-		return 0;
+static void free_variable_unreferenced(void *v, void *context){
+	variable *var;
+
+	var = v;
+	free(var->name);
+	free(var);
+}
+
+//Every thread must have been unregistered first
+void free_heap(heap *h){
+	unsigned int i;
+
+	if(h->global_scope){
+		free_dictionary(&(h->global_scope->variables), free_variable_unreferenced, NULL);
+		free(h->global_scope);
 	}
-	global_scope->variables = create_dictionary(NULL);
-	global_scope->level = 0;
-	global_scope->previous = NULL;
-	global_scope->next = NULL;
+	for(i = 0; i < h->data_heap_size; i++){
+		if(h->data_heap[i].type == IDENTIFIER){
+			free(h->data_heap[i].identifier_name);
+		} else if(h->data_heap[i].type == S_EXPR || h->data_heap[i].type == Q_EXPR){
+			free_entries(h->data_heap + i);
+		} else if(h->data_heap[i].type == MEMO_FUNCTION && h->data_heap[i].memo_table){
+			discard_memo_table(h->data_heap[i].memo_table);
+		}
+	}
+	free(h->data_heap);
+	free(h->data_heap_allocation);
+	free(h->data_heap_locations);
+	free(h->mark_stack);
+	free_dictionary(&h->profile, free_profile_sample, NULL);
+	free_allocation_sites(h);
+	free(h->intern_buckets);
+	free(h->intern_next);
+	free_compiled_table(h);
+	if(h->isolate){
+		leave_isolate(h->isolate);
+	}
+	pthread_mutex_destroy(&h->intern_lock);
+	pthread_mutex_destroy(&h->compiled_lock);
+	pthread_mutex_destroy(&h->heap_lock);
+	pthread_cond_destroy(&h->parked_cond);
+	pthread_cond_destroy(&h->resume_cond);
+	pthread_rwlock_destroy(&h->global_scope_lock);
+	free(h);
+}
 
-	current_scope = global_scope;
+int create_global_scope(heap *h){
+	h->global_scope = malloc(sizeof(scope));
+	if(!h->global_scope){
+		return 0;
+	}
+	h->global_scope->variables = create_dictionary(NULL);
+	h->global_scope->level = 0;
+	h->global_scope->region_base = 0;
+	h->global_scope->num_variables = 0;
+	h->global_scope->previous = NULL;
 
 	return 1;
 }
 
-int next_scope(){
+//Each thread evaluating on the heap needs its own interp
+interp *register_thread(heap *h){
+	interp *in;
+
+	in = malloc(sizeof(interp));
+	if(!in){
+		return NULL;
+	}
+	in->heap = h;
+	in->data_heap = h->data_heap;
+	in->global_none = h->global_none;
+	in->current_scope = h->global_scope;
+	in->stack = NULL;
+	in->shadow_stack_size = 0;
+	in->num_local_cells = 0;
+	in->region_cells = NULL;
+	in->region_size = 0;
+	in->num_temporaries = 0;
+	in->temporary_result = 0;
+	in->owned_arguments = 0;
+	in->at_safepoint = 0;
+	memset(&in->metrics, 0, sizeof(metrics));
+	in->frames = NULL;
+	in->call_frames = NULL;
+	in->num_frames = 0;
+	in->frames_size = 0;
+	in->values = NULL;
+	in->borrowed = NULL;
+	in->num_values = 0;
+	in->values_size = 0;
+	in->zero_counts = NULL;
+	in->num_zero_counts = 0;
+	in->zero_counts_size = 0;
+	in->zero_count_cells = 0;
+	in->zero_count_limit = ZERO_COUNT_LIMIT;
+	init_cell_stack(&in->release_stack);
+	in->releasing = 0;
+	in->tasks = NULL;
+	in->num_tasks = 0;
+	in->tasks_size = 0;
+	in->current_task = NULL;
+	in->steps_left = 0;
+	in->finished_stack = NULL;
+	in->lines_file = NULL;
+	in->lines_path = NULL;
+	in->lines_offset = 0;
+	in->error_message = "none";
+	in->previous = NULL;
+
+	pthread_mutex_lock(&h->heap_lock);
+	while(__atomic_load_n(&h->gc_pending, __ATOMIC_ACQUIRE)){
+		pthread_cond_wait(&h->resume_cond, &h->heap_lock);
+	}
+	in->next = h->threads;
+	if(h->threads){
+		h->threads->previous = in;
+	}
+	h->threads = in;
+	h->num_threads++;
+	pthread_mutex_unlock(&h->heap_lock);
+
+	return in;
+}
+
+static void park_thread(interp *in);
+
+void unregister_thread(interp *in){
+	heap *h;
+
+	h = in->heap;
+	free_tasks(in);
+	clear_shadow_stack(in);
+	while(in->current_scope != h->global_scope){
+		previous_scope(in);
+	}
+	in->num_frames = 0;
+	in->num_values = 0;
+	free(in->frames);
+	free(in->call_frames);
+	free(in->values);
+	free(in->borrowed);
+	//The stack is empty now. Cells another thread still borrows are left for the collector
+	reconcile_zero_counts(in);
+	free(in->zero_counts);
+	free_cell_stack(&in->release_stack);
+	if(in->lines_file){
+		fclose(in->lines_file);
+	}
+	free(in->lines_path);
+
+	pthread_mutex_lock(&h->heap_lock);
+	if(__atomic_load_n(&h->gc_pending, __ATOMIC_ACQUIRE)){
+		park_thread(in);
+	}
+	while(in->num_local_cells){
+		in->num_local_cells--;
+		mark_deallocated(h, in->local_cells[in->num_local_cells]);
+	}
+	free_region(in);
+	//Keep the counts of threads that have gone away
+	add_metrics(&h->metrics, &in->metrics);
+	if(in->previous){
+		in->previous->next = in->next;
+	} else {
+		h->threads = in->next;
+	}
+	if(in->next){
+		in->next->previous = in->previous;
+	}
+	h->num_threads--;
+	pthread_cond_signal(&h->parked_cond);
+	pthread_mutex_unlock(&h->heap_lock);
+
+	free(in);
+}
+
+//Expects heap_lock to be held. Blocks until the pending collection has finished
+static void park_thread(interp *in){
+	heap *h;
+
+	h = in->heap;
+	in->at_safepoint = 1;
+	h->num_parked++;
+	pthread_cond_signal(&h->parked_cond);
+	while(__atomic_load_n(&h->gc_pending, __ATOMIC_ACQUIRE)){
+		pthread_cond_wait(&h->resume_cond, &h->heap_lock);
+	}
+	h->num_parked--;
+	in->at_safepoint = 0;
+}
+
+void safepoint(interp *in){
+	if(__atomic_load_n(&profile_ticks, __ATOMIC_RELAXED)){
+		record_profile_samples(in);
+	}
+	if(__atomic_load_n(&in->heap->gc_pending, __ATOMIC_ACQUIRE)){
+		pthread_mutex_lock(&in->heap->heap_lock);
+		park_thread(in);
+		pthread_mutex_unlock(&in->heap->heap_lock);
+	}
+}
+
+//Between these calls the thread may block without holding up a collection, so it must not touch the heap
+void enter_safe_region(interp *in){
+	pthread_mutex_lock(&in->heap->heap_lock);
+	in->at_safepoint = 1;
+	in->heap->num_parked++;
+	pthread_cond_signal(&in->heap->parked_cond);
+	pthread_mutex_unlock(&in->heap->heap_lock);
+}
+
+void leave_safe_region(interp *in){
+	pthread_mutex_lock(&in->heap->heap_lock);
+	while(__atomic_load_n(&in->heap->gc_pending, __ATOMIC_ACQUIRE)){
+		pthread_cond_wait(&in->heap->resume_cond, &in->heap->heap_lock);
+	}
+	in->heap->num_parked--;
+	in->at_safepoint = 0;
+	pthread_mutex_unlock(&in->heap->heap_lock);
+}
+
+void read_lock_global_scope(interp *in){
+	pthread_rwlock_rdlock(&in->heap->global_scope_lock);
+}
+
+void write_lock_global_scope(interp *in){
+	pthread_rwlock_wrlock(&in->heap->global_scope_lock);
+}
+
+void unlock_global_scope(interp *in){
+	pthread_rwlock_unlock(&in->heap->global_scope_lock);
+}
+
+int next_scope(interp *in){
 	scope *next;
 
 	next = malloc(sizeof(scope));
 	if(!next){
 		return 0;
 	}
+	in->metrics.scopes_created++;
 	next->variables = create_dictionary(NULL);
-	next->level = current_scope->level + 1;
-	next->previous = current_scope;
-	next->next = NULL;
+	next->level = in->current_scope->level + 1;
+	next->region_base = in->num_temporaries;
+	next->num_variables = 0;
+	next->previous = in->current_scope;
 
-	current_scope->next = next;
-	current_scope = next;
+	in->current_scope = next;
 
 	return 1;
 }
 
-void free_variable(void *v){
+void free_variable(void *v, void *context){
 	variable *var;
 
 	var = v;
-	decrement_references(var->data_index);
+	decrement_references(context, var->data_index);
 	free(var->name);
 	free(var);
 }
 
-void clear_scope(){
-	free_dictionary(&(current_scope->variables), free_variable);
+void clear_scope(interp *in){
+	free_dictionary(&(in->current_scope->variables), free_variable, in);
 }
 
-void previous_scope(){
+void previous_scope(interp *in){
 	scope *previous;
 
-	previous = current_scope->previous;
-	free_dictionary(&(current_scope->variables), free_variable);
-	free(current_scope);
-	current_scope = previous;
-
-	current_scope->next = NULL;
+	previous = in->current_scope->previous;
+	in->num_temporaries = in->current_scope->region_base;
+	free_dictionary(&(in->current_scope->variables), free_variable, in);
+	free(in->current_scope);
+	in->current_scope = previous;
 }
 
-void mark_allocated(int data_index){
+void mark_allocated(heap *h, int data_index){
 	int temp_index;
 
-	if(0 && data_index == data_heap_allocation[num_allocated]){
-		num_allocated++;
+	if(0 && data_index == h->data_heap_allocation[h->num_allocated]){
+		h->num_allocated++;
 	} else {
-		temp_index = data_heap_allocation[num_allocated];
-		data_heap_allocation[num_allocated] = data_index;
-		data_heap_allocation[data_heap_locations[data_index]] = temp_index;
-		data_heap_locations[temp_index] = data_heap_locations[data_index];
-		data_heap_locations[data_index] = num_allocated;
+		temp_index = h->data_heap_allocation[h->num_allocated];
+		h->data_heap_allocation[h->num_allocated] = data_index;
+		h->data_heap_allocation[h->data_heap_locations[data_index]] = temp_index;
+		h->data_heap_locations[temp_index] = h->data_heap_locations[data_index];
+		h->data_heap_locations[data_index] = h->num_allocated;
 
-		num_allocated++;
+		h->num_allocated++;
 	}
 }
 
-void mark_deallocated(int data_index){
+void mark_deallocated(heap *h, int data_index){
 	//Often, data is deallocated in the reverse order that it was allocated
-	if(0 && data_index == data_heap_allocation[num_allocated - 1]){
-		num_allocated--;
+	if(0 && data_index == h->data_heap_allocation[h->num_allocated - 1]){
+		h->num_allocated--;
 	} else {
-		num_allocated--;
+		h->num_allocated--;
 
 		//Again, this is confusing but it's the same swap as before
-		mark_allocated(data_index);
+		mark_allocated(h, data_index);
 
-		num_allocated--;
+		h->num_allocated--;
 	}
 }
 
-void mark_allocated_recursive(int data_index){
-	int i;
+void init_cell_stack(cell_stack *s){
+	s->cells = s->initial_cells;
+	s->depth = 0;
+	s->size = CELL_STACK_CELLS;
+}
+
+//Returns 0 if malloc fails
+int push_cell_stack(cell_stack *s, int data_index){
+	int *next_cells;
+
+	if(s->depth == s->size){
+		if(s->cells == s->initial_cells){
+			next_cells = malloc(sizeof(int)*s->size*2);
+			if(next_cells){
+				memcpy(next_cells, s->initial_cells, sizeof(int)*s->size);
+			}
+		} else {
+			next_cells = realloc(s->cells, sizeof(int)*s->size*2);
+		}
+		if(!next_cells){
+			return 0;
+		}
+		s->cells = next_cells;
+		s->size *= 2;
+	}
+	s->cells[s->depth] = data_index;
+	s->depth++;
+
+	return 1;
+}
+
+void free_cell_stack(cell_stack *s){
+	if(s->cells != s->initial_cells){
+		free(s->cells);
+	}
+}
 
-	if(data_heap_locations[data_index] < num_allocated){
+static void push_marked(heap *h, unsigned int *depth, int data_index){
+	if(h->data_heap_locations[data_index] < h->num_allocated){
 		return;
 	}
+	mark_allocated(h, data_index);
+	h->mark_stack[*depth] = data_index;
+	(*depth)++;
+}
 
-	mark_allocated(data_index);
+//Marks everything reachable from data_index, walking it with the heap's mark stack so that nesting
+//depth doesn't use up the C stack
+void mark_allocated_recursive(heap *h, int data_index){
+	memo_entry *entry;
+	data *d;
+	unsigned int depth = 0;
+	int i;
 
-	if(data_heap[data_index].type == S_EXPR || data_heap[data_index].type == Q_EXPR){
-		for(i = 0; i < data_heap[data_index].num_entries; i++){
-			mark_allocated_recursive(data_heap[data_index].entries[i]);
+	push_marked(h, &depth, data_index);
+	while(depth){
+		depth--;
+		d = h->data_heap + h->mark_stack[depth];
+		if(d->type == S_EXPR || d->type == Q_EXPR){
+			for(i = 0; i < d->num_entries; i++){
+				push_marked(h, &depth, d->entries[i]);
+			}
+		} else if(d->type == FUNCTION){
+			push_marked(h, &depth, d->var_list);
+			push_marked(h, &depth, d->source);
+		} else if(d->type == MEMO_FUNCTION){
+			push_marked(h, &depth, d->memo_function);
+			for(entry = d->memo_table->newest; entry; entry = entry->older){
+				push_marked(h, &depth, entry->key);
+				push_marked(h, &depth, entry->value);
+			}
+		} else if(d->type == PROMISE){
+			if(d->promise_expr != -1){
+				push_marked(h, &depth, d->promise_expr);
+			}
+			if(d->promise_value != -1){
+				push_marked(h, &depth, d->promise_value);
+			}
 		}
-	} else if(data_heap[data_index].type == FUNCTION){
-		mark_allocated_recursive(data_heap[data_index].var_list);
-		mark_allocated_recursive(data_heap[data_index].source);
 	}
 }
 
-void mark_variable_data(void *v){
+void mark_variable_data(void *v, void *context){
 	variable *var;
 
 	var = v;
-	mark_allocated_recursive(var->data_index);
+	mark_allocated_recursive(context, var->data_index);
+}
+
+static int push_unshared(interp *in, cell_stack *s, int data_index){
+	if(in->data_heap[data_index].flags&DATA_SHARED){
+		return 1;
+	}
+
+	return push_cell_stack(s, data_index);
+}
+
+//Called before data becomes visible to other threads, e.g. when it is bound in the global scope.
+//Returns 0 with the error set if malloc fails, in which case the data must not be published. A cell
+//is only flagged once its children are, which ~data_index on the stack stands for, so a shared cell
+//never has unshared children even then
+int mark_shared(interp *in, int data_index){
+	cell_stack s;
+	memo_table *table;
+	memo_entry *entry;
+	data *d;
+	int program;
+	int success;
+	int i;
+
+	init_cell_stack(&s);
+	success = push_unshared(in, &s, data_index);
+	while(success && s.depth){
+		s.depth--;
+		data_index = s.cells[s.depth];
+		if(data_index < 0){
+			in->data_heap[~data_index].flags |= DATA_SHARED;
+			continue;
+		}
+		d = in->data_heap + data_index;
+		if(d->flags&DATA_SHARED){
+			continue;
+		}
+		success = push_cell_stack(&s, ~data_index);
+		if(success && d->flags&DATA_COMPILED){
+			program = compiled_program_of(in, data_index);
+			if(program != -1){
+				success = push_unshared(in, &s, program);
+			}
+		}
+		if(d->type == S_EXPR || d->type == Q_EXPR){
+			for(i = 0; success && i < d->num_entries; i++){
+				success = push_unshared(in, &s, d->entries[i]);
+			}
+		} else if(d->type == FUNCTION){
+			success = success && push_unshared(in, &s, d->var_list) && push_unshared(in, &s, d->source);
+		} else if(d->type == MEMO_FUNCTION){
+			success = success && push_unshared(in, &s, d->memo_function);
+			table = d->memo_table;
+			pthread_mutex_lock(&table->lock);
+			for(entry = table->newest; success && entry; entry = entry->older){
+				success = push_unshared(in, &s, entry->key) && push_unshared(in, &s, entry->value);
+			}
+			pthread_mutex_unlock(&table->lock);
+		} else if(d->type == PROMISE){
+			if(success && d->promise_expr != -1){
+				success = push_unshared(in, &s, d->promise_expr);
+			}
+			if(success && d->promise_value != -1){
+				success = push_unshared(in, &s, d->promise_value);
+			}
+		}
+	}
+	free_cell_stack(&s);
+	if(!success){
+		set_error(in, "malloc returned NULL");
+	}
+
+	return success;
+}
+
+//Expects heap_lock to be held. Returns once every other thread is parked at a safepoint
+static void stop_world(interp *in){
+	heap *h;
+
+	h = in->heap;
+	__atomic_store_n(&h->gc_pending, 1, __ATOMIC_RELEASE);
+	while(h->num_parked < h->num_threads - 1){
+		pthread_cond_wait(&h->parked_cond, &h->heap_lock);
+	}
+}
+
+static void resume_world(interp *in){
+	__atomic_store_n(&in->heap->gc_pending, 0, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&in->heap->resume_cond);
+}
+
+//Returns with heap_lock held and every other thread parked, for walking the heap outside a collection
+void lock_world(interp *in){
+	pthread_mutex_lock(&in->heap->heap_lock);
+	if(__atomic_load_n(&in->heap->gc_pending, __ATOMIC_ACQUIRE)){
+		park_thread(in);
+	}
+	stop_world(in);
+}
+
+void unlock_world(interp *in){
+	resume_world(in);
+	pthread_mutex_unlock(&in->heap->heap_lock);
+}
+
+//Expects the world to be stopped and the heap marked. Cells in the table that nothing reaches are
+//about to be reused
+static void prune_zero_counts(heap *h, interp *thread){
+	unsigned int num_kept = 0;
+	unsigned int i;
+
+	for(i = 0; i < thread->num_zero_counts; i++){
+		if(h->data_heap_locations[thread->zero_counts[i]] < h->num_allocated){
+			thread->zero_counts[num_kept] = thread->zero_counts[i];
+			num_kept++;
+		}
+	}
+	thread->num_zero_counts = num_kept;
+	thread->zero_count_cells = num_kept;
 }
 
-void garbage_collect(){
+//Expects heap_lock to be held
+void garbage_collect(interp *in){
+	heap *h;
+	interp *thread;
 	scope *search_scope;
 	shadow_stack *stack_place;
+	struct timespec start;
+	struct timespec end;
+	unsigned int i;
 
-	printf("garbage collecting...\n");
-	num_allocated = 0;
-	search_scope = global_scope;
-	while(search_scope){
-		iterate_dictionary(search_scope->variables, mark_variable_data);
-		search_scope = search_scope->next;
+	h = in->heap;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	stop_world(in);
+
+	h->num_allocated = 0;
+	mark_allocated_recursive(h, h->global_none);
+	iterate_dictionary(h->global_scope->variables, mark_variable_data, h);
+
+	for(thread = h->threads; thread; thread = thread->next){
+		thread->num_local_cells = 0;
+		mark_region(h, thread);
+
+		search_scope = thread->current_scope;
+		while(search_scope != h->global_scope){
+			iterate_dictionary(search_scope->variables, mark_variable_data, h);
+			search_scope = search_scope->previous;
+		}
+
+		stack_place = thread->stack;
+		while(stack_place){
+			mark_allocated_recursive(h, stack_place->data_index);
+			stack_place = stack_place->previous;
+		}
+
+		for(i = 0; i < thread->num_frames; i++){
+			mark_allocated_recursive(h, thread->frames[i].expr);
+		}
+		for(i = 0; i < thread->num_values; i++){
+			mark_allocated_recursive(h, thread->values[i]);
+		}
+		mark_tasks(h, thread);
+	}
+	for(thread = h->threads; thread; thread = thread->next){
+		prune_zero_counts(h, thread);
+	}
+	mark_compiled(h);
+	sweep_compiled(h);
+	if(h->intern_buckets){
+		sweep_intern_table(h);
+	}
+	if(h->compact_after_collection){
+		h->compact_pending = 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	record_pause(&h->metrics, (end.tv_sec - start.tv_sec)*1000000000UL + end.tv_nsec - start.tv_nsec);
+
+	resume_world(in);
+}
+
+//Reserve a batch of free cells for this thread so most allocations don't need heap_lock
+static int refill_local_cells(interp *in){
+	heap *h;
+
+	h = in->heap;
+	pthread_mutex_lock(&h->heap_lock);
+	if(__atomic_load_n(&h->gc_pending, __ATOMIC_ACQUIRE)){
+		park_thread(in);
+	}
+	if(h->num_allocated >= h->data_heap_size){
+		garbage_collect(in);
+		if(h->num_allocated >= h->data_heap_size){
+			pthread_mutex_unlock(&h->heap_lock);
+			set_error(in, "out of memory");
+			return 0;
+		}
 	}
 
-	stack_place = stack;
-	while(stack_place){
-		mark_allocated_recursive(stack_place->data_index);
-		stack_place = stack_place->previous;
+	while(in->num_local_cells < LOCAL_CELLS && h->num_allocated < h->data_heap_size){
+		in->local_cells[in->num_local_cells] = h->data_heap_allocation[h->num_allocated];
+		in->num_local_cells++;
+		h->num_allocated++;
 	}
-	printf("after garbage collection: %d\n", num_allocated);
+	//Cells reserved by a thread count as live until they are handed back
+	if(h->num_allocated > h->metrics.peak_live_cells){
+		h->metrics.peak_live_cells = h->num_allocated;
+	}
+	pthread_mutex_unlock(&h->heap_lock);
+
+	return 1;
 }
 
-int allocate(){
-	if(num_allocated >= data_heap_size){
-		garbage_collect();
-		if(num_allocated >= data_heap_size){
-			fprintf(stderr, "Error: Out of memory!\n");
-			return -1;
+//Releases what a free cell still holds from before it was freed
+static void reset_cell(interp *in, int data_index){
+	if(in->data_heap[data_index].type == IDENTIFIER){
+		free(in->data_heap[data_index].identifier_name);
+	} else if(in->data_heap[data_index].type == S_EXPR || in->data_heap[data_index].type == Q_EXPR){
+		free_entries(in->data_heap + data_index);
+	} else if(in->data_heap[data_index].type == MEMO_FUNCTION && in->data_heap[data_index].memo_table){
+		discard_memo_table(in->data_heap[data_index].memo_table);
+	}
+
+	//Stale contents were just released, so a collection must not release them again
+	in->data_heap[data_index].type = NONE_DATA;
+	in->data_heap[data_index].num_references = 0;
+	in->data_heap[data_index].flags = 0;
+	if(in->heap->allocation_sites){
+		in->heap->cell_generations[data_index]++;
+		in->heap->allocation_sites[data_index] = current_allocation_site(in);
+	}
+}
+
+int allocate(interp *in){
+	int data_index;
+
+	safepoint(in);
+	if(!in->num_local_cells && !refill_local_cells(in)){
+		return -1;
+	}
+
+	in->num_local_cells--;
+	in->metrics.allocations++;
+	data_index = in->local_cells[in->num_local_cells];
+	reset_cell(in, data_index);
+	in->data_heap[data_index].num_references = 1;
+
+	return data_index;
+}
+
+//Takes num_cells cells from the heap at once, collecting first if it doesn't have that many free. They
+//come back with no contents and no references, and nothing keeps them alive, so the caller must make
+//them reachable before it reaches a safepoint. Returns 0 if the heap is out of memory
+int allocate_cells(interp *in, int *cells, unsigned int num_cells){
+	heap *h;
+	unsigned int i;
+
+	h = in->heap;
+	safepoint(in);
+	pthread_mutex_lock(&h->heap_lock);
+	if(__atomic_load_n(&h->gc_pending, __ATOMIC_ACQUIRE)){
+		park_thread(in);
+	}
+	if(h->data_heap_size - h->num_allocated < num_cells){
+		garbage_collect(in);
+		if(h->data_heap_size - h->num_allocated < num_cells){
+			pthread_mutex_unlock(&h->heap_lock);
+			set_error(in, "out of memory");
+			return 0;
 		}
 	}
+	for(i = 0; i < num_cells; i++){
+		cells[i] = h->data_heap_allocation[h->num_allocated];
+		h->num_allocated++;
+	}
+	if(h->num_allocated > h->metrics.peak_live_cells){
+		h->metrics.peak_live_cells = h->num_allocated;
+	}
+	pthread_mutex_unlock(&h->heap_lock);
 
-	if(data_heap[data_heap_allocation[num_allocated]].type == IDENTIFIER){
-		free(data_heap[data_heap_allocation[num_allocated]].identifier_name);
-	} else if(data_heap[data_heap_allocation[num_allocated]].type == S_EXPR || data_heap[data_heap_allocation[num_allocated]].type == Q_EXPR){
-		free(data_heap[data_heap_allocation[num_allocated]].entries);
+	in->metrics.allocations += num_cells;
+	for(i = 0; i < num_cells; i++){
+		reset_cell(in, cells[i]);
+	}
+
+	return 1;
+}
+
+//Makes room for size entries, keeping the num_entries already there. entries may be NULL for an
+//empty list. Returns NULL and leaves the list as it was if malloc fails
+int *resize_entries(data *d, int size){
+	int *next_entries;
+
+	if(d->entries == d->inline_entries){
+		if(size <= INLINE_ENTRIES){
+			return d->entries;
+		}
+		next_entries = malloc(sizeof(int)*size);
+		if(!next_entries){
+			return NULL;
+		}
+		memcpy(next_entries, d->inline_entries, sizeof(int)*(d->num_entries < INLINE_ENTRIES ? d->num_entries : INLINE_ENTRIES));
+	} else if(!d->entries && size <= INLINE_ENTRIES){
+		next_entries = d->inline_entries;
+	} else {
+		next_entries = realloc(d->entries, sizeof(int)*(size ? size : 1));
+		if(!next_entries){
+			return NULL;
+		}
+	}
+	d->entries = next_entries;
+
+	return next_entries;
+}
+
+void free_entries(data *d){
+	if(d->entries != d->inline_entries){
+		free(d->entries);
+	}
+	d->entries = NULL;
+}
+
+//Sets an analysis flag on a cell that other threads can be walking at the same time
+void set_flag(interp *in, int data_index, int flag){
+	if(in->data_heap[data_index].flags&DATA_SHARED){
+		__atomic_or_fetch(&in->data_heap[data_index].flags, flag, __ATOMIC_RELAXED);
+	} else {
+		in->data_heap[data_index].flags |= flag;
+	}
+}
+
+void increment_references(interp *in, int data_index){
+	if(in->data_heap[data_index].flags&DATA_SHARED){
+		__atomic_add_fetch(&in->data_heap[data_index].num_references, 1, __ATOMIC_RELAXED);
+	} else {
+		in->data_heap[data_index].num_references++;
 	}
+}
 
-	data_heap[data_heap_allocation[num_allocated]].num_references = 1;
-	num_allocated++;
-	return data_heap_allocation[num_allocated - 1];
+static void free_cell(interp *in, int data_index){
+	in->metrics.frees++;
+	if(in->num_local_cells < LOCAL_CELLS){
+		in->local_cells[in->num_local_cells] = data_index;
+		in->num_local_cells++;
+	} else {
+		pthread_mutex_lock(&in->heap->heap_lock);
+		mark_deallocated(in->heap, data_index);
+		pthread_mutex_unlock(&in->heap->heap_lock);
+	}
 }
 
-void decrement_references(int data_index){
+static void release_contents(interp *in, int data_index){
 	int i;
 
-	data_heap[data_index].num_references--;
-	if(data_heap[data_index].num_references == 0){
-		if(data_heap[data_index].type == Q_EXPR || data_heap[data_index].type == S_EXPR){
-			for(i = 0; i < data_heap[data_index].num_entries; i++){
-				decrement_references(data_heap[data_index].entries[i]);
+	if(in->data_heap[data_index].flags&DATA_INTERNED){
+		release_interned(in, data_index);
+	}
+	if(in->data_heap[data_index].flags&DATA_COMPILED){
+		forget_compiled(in, data_index);
+	}
+	if(in->data_heap[data_index].type == Q_EXPR || in->data_heap[data_index].type == S_EXPR){
+		for(i = 0; i < in->data_heap[data_index].num_entries; i++){
+			decrement_references(in, in->data_heap[data_index].entries[i]);
+		}
+	} else if(in->data_heap[data_index].type == FUNCTION){
+		decrement_references(in, in->data_heap[data_index].var_list);
+		decrement_references(in, in->data_heap[data_index].source);
+	} else if(in->data_heap[data_index].type == MEMO_FUNCTION){
+		decrement_references(in, in->data_heap[data_index].memo_function);
+		release_memo_table(in, in->data_heap[data_index].memo_table);
+		in->data_heap[data_index].memo_table = NULL;
+	} else if(in->data_heap[data_index].type == PROMISE){
+		if(in->data_heap[data_index].promise_expr != -1){
+			decrement_references(in, in->data_heap[data_index].promise_expr);
+		}
+		if(in->data_heap[data_index].promise_value != -1){
+			decrement_references(in, in->data_heap[data_index].promise_value);
+		}
+	}
+	free_cell(in, data_index);
+}
+
+//Releases what a cell refers to and frees it, once nothing refers to it. Cells that this lets go of
+//are released one after another from the release stack
+static void release_cell(interp *in, int data_index){
+	if(in->releasing){
+		//One that doesn't fit is released right away
+		if(!push_cell_stack(&in->release_stack, data_index)){
+			release_contents(in, data_index);
+		}
+		return;
+	}
+	in->releasing = 1;
+	release_contents(in, data_index);
+	while(in->release_stack.depth){
+		in->release_stack.depth--;
+		release_contents(in, in->release_stack.cells[in->release_stack.depth]);
+	}
+	in->releasing = 0;
+}
+
+//Puts a cell in the zero count table instead of freeing it. A cell can only be in one table at a
+//time, and one that doesn't fit is left for the collector
+static void defer_release(interp *in, int data_index){
+	int *next_zero_counts;
+	unsigned int next_size;
+	int flags;
+
+	if(in->data_heap[data_index].flags&DATA_SHARED){
+		flags = __atomic_fetch_or(&in->data_heap[data_index].flags, DATA_ZERO_COUNT, __ATOMIC_RELAXED);
+	} else {
+		flags = in->data_heap[data_index].flags;
+		in->data_heap[data_index].flags |= DATA_ZERO_COUNT;
+	}
+	if(flags&DATA_ZERO_COUNT){
+		return;
+	}
+	if(in->num_zero_counts == in->zero_counts_size){
+		next_size = in->zero_counts_size ? in->zero_counts_size*2 : ZERO_COUNT_LIMIT;
+		next_zero_counts = realloc(in->zero_counts, sizeof(int)*next_size);
+		if(!next_zero_counts){
+			return;
+		}
+		in->zero_counts = next_zero_counts;
+		in->zero_counts_size = next_size;
+	}
+	in->zero_counts[in->num_zero_counts] = data_index;
+	in->num_zero_counts++;
+	//A long list would otherwise wait as long as many small cells
+	in->zero_count_cells++;
+	if(in->data_heap[data_index].type == Q_EXPR || in->data_heap[data_index].type == S_EXPR){
+		in->zero_count_cells += in->data_heap[data_index].num_entries;
+	}
+}
+
+void decrement_references(interp *in, int data_index){
+	int num_references;
+
+	//Temporaries are released with their region
+	if(in->data_heap[data_index].flags&DATA_TEMPORARY){
+		return;
+	}
+	if(in->data_heap[data_index].flags&DATA_SHARED){
+		num_references = __atomic_sub_fetch(&in->data_heap[data_index].num_references, 1, __ATOMIC_ACQ_REL);
+	} else {
+		num_references = --in->data_heap[data_index].num_references;
+	}
+	if(num_references == 0){
+		if(in->data_heap[data_index].flags&DATA_STACKED){
+			defer_release(in, data_index);
+		} else {
+			release_cell(in, data_index);
+		}
+	}
+}
+
+//Adds the cells a value stack borrows
+static unsigned long add_stacked(int *stacked, unsigned long num_stacked, int *values, unsigned char *borrowed, unsigned int num_values){
+	unsigned int i;
+
+	for(i = 0; i < num_values; i++){
+		if(borrowed[i]){
+			stacked[num_stacked] = values[i];
+			num_stacked++;
+		}
+	}
+
+	return num_stacked;
+}
+
+static int compare_cells(const void *a, const void *b){
+	return (*(int *) a > *(int *) b) - (*(int *) a < *(int *) b);
+}
+
+//Releases the cells in this thread's zero count table that no value stack borrows any more, and drops
+//the ones that are counted again. The stacks of every thread and task are scanned with the world
+//stopped, but the cells are released after it resumes. A cell nothing counts or borrows can't be
+//reached, so no other thread can take it back in the meantime
+void reconcile_zero_counts(interp *in){
+	interp *thread;
+	int *stacked = NULL;
+	int *released;
+	unsigned long num_stacked = 0;
+	unsigned int num_released = 0;
+	unsigned int num_kept = 0;
+	unsigned int i;
+	unsigned int j;
+	task *t;
+	int data_index;
+
+	if(!in->num_zero_counts){
+		return;
+	}
+	released = malloc(sizeof(int)*in->num_zero_counts);
+	if(!released){
+		return;
+	}
+	lock_world(in);
+	for(thread = in->heap->threads; thread; thread = thread->next){
+		num_stacked += thread->num_values;
+		for(j = 0; j < thread->num_tasks; j++){
+			if(thread->tasks[j] && thread->tasks[j] != running_task(thread)){
+				num_stacked += thread->tasks[j]->num_values;
+			}
+		}
+	}
+	if(num_stacked){
+		stacked = malloc(sizeof(int)*num_stacked);
+		if(!stacked){
+			unlock_world(in);
+			free(released);
+			return;
+		}
+	}
+	num_stacked = 0;
+	for(thread = in->heap->threads; thread; thread = thread->next){
+		num_stacked = add_stacked(stacked, num_stacked, thread->values, thread->borrowed, thread->num_values);
+		for(j = 0; j < thread->num_tasks; j++){
+			t = thread->tasks[j];
+			if(t && t != running_task(thread) && t->state == TASK_RUNNING){
+				num_stacked = add_stacked(stacked, num_stacked, t->values, t->borrowed, t->num_values);
 			}
-		} else if(data_heap[data_index].type == FUNCTION){
-			decrement_references(data_heap[data_index].var_list);
-			decrement_references(data_heap[data_index].source);
 		}
-		mark_deallocated(data_index);
 	}
+	if(num_stacked){
+		qsort(stacked, num_stacked, sizeof(int), compare_cells);
+	}
+	for(i = 0; i < in->num_zero_counts; i++){
+		data_index = in->zero_counts[i];
+		if(__atomic_load_n(&in->data_heap[data_index].num_references, __ATOMIC_RELAXED)){
+			__atomic_and_fetch(&in->data_heap[data_index].flags, ~DATA_ZERO_COUNT, __ATOMIC_RELAXED);
+		} else if(num_stacked && bsearch(&data_index, stacked, num_stacked, sizeof(int), compare_cells)){
+			in->zero_counts[num_kept] = data_index;
+			num_kept++;
+		} else {
+			released[num_released] = data_index;
+			num_released++;
+		}
+	}
+	in->num_zero_counts = num_kept;
+	in->zero_count_cells = num_kept;
+	//Scanning the stacks again costs as much as the cells that waited for it
+	in->zero_count_limit = num_kept + num_stacked > ZERO_COUNT_LIMIT ? num_kept + num_stacked : ZERO_COUNT_LIMIT;
+	unlock_world(in);
+
+	free(stacked);
+	for(i = 0; i < num_released; i++){
+		in->metrics.deferred_releases++;
+		release_cell(in, released[i]);
+	}
+	free(released);
 }
 
-int push_shadow_stack(int data_index){
+int push_shadow_stack(interp *in, int data_index){
 	shadow_stack *next;
 
 	next = malloc(sizeof(shadow_stack));
 	if(!next){
 		return 0;
 	}
-	next->previous = stack;
+	next->previous = in->stack;
 	next->data_index = data_index;
-	stack = next;
-	shadow_stack_size++;
+	in->stack = next;
+	in->shadow_stack_size++;
 
 	return 1;
 }
 
-int pop_shadow_stack(){
+int pop_shadow_stack(interp *in){
 	shadow_stack *previous;
 	int output;
 
-	previous = stack->previous;
-	output = stack->data_index;
-	free(stack);
-	stack = previous;
-	shadow_stack_size--;
+	previous = in->stack->previous;
+	output = in->stack->data_index;
+	free(in->stack);
+	in->stack = previous;
+	in->shadow_stack_size--;
 
 	return output;
 }
 
-void clear_shadow_stack(){
-	while(stack){
-		pop_shadow_stack();
+void clear_shadow_stack(interp *in){
+	while(in->stack){
+		pop_shadow_stack(in);
 	}
 }
 
-shadow_stack *get_shadow_stack(){
-	return stack;
+shadow_stack *get_shadow_stack(interp *in){
+	return in->stack;
 }
 
-void set_shadow_stack(shadow_stack *next_stack){
-	stack = next_stack;
+void set_shadow_stack(interp *in, shadow_stack *next_stack){
+	in->stack = next_stack;
 }
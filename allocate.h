@@ -1,4 +1,12 @@
+#ifndef ALLOCATE_INCLUDED
+#define ALLOCATE_INCLUDED
+#include <pthread.h>
+#include <stdio.h>
 #include "dictionary.h"
+#include "lisp.h"
+#include "profile.h"
+#include "heapprof.h"
+#include "memo.h"
 
 typedef enum data_type data_type;
 
@@ -9,36 +17,82 @@ enum data_type{
 	S_EXPR,
 	Q_EXPR,
 	BUILTIN_FUNCTION,
-	FUNCTION
+	FUNCTION,
+	MEMO_FUNCTION,
+	PROMISE
 };
 
+//Data reachable from more than one thread has its reference count updated atomically
+#define DATA_SHARED 1
+//Hash consed by intern.c, so it must not be modified
+#define DATA_INTERNED 2
+//Allocated in a region by region.c. Its reference count is ignored and it is released with the region
+#define DATA_TEMPORARY 4
+//An S expression whose S expression arguments don't outlive it, if its function turns out to be a
+//builtin that only reads its arguments. Set by analyze_escapes()
+#define DATA_NO_ESCAPE 8
+//A list analyze_escapes() has already walked
+#define DATA_ANALYZED 16
+//A Q expression eval has run at least once
+#define DATA_EVALUATED 32
+//A Q expression with an entry in the compiled table of compile.c
+#define DATA_COMPILED 64
+//Read onto a value stack without counting the reference, so a count of zero doesn't mean nothing
+//refers to it. See reconcile_zero_counts()
+#define DATA_STACKED 128
+//In a thread's zero count table
+#define DATA_ZERO_COUNT 256
+
+//Lists this short keep their entries in the cell instead of a separate array
+#define INLINE_ENTRIES 2
+
 typedef struct data data;
 
 struct data{
 	data_type type;
+	//Kept outside the union, where it fills the padding after type
+	int num_entries;
 	union{
 		int int_value;
 		char *identifier_name;
+		//entries points at inline_entries while the list fits in them. Use resize_entries() and
+		//free_entries() rather than malloc and free
 		struct{
-			int num_entries;
 			int *entries;
+			int inline_entries[INLINE_ENTRIES];
 		};
 		struct{
 			int var_list;
 			int source;
 		};
-		int (*builtin_function)(int, int *);
+		struct{
+			int (*builtin_function)(interp *, int *, int, int *);
+			int builtin_id;
+		};
+		struct{
+			int memo_function;
+			memo_table *memo_table;
+		};
+		//promise_value is -1 until forced. Forcing an unshared promise releases promise_expr
+		struct{
+			int promise_expr;
+			int promise_value;
+		};
 	};
 	int num_references;
+	int flags;
 };
 
 typedef struct scope scope;
 
 struct scope{
 	int level;
+	//Temporaries allocated while this scope is current start here in the thread's region
+	unsigned int region_base;
+	//Variables set_variable() has added, so a scope reused across calls can tell if one added any
+	unsigned int num_variables;
 	dictionary variables;
 	scope *previous;
-	scope *next;
 };
 
 typedef struct variable variable;
@@ -55,28 +109,204 @@ struct shadow_stack{
 	int data_index;
 };
 
-extern data *data_heap;
-extern unsigned int num_allocated;
-extern scope *global_scope;
-extern scope *current_scope;
-
-int initialize_heap(int num_entries);
-int create_global_scope();
-int next_scope();
-void free_variable(void *v);
-void clear_scope();
-void previous_scope();
-void mark_protected(int data_index);
-void mark_unprotected(int data_index);
-void mark_allocated(int data_index);
-void mark_allocated_recursive(int data_index);
-void mark_variable_data(void *v);
-void garbage_collect();
-int allocate();
-void decrement_references(int data_index);
-int push_shadow_stack(int data_index);
-int pop_shadow_stack();
-void clear_shadow_stack();
-shadow_stack *get_shadow_stack();
-void set_shadow_stack(shadow_stack *next_stack);
+typedef struct eval_frame eval_frame;
+
+//One S expression being evaluated by the evaluator in execute.c. Frames own a reference to expr.
+//Values evaluated so far (the function, then its arguments) are on the value stack from base up
+struct eval_frame{
+	int expr;
+	int next;
+	unsigned int base;
+	unsigned char state;
+	unsigned char made_scope;
+	//The value is only read by the frame below, so it can be a temporary
+	unsigned char temporary;
+};
+
+//Default limit on the bytes of frames and values one thread's evaluation can use
+#define DEFAULT_STACK_LIMIT (64UL<<20)
+
+//Number of free cells a thread reserves from the heap at a time
+#define LOCAL_CELLS 64
+
+//Most cells a thread keeps reserved for temporaries
+#define REGION_CELLS 1024
+
+//Fewest cells a thread's zero count table holds up before the evaluator reconciles it
+#define ZERO_COUNT_LIMIT 1024
+
+//Cells a cell_stack holds before it needs malloc
+#define CELL_STACK_CELLS 32
+
+typedef struct cell_stack cell_stack;
+
+//Cells still to visit while walking nested data, for walkers that mustn't recurse in C. cells points
+//at initial_cells until the stack outgrows them
+struct cell_stack{
+	int *cells;
+	unsigned int depth;
+	unsigned int size;
+	int initial_cells[CELL_STACK_CELLS];
+};
+
+typedef struct heap heap;
+typedef struct isolate isolate;
+typedef struct compiled_program compiled_program;
+typedef struct task task;
+
+//Everything shared by the threads evaluating in one interpreter
+struct heap{
+	data *data_heap;
+	unsigned int *data_heap_allocation;
+	unsigned int *data_heap_locations;
+	unsigned int data_heap_size;
+	unsigned int num_allocated;
+	//Cells marked by a collection whose children haven't been marked yet. A cell is pushed once, when
+	//it is marked, so the stack is as large as the heap and never needs to grow
+	int *mark_stack;
+	scope *global_scope;
+	int global_none;
+	interp *threads;
+	unsigned int num_threads;
+	unsigned int num_parked;
+	//Set while a thread stops the world. Safepoints poll it without heap_lock, so it is only accessed
+	//atomically
+	int gc_pending;
+	metrics metrics;
+	dictionary profile;
+	//Allocation site of each cell, or NULL when sites aren't tracked. A cell's generation counts the
+	//times it has been allocated, so a site keyed by a form cell isn't reused for a later form there
+	int *allocation_sites;
+	unsigned int *cell_generations;
+	allocation_site **sites;
+	int num_sites;
+	int sites_size;
+	//Open addressing table of site IDs, or -1, see heapprof.c
+	int *site_buckets;
+	unsigned int num_site_buckets;
+	unsigned long stack_limit;
+	//Threads pmap and psort run on, or 0 for one per CPU
+	unsigned int parallel_workers;
+	//Set once the heap has a mailbox, see isolate.c
+	isolate *isolate;
+	//Weak table of hash consed cells, chained through intern_next. NULL unless hash consing is on
+	int *intern_buckets;
+	int *intern_next;
+	unsigned int num_intern_buckets;
+	pthread_mutex_t intern_lock;
+	//Compiled forms of the Q expressions eval runs, chained by source. See compile.c
+	compiled_program **compiled_buckets;
+	unsigned int num_compiled_buckets;
+	unsigned int num_compiled;
+	pthread_mutex_t compiled_lock;
+	//Set by (compact), or by every collection with compact_after_collection, until compact_heap() runs
+	int compact_pending;
+	int compact_after_collection;
+	pthread_mutex_t heap_lock;
+	pthread_cond_t parked_cond;
+	pthread_cond_t resume_cond;
+	pthread_rwlock_t global_scope_lock;
+};
+
+//The state of one thread evaluating on a heap. data_heap and global_none are copied from the heap
+struct interp{
+	heap *heap;
+	data *data_heap;
+	int global_none;
+	scope *current_scope;
+	shadow_stack *stack;
+	unsigned int shadow_stack_size;
+	unsigned int local_cells[LOCAL_CELLS];
+	unsigned int num_local_cells;
+	//Cells reserved for temporaries. Those below num_temporaries are in use, the rest are free
+	int *region_cells;
+	unsigned int region_size;
+	unsigned int num_temporaries;
+	//Set while a builtin runs whose integer result only lives as long as its scope
+	int temporary_result;
+	//Set while a builtin runs. Bit i means the caller's reference to args[i] is counted, so when it is
+	//the only one the builtin can build its result in that cell
+	unsigned int owned_arguments;
+	int at_safepoint;
+	metrics metrics;
+	eval_frame *frames;
+	//What the profilers know about each of frames, grown along with it
+	call_frame *call_frames;
+	unsigned int num_frames;
+	unsigned int frames_size;
+	int *values;
+	//Set where values holds a reference that isn't counted, because the frame's expression or a
+	//variable keeps the cell alive
+	unsigned char *borrowed;
+	unsigned int num_values;
+	unsigned int values_size;
+	//Cells whose count reached zero while a value stack could still be borrowing them. They are
+	//released once a scan of the stacks finds them gone. zero_count_cells counts them with the
+	//entries of the lists among them, and the scan happens when it reaches zero_count_limit
+	int *zero_counts;
+	unsigned int num_zero_counts;
+	unsigned int zero_counts_size;
+	unsigned long zero_count_cells;
+	unsigned long zero_count_limit;
+	//Cells whose count reached zero while another cell was being released, queued rather than
+	//released recursively so a long chain doesn't use up the C stack, which is small on a task
+	cell_stack release_stack;
+	int releasing;
+	//Green threads started on this interp, by id, see task.c. current_task is the one whose state is
+	//in the fields above, or NULL while no other task is unfinished
+	task **tasks;
+	unsigned int num_tasks;
+	unsigned int tasks_size;
+	task *current_task;
+	unsigned long steps_left;
+	//The stack of a task that just finished, unmapped once another task runs
+	void *finished_stack;
+	//The file a lines sequence last read, kept open for reading the next line
+	FILE *lines_file;
+	char *lines_path;
+	long lines_offset;
+	char *error_message;
+	interp *previous;
+	interp *next;
+};
 
+heap *create_heap(int num_entries);
+void free_heap(heap *h);
+int create_global_scope(heap *h);
+interp *register_thread(heap *h);
+void unregister_thread(interp *in);
+void safepoint(interp *in);
+void enter_safe_region(interp *in);
+void leave_safe_region(interp *in);
+void read_lock_global_scope(interp *in);
+void write_lock_global_scope(interp *in);
+void unlock_global_scope(interp *in);
+int next_scope(interp *in);
+void free_variable(void *v, void *context);
+void clear_scope(interp *in);
+void previous_scope(interp *in);
+void mark_allocated(heap *h, int data_index);
+void mark_deallocated(heap *h, int data_index);
+void init_cell_stack(cell_stack *s);
+int push_cell_stack(cell_stack *s, int data_index);
+void free_cell_stack(cell_stack *s);
+void mark_allocated_recursive(heap *h, int data_index);
+void mark_variable_data(void *v, void *context);
+int mark_shared(interp *in, int data_index);
+void lock_world(interp *in);
+void unlock_world(interp *in);
+void garbage_collect(interp *in);
+int allocate(interp *in);
+int allocate_cells(interp *in, int *cells, unsigned int num_cells);
+int *resize_entries(data *d, int size);
+void free_entries(data *d);
+void set_flag(interp *in, int data_index, int flag);
+void increment_references(interp *in, int data_index);
+void decrement_references(interp *in, int data_index);
+void reconcile_zero_counts(interp *in);
+int push_shadow_stack(interp *in, int data_index);
+int pop_shadow_stack(interp *in);
+void clear_shadow_stack(interp *in);
+shadow_stack *get_shadow_stack(interp *in);
+void set_shadow_stack(interp *in, shadow_stack *next_stack);
+#endif
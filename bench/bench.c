@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../lisp.h"
+#include "stats.h"
+
+//Runs each Lisp workload in a fresh interpreter, after one untimed warmup run
+static int run_workload(char *path, int repetitions, int heap_size){
+	interp *in;
+	metrics counters;
+	double *samples;
+	double collection_seconds = 0;
+	unsigned long allocations = 0;
+	unsigned long collections = 0;
+	double start;
+	stats s;
+	int result;
+	int i;
+
+	samples = malloc(sizeof(double)*repetitions);
+	if(!samples){
+		return 0;
+	}
+	for(i = -1; i < repetitions; i++){
+		in = create_interp(heap_size);
+		if(!in){
+			fprintf(stderr, "Error: failed to create interpreter\n");
+			free(samples);
+			return 0;
+		}
+		start = now_seconds();
+		result = interp_load(in, path);
+		if(i >= 0){
+			samples[i] = now_seconds() - start;
+		}
+		if(result == -1){
+			fprintf(stderr, "Error: %s: %s\n", path, interp_error(in));
+			destroy_interp(in);
+			free(samples);
+			return 0;
+		}
+		release_value(in, result);
+		get_metrics(in, &counters);
+		if(i >= 0){
+			allocations += counters.allocations;
+			collections += counters.collections;
+			collection_seconds += counters.collection_nanoseconds/1e9;
+		}
+		destroy_interp(in);
+	}
+
+	compute_stats(samples, repetitions, &s);
+	printf("%-20s %10.3f %9.3f %10.3f %10.3f %10.2f %12lu %6lu %9.3f\n", path, s.mean*1e3, s.stddev*1e3, s.min*1e3, s.median*1e3, 1/s.median, allocations/repetitions, collections/repetitions, collection_seconds/repetitions*1e3);
+	free(samples);
+
+	return 1;
+}
+
+int main(int argc, char **argv){
+	int repetitions = 10;
+	int heap_size = 10000;
+	int success = 1;
+	int i;
+
+	for(i = 1; i < argc && argv[i][0] == '-'; i++){
+		if(!strcmp(argv[i], "-r") && i + 1 < argc){
+			repetitions = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "--heap") && i + 1 < argc){
+			heap_size = atoi(argv[++i]);
+		} else {
+			fprintf(stderr, "Usage: %s [-r REPETITIONS] [--heap CELLS] WORKLOAD...\n", argv[0]);
+			return 1;
+		}
+	}
+	if(repetitions <= 0 || heap_size <= 0){
+		fprintf(stderr, "Error: repetitions and heap size must be positive\n");
+		return 1;
+	}
+
+	printf("%-20s %10s %9s %10s %10s %10s %12s %6s %9s\n", "workload", "mean_ms", "stddev", "min_ms", "median_ms", "runs/s", "allocs/run", "gcs", "gc_ms/run");
+	for(; i < argc; i++){
+		success &= run_workload(argv[i], repetitions, heap_size);
+	}
+
+	return !success;
+}
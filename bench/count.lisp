@@ -0,0 +1,2 @@
+(set count (lambda {n acc} {if (= n 0) acc (count (- n 1) (+ acc 1))}))
+(count 200000 0)
@@ -0,0 +1,3 @@
+(set depth (lambda {n} {if (= n 0) 0 (+ 1 (depth (- n 1)))}))
+(set repeat (lambda {n} {if (= n 0) 0 (: (depth 2000) (repeat (- n 1)))}))
+(repeat 10)
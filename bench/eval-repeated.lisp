@@ -0,0 +1,3 @@
+(set step {+ (* x 3) (- x 1) (* 2 (+ 4 5)) (len {a b c d}) (* (+ 1 2) (- 10 4)) (= (list 1 2) (join {1} {2}))})
+(set run (lambda {n total} {if (= n 0) total (: (set x n) (run (- n 1) (+ total (eval step))))}))
+(run 20000 0)
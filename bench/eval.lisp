@@ -0,0 +1,4 @@
+(set generate (lambda {n code} {if (= n 0) code (generate (- n 1) (join code (list n)))}))
+(set sum-code (generate 200 {+}))
+(set run (lambda {n total} {if (= n 0) total (run (- n 1) (+ total (eval (join {+} (list (eval sum-code) n)))))}))
+(run 5000 0)
@@ -0,0 +1,4 @@
+(set live (collect (range 0 6000)))
+(set walk (lambda {s acc} {if (= s {}) acc (walk (force (head (tail s))) (+ acc 1))}))
+(walk (force (range 0 50000)) 0)
+(len live)
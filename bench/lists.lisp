@@ -0,0 +1,4 @@
+(set build (lambda {n acc} {if (= n 0) acc (build (- n 1) (join acc (list n (* n n))))}))
+(set walk (lambda {total xs} {if (= (len xs) 0) total (walk (+ total (head xs)) (tail xs))}))
+(set repeat (lambda {n} {if (= n 0) 0 (: (walk 0 (build 300 {})) (repeat (- n 1)))}))
+(repeat 10)
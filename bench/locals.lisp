@@ -0,0 +1,3 @@
+(set xs (collect (range 0 64)))
+(set walk (lambda {xs ys n acc} {if (= n 0) acc (walk ys xs (- n 1) (+ acc (len xs) (len ys) (len (join xs ys))))}))
+(walk xs (tail xs) 100000 0)
@@ -0,0 +1,10 @@
+(set a-rather-long-variable-name-for-the-first-value 1)
+(set a-rather-long-variable-name-for-the-second-value 2)
+(set a-rather-long-variable-name-for-the-third-value 3)
+(set a-rather-long-variable-name-for-the-fourth-value 4)
+(set shadowed-through-several-scopes 5)
+(set inner (lambda {x} {+ x a-rather-long-variable-name-for-the-first-value a-rather-long-variable-name-for-the-second-value a-rather-long-variable-name-for-the-third-value a-rather-long-variable-name-for-the-fourth-value shadowed-through-several-scopes}))
+(set middle (lambda {y} {inner (+ y a-rather-long-variable-name-for-the-first-value)}))
+(set outer (lambda {z} {middle (+ z a-rather-long-variable-name-for-the-second-value)}))
+(set loop (lambda {n total} {if (= n 0) total (loop (- n 1) (+ total (outer n)))}))
+(loop 30000 0)
@@ -0,0 +1,5 @@
+(set step (lambda {i} {+ i 1}))
+(for-range 0 100000 step)
+(fold (lambda {acc i} {+ acc 1}) 0 (range 0 100000))
+(set i 0)
+(while {= 0 (= i 100000)} {set i (+ i 1)})
@@ -0,0 +1,7 @@
+(set step (lambda {i} {+ i 1}))
+(set each (lambda {i n} {if (= i n) 0 (: (step i) (each (+ i 1) n))}))
+(each 0 100000)
+(set sum (lambda {s acc} {if (= s {}) acc (sum (force (head (tail s))) (+ acc 1))}))
+(sum (force (range 0 100000)) 0)
+(set count (lambda {i} {if (= i 100000) i (count (+ i 1))}))
+(count 0)
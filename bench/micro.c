@@ -0,0 +1,589 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../allocate.h"
+#include "../dictionary.h"
+#include "../execute.h"
+#include "../printer.h"
+#include "../serialize.h"
+#include "../compact.h"
+#include "../parallel.h"
+#include "stats.h"
+
+#define NUM_KEYS 10000
+#define NUM_ALLOCATIONS 1000000
+#define NUM_PRINTED 1000000
+#define NUM_ROUND_TRIP 100000
+#define NUM_WALKED 250000
+#define NUM_PARSED 200000
+#define NUM_MAPPED 20000
+#define NUM_SORTED 500000
+#define NUM_MESSAGES 50000
+
+typedef struct micro micro;
+
+struct micro{
+	char *name;
+	void (*setup)();
+	//Returns the number of operations performed
+	long (*run)();
+	void (*teardown)();
+};
+
+static char *keys[NUM_KEYS];
+static char *missing_keys[NUM_KEYS];
+static dictionary dict;
+static interp *in;
+
+static void free_nothing(void *value, void *context){
+}
+
+static void create_keys(){
+	char buffer[64];
+	int i;
+
+	for(i = 0; i < NUM_KEYS; i++){
+		sprintf(buffer, "identifier-%d", i*7919);
+		keys[i] = strdup(buffer);
+		sprintf(buffer, "missing-%d", i*7919);
+		missing_keys[i] = strdup(buffer);
+	}
+}
+
+static void fill_dictionary(){
+	int i;
+
+	dict = create_dictionary(NULL);
+	for(i = 0; i < NUM_KEYS; i++){
+		write_dictionary(&dict, keys[i], keys[i], 0);
+	}
+}
+
+static void clear_dictionary(){
+	free_dictionary(&dict, free_nothing, NULL);
+}
+
+static long run_write_dictionary(){
+	fill_dictionary();
+	clear_dictionary();
+
+	return NUM_KEYS;
+}
+
+static long run_read_dictionary(){
+	int i;
+	int j;
+
+	for(j = 0; j < 10; j++){
+		for(i = 0; i < NUM_KEYS; i++){
+			if(read_dictionary(dict, keys[i], 0) != keys[i]){
+				fprintf(stderr, "Error: lookup of %s failed\n", keys[i]);
+				exit(1);
+			}
+		}
+	}
+
+	return NUM_KEYS*10;
+}
+
+static long run_read_missing(){
+	int i;
+	int j;
+
+	for(j = 0; j < 10; j++){
+		for(i = 0; i < NUM_KEYS; i++){
+			if(read_dictionary(dict, missing_keys[i], 0)){
+				fprintf(stderr, "Error: found %s\n", missing_keys[i]);
+				exit(1);
+			}
+		}
+	}
+
+	return NUM_KEYS*10;
+}
+
+static void create_heap_interp(){
+	in = create_interp(100000);
+	if(!in){
+		fprintf(stderr, "Error: failed to create interpreter\n");
+		exit(1);
+	}
+}
+
+static void destroy_heap_interp(){
+	destroy_interp(in);
+}
+
+//Every cell is released straight away, as most temporaries are
+static long run_allocate_release(){
+	int data_index;
+	int i;
+
+	for(i = 0; i < NUM_ALLOCATIONS; i++){
+		data_index = allocate(in);
+		in->data_heap[data_index].type = INT_DATA;
+		in->data_heap[data_index].int_value = i;
+		decrement_references(in, data_index);
+	}
+
+	return NUM_ALLOCATIONS;
+}
+
+//Cells are dropped without being released, so the heap is recovered by collection
+static long run_allocate_collect(){
+	int data_index;
+	int i;
+
+	for(i = 0; i < NUM_ALLOCATIONS; i++){
+		data_index = allocate(in);
+		if(data_index == -1){
+			fprintf(stderr, "Error: %s\n", interp_error(in));
+			exit(1);
+		}
+		in->data_heap[data_index].type = INT_DATA;
+		in->data_heap[data_index].int_value = i;
+	}
+
+	return NUM_ALLOCATIONS;
+}
+
+static int printed;
+static int null_fd;
+
+static int allocate_entries(int num_entries, data_type type){
+	int data_index;
+
+	data_index = allocate(in);
+	if(data_index == -1){
+		fprintf(stderr, "Error: out of memory\n");
+		exit(1);
+	}
+	in->data_heap[data_index].type = type;
+	in->data_heap[data_index].entries = NULL;
+	in->data_heap[data_index].num_entries = num_entries;
+	if(!resize_entries(in->data_heap + data_index, num_entries)){
+		fprintf(stderr, "Error: out of memory\n");
+		exit(1);
+	}
+
+	return data_index;
+}
+
+static void open_null(){
+	in = create_interp(NUM_PRINTED + 1000);
+	null_fd = open("/dev/null", O_WRONLY);
+	if(!in || null_fd < 0){
+		fprintf(stderr, "Error: failed to set up printing\n");
+		exit(1);
+	}
+}
+
+//{0 1 2 ...}
+static void create_flat_list(){
+	int i;
+
+	open_null();
+	printed = allocate_entries(NUM_PRINTED, Q_EXPR);
+	for(i = 0; i < NUM_PRINTED; i++){
+		in->data_heap[printed].entries[i] = allocate(in);
+		in->data_heap[in->data_heap[printed].entries[i]].type = INT_DATA;
+		in->data_heap[in->data_heap[printed].entries[i]].int_value = i*1009;
+	}
+}
+
+//{{{... {0} ...}}}, deeper than the C stack allows recursing
+static void create_nested_list(){
+	int data_index;
+	int i;
+
+	open_null();
+	printed = allocate(in);
+	in->data_heap[printed].type = INT_DATA;
+	in->data_heap[printed].int_value = 0;
+	for(i = 1; i < NUM_PRINTED; i++){
+		data_index = allocate_entries(1, Q_EXPR);
+		in->data_heap[data_index].entries[0] = printed;
+		printed = data_index;
+	}
+}
+
+static void close_null(){
+	close(null_fd);
+	destroy_interp(in);
+}
+
+static long run_print(){
+	if(!write_value(in, printed, null_fd)){
+		fprintf(stderr, "Error: failed to print\n");
+		exit(1);
+	}
+
+	return NUM_PRINTED;
+}
+
+static int round_trip;
+static int round_trip_copy;
+
+//{{0 name-0 {0}} {1 name-1 {1}} ...} with 1000 distinct names
+static void create_round_trip_data(){
+	char name[32];
+	int entry;
+	int data_index;
+	int i;
+
+	in = create_interp(NUM_ROUND_TRIP*20);
+	if(!in){
+		fprintf(stderr, "Error: failed to create interpreter\n");
+		exit(1);
+	}
+	round_trip = allocate_entries(NUM_ROUND_TRIP, Q_EXPR);
+	for(i = 0; i < NUM_ROUND_TRIP; i++){
+		entry = allocate_entries(3, Q_EXPR);
+		in->data_heap[entry].entries[0] = allocate_int(in, i);
+		sprintf(name, "name-%d", i%1000);
+		data_index = allocate(in);
+		in->data_heap[data_index].type = IDENTIFIER;
+		in->data_heap[data_index].identifier_name = strdup(name);
+		in->data_heap[entry].entries[1] = data_index;
+		data_index = allocate_entries(1, Q_EXPR);
+		in->data_heap[data_index].entries[0] = allocate_int(in, i);
+		in->data_heap[entry].entries[2] = data_index;
+		in->data_heap[round_trip].entries[i] = entry;
+	}
+}
+
+//Compared outside the timed run
+static void check_round_trip(){
+	if(round_trip_copy == -1 || !data_equal(in, round_trip_copy, round_trip)){
+		fprintf(stderr, "Error: round trip failed\n");
+		exit(1);
+	}
+	destroy_interp(in);
+}
+
+//Printed with the printer and read back with the parser
+static long run_text_round_trip(){
+	output_buffer b;
+	char *c;
+
+	init_output_buffer(&b, -1);
+	append_value(in, &b, round_trip);
+	append_output(&b, "", 1);
+	c = b.text;
+	round_trip_copy = get_quoted_value(in, &c);
+	free_output_buffer(&b);
+
+	return NUM_ROUND_TRIP;
+}
+
+static long run_binary_round_trip(){
+	encoder e;
+	decoder d;
+	char *bytes;
+	size_t length;
+
+	init_encoder(&e, -1);
+	encode_value(in, &e, round_trip);
+	init_decoder(&d);
+	bytes = e.output.text;
+	length = e.output.length;
+	round_trip_copy = decode_value(in, &d, &bytes, &length);
+	free_decoder(in, &d);
+	free_encoder(&e);
+
+	return NUM_ROUND_TRIP;
+}
+
+static char *parsed_text;
+static int parsed;
+
+//{(f 0) (f 1) ...}, short lists like most calls in a program
+static void create_parse_text(){
+	size_t length = 0;
+	int i;
+
+	in = create_interp(NUM_PARSED*4);
+	parsed_text = malloc(NUM_PARSED*16 + 3);
+	if(!in || !parsed_text){
+		fprintf(stderr, "Error: failed to create interpreter\n");
+		exit(1);
+	}
+	parsed_text[length++] = '{';
+	for(i = 0; i < NUM_PARSED; i++){
+		length += sprintf(parsed_text + length, "(f %d) ", i%1000);
+	}
+	strcpy(parsed_text + length, "}");
+}
+
+static void release_parsed(){
+	release_value(in, parsed);
+	free(parsed_text);
+	destroy_interp(in);
+}
+
+static long run_parse(){
+	char *c;
+
+	c = parsed_text;
+	parsed = get_quoted_value(in, &c);
+	if(parsed == -1){
+		fprintf(stderr, "Error: %s\n", interp_error(in));
+		exit(1);
+	}
+
+	return NUM_PARSED;
+}
+
+static int walked;
+static volatile unsigned long walk_hash;
+
+//{{0 0} {1 1} ...} built after freeing a heap's worth of cells in random order, so consecutive
+//allocations land far apart, as they do in a long running interpreter
+static void create_fragmented_list(){
+	int *cells;
+	int data_index;
+	int entry;
+	int swap;
+	int i;
+
+	in = create_interp(NUM_WALKED*4 + 1000);
+	cells = malloc(sizeof(int)*NUM_WALKED*4);
+	if(!in || !cells){
+		fprintf(stderr, "Error: failed to create interpreter\n");
+		exit(1);
+	}
+	for(i = 0; i < NUM_WALKED*4; i++){
+		cells[i] = allocate_int(in, i);
+	}
+	srand(1);
+	for(i = NUM_WALKED*4 - 1; i > 0; i--){
+		data_index = rand()%(i + 1);
+		swap = cells[i];
+		cells[i] = cells[data_index];
+		cells[data_index] = swap;
+	}
+	for(i = 0; i < NUM_WALKED*4; i++){
+		decrement_references(in, cells[i]);
+	}
+	free(cells);
+
+	walked = allocate_entries(NUM_WALKED, Q_EXPR);
+	for(i = 0; i < NUM_WALKED; i++){
+		entry = allocate_entries(2, Q_EXPR);
+		in->data_heap[entry].entries[0] = allocate_int(in, i);
+		in->data_heap[entry].entries[1] = allocate_int(in, i);
+		in->data_heap[walked].entries[i] = entry;
+	}
+}
+
+static void create_compacted_list(){
+	create_fragmented_list();
+	if(!push_shadow_stack(in, walked) || !compact_heap(in)){
+		fprintf(stderr, "Error: failed to compact\n");
+		exit(1);
+	}
+	walked = pop_shadow_stack(in);
+}
+
+//hash_data() reads every cell of the list
+static long run_walk(){
+	walk_hash = hash_data(in, walked);
+
+	return NUM_WALKED*3;
+}
+
+//Evaluates source, exiting on an error
+static void evaluate(char *source){
+	int value;
+
+	value = interp_eval(in, source);
+	if(value == -1){
+		fprintf(stderr, "Error: %s\n", interp_error(in));
+		exit(1);
+	}
+	release_value(in, value);
+}
+
+//Each call does a little work, so the cost of splitting the list between workers shows
+static void create_mapped_list(){
+	char source[64];
+
+	in = create_interp(NUM_MAPPED*16);
+	if(!in){
+		fprintf(stderr, "Error: failed to create interpreter\n");
+		exit(1);
+	}
+	sprintf(source, "(set xs (collect (range 0 %d)))", NUM_MAPPED);
+	evaluate(source);
+	evaluate("(set work (lambda {x} {fold + x (range 0 16)}))");
+}
+
+static long run_map(){
+	evaluate("(map work xs)");
+
+	return NUM_MAPPED;
+}
+
+static long run_pmap(){
+	evaluate("(pmap work xs)");
+
+	return NUM_MAPPED;
+}
+
+static int unsorted;
+
+static void create_sorted_list(){
+	int i;
+
+	in = create_interp(NUM_SORTED*3);
+	if(!in){
+		fprintf(stderr, "Error: failed to create interpreter\n");
+		exit(1);
+	}
+	srand(1);
+	unsorted = allocate_entries(NUM_SORTED, Q_EXPR);
+	for(i = 0; i < NUM_SORTED; i++){
+		in->data_heap[unsorted].entries[i] = allocate_int(in, rand());
+	}
+	if(!push_shadow_stack(in, unsorted)){
+		exit(1);
+	}
+}
+
+static void create_sorted_list_serial(){
+	create_sorted_list();
+	set_parallel_workers(in, 1);
+}
+
+static long run_psort(){
+	int tail_call = 0;
+	int sorted;
+
+	sorted = psort(in, &unsorted, 1, &tail_call);
+	if(sorted == -1){
+		fprintf(stderr, "Error: %s\n", interp_error(in));
+		exit(1);
+	}
+	release_value(in, sorted);
+
+	return NUM_SORTED;
+}
+
+//Sends a 16 entry list to this interpreter's own mailbox and takes it back out, encoding and
+//decoding it each way
+static void create_message(){
+	in = create_interp(100000);
+	if(!in){
+		fprintf(stderr, "Error: failed to create interpreter\n");
+		exit(1);
+	}
+	evaluate("(set me (self))");
+	evaluate("(set message {1 2 3 4 5 6 7 8 {nine ten} 11 12 13 14 15 16})");
+}
+
+static long run_send_receive(){
+	char source[96];
+
+	sprintf(source, "(for-range 0 %d (lambda {i} {: (send me message) (receive)}))", NUM_MESSAGES);
+	evaluate(source);
+
+	return NUM_MESSAGES;
+}
+
+static micro micros[] = {
+	{"write_dictionary", NULL, run_write_dictionary, NULL},
+	{"read_dictionary", fill_dictionary, run_read_dictionary, clear_dictionary},
+	{"read_dictionary_miss", fill_dictionary, run_read_missing, clear_dictionary},
+	{"allocate_release", create_heap_interp, run_allocate_release, destroy_heap_interp},
+	{"allocate_collect", create_heap_interp, run_allocate_collect, destroy_heap_interp},
+	{"print_flat", create_flat_list, run_print, close_null},
+	{"print_nested", create_nested_list, run_print, close_null},
+	{"text_round_trip", create_round_trip_data, run_text_round_trip, check_round_trip},
+	{"binary_round_trip", create_round_trip_data, run_binary_round_trip, check_round_trip},
+	{"parse_short_lists", create_parse_text, run_parse, release_parsed},
+	{"walk_fragmented", create_fragmented_list, run_walk, destroy_heap_interp},
+	{"walk_compacted", create_compacted_list, run_walk, destroy_heap_interp},
+	{"map", create_mapped_list, run_map, destroy_heap_interp},
+	{"pmap", create_mapped_list, run_pmap, destroy_heap_interp},
+	{"psort_1_worker", create_sorted_list_serial, run_psort, destroy_heap_interp},
+	{"psort", create_sorted_list, run_psort, destroy_heap_interp},
+	{"send_receive", create_message, run_send_receive, destroy_heap_interp},
+	{NULL, NULL, NULL, NULL}
+};
+
+int main(int argc, char **argv){
+	int repetitions = 10;
+	double *samples;
+	metrics counters;
+	unsigned long collections;
+	double collection_seconds;
+	double start;
+	long ops = 0;
+	int counter;
+	long misses;
+	char misses_text[16];
+	micro *m;
+	stats s;
+	int i;
+
+	if(argc == 3 && !strcmp(argv[1], "-r")){
+		repetitions = atoi(argv[2]);
+	}
+	if(repetitions <= 0){
+		fprintf(stderr, "Usage: %s [-r REPETITIONS]\n", argv[0]);
+		return 1;
+	}
+	samples = malloc(sizeof(double)*repetitions);
+	if(!samples){
+		return 1;
+	}
+	create_keys();
+	counter = open_cache_counter();
+
+	printf("%-20s %14s %9s %14s %6s %9s %10s\n", "micro", "median_ops/s", "stddev%", "best_ops/s", "gcs", "gc_ms/run", "misses/op");
+	for(m = micros; m->name; m++){
+		collections = 0;
+		collection_seconds = 0;
+		misses = 0;
+		//The first run is a warmup and is not recorded
+		for(i = -1; i < repetitions; i++){
+			if(m->setup){
+				m->setup();
+			}
+			if(counter >= 0){
+				start_counter(counter);
+			}
+			start = now_seconds();
+			ops = m->run();
+			if(i >= 0){
+				samples[i] = now_seconds() - start;
+				if(counter >= 0){
+					misses += stop_counter(counter);
+				}
+			}
+			if(m->setup == create_heap_interp){
+				get_metrics(in, &counters);
+				if(i >= 0){
+					collections += counters.collections;
+					collection_seconds += counters.collection_nanoseconds/1e9;
+				}
+			}
+			if(m->teardown){
+				m->teardown();
+			}
+		}
+		compute_stats(samples, repetitions, &s);
+		//Without hardware counters the column is left empty
+		if(counter >= 0){
+			snprintf(misses_text, sizeof(misses_text), "%.3f", (double) misses/repetitions/ops);
+		} else {
+			strcpy(misses_text, "-");
+		}
+		printf("%-20s %14.0f %9.2f %14.0f %6lu %9.3f %10s\n", m->name, ops/s.median, s.stddev/s.mean*100, ops/s.min, collections/repetitions, collection_seconds/repetitions*1e3, misses_text);
+	}
+	free(samples);
+
+	return 0;
+}
@@ -0,0 +1,5 @@
+(set chunks (collect (map (lambda {x} {list x (* x x)}) (range 0 3000))))
+(len (fold join {} chunks))
+(fold + 0 (range 0 100000))
+(set f (lambda {n acc} {if (= n 0) acc (f (- n 1) (tail (join (tail acc) (list n n))))}))
+(f 20000 {0 0})
@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "stats.h"
+
+double now_seconds(){
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+static int compare_doubles(const void *a, const void *b){
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+//Sorts samples in place
+void compute_stats(double *samples, int num_samples, stats *output){
+	double total = 0;
+	double variance = 0;
+	int i;
+
+	qsort(samples, num_samples, sizeof(double), compare_doubles);
+	for(i = 0; i < num_samples; i++){
+		total += samples[i];
+	}
+	output->mean = total/num_samples;
+	for(i = 0; i < num_samples; i++){
+		variance += (samples[i] - output->mean)*(samples[i] - output->mean);
+	}
+	output->stddev = num_samples > 1 ? sqrt(variance/(num_samples - 1)) : 0;
+	output->min = samples[0];
+	output->max = samples[num_samples - 1];
+	if(num_samples%2){
+		output->median = samples[num_samples/2];
+	} else {
+		output->median = (samples[num_samples/2 - 1] + samples[num_samples/2])/2;
+	}
+}
+
+//Counts this thread's last level cache misses in user space. Returns -1 where hardware counters
+//aren't available, as in most virtual machines
+int open_cache_counter(){
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void start_counter(int fd){
+	ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+long stop_counter(int fd){
+	long count;
+
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	if(read(fd, &count, sizeof(count)) != sizeof(count)){
+		return 0;
+	}
+
+	return count;
+}
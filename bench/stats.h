@@ -0,0 +1,18 @@
+#ifndef STATS_INCLUDED
+#define STATS_INCLUDED
+typedef struct stats stats;
+
+struct stats{
+	double mean;
+	double stddev;
+	double min;
+	double median;
+	double max;
+};
+
+double now_seconds();
+void compute_stats(double *samples, int num_samples, stats *output);
+int open_cache_counter();
+void start_counter(int fd);
+long stop_counter(int fd);
+#endif
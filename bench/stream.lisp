@@ -0,0 +1,3 @@
+(set square (lambda {x} {* x x}))
+(set keep (lambda {x} {= 0 (= x 100)}))
+(fold + 0 (map square (filter keep (take 200000 (range 0)))))
@@ -0,0 +1,398 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "allocate.h"
+#include "compact.h"
+#include "intern.h"
+#include "memo.h"
+#include "compile.h"
+#include "task.h"
+
+//allocate() hands out whichever cell was freed last, so after a while a list, its entries and the
+//function using it are spread across the whole heap. compact_heap() renumbers the live cells in the
+//depth first order they are reached from the roots, so walking a value reads the heap front to back.
+//Every index the heap and the threads keep is rewritten. Indices in C variables can't be, so it only
+//runs between top level forms, while no other thread or unfinished task is evaluating on the heap
+
+typedef struct compaction compaction;
+
+struct compaction{
+	heap *h;
+	//New index of each cell, or -1 until it is reached
+	int *forward;
+	//Old index of each new cell
+	unsigned int *order;
+	unsigned int num_live;
+	int *stack;
+	unsigned int depth;
+	unsigned int stack_size;
+	int failed;
+};
+
+static void push_cell(compaction *c, int data_index){
+	int *next_stack;
+
+	if(c->forward[data_index] != -1){
+		return;
+	}
+	if(c->depth == c->stack_size){
+		next_stack = realloc(c->stack, sizeof(int)*c->stack_size*2);
+		if(!next_stack){
+			c->failed = 1;
+			return;
+		}
+		c->stack = next_stack;
+		c->stack_size *= 2;
+	}
+	c->stack[c->depth++] = data_index;
+}
+
+//Children are pushed last first, so the first entry of a list is numbered right after the list
+static void number_reachable(compaction *c, int root){
+	memo_entry *entry;
+	data *d;
+	int data_index;
+	int i;
+
+	push_cell(c, root);
+	while(c->depth && !c->failed){
+		data_index = c->stack[--c->depth];
+		if(c->forward[data_index] != -1){
+			continue;
+		}
+		c->forward[data_index] = c->num_live;
+		c->order[c->num_live] = data_index;
+		c->num_live++;
+
+		d = c->h->data_heap + data_index;
+		if(d->type == S_EXPR || d->type == Q_EXPR){
+			for(i = d->num_entries - 1; i >= 0; i--){
+				push_cell(c, d->entries[i]);
+			}
+		} else if(d->type == FUNCTION){
+			push_cell(c, d->source);
+			push_cell(c, d->var_list);
+		} else if(d->type == MEMO_FUNCTION){
+			for(entry = d->memo_table->oldest; entry; entry = entry->newer){
+				push_cell(c, entry->value);
+				push_cell(c, entry->key);
+			}
+			push_cell(c, d->memo_function);
+		} else if(d->type == PROMISE){
+			if(d->promise_value != -1){
+				push_cell(c, d->promise_value);
+			}
+			if(d->promise_expr != -1){
+				push_cell(c, d->promise_expr);
+			}
+		}
+	}
+}
+
+static void number_variable(void *v, void *context){
+	variable *var;
+
+	var = v;
+	number_reachable(context, var->data_index);
+}
+
+static void forward_variable(void *v, void *context){
+	compaction *c;
+	variable *var;
+
+	c = context;
+	var = v;
+	var->data_index = c->forward[var->data_index];
+}
+
+//Compiled programs are reachable from their sources, as mark_compiled() has them for a collection
+static void number_compiled(compaction *c){
+	compiled_program *entry;
+	unsigned int i;
+	int numbered = 1;
+
+	while(numbered && !c->failed){
+		numbered = 0;
+		for(i = 0; i < c->h->num_compiled_buckets; i++){
+			for(entry = c->h->compiled_buckets[i]; entry; entry = entry->next){
+				if(entry->program != -1 && c->forward[entry->source] != -1 && c->forward[entry->program] == -1){
+					number_reachable(c, entry->program);
+					numbered = 1;
+				}
+			}
+		}
+	}
+}
+
+//The same roots as garbage_collect(), except that free cells reserved by threads are given back
+static void number_roots(compaction *c){
+	heap *h;
+	interp *thread;
+	scope *search_scope;
+	shadow_stack *stack_place;
+	unsigned int i;
+
+	h = c->h;
+	number_reachable(c, h->global_none);
+	iterate_dictionary(h->global_scope->variables, number_variable, c);
+	for(thread = h->threads; thread; thread = thread->next){
+		for(search_scope = thread->current_scope; search_scope != h->global_scope; search_scope = search_scope->previous){
+			iterate_dictionary(search_scope->variables, number_variable, c);
+		}
+		for(stack_place = thread->stack; stack_place; stack_place = stack_place->previous){
+			number_reachable(c, stack_place->data_index);
+		}
+		for(i = 0; i < thread->num_frames; i++){
+			number_reachable(c, thread->frames[i].expr);
+		}
+		for(i = 0; i < thread->num_values; i++){
+			number_reachable(c, thread->values[i]);
+		}
+		//Every task has finished, but some haven't been awaited
+		for(i = 1; i < thread->num_tasks; i++){
+			if(thread->tasks[i] && thread->tasks[i]->result != -1){
+				number_reachable(c, thread->tasks[i]->result);
+			}
+		}
+	}
+	number_compiled(c);
+	//Free temporaries go last, out of the way of everything else
+	for(thread = h->threads; thread; thread = thread->next){
+		for(i = 0; i < thread->region_size; i++){
+			number_reachable(c, thread->region_cells[i]);
+		}
+	}
+}
+
+//Dead cells keep their stale contents, which allocate() releases when it reuses them, so their
+//indices are left as they are
+static void forward_cell(compaction *c, data *d){
+	memo_entry *entry;
+	int i;
+
+	if(d->type == S_EXPR || d->type == Q_EXPR){
+		for(i = 0; i < d->num_entries; i++){
+			d->entries[i] = c->forward[d->entries[i]];
+		}
+	} else if(d->type == FUNCTION){
+		d->var_list = c->forward[d->var_list];
+		d->source = c->forward[d->source];
+	} else if(d->type == MEMO_FUNCTION){
+		d->memo_function = c->forward[d->memo_function];
+		for(entry = d->memo_table->newest; entry; entry = entry->older){
+			entry->key = c->forward[entry->key];
+			entry->value = c->forward[entry->value];
+		}
+	} else if(d->type == PROMISE){
+		if(d->promise_expr != -1){
+			d->promise_expr = c->forward[d->promise_expr];
+		}
+		if(d->promise_value != -1){
+			d->promise_value = c->forward[d->promise_value];
+		}
+	}
+}
+
+static void forward_roots(compaction *c){
+	heap *h;
+	interp *thread;
+	scope *search_scope;
+	shadow_stack *stack_place;
+	unsigned int num_kept;
+	unsigned int i;
+
+	h = c->h;
+	h->global_none = c->forward[h->global_none];
+	iterate_dictionary(h->global_scope->variables, forward_variable, c);
+	for(thread = h->threads; thread; thread = thread->next){
+		thread->global_none = h->global_none;
+		thread->num_local_cells = 0;
+		for(search_scope = thread->current_scope; search_scope != h->global_scope; search_scope = search_scope->previous){
+			iterate_dictionary(search_scope->variables, forward_variable, c);
+		}
+		for(stack_place = thread->stack; stack_place; stack_place = stack_place->previous){
+			stack_place->data_index = c->forward[stack_place->data_index];
+		}
+		for(i = 0; i < thread->num_frames; i++){
+			thread->frames[i].expr = c->forward[thread->frames[i].expr];
+			thread->call_frames[i].expr = c->forward[thread->call_frames[i].expr];
+		}
+		for(i = 0; i < thread->num_values; i++){
+			thread->values[i] = c->forward[thread->values[i]];
+		}
+		//Cells in the zero count table that nothing reached are dead now
+		num_kept = 0;
+		for(i = 0; i < thread->num_zero_counts; i++){
+			if((unsigned int) c->forward[thread->zero_counts[i]] < h->num_allocated){
+				thread->zero_counts[num_kept] = c->forward[thread->zero_counts[i]];
+				num_kept++;
+			}
+		}
+		thread->num_zero_counts = num_kept;
+		thread->zero_count_cells = num_kept;
+		for(i = 0; i < thread->region_size; i++){
+			thread->region_cells[i] = c->forward[thread->region_cells[i]];
+		}
+		for(i = 1; i < thread->num_tasks; i++){
+			if(thread->tasks[i] && thread->tasks[i]->result != -1){
+				thread->tasks[i]->result = c->forward[thread->tasks[i]->result];
+			}
+		}
+	}
+}
+
+//Expects heap_lock to be held, with this the only thread on the heap. Frees nothing unless every
+//buffer could be allocated, so on failure the heap is as it was
+static int move_cells(interp *in){
+	compaction c;
+	heap *h;
+	data *next_heap = NULL;
+	int *next_sites = NULL;
+	unsigned int *next_generations = NULL;
+	data *d;
+	unsigned int i;
+
+	h = in->heap;
+	c.h = h;
+	c.num_live = 0;
+	c.depth = 0;
+	c.stack_size = 256;
+	c.failed = 0;
+	c.forward = malloc(sizeof(int)*h->data_heap_size);
+	c.order = malloc(sizeof(unsigned int)*h->data_heap_size);
+	c.stack = malloc(sizeof(int)*c.stack_size);
+	next_heap = malloc(sizeof(data)*h->data_heap_size);
+	if(h->allocation_sites){
+		next_sites = malloc(sizeof(int)*h->data_heap_size);
+		next_generations = malloc(sizeof(unsigned int)*h->data_heap_size);
+	}
+	if(!c.forward || !c.order || !c.stack || !next_heap || (h->allocation_sites && (!next_sites || !next_generations))){
+		c.failed = 1;
+	} else {
+		for(i = 0; i < h->data_heap_size; i++){
+			c.forward[i] = -1;
+		}
+		number_roots(&c);
+	}
+	if(c.failed){
+		free(c.forward);
+		free(c.order);
+		free(c.stack);
+		free(next_heap);
+		free(next_sites);
+		free(next_generations);
+		return 0;
+	}
+
+	//Dead cells follow the live ones in their old order
+	h->num_allocated = c.num_live;
+	for(i = 0; i < h->data_heap_size; i++){
+		if(c.forward[i] == -1){
+			c.forward[i] = c.num_live;
+			c.order[c.num_live] = i;
+			c.num_live++;
+		}
+	}
+	for(i = 0; i < h->data_heap_size; i++){
+		next_heap[i] = h->data_heap[c.order[i]];
+		if(next_sites){
+			next_sites[i] = h->allocation_sites[c.order[i]];
+			next_generations[i] = h->cell_generations[c.order[i]];
+		}
+		h->data_heap_allocation[i] = i;
+		h->data_heap_locations[i] = i;
+	}
+	//Threads keep a pointer to data_heap, so the cells are copied back rather than swapped in
+	memcpy(h->data_heap, next_heap, sizeof(data)*h->data_heap_size);
+	for(i = 0; i < h->data_heap_size; i++){
+		d = h->data_heap + i;
+		//Entries kept in the cell moved with it
+		if((d->type == S_EXPR || d->type == Q_EXPR) && d->entries == h->data_heap[c.order[i]].inline_entries){
+			d->entries = d->inline_entries;
+		}
+		if(i < h->num_allocated){
+			forward_cell(&c, d);
+		} else {
+			//The intern and compiled tables only keep live cells
+			d->flags &= ~(DATA_INTERNED | DATA_EVALUATED | DATA_COMPILED);
+		}
+	}
+	if(next_sites){
+		free(h->allocation_sites);
+		h->allocation_sites = next_sites;
+		free(h->cell_generations);
+		h->cell_generations = next_generations;
+		forward_allocation_sites(h, c.forward);
+	}
+	forward_roots(&c);
+
+	//These tables hash some cells by index
+	for(i = 0; i < h->num_allocated; i++){
+		if(h->data_heap[i].type == MEMO_FUNCTION){
+			rehash_memo_table(in, h->data_heap[i].memo_table);
+		}
+	}
+	if(h->intern_buckets){
+		rebuild_intern_table(h);
+	}
+	rebuild_compiled_table(h, c.forward);
+
+	free(c.forward);
+	free(c.order);
+	free(c.stack);
+	free(next_heap);
+
+	return 1;
+}
+
+//Compacts the heap and returns 1, or returns 0 if it can't be done now. Every index held outside
+//the heap, the scopes, the shadow stacks and the evaluators' stacks is left pointing at the wrong cell
+int compact_heap(interp *in){
+	heap *h;
+	struct timespec start;
+	struct timespec end;
+	int result;
+
+	h = in->heap;
+	pthread_mutex_lock(&h->heap_lock);
+	if(h->num_threads != 1 || in->current_task){
+		pthread_mutex_unlock(&h->heap_lock);
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	result = move_cells(in);
+	h->compact_pending = 0;
+	if(result){
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		//A compaction frees the garbage as well, so it also counts as a collection
+		record_pause(&h->metrics, (end.tv_sec - start.tv_sec)*1000000000UL + end.tv_nsec - start.tv_nsec);
+		h->metrics.compactions++;
+	}
+	pthread_mutex_unlock(&h->heap_lock);
+
+	return result;
+}
+
+//Called between top level forms. A compaction stays pending while other threads are attached
+void maybe_compact(interp *in){
+	if(!__atomic_load_n(&in->heap->compact_pending, __ATOMIC_RELAXED) || in->num_frames){
+		return;
+	}
+	compact_heap(in);
+}
+
+//Compaction has to wait until the current top level form has finished
+int compact(interp *in, int *args, int num_args, int *tail_call){
+	if(num_args){
+		set_error(in, "compact expects no arguments");
+		return -1;
+	}
+	__atomic_store_n(&in->heap->compact_pending, 1, __ATOMIC_RELAXED);
+
+	increment_references(in, in->global_none);
+	return in->global_none;
+}
+
+void enable_compaction(interp *in){
+	in->heap->compact_after_collection = 1;
+}
@@ -0,0 +1,8 @@
+#ifndef COMPACT_INCLUDED
+#define COMPACT_INCLUDED
+#include "allocate.h"
+
+int compact_heap(interp *in);
+void maybe_compact(interp *in);
+int compact(interp *in, int *args, int num_args, int *tail_call);
+#endif
@@ -0,0 +1,534 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "allocate.h"
+#include "execute.h"
+#include "region.h"
+#include "compile.h"
+
+//Generated code tends to build a Q expression once and eval it many times. Each eval walks the tree
+//again, looking up every builtin name through each scope and recomputing calls whose arguments are
+//all literals. The second time eval sees a Q expression it compiles it: the copy it runs from then
+//on has builtins in call position instead of their names and the results of pure calls in place of
+//the calls. The table of compiled forms holds a reference to each program but not to its source, and
+//an entry goes away with its source, whether the count reaches zero or a collection finds it dead
+
+//Deeper code is left as it is, so compiling can't exhaust the C stack
+#define MAX_COMPILE_DEPTH 128
+
+typedef struct compilation compilation;
+
+struct compilation{
+	//The builtins the program assumes. The entries of the list cells are the builtins themselves,
+	//kept alive there while calls using them may still be folded away
+	char **names;
+	int *builtin_ids;
+	int cells;
+	int num_names;
+	int names_size;
+	//Names the source sets itself, which can stop meaning a builtin halfway through
+	char **set_names;
+	int num_set_names;
+	int set_names_size;
+};
+
+static int add_builtin(interp *in, compilation *c, char *name, int builtin_id, int cell){
+	char **next_names;
+	int *next_ids;
+	int next_size;
+
+	if(c->num_names == c->names_size){
+		next_size = c->names_size ? c->names_size*2 : 8;
+		next_names = realloc(c->names, sizeof(char *)*next_size);
+		if(!next_names){
+			return 0;
+		}
+		c->names = next_names;
+		next_ids = realloc(c->builtin_ids, sizeof(int)*next_size);
+		if(!next_ids){
+			return 0;
+		}
+		c->builtin_ids = next_ids;
+		if(!resize_entries(in->data_heap + c->cells, next_size)){
+			return 0;
+		}
+		c->names_size = next_size;
+	}
+	c->names[c->num_names] = name;
+	c->builtin_ids[c->num_names] = builtin_id;
+	in->data_heap[c->cells].entries[c->num_names] = cell;
+	in->data_heap[c->cells].num_entries++;
+	c->num_names++;
+
+	return 1;
+}
+
+//Finds every (set NAME ...) in the source, quoted or not. Returns 0 if the source is too deep to tell
+static int find_set_names(interp *in, compilation *c, int expr, unsigned int depth){
+	char **next_names;
+	int next_size;
+	data *d;
+	int i;
+
+	d = in->data_heap + expr;
+	if(d->type != S_EXPR && d->type != Q_EXPR){
+		return 1;
+	}
+	if(depth > MAX_COMPILE_DEPTH){
+		return 0;
+	}
+	if(d->num_entries >= 2 && in->data_heap[d->entries[0]].type == IDENTIFIER && in->data_heap[d->entries[1]].type == IDENTIFIER && !strcmp(in->data_heap[d->entries[0]].identifier_name, "set")){
+		if(c->num_set_names == c->set_names_size){
+			next_size = c->set_names_size ? c->set_names_size*2 : 8;
+			next_names = realloc(c->set_names, sizeof(char *)*next_size);
+			if(!next_names){
+				return 0;
+			}
+			c->set_names = next_names;
+			c->set_names_size = next_size;
+		}
+		c->set_names[c->num_set_names++] = in->data_heap[d->entries[1]].identifier_name;
+	}
+	for(i = 0; i < d->num_entries; i++){
+		if(!find_set_names(in, c, d->entries[i], depth + 1)){
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+//The builtin in place of a name in call position, or a new reference to the name itself
+static int compile_name(interp *in, compilation *c, int name){
+	char *identifier_name;
+	int builtin_id;
+	int cell;
+	int i;
+
+	identifier_name = in->data_heap[name].identifier_name;
+	for(i = 0; i < c->num_names; i++){
+		if(!strcmp(c->names[i], identifier_name)){
+			cell = in->data_heap[c->cells].entries[i];
+			increment_references(in, cell);
+			return cell;
+		}
+	}
+	for(i = 0; i < c->num_set_names; i++){
+		if(!strcmp(c->set_names[i], identifier_name)){
+			increment_references(in, name);
+			return name;
+		}
+	}
+	builtin_id = lookup_builtin(identifier_name);
+	if(builtin_id == -1 || !names_builtin(in, identifier_name, builtin_id)){
+		increment_references(in, name);
+		return name;
+	}
+	cell = allocate_builtin(in, builtin_id);
+	if(cell == -1){
+		return -1;
+	}
+	if(!add_builtin(in, c, identifier_name, builtin_id, cell)){
+		decrement_references(in, cell);
+		set_error(in, "malloc returned NULL");
+		return -1;
+	}
+	increment_references(in, cell);
+
+	return cell;
+}
+
+//The result of a pure builtin called on literals, or -1 if it doesn't give a literal
+static int fold_call(interp *in, int call){
+	char *error_message;
+	int builtin_id;
+	int tail_call = 0;
+	int value;
+
+	builtin_id = in->data_heap[in->data_heap[call].entries[0]].builtin_id;
+	error_message = in->error_message;
+	value = builtin_function(builtin_id)(in, in->data_heap[call].entries + 1, in->data_heap[call].num_entries - 1, &tail_call);
+	//A call that fails is left for the program to fail on when it runs
+	if(value == -1){
+		in->error_message = error_message;
+		return -1;
+	}
+	if(tail_call || in->data_heap[value].type == S_EXPR || in->data_heap[value].type == IDENTIFIER){
+		decrement_references(in, value);
+		return -1;
+	}
+
+	return value;
+}
+
+//Returns a new reference to the compiled form of the call, which is the call itself if nothing in it
+//changed. Quoted entries are data, and are kept as they are
+static int compile_call(interp *in, compilation *c, int expr, unsigned int depth){
+	int num_entries;
+	int program;
+	int entry;
+	int compiled;
+	int changed = 0;
+	int constant = 1;
+	int value;
+	int i;
+
+	num_entries = in->data_heap[expr].num_entries;
+	if(!num_entries || depth > MAX_COMPILE_DEPTH){
+		increment_references(in, expr);
+		return expr;
+	}
+	program = allocate_list(in, num_entries);
+	if(program == -1){
+		return -1;
+	}
+	in->data_heap[program].type = S_EXPR;
+	if(!push_shadow_stack(in, program)){
+		decrement_references(in, program);
+		set_error(in, "malloc returned NULL");
+		return -1;
+	}
+	for(i = 0; i < num_entries; i++){
+		entry = in->data_heap[expr].entries[i];
+		if(in->data_heap[entry].type == S_EXPR){
+			compiled = compile_call(in, c, entry, depth + 1);
+		} else if(!i && in->data_heap[entry].type == IDENTIFIER){
+			compiled = compile_name(in, c, entry);
+		} else {
+			increment_references(in, entry);
+			compiled = entry;
+		}
+		if(compiled == -1){
+			pop_shadow_stack(in);
+			decrement_references(in, program);
+			return -1;
+		}
+		in->data_heap[program].entries[i] = compiled;
+		in->data_heap[program].num_entries++;
+		if(compiled != entry){
+			changed = 1;
+		}
+		if(i && (in->data_heap[compiled].type == S_EXPR || in->data_heap[compiled].type == IDENTIFIER)){
+			constant = 0;
+		}
+	}
+	pop_shadow_stack(in);
+
+	entry = in->data_heap[program].entries[0];
+	if(constant && in->data_heap[entry].type == BUILTIN_FUNCTION && builtin_flags(in->data_heap[entry].builtin_id)&BUILTIN_PURE){
+		value = fold_call(in, program);
+		if(value != -1){
+			decrement_references(in, program);
+			return value;
+		}
+	}
+	if(!changed){
+		decrement_references(in, program);
+		increment_references(in, expr);
+		return expr;
+	}
+
+	return program;
+}
+
+static compiled_program **find_place(heap *h, int source){
+	compiled_program **place;
+
+	place = h->compiled_buckets + (source&(h->num_compiled_buckets - 1));
+	while(*place && (*place)->source != source){
+		place = &(*place)->next;
+	}
+
+	return place;
+}
+
+//Expects compiled_lock to be held
+static int grow_table(heap *h){
+	compiled_program **buckets;
+	compiled_program *entry;
+	compiled_program *next;
+	unsigned int num_buckets;
+	unsigned int i;
+
+	num_buckets = h->num_compiled_buckets ? h->num_compiled_buckets*2 : 64;
+	buckets = calloc(num_buckets, sizeof(compiled_program *));
+	if(!buckets){
+		return 0;
+	}
+	for(i = 0; i < h->num_compiled_buckets; i++){
+		for(entry = h->compiled_buckets[i]; entry; entry = next){
+			next = entry->next;
+			entry->next = buckets[entry->source&(num_buckets - 1)];
+			buckets[entry->source&(num_buckets - 1)] = entry;
+		}
+	}
+	free(h->compiled_buckets);
+	h->compiled_buckets = buckets;
+	h->num_compiled_buckets = num_buckets;
+
+	return 1;
+}
+
+static void free_entry(compiled_program *entry){
+	free(entry->names);
+	free(entry->builtin_ids);
+	free(entry);
+}
+
+//Adds the entry unless another thread compiled the same source first. Returns 0 if it wasn't added
+static int add_entry(interp *in, compiled_program *entry){
+	heap *h;
+	int added = 0;
+
+	h = in->heap;
+	pthread_mutex_lock(&h->compiled_lock);
+	if(!(in->data_heap[entry->source].flags&DATA_COMPILED) && (h->num_compiled < h->num_compiled_buckets || grow_table(h))){
+		entry->next = NULL;
+		*find_place(h, entry->source) = entry;
+		h->num_compiled++;
+		set_flag(in, entry->source, DATA_COMPILED);
+		added = 1;
+	}
+	pthread_mutex_unlock(&h->compiled_lock);
+
+	return added;
+}
+
+//A program that fails to compile gets an entry all the same, so eval doesn't try again
+static void compile(interp *in, int source){
+	compilation c = {0};
+	compiled_program *entry;
+	char *error_message;
+	int program = -1;
+
+	error_message = in->error_message;
+	c.cells = allocate_list(in, 0);
+	if(c.cells != -1){
+		if(push_shadow_stack(in, c.cells)){
+			if(find_set_names(in, &c, source, 0)){
+				program = compile_call(in, &c, source, 0);
+			}
+			pop_shadow_stack(in);
+		}
+		decrement_references(in, c.cells);
+	}
+	free(c.set_names);
+	in->error_message = error_message;
+	if(program == source){
+		decrement_references(in, program);
+		program = -1;
+	}
+
+	entry = malloc(sizeof(compiled_program));
+	if(!entry){
+		if(program != -1){
+			decrement_references(in, program);
+		}
+		free(c.names);
+		free(c.builtin_ids);
+		return;
+	}
+	entry->source = source;
+	entry->program = program;
+	entry->is_value = program != -1 && in->data_heap[program].type != S_EXPR;
+	entry->num_names = c.num_names;
+	entry->names = c.names;
+	entry->builtin_ids = c.builtin_ids;
+	if(program != -1){
+		if(!entry->is_value){
+			analyze_escapes(in, program);
+		}
+		if(in->data_heap[source].flags&DATA_SHARED && !mark_shared(in, program)){
+			in->error_message = error_message;
+			decrement_references(in, program);
+			free_entry(entry);
+			return;
+		}
+	}
+	if(!add_entry(in, entry)){
+		if(program != -1){
+			decrement_references(in, program);
+		}
+		free_entry(entry);
+	}
+}
+
+//The entry of a source stays put until the source is freed, which can't happen while eval has it
+static compiled_program *find_entry(interp *in, int source){
+	compiled_program *entry;
+
+	pthread_mutex_lock(&in->heap->compiled_lock);
+	entry = in->heap->compiled_buckets ? *find_place(in->heap, source) : NULL;
+	pthread_mutex_unlock(&in->heap->compiled_lock);
+
+	return entry;
+}
+
+//Returns what eval returns for the Q expression: the compiled program to run in its place, its value,
+//or the source itself
+int eval_compiled(interp *in, int source, int *tail_call){
+	compiled_program *entry;
+	int flags;
+	int i;
+
+	flags = in->data_heap[source].flags;
+	//Code that is only run once isn't worth compiling
+	if(!(flags&DATA_EVALUATED)){
+		set_flag(in, source, DATA_EVALUATED);
+	} else {
+		if(!(flags&DATA_COMPILED)){
+			compile(in, source);
+		}
+		entry = find_entry(in, source);
+		if(entry && entry->program != -1){
+			for(i = 0; i < entry->num_names; i++){
+				if(!names_builtin(in, entry->names[i], entry->builtin_ids[i])){
+					break;
+				}
+			}
+			if(i == entry->num_names){
+				in->metrics.compiled_evals++;
+				*tail_call = !entry->is_value;
+				increment_references(in, entry->program);
+				return entry->program;
+			}
+		}
+	}
+
+	*tail_call = 1;
+	increment_references(in, source);
+	return source;
+}
+
+//Called when a compiled source's count reaches zero, or before it is rebuilt in place
+void forget_compiled(interp *in, int source){
+	compiled_program **place;
+	compiled_program *entry;
+	heap *h;
+
+	h = in->heap;
+	pthread_mutex_lock(&h->compiled_lock);
+	entry = NULL;
+	if(h->compiled_buckets){
+		place = find_place(h, source);
+		entry = *place;
+	}
+	if(entry){
+		*place = entry->next;
+		h->num_compiled--;
+	}
+	in->data_heap[source].flags &= ~(DATA_EVALUATED | DATA_COMPILED);
+	pthread_mutex_unlock(&h->compiled_lock);
+	if(!entry){
+		return;
+	}
+	if(entry->program != -1){
+		decrement_references(in, entry->program);
+	}
+	free_entry(entry);
+}
+
+//The program of a compiled source, or -1. mark_shared() shares it with the source, since whichever
+//thread evals a shared source runs its program
+int compiled_program_of(interp *in, int source){
+	compiled_program *entry;
+
+	entry = find_entry(in, source);
+
+	return entry ? entry->program : -1;
+}
+
+static int is_marked(heap *h, int data_index){
+	return h->data_heap_locations[data_index] < h->num_allocated;
+}
+
+//Marks the programs of sources the collector has marked. Programs can hold sources of their own, so
+//this goes round until nothing new is marked. Expects the world to be stopped
+void mark_compiled(heap *h){
+	compiled_program *entry;
+	unsigned int i;
+	int marked = 1;
+
+	while(marked){
+		marked = 0;
+		for(i = 0; i < h->num_compiled_buckets; i++){
+			for(entry = h->compiled_buckets[i]; entry; entry = entry->next){
+				if(entry->program != -1 && is_marked(h, entry->source) && !is_marked(h, entry->program)){
+					mark_allocated_recursive(h, entry->program);
+					marked = 1;
+				}
+			}
+		}
+	}
+}
+
+//Drops the entries of sources the collector didn't mark, along with their programs, which it didn't
+//mark either. Expects the world to be stopped
+void sweep_compiled(heap *h){
+	compiled_program **place;
+	compiled_program *entry;
+	unsigned int i;
+
+	for(i = 0; i < h->num_compiled_buckets; i++){
+		place = h->compiled_buckets + i;
+		while(*place){
+			entry = *place;
+			if(is_marked(h, entry->source)){
+				place = &entry->next;
+				continue;
+			}
+			*place = entry->next;
+			h->num_compiled--;
+			h->data_heap[entry->source].flags &= ~(DATA_EVALUATED | DATA_COMPILED);
+			free_entry(entry);
+		}
+	}
+}
+
+//Renumbers the entries after compact_heap() moved the cells, dropping those whose sources are dead.
+//Expects the world to be stopped
+void rebuild_compiled_table(heap *h, int *forward){
+	compiled_program *entries = NULL;
+	compiled_program *entry;
+	compiled_program *next;
+	unsigned int i;
+
+	for(i = 0; i < h->num_compiled_buckets; i++){
+		for(entry = h->compiled_buckets[i]; entry; entry = next){
+			next = entry->next;
+			entry->next = entries;
+			entries = entry;
+		}
+		h->compiled_buckets[i] = NULL;
+	}
+	h->num_compiled = 0;
+	for(entry = entries; entry; entry = next){
+		next = entry->next;
+		entry->source = forward[entry->source];
+		if(entry->source >= h->num_allocated){
+			free_entry(entry);
+			continue;
+		}
+		if(entry->program != -1){
+			entry->program = forward[entry->program];
+		}
+		entry->next = NULL;
+		*find_place(h, entry->source) = entry;
+		h->num_compiled++;
+	}
+}
+
+//The programs go with the rest of the heap
+void free_compiled_table(heap *h){
+	compiled_program *entry;
+	compiled_program *next;
+	unsigned int i;
+
+	for(i = 0; i < h->num_compiled_buckets; i++){
+		for(entry = h->compiled_buckets[i]; entry; entry = next){
+			next = entry->next;
+			free_entry(entry);
+		}
+	}
+	free(h->compiled_buckets);
+}
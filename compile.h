@@ -0,0 +1,27 @@
+#ifndef COMPILE_INCLUDED
+#define COMPILE_INCLUDED
+#include "allocate.h"
+
+//What eval runs in place of a Q expression it has run before. program is a copy of source with the
+//names of builtins in call position replaced by the builtins, and calls of pure builtins on literals
+//replaced by their results. It is the value of the whole source when is_value is set, and -1 when
+//compiling changed nothing. The copy is right as long as each of names still means the builtin in
+//builtin_ids, so eval looks them up every time. names point into source, which outlives the entry
+struct compiled_program{
+	int source;
+	int program;
+	int is_value;
+	int num_names;
+	char **names;
+	int *builtin_ids;
+	compiled_program *next;
+};
+
+int eval_compiled(interp *in, int source, int *tail_call);
+void forget_compiled(interp *in, int source);
+int compiled_program_of(interp *in, int source);
+void mark_compiled(heap *h);
+void sweep_compiled(heap *h);
+void rebuild_compiled_table(heap *h, int *forward);
+void free_compiled_table(heap *h);
+#endif
@@ -9,24 +9,25 @@ dictionary create_dictionary(void *value){
 	return output;
 }
 
-void free_dictionary(dictionary *dict, void (*free_value)(void *)){
+void free_dictionary(dictionary *dict, void (*free_value)(void *, void *), void *context){
 	unsigned char i;
 
 	for(i = 0; i < 8; i++){
 		if(dict->next_chars[i]){
-			free_dictionary(dict->next_chars[i], free_value);
+			free_dictionary(dict->next_chars[i], free_value, context);
 			free(dict->next_chars[i]);
 			dict->next_chars[i] = NULL;
 		}
 	}
 
 	if(dict->value){
-		free_value(dict->value);
+		free_value(dict->value, context);
 		dict->value = NULL;
 	}
 }
 
-void *read_dictionary(dictionary dict, char *string, unsigned char offset){
+//Adds the number of nodes visited to *probes
+void *read_dictionary_counted(dictionary dict, char *string, unsigned char offset, unsigned long *probes){
 	unsigned char zeros = 0;
 	unsigned char c;
 
@@ -49,6 +50,7 @@ void *read_dictionary(dictionary dict, char *string, unsigned char offset){
 		offset += zeros + 1;
 		string += (offset&0x08)>>3;
 		offset = offset&0x07;
+		++*probes;
 		if(dict.next_chars[zeros]){
 			dict = *(dict.next_chars[zeros]);
 		} else {
@@ -59,6 +61,12 @@ void *read_dictionary(dictionary dict, char *string, unsigned char offset){
 	return dict.value;
 }
 
+void *read_dictionary(dictionary dict, char *string, unsigned char offset){
+	unsigned long probes = 0;
+
+	return read_dictionary_counted(dict, string, offset, &probes);
+}
+
 void write_dictionary(dictionary *dict, char *string, void *value, unsigned char offset){
 	unsigned char zeros = 0;
 	unsigned char c;
@@ -92,16 +100,16 @@ void write_dictionary(dictionary *dict, char *string, void *value, unsigned char
 	dict->value = value;
 }
 
-void iterate_dictionary(dictionary dict, void (*func)(void *)){
+void iterate_dictionary(dictionary dict, void (*func)(void *, void *), void *context){
 	unsigned char i;
 	
 	if(dict.value){
-		func(dict.value);
+		func(dict.value, context);
 	}
 
 	for(i = 0; i < 8; i++){
 		if(dict.next_chars[i]){
-			iterate_dictionary(*dict.next_chars[i], func);
+			iterate_dictionary(*dict.next_chars[i], func, context);
 		}
 	}
 }
@@ -9,11 +9,13 @@ struct dictionary{
 
 dictionary create_dictionary(void *value);
 
-void free_dictionary(dictionary *dict, void (*free_value)(void *));
+void free_dictionary(dictionary *dict, void (*free_value)(void *, void *), void *context);
 
 void *read_dictionary(dictionary dict, char *string, unsigned char offset);
 
+void *read_dictionary_counted(dictionary dict, char *string, unsigned char offset, unsigned long *probes);
+
 void write_dictionary(dictionary *dict, char *string, void *value, unsigned char offset);
 
-void iterate_dictionary(dictionary dict, void (*func)(void *));
+void iterate_dictionary(dictionary dict, void (*func)(void *, void *), void *context);
 #endif
@@ -1,14 +1,24 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include "allocate.h"
 #include "dictionary.h"
-
-int global_none;
-static char *error_message = "none";
-
-void set_error(char *err){
-	error_message = err;
+#include "execute.h"
+#include "image.h"
+#include "intern.h"
+#include "sequence.h"
+#include "printer.h"
+#include "serialize.h"
+#include "region.h"
+#include "compact.h"
+#include "parallel.h"
+#include "isolate.h"
+#include "task.h"
+#include "compile.h"
+
+void set_error(interp *in, char *err){
+	in->error_message = err;
 }
 
 int is_whitespace(char c){
@@ -48,7 +58,7 @@ int get_integer(char **c){
 	return output;
 }
 
-char *get_identifier_name(char **c){
+char *get_identifier_name(interp *in, char **c){
 	char *beginning;
 	char *output;
 
@@ -59,7 +69,7 @@ char *get_identifier_name(char **c){
 
 	output = malloc(sizeof(char)*(*c - beginning + 1));
 	if(!output){
-		set_error("malloc returned NULL");
+		set_error(in, "malloc returned NULL");
 		return NULL;
 	}
 
@@ -70,42 +80,42 @@ char *get_identifier_name(char **c){
 	return output;
 }
 
-int get_quoted_identifier(char **c){
+int get_quoted_identifier(interp *in, char **c){
 	char *name;
 	int output;
 
-	name = get_identifier_name(c);
+	name = get_identifier_name(in, c);
 	if(!name){
 		return -1;
 	}
-	output = allocate();
+	output = allocate(in);
 	if(output == -1){
 		return -1;
 	}
-	data_heap[output].type = IDENTIFIER;
-	data_heap[output].identifier_name = name;
+	in->data_heap[output].type = IDENTIFIER;
+	in->data_heap[output].identifier_name = name;
 
 	return output;
 }
 
-int get_integer_data(char **c){
+int get_integer_data(interp *in, char **c){
 	int output;
 	int int_value;
 
 	int_value = get_integer(c);
-	output = allocate();
+	output = allocate(in);
 	if(output == -1){
 		return -1;
 	}
-	data_heap[output].type = INT_DATA;
-	data_heap[output].int_value = int_value;
+	in->data_heap[output].type = INT_DATA;
+	in->data_heap[output].int_value = int_value;
 
 	return output;
 }
 
-int get_quoted_value(char **c);
+int get_quoted_value(interp *in, char **c);
 
-int get_quoted_expression(char **c, data_type type){
+int get_quoted_expression(interp *in, char **c, data_type type){
 	char end_char;
 	int output;
 	int value;
@@ -118,740 +128,2134 @@ int get_quoted_expression(char **c, data_type type){
 		end_char = '}';
 	}
 
-	output = allocate();
+	output = allocate(in);
 	if(output == -1){
 		return -1;
 	}
-	if(!push_shadow_stack(output)){
+	if(!push_shadow_stack(in, output)){
 		return -1;
 	}
-	data_heap[output].num_entries = 0;
-	data_heap[output].entries = NULL;
+	in->data_heap[output].num_entries = 0;
+	in->data_heap[output].entries = NULL;
 
 	skip_whitespace(c);
 	while(**c != end_char){
-		value = get_quoted_value(c);
+		value = get_quoted_value(in, c);
 		if(value == -1){
 			return -1;
 		}
-		push_shadow_stack(value);
-		data_heap[output].num_entries++;
-		next_entries = realloc(data_heap[output].entries, sizeof(int)*data_heap[output].num_entries);
+		push_shadow_stack(in, value);
+		in->data_heap[output].num_entries++;
+		next_entries = resize_entries(in->data_heap + output, in->data_heap[output].num_entries);
 		if(!next_entries){
 			return -1;
 		}
-		data_heap[output].entries = next_entries;
-		data_heap[output].entries[data_heap[output].num_entries - 1] = value;
+		in->data_heap[output].entries = next_entries;
+		in->data_heap[output].entries[in->data_heap[output].num_entries - 1] = value;
 		skip_whitespace(c);
 	}
 
 	++*c;
 	skip_whitespace(c);
 
-	for(i = 0; i <= data_heap[output].num_entries; i++){
-		pop_shadow_stack();
+	for(i = 0; i <= in->data_heap[output].num_entries; i++){
+		pop_shadow_stack(in);
 	}
-	data_heap[output].type = type;
+	in->data_heap[output].type = type;
 
 	return output;
 }
 
-int get_quoted_value(char **c){
+int get_quoted_value(interp *in, char **c){
+	int output;
+
 	skip_whitespace(c);
 	if(is_digit(**c) || (**c == '-' && is_digit((*c)[1]))){
-		return get_integer_data(c);
+		output = get_integer_data(in, c);
 	} else if(is_identifier_char(**c)){
-		return get_quoted_identifier(c);
+		output = get_quoted_identifier(in, c);
 	} else if(**c == '('){
 		++*c;
-		return get_quoted_expression(c, S_EXPR);
+		output = get_quoted_expression(in, c, S_EXPR);
 	} else if(**c == '{'){
 		++*c;
-		return get_quoted_expression(c, Q_EXPR);
+		output = get_quoted_expression(in, c, Q_EXPR);
 	} else {
-		set_error("unrecognized expression value");
+		set_error(in, "unrecognized expression value");
 		return -1;
 	}
+	if(output == -1 || !in->heap->intern_buckets){
+		return output;
+	}
+
+	return intern_value(in, output);
 }
 
-void print_value(int value){
-	int i;
+void print_value(interp *in, int value){
+	write_value(in, value, STDOUT_FILENO);
+}
 
-	switch(data_heap[value].type){
-		case INT_DATA:
-			printf("%d", data_heap[value].int_value);
-			return;
-		case IDENTIFIER:
-			printf("%s", data_heap[value].identifier_name);
-			return;
-		case S_EXPR:
-			printf("(");
-			for(i = 0; i < data_heap[value].num_entries; i++){
-				print_value(data_heap[value].entries[i]);
-				if(i < data_heap[value].num_entries - 1){
-					printf(" ");
-				}
-			}
-			printf(")");
-			return;
-		case Q_EXPR:
-			printf("{");
-			for(i = 0; i < data_heap[value].num_entries; i++){
-				print_value(data_heap[value].entries[i]);
-				if(i < data_heap[value].num_entries - 1){
-					printf(" ");
-				}
-			}
-			printf("}");
-			return;
-		case NONE_DATA:
-			printf("none");
-			return;
-		case BUILTIN_FUNCTION:
-			printf("[builtin_function]");
-			return;
-		case FUNCTION:
-			printf("[function](");
-			print_value(data_heap[value].var_list);
-			printf(" ");
-			print_value(data_heap[value].source);
-			printf(")");
-			return;
-	}
-}
-
-int set_variable(char *var_name, int data_index){
+int set_variable(interp *in, char *var_name, int data_index){
 	variable *var;
+	int is_global;
 
-	var = read_dictionary(current_scope->variables, var_name, 0);
+	//Other threads can see bindings in the global scope
+	is_global = in->current_scope == in->heap->global_scope;
+	if(is_global){
+		if(!mark_shared(in, data_index)){
+			return 0;
+		}
+		write_lock_global_scope(in);
+	}
+	var = read_dictionary(in->current_scope->variables, var_name, 0);
 	if(!var){
 		var = malloc(sizeof(variable));
 		if(!var){
-			set_error("malloc returned NULL");
+			if(is_global){
+				unlock_global_scope(in);
+			}
+			set_error(in, "malloc returned NULL");
 			return 0;
 		}
 		var->name = malloc(sizeof(char)*(strlen(var_name) + 1));
 		if(!var->name){
 			free(var);
-			set_error("malloc returned NULL");
+			if(is_global){
+				unlock_global_scope(in);
+			}
+			set_error(in, "malloc returned NULL");
 			return 0;
 		}
+		strcpy(var->name, var_name);
 		var->data_index = data_index;
-		data_heap[data_index].num_references++;
-		write_dictionary(&(current_scope->variables), var_name, var, 0);
-		return 1;
+		increment_references(in, data_index);
+		write_dictionary(&(in->current_scope->variables), var_name, var, 0);
+		in->current_scope->num_variables++;
 	} else {
-		decrement_references(var->data_index);
+		decrement_references(in, var->data_index);
 		var->data_index = data_index;
-		data_heap[data_index].num_references++;
-		return 1;
+		increment_references(in, data_index);
+	}
+	if(is_global){
+		unlock_global_scope(in);
 	}
+
+	return 1;
 }
 
-int evaluate_q_expression(int data_index, int expand_q_expr);
+static builtin *get_builtin(int builtin_id);
 
-int execute_s_expr(int data_index){
-	int next_data_index;
-	int identifier_value;
-	int function;
-	int i;
-	int made_scope = 0;
-	int tail_call;
+//Names the frame after the function being called, for the profilers. Copying only happens while one is on
+static void enter_function_frame(interp *in, unsigned int frame, int call){
+	int name;
 
-	data_heap[data_index].num_references++;
-	do{
-		if(!push_shadow_stack(data_index)){
-			return -1;
+	if(!profiling && !in->heap->allocation_sites){
+		return;
+	}
+	name = in->data_heap[call].entries[0];
+	if(in->data_heap[name].type == IDENTIFIER){
+		strncpy(in->call_frames[frame].name, in->data_heap[name].identifier_name, MAX_FRAME_NAME - 1);
+		in->call_frames[frame].name[MAX_FRAME_NAME - 1] = '\0';
+	} else {
+		strcpy(in->call_frames[frame].name, "<lambda>");
+	}
+	in->call_frames[frame].site = -1;
+}
+
+static void set_frame_expr(interp *in, unsigned int frame, int expr){
+	in->call_frames[frame].builtin_id = -1;
+	in->call_frames[frame].expr = expr;
+	in->call_frames[frame].site = -1;
+}
+
+//Frames and values share one budget, so recursion depth is limited by memory rather than the C stack
+static int within_stack_limit(interp *in, unsigned long frames_size, unsigned long values_size){
+	if(frames_size*(sizeof(eval_frame) + sizeof(call_frame)) + values_size*sizeof(int) > in->heap->stack_limit){
+		set_error(in, "stack overflow");
+		return 0;
+	}
+
+	return 1;
+}
+
+//Takes ownership of a reference to expr
+static int push_frame(interp *in, int expr){
+	eval_frame *next_frames;
+	call_frame *next_call_frames;
+	unsigned int next_size;
+
+	if(!in->data_heap[expr].num_entries){
+		decrement_references(in, expr);
+		set_error(in, "empty function call");
+		return 0;
+	}
+	if(in->num_frames == in->frames_size){
+		next_size = in->frames_size ? in->frames_size*2 : 64;
+		if(!within_stack_limit(in, in->num_frames + 1, in->num_values)){
+			decrement_references(in, expr);
+			return 0;
 		}
-		tail_call = 0;
-		if(data_heap[data_index].num_entries == 0){
-			set_error("empty function call");
-			return -1;
+		next_frames = realloc(in->frames, sizeof(eval_frame)*next_size);
+		if(next_frames){
+			in->frames = next_frames;
 		}
-		function = evaluate_q_expression(data_heap[data_index].entries[0], 0);
-		if(function == -1){
-			return -1;
+		next_call_frames = realloc(in->call_frames, sizeof(call_frame)*next_size);
+		if(next_call_frames){
+			in->call_frames = next_call_frames;
 		}
-		while(data_heap[function].type == FUNCTION){
-			if(!made_scope){
-				if(!next_scope()){
-					return -1;
-				}
-				made_scope = 1;
-			}
-			if(data_heap[data_heap[function].var_list].type != Q_EXPR){
-				set_error("expected a Q expression for function variable list");
-				return -1;
-			}
-			if(data_heap[data_heap[function].var_list].num_entries != data_heap[data_index].num_entries - 1){
-				set_error("function called with wrong number of arguments");
-				return -1;
-			}
-			for(i = 0; i < data_heap[data_heap[function].var_list].num_entries; i++){
-				if(data_heap[data_heap[data_heap[function].var_list].entries[i]].type != IDENTIFIER){
-					set_error("expected identifier name in function variable list");
-					return -1;
-				}
-				identifier_value = evaluate_q_expression(data_heap[data_index].entries[i + 1], 0);
-				if(identifier_value == -1){
-					return -1;
-				}
-				if(!set_variable(data_heap[data_heap[data_heap[function].var_list].entries[i]].identifier_name, identifier_value)){
-					return -1;
-				}
-				decrement_references(identifier_value);
-			}
-			next_data_index = data_heap[function].source;
-			if(data_heap[next_data_index].type != Q_EXPR){
-				set_error("expected a Q expression for function source");
-				return -1;
-			}
-			if(data_heap[next_data_index].num_entries == 0){
-				set_error("empty function call");
-				return -1;
-			}
-			data_heap[next_data_index].num_references++;
-			pop_shadow_stack();
-			if(!push_shadow_stack(next_data_index)){
-				return -1;
-			}
-			decrement_references(data_index);
-			decrement_references(function);
-			data_index = next_data_index;
-			function = evaluate_q_expression(data_heap[data_index].entries[0], 0);
+		if(!next_frames || !next_call_frames){
+			decrement_references(in, expr);
+			set_error(in, "malloc returned NULL");
+			return 0;
 		}
-		if(data_heap[function].type != BUILTIN_FUNCTION){
-			set_error("expected function or builtin_function for function call");
-			return -1;
+		in->frames_size = next_size;
+	}
+	in->frames[in->num_frames].expr = expr;
+	in->frames[in->num_frames].next = 0;
+	in->frames[in->num_frames].base = in->num_values;
+	in->frames[in->num_frames].state = EVAL_FUNCTION;
+	in->frames[in->num_frames].made_scope = 0;
+	in->frames[in->num_frames].temporary = 0;
+	in->call_frames[in->num_frames].name[0] = '\0';
+	set_frame_expr(in, in->num_frames, expr);
+	in->num_frames++;
+
+	return 1;
+}
+
+//A tail call: the frame evaluates expr instead, keeping its scope. Takes ownership of a reference to expr
+static int replace_frame(interp *in, int expr){
+	eval_frame *frame;
+
+	frame = in->frames + in->num_frames - 1;
+	decrement_references(in, frame->expr);
+	frame->expr = expr;
+	frame->next = 0;
+	frame->state = EVAL_FUNCTION;
+	set_frame_expr(in, in->num_frames - 1, expr);
+	if(!in->data_heap[expr].num_entries){
+		set_error(in, "empty function call");
+		return 0;
+	}
+
+	return 1;
+}
+
+//Values that evaluate to themselves. The frame's expression keeps them alive, so when they are
+//entries of it the value stack borrows them instead of counting references, which would be atomic
+//for shared code
+static int is_literal(interp *in, int data_index){
+	return in->data_heap[data_index].type != S_EXPR && in->data_heap[data_index].type != IDENTIFIER;
+}
+
+//The value is owned by the stack unless it is borrowed, see read_atom()
+static int push_value(interp *in, int value, unsigned char borrowed){
+	unsigned char *next_borrowed;
+	int *next_values;
+	unsigned int next_size;
+
+	if(in->num_values == in->values_size){
+		next_size = in->values_size ? in->values_size*2 : 256;
+		if(!within_stack_limit(in, in->num_frames, in->num_values + 1)){
+			return 0;
 		}
-		next_data_index = data_heap[function].builtin_function(data_index, &tail_call);
-		if(next_data_index == -1){
-			return -1;
+		next_values = realloc(in->values, sizeof(int)*next_size);
+		if(!next_values){
+			set_error(in, "malloc returned NULL");
+			return 0;
+		}
+		in->values = next_values;
+		next_borrowed = realloc(in->borrowed, sizeof(unsigned char)*next_size);
+		if(!next_borrowed){
+			set_error(in, "malloc returned NULL");
+			return 0;
+		}
+		in->borrowed = next_borrowed;
+		in->values_size = next_size;
+	}
+	in->values[in->num_values] = value;
+	in->borrowed[in->num_values] = borrowed;
+	in->num_values++;
+
+	return 1;
+}
+
+//values[base + i] always holds the value of entries[i] of the frame's expression
+static void pop_values(interp *in, eval_frame *frame){
+	while(in->num_values > frame->base){
+		in->num_values--;
+		if(!in->borrowed[in->num_values]){
+			decrement_references(in, in->values[in->num_values]);
 		}
-		decrement_references(pop_shadow_stack());
-		decrement_references(function);
-		data_index = next_data_index;
-	} while(tail_call);
+	}
+}
 
-	if(made_scope){
-		previous_scope();
+//read_dictionary() that also records how many trie nodes the lookup visited
+static variable *lookup_variable(interp *in, dictionary dict, char *name){
+	unsigned long probes = 0;
+	variable *var;
+
+	var = read_dictionary_counted(dict, name, 0, &probes);
+	in->metrics.dictionary_lookups++;
+	in->metrics.dictionary_probes += probes;
+	if(probes > in->metrics.max_probe_length){
+		in->metrics.max_probe_length = probes;
 	}
 
-	return data_index;
+	return var;
 }
 
-int evaluate_q_expression(int data_index, int expand_q_expr){
-	int output;
-	int i;
+//Everything except S expressions evaluates without the frame stack. When borrowed isn't NULL the
+//value only has to last as long as the frame, so the value of a local variable that no other thread
+//can see is borrowed from the variable instead of counted. It is marked DATA_STACKED, so that if the
+//variable lets go of it first it waits in the zero count table, see reconcile_zero_counts()
+static int read_atom(interp *in, int data_index, unsigned char *borrowed){
 	scope *search_scope;
 	variable *var;
+	int output;
 
-	switch(data_heap[data_index].type){
-		case INT_DATA:
-			output = allocate();
-			if(output == -1){
-				return -1;
-			}
-			data_heap[output].type = INT_DATA;
-			data_heap[output].int_value = data_heap[data_index].int_value;
-			return output;
-		case IDENTIFIER:
-			search_scope = current_scope;
-			while(search_scope){
-				var = read_dictionary(search_scope->variables, data_heap[data_index].identifier_name, 0);
-				if(var){
-					output = var->data_index;
-					data_heap[output].num_references++;
-					return output;
-				}
-				search_scope = search_scope->previous;
-			}
-			set_error("unrecognized variable");
-			return -1;
-		case Q_EXPR:
-		case S_EXPR:
-			if(data_heap[data_index].type == S_EXPR || expand_q_expr){
-				return execute_s_expr(data_index);
+	if(in->data_heap[data_index].type != IDENTIFIER){
+		increment_references(in, data_index);
+		return data_index;
+	}
+
+	search_scope = in->current_scope;
+	while(search_scope != in->heap->global_scope){
+		var = lookup_variable(in, search_scope->variables, in->data_heap[data_index].identifier_name);
+		if(var){
+			output = var->data_index;
+			if(borrowed && !(in->data_heap[output].flags&DATA_SHARED)){
+				in->data_heap[output].flags |= DATA_STACKED;
+				*borrowed = 1;
 			} else {
-				data_heap[data_index].num_references++;
-				return data_index;
+				increment_references(in, output);
 			}
-		case BUILTIN_FUNCTION:
-		case FUNCTION:
-		case NONE_DATA:
-			data_heap[data_index].num_references++;
-			return data_index;
+			return output;
+		}
+		search_scope = search_scope->previous;
 	}
-
-	set_error("unrecognized expression type");
+	read_lock_global_scope(in);
+	var = lookup_variable(in, in->heap->global_scope->variables, in->data_heap[data_index].identifier_name);
+	if(var){
+		output = var->data_index;
+		increment_references(in, output);
+		unlock_global_scope(in);
+		return output;
+	}
+	unlock_global_scope(in);
+	set_error(in, "unrecognized variable");
 	return -1;
 }
 
-int data_equal(int b, int a){
-	int i;
+static int evaluate_atom(interp *in, int data_index){
+	return read_atom(in, data_index, NULL);
+}
 
-	if(data_heap[a].type != data_heap[b].type){
-		return 0;
-	}
+//Whether the name means the builtin in the current scope, looked up as evaluate_atom() would
+int names_builtin(interp *in, char *name, int builtin_id){
+	scope *search_scope;
+	variable *var;
+	int result;
 
-	switch(data_heap[a].type){
-		case NONE_DATA:
-			return 1;
-		case INT_DATA:
-			return data_heap[a].int_value == data_heap[b].int_value;
-		case IDENTIFIER:
-			return !strcmp(data_heap[a].identifier_name, data_heap[b].identifier_name);
-		case S_EXPR:
-		case Q_EXPR:
-			if(data_heap[a].num_entries != data_heap[b].num_entries){
-				return 0;
-			}
-			for(i = 0; i < data_heap[a].num_entries; i++){
-				if(!data_equal(data_heap[a].entries[i], data_heap[b].entries[i])){
-					return 0;
-				}
-			}
-			return 1;
-		case BUILTIN_FUNCTION:
-			return data_heap[a].builtin_function == data_heap[b].builtin_function;
-		case FUNCTION:
-			return data_equal(data_heap[a].var_list, data_heap[b].var_list) && data_equal(data_heap[a].source, data_heap[b].source);
+	search_scope = in->current_scope;
+	while(search_scope != in->heap->global_scope){
+		var = lookup_variable(in, search_scope->variables, name);
+		if(var){
+			return in->data_heap[var->data_index].type == BUILTIN_FUNCTION && in->data_heap[var->data_index].builtin_id == builtin_id;
+		}
+		search_scope = search_scope->previous;
 	}
+	read_lock_global_scope(in);
+	var = lookup_variable(in, in->heap->global_scope->variables, name);
+	result = var && in->data_heap[var->data_index].type == BUILTIN_FUNCTION && in->data_heap[var->data_index].builtin_id == builtin_id;
+	unlock_global_scope(in);
 
-	return 0;
+	return result;
 }
 
-int register_builtin_function(char *name, int (*builtin_function)(int, int *)){
-	int data_index;
-	variable *var;
+//Whether the function can be called on num_args arguments
+static int check_function(interp *in, int function, int num_args){
+	int var_list;
+	int i;
 
-	data_index = allocate();
-	if(data_index == -1){
-		return -1;
+	var_list = in->data_heap[function].var_list;
+	if(in->data_heap[var_list].type != Q_EXPR){
+		set_error(in, "expected a Q expression for function variable list");
+		return 0;
 	}
-	data_heap[data_index].type = BUILTIN_FUNCTION;
-	data_heap[data_index].builtin_function = builtin_function;
-	var = malloc(sizeof(variable));
-	if(!var){
-		set_error("malloc returned NULL");
-		decrement_references(data_index);
-		return -1;
+	if(in->data_heap[var_list].num_entries != num_args){
+		set_error(in, "function called with wrong number of arguments");
+		return 0;
 	}
-	var->name = malloc(sizeof(char)*(strlen(name) + 1));
-	if(!var->name){
-		set_error("malloc returned NULL");
-		free(var);
-		decrement_references(data_index);
-		return -1;
+	for(i = 0; i < num_args; i++){
+		if(in->data_heap[in->data_heap[var_list].entries[i]].type != IDENTIFIER){
+			set_error(in, "expected identifier name in function variable list");
+			return 0;
+		}
 	}
-	strcpy(var->name, name);
-	var->data_index = data_index;
+	if(in->data_heap[in->data_heap[function].source].type != Q_EXPR){
+		set_error(in, "expected a Q expression for function source");
+		return 0;
+	}
+	analyze_escapes(in, in->data_heap[function].source);
 
-	write_dictionary(&(global_scope->variables), name, var, 0);
-	return data_index;
+	return 1;
 }
 
-int print(int expr, int *tail_call){
+//Binds the evaluated arguments on the value stack to the function's parameters
+static int bind_arguments(interp *in, eval_frame *frame, int function){
+	int var_list;
+	int num_args;
 	int i;
-	int arg_value;
 
-	for(i = 1; i < data_heap[expr].num_entries; i++){
-		if(i - 1){
-			printf(" ");
+	var_list = in->data_heap[function].var_list;
+	num_args = in->num_values - frame->base - 1;
+	if(!check_function(in, function, num_args)){
+		return 0;
+	}
+	if(!frame->made_scope){
+		if(!next_scope(in)){
+			return 0;
 		}
-		arg_value = evaluate_q_expression(data_heap[expr].entries[i], 0);
-		if(arg_value == -1){
-			return -1;
+		frame->made_scope = 1;
+	} else {
+		//A tail call reuses the scope, and every temporary of the last call has been read by now
+		in->num_temporaries = in->current_scope->region_base;
+	}
+	for(i = 0; i < num_args; i++){
+		if(!set_variable(in, in->data_heap[in->data_heap[var_list].entries[i]].identifier_name, in->values[frame->base + 1 + i])){
+			return 0;
 		}
-		print_value(arg_value);
-		decrement_references(arg_value);
 	}
 
-	printf("\n");
-	data_heap[global_none].num_references++;
-	return global_none;
+	return 1;
 }
 
-int add(int expr, int *tail_call){
-	int output = 0;
-	int output_index;
-	int arg_value;
+//A memoized function missed its cache. The frame waits in MEMO_RESULT for a frame calling the
+//underlying function on copies of the same arguments, so it still has them to store the result under
+static int call_memoized(interp *in){
+	unsigned int parent;
+	unsigned int parent_base;
+	int num_entries;
+	int value;
 	int i;
 
-	for(i = 1; i < data_heap[expr].num_entries; i++){
-		arg_value = evaluate_q_expression(data_heap[expr].entries[i], 0);
-		if(arg_value == -1){
-			return -1;
+	parent = in->num_frames - 1;
+	in->frames[parent].state = MEMO_RESULT;
+	increment_references(in, in->frames[parent].expr);
+	if(!push_frame(in, in->frames[parent].expr)){
+		return 0;
+	}
+	num_entries = in->data_heap[in->frames[parent].expr].num_entries;
+	parent_base = in->frames[parent].base;
+	in->frames[parent + 1].state = EVAL_ARGUMENTS;
+	in->frames[parent + 1].next = num_entries;
+	enter_function_frame(in, parent + 1, in->frames[parent].expr);
+	for(i = 0; i < num_entries; i++){
+		if(i){
+			value = in->values[parent_base + i];
+		} else {
+			value = in->data_heap[in->values[parent_base]].memo_function;
 		}
-		if(data_heap[arg_value].type != INT_DATA){
-			set_error("expected integer value");
-			return -1;
+		//The parent frame keeps the values until this one is done
+		if(!push_value(in, value, 1)){
+			return 0;
 		}
-		output += data_heap[arg_value].int_value;
-		decrement_references(arg_value);
-	}
-
-	output_index = allocate();
-	if(output_index == -1){
-		return -1;
 	}
-	data_heap[output_index].type = INT_DATA;
-	data_heap[output_index].int_value = output;
 
-	return output_index;
+	return 1;
 }
 
-int subtract(int expr, int *tail_call){
-	int output;
-	int output_index;
-	int arg_value;
-	int i;
+//Whether the frame only reads the value of the entry it is about to evaluate, so that value can be a
+//temporary. Temporaries belong to function scopes, since nothing releases them at the top level. Tasks
+//taking turns would give the region back out of order, so there are none while tasks run
+static int reads_temporary(interp *in, eval_frame *frame){
+	int function;
 
-	if(data_heap[expr].num_entries < 2){
-		set_error("- expects at least one argument");
-		return -1;
+	if(!(in->data_heap[frame->expr].flags&DATA_NO_ESCAPE) || in->current_scope == in->heap->global_scope || in->current_task){
+		return 0;
 	}
-
-	arg_value = evaluate_q_expression(data_heap[expr].entries[1], 0);
-	if(arg_value == -1){
-		return -1;
+	if(frame->state == IF_CONDITION){
+		return 1;
 	}
-	if(data_heap[arg_value].type != INT_DATA){
-		set_error("expected integer value");
-		return -1;
+	if(frame->state != EVAL_ARGUMENTS){
+		return 0;
 	}
-	if(data_heap[expr].num_entries == 2){
-		output = -data_heap[arg_value].int_value;
-		decrement_references(arg_value);
-		output_index = allocate();
-		if(output_index == -1){
-			return -1;
-		}
-		data_heap[output_index].type = INT_DATA;
-		data_heap[output_index].int_value = output;
-
-		return output_index;
-	} else {
-		output = data_heap[arg_value].int_value;
-		decrement_references(arg_value);
-		for(i = 2; i < data_heap[expr].num_entries; i++){
-			arg_value = evaluate_q_expression(data_heap[expr].entries[i], 0);
-			if(arg_value == -1){
-				return -1;
-			}
-			if(data_heap[arg_value].type != INT_DATA){
-				set_error("expected integer value");
-				return -1;
-			}
-			output -= data_heap[arg_value].int_value;
-			decrement_references(arg_value);
-		}
-		output_index = allocate();
-		if(output_index == -1){
-			return -1;
-		}
-		data_heap[output_index].type = INT_DATA;
-		data_heap[output_index].int_value = output;
+	function = in->values[frame->base];
 
-		return output_index;
-	}
+	return in->data_heap[function].type == BUILTIN_FUNCTION && get_builtin(in->data_heap[function].builtin_id)->flags&BUILTIN_READS_ARGUMENTS;
 }
 
-int multiply(int expr, int *tail_call){
-	int output = 1;
-	int output_index;
-	int arg_value;
-	int i;
+//The arguments on the value stack that the stack holds a counted reference to, which is every one it
+//doesn't borrow
+static unsigned int owned_arguments(interp *in, eval_frame *frame){
+	unsigned int owned = 0;
+	unsigned int i;
 
-	for(i = 1; i < data_heap[expr].num_entries; i++){
-		arg_value = evaluate_q_expression(data_heap[expr].entries[i], 0);
-		if(arg_value == -1){
-			return -1;
-		}
-		if(data_heap[arg_value].type != INT_DATA){
-			set_error("expected integer value");
-			return -1;
+	for(i = 1; frame->base + i < in->num_values && i <= 32; i++){
+		if(!in->borrowed[frame->base + i]){
+			owned |= 1U<<(i - 1);
 		}
-		output *= data_heap[arg_value].int_value;
-		decrement_references(arg_value);
 	}
 
-	output_index = allocate();
-	if(output_index == -1){
-		return -1;
-	}
-	data_heap[output_index].type = INT_DATA;
-	data_heap[output_index].int_value = output;
+	return owned;
+}
 
-	return output_index;
+//One step of the running task's quota. Another task may run before this returns, see task.c
+static void count_step(interp *in){
+	if(in->current_task && !--in->steps_left){
+		next_task(in);
+	}
 }
 
-int if_func(int expr, int *tail_call){
-	int arg_value;
+//Runs frames until the stack is back to base_frames, returning the value of the bottom one.
+//Subexpressions that are S expressions get frames of their own instead of a C call, and every
+//tail position (function bodies, if branches, the last form of :, eval) reuses the current frame
+static int run_frames(interp *in, unsigned int base_frames){
+	eval_frame *frame;
+	builtin *b;
+	unsigned int base_values;
+	int value = -1;
+	//Whether the reference to value is borrowed rather than counted
+	unsigned char borrowed = 0;
+	int next_expr;
+	int function;
+	int tail_call;
+	int temporary;
+	int num_entries;
+	int *entries;
 
-	if(data_heap[expr].num_entries == 3){
-		arg_value = evaluate_q_expression(data_heap[expr].entries[1], 0);
-		if(arg_value == -1){
-			return -1;
+	base_values = in->frames[base_frames].base;
+	while(1){
+		frame = in->frames + in->num_frames - 1;
+		num_entries = in->data_heap[frame->expr].num_entries;
+		entries = in->data_heap[frame->expr].entries;
+		next_expr = -1;
+		switch(frame->state){
+			case EVAL_FUNCTION:
+				if(value == -1){
+					safepoint(in);
+					if(in->zero_count_cells >= in->zero_count_limit){
+						reconcile_zero_counts(in);
+					}
+					count_step(in);
+					next_expr = entries[0];
+					break;
+				}
+				function = value;
+				value = -1;
+				if(!push_value(in, function, borrowed)){
+					goto error;
+				}
+				borrowed = 0;
+				if(in->data_heap[function].type == FUNCTION || in->data_heap[function].type == MEMO_FUNCTION){
+					enter_function_frame(in, in->num_frames - 1, frame->expr);
+					frame->state = EVAL_ARGUMENTS;
+					frame->next = 1;
+					continue;
+				}
+				if(in->data_heap[function].type != BUILTIN_FUNCTION){
+					set_error(in, "expected function or builtin_function for function call");
+					goto error;
+				}
+				b = get_builtin(in->data_heap[function].builtin_id);
+				in->metrics.builtin_calls[in->data_heap[function].builtin_id]++;
+				in->call_frames[in->num_frames - 1].builtin_id = in->data_heap[function].builtin_id;
+				in->call_frames[in->num_frames - 1].site = -1;
+				switch(b->kind){
+					case STRICT_BUILTIN:
+						frame->state = EVAL_ARGUMENTS;
+						frame->next = 1;
+						continue;
+					case RAW_BUILTIN:
+						tail_call = 0;
+						value = b->builtin_function(in, entries + 1, num_entries - 1, &tail_call);
+						goto builtin_returned;
+					case IF_FORM:
+						if(num_entries != 3 && num_entries != 4){
+							set_error(in, "if expects 2 or 3 arguments");
+							goto error;
+						}
+						frame->state = IF_CONDITION;
+						next_expr = entries[1];
+						break;
+					case COLON_FORM:
+						frame->state = COLON_SEQUENCE;
+						frame->next = 1;
+						continue;
+					case SET_FORM:
+						if(num_entries != 3){
+							set_error(in, "set expects 2 arguments");
+							goto error;
+						}
+						if(in->data_heap[entries[1]].type != IDENTIFIER){
+							set_error(in, "set expectes identifier as first argument");
+							goto error;
+						}
+						frame->state = SET_VALUE;
+						next_expr = entries[2];
+						break;
+				}
+				break;
+			case EVAL_ARGUMENTS:
+				if(value != -1){
+					if(!push_value(in, value, borrowed)){
+						value = -1;
+						goto error;
+					}
+					value = -1;
+					borrowed = 0;
+					frame->next++;
+				}
+				if(frame->next < num_entries){
+					next_expr = entries[frame->next];
+					break;
+				}
+				function = in->values[frame->base];
+				if(in->data_heap[function].type == FUNCTION){
+					if(!bind_arguments(in, frame, function)){
+						goto error;
+					}
+					next_expr = in->data_heap[function].source;
+					increment_references(in, next_expr);
+					pop_values(in, frame);
+					if(!replace_frame(in, next_expr)){
+						goto error;
+					}
+					continue;
+				}
+				if(in->data_heap[function].type == MEMO_FUNCTION){
+					value = memo_lookup(in, function, in->values + frame->base + 1, num_entries - 1);
+					if(value != -1){
+						pop_values(in, frame);
+						goto finish;
+					}
+					if(!call_memoized(in)){
+						goto error;
+					}
+					continue;
+				}
+				tail_call = 0;
+				b = get_builtin(in->data_heap[function].builtin_id);
+				//The result goes in the region of the scope the frame below runs in, which lasts
+				//until that frame has read it
+				in->temporary_result = frame->temporary && !frame->made_scope && b->flags&BUILTIN_RETURNS_INT && !in->current_task;
+				if(b->flags&BUILTIN_REUSES_ARGUMENTS){
+					in->owned_arguments = owned_arguments(in, frame);
+				}
+				value = b->builtin_function(in, in->values + frame->base + 1, in->num_values - frame->base - 1, &tail_call);
+				in->temporary_result = 0;
+				in->owned_arguments = 0;
+				goto builtin_returned;
+			case IF_CONDITION:
+				if(in->data_heap[value].type != INT_DATA || in->data_heap[value].int_value){
+					next_expr = entries[2];
+				} else if(num_entries == 4){
+					next_expr = entries[3];
+				}
+				if(!borrowed){
+					decrement_references(in, value);
+				}
+				value = -1;
+				borrowed = 0;
+				pop_values(in, frame);
+				if(next_expr == -1){
+					increment_references(in, in->global_none);
+					value = in->global_none;
+					goto finish;
+				}
+				goto tail_position;
+			case COLON_SEQUENCE:
+				if(value != -1){
+					if(!borrowed){
+						decrement_references(in, value);
+					}
+					value = -1;
+					borrowed = 0;
+					frame->next++;
+				}
+				if(frame->next < num_entries - 1){
+					next_expr = entries[frame->next];
+					break;
+				}
+				pop_values(in, frame);
+				if(num_entries < 2){
+					increment_references(in, in->global_none);
+					value = in->global_none;
+					goto finish;
+				}
+				next_expr = entries[num_entries - 1];
+				goto tail_position;
+			case SET_VALUE:
+				if(!set_variable(in, in->data_heap[entries[1]].identifier_name, value)){
+					goto error;
+				}
+				if(!borrowed){
+					decrement_references(in, value);
+				}
+				borrowed = 0;
+				pop_values(in, frame);
+				increment_references(in, in->global_none);
+				value = in->global_none;
+				goto finish;
+			case MEMO_RESULT:
+				if(!memo_insert(in, in->values[frame->base], in->values + frame->base + 1, num_entries - 1, value)){
+					goto error;
+				}
+				pop_values(in, frame);
+				goto finish;
 		}
-		if(data_heap[arg_value].type != INT_DATA || data_heap[arg_value].int_value){
-			decrement_references(arg_value);
-			if(data_heap[data_heap[expr].entries[2]].type == S_EXPR){
-				*tail_call = 1;
-				data_heap[data_heap[expr].entries[2]].num_references++;
-				return data_heap[expr].entries[2];
-			} else {
-				return evaluate_q_expression(data_heap[expr].entries[2], 0);
+
+		//Evaluate next_expr, an entry of the current frame's expression
+		if(in->data_heap[next_expr].type == S_EXPR){
+			increment_references(in, next_expr);
+			temporary = reads_temporary(in, frame);
+			if(!push_frame(in, next_expr)){
+				goto error;
 			}
+			in->frames[in->num_frames - 1].temporary = temporary;
+		} else if(is_literal(in, next_expr)){
+			value = next_expr;
+			borrowed = 1;
 		} else {
-			decrement_references(arg_value);
-			data_heap[global_none].num_references++;
-			return global_none;
-		}
-	} else if(data_heap[expr].num_entries == 4){
-		arg_value = evaluate_q_expression(data_heap[expr].entries[1], 0);
-		if(arg_value == -1){
-			return -1;
+			value = read_atom(in, next_expr, &borrowed);
+			if(value == -1){
+				goto error;
+			}
 		}
-		if(data_heap[arg_value].type != INT_DATA || data_heap[arg_value].int_value){
-			decrement_references(arg_value);
-			if(data_heap[data_heap[expr].entries[2]].type == S_EXPR){
-				*tail_call = 1;
-				data_heap[data_heap[expr].entries[2]].num_references++;
-				return data_heap[expr].entries[2];
-			} else {
-				return evaluate_q_expression(data_heap[expr].entries[2], 0);
+		continue;
+
+		tail_position:
+		if(in->data_heap[next_expr].type == S_EXPR){
+			increment_references(in, next_expr);
+			if(!replace_frame(in, next_expr)){
+				goto error;
 			}
-		} else {
-			decrement_references(arg_value);
-			if(data_heap[data_heap[expr].entries[3]].type == S_EXPR){
-				*tail_call = 1;
-				data_heap[data_heap[expr].entries[3]].num_references++;
-				return data_heap[expr].entries[3];
-			} else {
-				return evaluate_q_expression(data_heap[expr].entries[3], 0);
+			continue;
+		}
+		value = evaluate_atom(in, next_expr);
+		if(value == -1){
+			goto error;
+		}
+		goto finish;
+
+		builtin_returned:
+		//The builtin may have run frames of its own and moved the frame stack
+		frame = in->frames + in->num_frames - 1;
+		if(value == -1){
+			goto error;
+		}
+		pop_values(in, frame);
+		if(tail_call){
+			if(!replace_frame(in, value)){
+				goto error;
 			}
+			value = -1;
+			continue;
+		}
+
+		finish:
+		frame = in->frames + in->num_frames - 1;
+		if(frame->made_scope){
+			previous_scope(in);
+		}
+		decrement_references(in, frame->expr);
+		in->num_frames--;
+		if(in->num_frames == base_frames){
+			return value;
+		}
+	}
+
+	//Data left on the stacks is reclaimed by the next collection
+	error:
+	while(in->num_frames > base_frames){
+		in->num_frames--;
+		if(in->frames[in->num_frames].made_scope){
+			previous_scope(in);
 		}
-	} else {
-		set_error("if expects 2 or 3 arguments");
-		return -1;
 	}
+	in->num_values = base_values;
+	return -1;
 }
 
-int equal(int expr, int *tail_call){
-	int output = 1;
-	int output_index;
-	int first;
-	int arg_value;
+//Calls a function on arguments that are already evaluated, for builtins that take functions.
+//The arguments must be reachable by the collector, e.g. from the caller's value stack
+int call_function(interp *in, int function, int *args, int num_args){
+	unsigned int base_frames;
+	unsigned int frame;
+	int expr;
 	int i;
 
-	if(data_heap[expr].num_entries < 2){
-		set_error("= expects at least 1 argument");
+	if(in->data_heap[function].type != FUNCTION && in->data_heap[function].type != MEMO_FUNCTION && (in->data_heap[function].type != BUILTIN_FUNCTION || get_builtin(in->data_heap[function].builtin_id)->kind != STRICT_BUILTIN)){
+		set_error(in, "expected a function");
 		return -1;
 	}
-
-	first = evaluate_q_expression(data_heap[expr].entries[1], 0);
-	if(first == -1){
+	expr = allocate_list(in, num_args + 1);
+	if(expr == -1){
 		return -1;
 	}
-	push_shadow_stack(first);
+	in->data_heap[expr].type = S_EXPR;
+	in->data_heap[expr].entries[0] = function;
+	increment_references(in, function);
+	for(i = 0; i < num_args; i++){
+		in->data_heap[expr].entries[i + 1] = args[i];
+		increment_references(in, args[i]);
+	}
+	in->data_heap[expr].num_entries = num_args + 1;
 
-	for(i = 2; i < data_heap[expr].num_entries; i++){
-		arg_value = evaluate_q_expression(data_heap[expr].entries[i], 0);
-		if(arg_value == -1){
+	//The frame starts with its values already on the stack, as if it had evaluated the entries
+	base_frames = in->num_frames;
+	if(!push_frame(in, expr)){
+		return -1;
+	}
+	frame = in->num_frames - 1;
+	in->frames[frame].state = EVAL_ARGUMENTS;
+	in->frames[frame].next = num_args + 1;
+	if(in->data_heap[function].type == BUILTIN_FUNCTION){
+		in->metrics.builtin_calls[in->data_heap[function].builtin_id]++;
+	} else {
+		enter_function_frame(in, frame, expr);
+	}
+	//The frame's expression keeps them alive
+	for(i = 0; i <= num_args; i++){
+		if(!push_value(in, in->data_heap[expr].entries[i], 1)){
+			in->num_frames--;
 			return -1;
 		}
-		if(!data_equal(arg_value, first)){
-			output = 0;
-			decrement_references(arg_value);
-			break;
-		}
-		decrement_references(arg_value);
 	}
 
-	decrement_references(pop_shadow_stack());
-	output_index = allocate();
+	return run_frames(in, base_frames);
+}
+
+int execute_s_expr(interp *in, int data_index){
+	unsigned int base_frames;
+
+	base_frames = in->num_frames;
+	increment_references(in, data_index);
+	if(!push_frame(in, data_index)){
+		return -1;
+	}
+
+	return run_frames(in, base_frames);
+}
+
+int evaluate_q_expression(interp *in, int data_index, int expand_q_expr){
+	if(in->data_heap[data_index].type == S_EXPR || (in->data_heap[data_index].type == Q_EXPR && expand_q_expr)){
+		return execute_s_expr(in, data_index);
+	}
+
+	return evaluate_atom(in, data_index);
+}
+
+//Makes the scope for a repeated call with the parameters bound to nothing yet
+static int bind_repeated_parameters(interp *in, repeated_call *call){
+	int var_list;
+	int i;
+
+	if(!next_scope(in)){
+		set_error(in, "malloc returned NULL");
+		return 0;
+	}
+	call->made_scope = 1;
+	var_list = in->data_heap[call->function].var_list;
+	for(i = 0; i < call->num_args; i++){
+		if(!set_variable(in, in->data_heap[in->data_heap[var_list].entries[i]].identifier_name, in->global_none)){
+			return 0;
+		}
+		call->parameters[i] = read_dictionary(in->current_scope->variables, in->data_heap[in->data_heap[var_list].entries[i]].identifier_name, 0);
+	}
+	call->num_variables = in->current_scope->num_variables;
+
+	return 1;
+}
+
+//Checks the function and binds its parameters once, so a loop over n elements makes one scope and
+//num_args variables instead of n of each. Other functions go through call_function(). A call that
+//started must be ended, error or not, since the scope stays current until then
+int start_repeated_call(interp *in, repeated_call *call, int function, int num_args){
+	call->function = function;
+	call->num_args = num_args;
+	call->made_scope = 0;
+	call->owned_arguments = 0;
+	if(num_args > MAX_REPEATED_ARGS){
+		set_error(in, "too many arguments for a repeated call");
+		return 0;
+	}
+	if(in->data_heap[function].type != FUNCTION){
+		return 1;
+	}
+	if(!check_function(in, function, num_args)){
+		return 0;
+	}
+
+	return bind_repeated_parameters(in, call);
+}
+
+//Returns a new reference to the function's value on args, which must be reachable by the collector.
+//A call that set variables of its own leaves a scope the next call can't see them in, so that one
+//gets a fresh scope, as it would without the loop
+int repeat_call(interp *in, repeated_call *call, int *args){
+	builtin *b;
+	int previous;
+	int value;
+	int expr;
+	int tail_call;
+	int i;
+
+	if(call->made_scope){
+		if(in->current_scope->num_variables != call->num_variables){
+			previous_scope(in);
+			call->made_scope = 0;
+			if(!bind_repeated_parameters(in, call)){
+				return -1;
+			}
+		}
+		for(i = 0; i < call->num_args; i++){
+			previous = call->parameters[i]->data_index;
+			call->parameters[i]->data_index = args[i];
+			increment_references(in, args[i]);
+			decrement_references(in, previous);
+		}
+		//Every temporary of the last call has been read by now
+		in->num_temporaries = in->current_scope->region_base;
+		return execute_s_expr(in, in->data_heap[call->function].source);
+	}
+	if(in->data_heap[call->function].type != BUILTIN_FUNCTION || get_builtin(in->data_heap[call->function].builtin_id)->kind != STRICT_BUILTIN){
+		return call_function(in, call->function, args, call->num_args);
+	}
+
+	//A builtin is called directly, without an expression to evaluate
+	count_step(in);
+	b = get_builtin(in->data_heap[call->function].builtin_id);
+	in->metrics.builtin_calls[in->data_heap[call->function].builtin_id]++;
+	tail_call = 0;
+	if(b->flags&BUILTIN_REUSES_ARGUMENTS){
+		in->owned_arguments = call->owned_arguments;
+	}
+	value = b->builtin_function(in, args, call->num_args, &tail_call);
+	in->owned_arguments = 0;
+	if(value == -1 || !tail_call){
+		return value;
+	}
+	expr = value;
+	value = execute_s_expr(in, expr);
+	decrement_references(in, expr);
+
+	return value;
+}
+
+void end_repeated_call(interp *in, repeated_call *call){
+	if(call->made_scope){
+		previous_scope(in);
+		call->made_scope = 0;
+	}
+}
+
+//Compares pairs of cells from a stack rather than recursing, so nesting depth doesn't use up the C
+//stack. Returns -1 with the error set if the stack can't grow
+int data_equal(interp *in, int b, int a){
+	cell_stack s;
+	data *x;
+	data *y;
+	int output = 1;
+	int i;
+
+	init_cell_stack(&s);
+	push_cell_stack(&s, a);
+	push_cell_stack(&s, b);
+	while(output == 1 && s.depth){
+		b = s.cells[--s.depth];
+		a = s.cells[--s.depth];
+		if(a == b){
+			continue;
+		}
+		x = in->data_heap + a;
+		y = in->data_heap + b;
+		if((x->flags&y->flags&DATA_INTERNED) || x->type != y->type){
+			output = 0;
+			break;
+		}
+		switch(x->type){
+			case NONE_DATA:
+				break;
+			case INT_DATA:
+				output = x->int_value == y->int_value;
+				break;
+			case IDENTIFIER:
+				output = !strcmp(x->identifier_name, y->identifier_name);
+				break;
+			case S_EXPR:
+			case Q_EXPR:
+				if(x->num_entries != y->num_entries){
+					output = 0;
+					break;
+				}
+				for(i = x->num_entries - 1; i >= 0; i--){
+					if(!push_cell_stack(&s, x->entries[i]) || !push_cell_stack(&s, y->entries[i])){
+						output = -1;
+						break;
+					}
+				}
+				break;
+			case BUILTIN_FUNCTION:
+				output = x->builtin_id == y->builtin_id;
+				break;
+			case FUNCTION:
+				if(!push_cell_stack(&s, x->source) || !push_cell_stack(&s, y->source) || !push_cell_stack(&s, x->var_list) || !push_cell_stack(&s, y->var_list)){
+					output = -1;
+				}
+				break;
+			case MEMO_FUNCTION:
+			case PROMISE:
+				output = 0;
+				break;
+		}
+	}
+	free_cell_stack(&s);
+	if(output == -1){
+		set_error(in, "malloc returned NULL");
+	}
+
+	return output;
+}
+
+//Structurally equal data hashes the same, so it can key tables compared with data_equal(). The cells
+//are hashed in the order the printer writes them, from a stack rather than recursively. If the stack
+//can't grow, the lists left over are only hashed by their lengths, which at worst costs a cache miss
+unsigned long hash_data(interp *in, int data_index){
+	cell_stack s;
+	data *d;
+	unsigned long hash = 0;
+	char *c;
+	int i;
+
+	init_cell_stack(&s);
+	push_cell_stack(&s, data_index);
+	while(s.depth){
+		data_index = s.cells[--s.depth];
+		d = in->data_heap + data_index;
+		hash = (hash ^ (d->type + 1)*0x9e3779b97f4a7c15UL)*0x100000001b3UL;
+		switch(d->type){
+			case NONE_DATA:
+				break;
+			case INT_DATA:
+				hash = (hash ^ (unsigned int) d->int_value)*0x100000001b3UL;
+				break;
+			case IDENTIFIER:
+				for(c = d->identifier_name; *c; c++){
+					hash = (hash ^ (unsigned char) *c)*0x100000001b3UL;
+				}
+				break;
+			case S_EXPR:
+			case Q_EXPR:
+				hash = (hash ^ d->num_entries)*0x100000001b3UL;
+				for(i = d->num_entries - 1; i >= 0 && push_cell_stack(&s, d->entries[i]); i--);
+				break;
+			case BUILTIN_FUNCTION:
+				hash = (hash ^ d->builtin_id)*0x100000001b3UL;
+				break;
+			case FUNCTION:
+				if(push_cell_stack(&s, d->source)){
+					push_cell_stack(&s, d->var_list);
+				}
+				break;
+			case MEMO_FUNCTION:
+			case PROMISE:
+				hash = (hash ^ data_index)*0x100000001b3UL;
+				break;
+		}
+	}
+	free_cell_stack(&s);
+
+	return hash ^ (hash >> 29);
+}
+
+int print(interp *in, int *args, int num_args, int *tail_call){
+	output_buffer b;
+	int i;
+
+	fflush(stdout);
+	init_output_buffer(&b, STDOUT_FILENO);
+	for(i = 0; i < num_args; i++){
+		if(i){
+			append_output(&b, " ", 1);
+		}
+		append_value(in, &b, args[i]);
+	}
+	append_output(&b, "\n", 1);
+	flush_output_buffer(&b);
+	free_output_buffer(&b);
+
+	increment_references(in, in->global_none);
+	return in->global_none;
+}
+
+int allocate_int(interp *in, int value){
+	int output_index;
+
+	if(in->temporary_result){
+		in->temporary_result = 0;
+		output_index = allocate_temporary(in);
+	} else {
+		output_index = allocate(in);
+	}
 	if(output_index == -1){
 		return -1;
 	}
-	data_heap[output_index].type = INT_DATA;
-	data_heap[output_index].int_value = output;
+	in->data_heap[output_index].type = INT_DATA;
+	in->data_heap[output_index].int_value = value;
 
 	return output_index;
 }
 
-int set(int expr, int *tail_call){
-	int set_value;
+static int check_integers(interp *in, int *args, int num_args){
+	int i;
+
+	for(i = 0; i < num_args; i++){
+		if(in->data_heap[args[i]].type != INT_DATA){
+			set_error(in, "expected integer value");
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+//Whether a builtin can rebuild args[i] into its result. That takes a reference the caller counts and
+//nobody else shares, and a cell no other thread, intern table, region or borrowing stack knows about.
+//Whatever was worked out about the old contents is dropped
+static int reuse_argument(interp *in, int *args, int i){
+	data *d;
+
+	if(i >= 32 || !(in->owned_arguments&1U<<i)){
+		return 0;
+	}
+	d = in->data_heap + args[i];
+	//Other threads count references to shared cells atomically, so only an unshared cell's count is
+	//read as it is
+	if(__atomic_load_n(&d->flags, __ATOMIC_RELAXED)&(DATA_SHARED | DATA_INTERNED | DATA_TEMPORARY | DATA_STACKED) || d->num_references != 1){
+		return 0;
+	}
+	if(d->flags&DATA_COMPILED){
+		forget_compiled(in, args[i]);
+	}
+	d->flags &= ~(DATA_NO_ESCAPE | DATA_ANALYZED | DATA_EVALUATED);
+	in->metrics.reused_cells++;
+
+	return 1;
+}
+
+//An integer result, written over an integer argument if one can be reused
+static int int_result(interp *in, int *args, int num_args, int value){
+	int i;
 
-	if(data_heap[expr].num_entries != 3){
-		set_error("set expects 2 arguments");
+	for(i = 0; i < num_args; i++){
+		if(in->data_heap[args[i]].type == INT_DATA && reuse_argument(in, args, i)){
+			in->temporary_result = 0;
+			in->data_heap[args[i]].int_value = value;
+			increment_references(in, args[i]);
+			return args[i];
+		}
+	}
+
+	return allocate_int(in, value);
+}
+
+int add(interp *in, int *args, int num_args, int *tail_call){
+	int output = 0;
+	int i;
+
+	if(!check_integers(in, args, num_args)){
 		return -1;
 	}
+	for(i = 0; i < num_args; i++){
+		output += in->data_heap[args[i]].int_value;
+	}
 
-	if(data_heap[data_heap[expr].entries[1]].type != IDENTIFIER){
-		set_error("set expectes identifier as first argument");
+	return int_result(in, args, num_args, output);
+}
+
+int subtract(interp *in, int *args, int num_args, int *tail_call){
+	int output;
+	int i;
+
+	if(num_args < 1){
+		set_error(in, "- expects at least one argument");
+		return -1;
+	}
+	if(!check_integers(in, args, num_args)){
 		return -1;
 	}
 
-	set_value = evaluate_q_expression(data_heap[expr].entries[2], 0);
-	if(set_value == -1){
+	if(num_args == 1){
+		return int_result(in, args, num_args, -in->data_heap[args[0]].int_value);
+	}
+	output = in->data_heap[args[0]].int_value;
+	for(i = 1; i < num_args; i++){
+		output -= in->data_heap[args[i]].int_value;
+	}
+
+	return int_result(in, args, num_args, output);
+}
+
+int multiply(interp *in, int *args, int num_args, int *tail_call){
+	int output = 1;
+	int i;
+
+	if(!check_integers(in, args, num_args)){
 		return -1;
 	}
-	if(!set_variable(data_heap[data_heap[expr].entries[1]].identifier_name, set_value)){
+	for(i = 0; i < num_args; i++){
+		output *= in->data_heap[args[i]].int_value;
+	}
+
+	return int_result(in, args, num_args, output);
+}
+
+int equal(interp *in, int *args, int num_args, int *tail_call){
+	int output = 1;
+	int i;
+
+	if(num_args < 1){
+		set_error(in, "= expects at least 1 argument");
 		return -1;
 	}
-	decrement_references(set_value);
 
-	data_heap[global_none].num_references++;
-	return global_none;
+	for(i = 1; i < num_args; i++){
+		output = data_equal(in, args[i], args[0]);
+		if(output == -1){
+			return -1;
+		}
+		if(!output){
+			break;
+		}
+	}
+
+	return int_result(in, args, num_args, output);
 }
 
-int lambda(int expr, int *tail_call){
+int lambda(interp *in, int *args, int num_args, int *tail_call){
 	int output_index;
-	int var_list;
-	int source;
 
-	if(data_heap[expr].num_entries != 3){
-		set_error("lambda expects 2 arguments");
+	if(num_args != 2){
+		set_error(in, "lambda expects 2 arguments");
 		return -1;
 	}
 
-	output_index = allocate();
+	output_index = allocate(in);
 	if(output_index == -1){
 		return -1;
 	}
-	var_list = evaluate_q_expression(data_heap[expr].entries[1], 0);
-	if(var_list == -1){
+	in->data_heap[output_index].type = FUNCTION;
+	in->data_heap[output_index].var_list = args[0];
+	in->data_heap[output_index].source = args[1];
+	increment_references(in, args[0]);
+	increment_references(in, args[1]);
+
+	return output_index;
+}
+
+//Wraps a function in a cache of its results, keyed on structurally equal arguments
+int memo(interp *in, int *args, int num_args, int *tail_call){
+	memo_table *table;
+	int output_index;
+	int capacity = DEFAULT_MEMO_CAPACITY;
+
+	if(num_args != 1 && num_args != 2){
+		set_error(in, "memo expects 1 or 2 arguments");
+		return -1;
+	}
+	if(in->data_heap[args[0]].type != FUNCTION){
+		set_error(in, "memo expects a function as its first argument");
+		return -1;
+	}
+	if(num_args == 2){
+		if(in->data_heap[args[1]].type != INT_DATA || in->data_heap[args[1]].int_value <= 0){
+			set_error(in, "memo expects a positive capacity");
+			return -1;
+		}
+		capacity = in->data_heap[args[1]].int_value;
+	}
+
+	output_index = allocate(in);
+	if(output_index == -1){
 		return -1;
 	}
-	push_shadow_stack(var_list);
-	source = evaluate_q_expression(data_heap[expr].entries[2], 0);
-	if(source == -1){
+	table = create_memo_table(capacity);
+	if(!table){
+		decrement_references(in, output_index);
+		set_error(in, "malloc returned NULL");
 		return -1;
 	}
-	pop_shadow_stack(var_list);
-	data_heap[output_index].type = FUNCTION;
-	data_heap[output_index].var_list = var_list;
-	data_heap[output_index].source = source;
+	in->data_heap[output_index].type = MEMO_FUNCTION;
+	in->data_heap[output_index].memo_function = args[0];
+	in->data_heap[output_index].memo_table = table;
+	increment_references(in, args[0]);
 
 	return output_index;
 }
 
-int colon(int expr, int *tail_call){
-	int arg_value;
-	int num_entries;
+//The Q expression is run in eval's place, so evaluating in tail position doesn't grow the stack.
+//From the second time on that is its compiled form, see compile.c
+int eval(interp *in, int *args, int num_args, int *tail_call){
+	if(num_args != 1){
+		set_error(in, "eval expects exactly one argument");
+		return -1;
+	}
+	if(in->data_heap[args[0]].type != Q_EXPR){
+		set_error(in, "eval expects a Q expression as its first argument");
+		return -1;
+	}
+
+	return eval_compiled(in, args[0], tail_call);
+}
+
+//(for-range start end f) calls (f i) for each i from start up to end, in C rather than by recursion
+int for_range(interp *in, int *args, int num_args, int *tail_call){
+	repeated_call call;
+	int start;
+	int end;
+	int index;
+	int value;
 	int i;
 
-	num_entries = data_heap[expr].num_entries;
-	if(num_entries < 2){
-		data_heap[global_none].num_references++;
-		return global_none;
+	if(num_args != 3 || in->data_heap[args[0]].type != INT_DATA || in->data_heap[args[1]].type != INT_DATA){
+		set_error(in, "for-range expects a start, an end and a function");
+		return -1;
+	}
+	start = in->data_heap[args[0]].int_value;
+	end = in->data_heap[args[1]].int_value;
+	if(!start_repeated_call(in, &call, args[2], 1)){
+		end_repeated_call(in, &call);
+		return -1;
+	}
+	for(i = start; i < end; i++){
+		//The value stack keeps the index alive while a builtin runs on it
+		index = allocate_int(in, i);
+		if(index == -1 || !push_value(in, index, 0)){
+			end_repeated_call(in, &call);
+			return -1;
+		}
+		value = repeat_call(in, &call, &index);
+		in->num_values--;
+		decrement_references(in, index);
+		if(value == -1){
+			end_repeated_call(in, &call);
+			return -1;
+		}
+		decrement_references(in, value);
+	}
+	end_repeated_call(in, &call);
+
+	increment_references(in, in->global_none);
+	return in->global_none;
+}
+
+//(while {condition} {body}) runs both as S expressions in the current scope until the condition
+//is 0, like if
+int while_loop(interp *in, int *args, int num_args, int *tail_call){
+	unsigned int region_mark;
+	int condition;
+	int body;
+	int value;
+	int done;
+
+	if(num_args != 2 || in->data_heap[args[0]].type != Q_EXPR || in->data_heap[args[1]].type != Q_EXPR){
+		set_error(in, "while expects a condition and a body as Q expressions");
+		return -1;
 	}
+	//args can move when the value stack grows
+	condition = args[0];
+	body = args[1];
+	region_mark = in->num_temporaries;
+	while(1){
+		value = execute_s_expr(in, condition);
+		if(value == -1){
+			return -1;
+		}
+		done = in->data_heap[value].type == INT_DATA && !in->data_heap[value].int_value;
+		decrement_references(in, value);
+		if(done){
+			break;
+		}
+		value = execute_s_expr(in, body);
+		if(value == -1){
+			return -1;
+		}
+		decrement_references(in, value);
+		//Each pass has read all of its temporaries
+		in->num_temporaries = region_mark;
+	}
+
+	increment_references(in, in->global_none);
+	return in->global_none;
+}
 
-	for(i = 1; i < num_entries - 1; i++){
-		arg_value = evaluate_q_expression(data_heap[expr].entries[i], 0);
-		if(arg_value == -1){
+//Allocates an empty Q expression with room for num_entries entries
+int allocate_list(interp *in, int num_entries){
+	int output_index;
+
+	output_index = allocate(in);
+	if(output_index == -1){
+		return -1;
+	}
+	in->data_heap[output_index].num_entries = 0;
+	in->data_heap[output_index].entries = NULL;
+	in->data_heap[output_index].type = Q_EXPR;
+	if(num_entries){
+		if(!resize_entries(in->data_heap + output_index, num_entries)){
+			decrement_references(in, output_index);
+			set_error(in, "malloc returned NULL");
 			return -1;
 		}
-		decrement_references(arg_value);
 	}
 
-	if(data_heap[data_heap[expr].entries[num_entries - 1]].type == S_EXPR){
-		*tail_call = 1;
-		data_heap[data_heap[expr].entries[num_entries - 1]].num_references++;
-		return data_heap[expr].entries[num_entries - 1];
-	} else {
-		return evaluate_q_expression(data_heap[expr].entries[num_entries - 1], 0);
+	return output_index;
+}
+
+int list(interp *in, int *args, int num_args, int *tail_call){
+	int output_index;
+	int i;
+
+	output_index = allocate_list(in, num_args);
+	if(output_index == -1){
+		return -1;
 	}
+	for(i = 0; i < num_args; i++){
+		in->data_heap[output_index].entries[i] = args[i];
+		increment_references(in, args[i]);
+	}
+	in->data_heap[output_index].num_entries = num_args;
+
+	return output_index;
 }
 
-int eval(int expr, int *tail_call){
-	int arg_value;
+int head(interp *in, int *args, int num_args, int *tail_call){
 	int output_index;
 
-	if(data_heap[expr].num_entries != 2){
-		set_error("eval expects exactly one argument");
+	if(num_args != 1){
+		set_error(in, "head expects exactly one argument");
+		return -1;
+	}
+	if(in->data_heap[args[0]].type != Q_EXPR){
+		set_error(in, "head expects a Q expression");
 		return -1;
 	}
+	if(!in->data_heap[args[0]].num_entries){
+		set_error(in, "head of empty Q expression");
+		return -1;
+	}
+	output_index = in->data_heap[args[0]].entries[0];
+	increment_references(in, output_index);
+
+	return output_index;
+}
+
+int tail(interp *in, int *args, int num_args, int *tail_call){
+	int output_index;
+	int *entries;
+	int i;
 
-	arg_value = evaluate_q_expression(data_heap[expr].entries[1], 0);
-	if(arg_value == -1){
+	if(num_args != 1){
+		set_error(in, "tail expects exactly one argument");
 		return -1;
 	}
-	if(data_heap[arg_value].type != Q_EXPR){
-		set_error("eval expects a Q expression as its first argument");
+	if(in->data_heap[args[0]].type != Q_EXPR){
+		set_error(in, "tail expects a Q expression");
 		return -1;
 	}
-	output_index = evaluate_q_expression(arg_value, 1);
+	if(!in->data_heap[args[0]].num_entries){
+		set_error(in, "tail of empty Q expression");
+		return -1;
+	}
+	if(reuse_argument(in, args, 0)){
+		entries = in->data_heap[args[0]].entries;
+		decrement_references(in, entries[0]);
+		memmove(entries, entries + 1, sizeof(int)*(in->data_heap[args[0]].num_entries - 1));
+		in->data_heap[args[0]].num_entries--;
+		increment_references(in, args[0]);
+		return args[0];
+	}
+	output_index = allocate_list(in, in->data_heap[args[0]].num_entries - 1);
 	if(output_index == -1){
 		return -1;
 	}
-	decrement_references(arg_value);
+	for(i = 1; i < in->data_heap[args[0]].num_entries; i++){
+		in->data_heap[output_index].entries[i - 1] = in->data_heap[args[0]].entries[i];
+		increment_references(in, in->data_heap[args[0]].entries[i]);
+	}
+	in->data_heap[output_index].num_entries = in->data_heap[args[0]].num_entries - 1;
+
 	return output_index;
 }
 
-int main(int argc, char **argv){
-	char input[1024];
-	char *input_pointer;
+//Joins into the first argument that can be reused, moving its entries along to make room for the
+//ones before it, so joining onto a fresh list copies only the other lists
+int join(interp *in, int *args, int num_args, int *tail_call){
+	int output_index = -1;
+	int num_entries = 0;
+	int offset = 0;
+	int place = 0;
+	int *entries;
+	int i;
+	int j;
+
+	for(i = 0; i < num_args; i++){
+		if(in->data_heap[args[i]].type != Q_EXPR){
+			set_error(in, "join expects Q expressions");
+			return -1;
+		}
+		num_entries += in->data_heap[args[i]].num_entries;
+	}
+	for(i = 0; i < num_args; i++){
+		if(reuse_argument(in, args, i)){
+			output_index = args[i];
+			break;
+		}
+		offset += in->data_heap[args[i]].num_entries;
+	}
+
+	if(output_index == -1){
+		output_index = allocate_list(in, num_entries);
+		if(output_index == -1){
+			return -1;
+		}
+	} else {
+		if(!resize_entries(in->data_heap + output_index, num_entries)){
+			set_error(in, "malloc returned NULL");
+			return -1;
+		}
+		entries = in->data_heap[output_index].entries;
+		memmove(entries + offset, entries, sizeof(int)*in->data_heap[output_index].num_entries);
+		increment_references(in, output_index);
+	}
+	entries = in->data_heap[output_index].entries;
+	for(i = 0; i < num_args; i++){
+		if(args[i] == output_index){
+			place += in->data_heap[output_index].num_entries;
+			continue;
+		}
+		for(j = 0; j < in->data_heap[args[i]].num_entries; j++){
+			entries[place] = in->data_heap[args[i]].entries[j];
+			increment_references(in, entries[place]);
+			place++;
+		}
+	}
+	in->data_heap[output_index].num_entries = num_entries;
+
+	return output_index;
+}
+
+int len(interp *in, int *args, int num_args, int *tail_call){
+	if(num_args != 1){
+		set_error(in, "len expects exactly one argument");
+		return -1;
+	}
+	if(in->data_heap[args[0]].type != Q_EXPR){
+		set_error(in, "len expects a Q expression");
+		return -1;
+	}
+
+	return allocate_int(in, in->data_heap[args[0]].num_entries);
+}
+
+//Builtins take a file name as {name}, which evaluates to itself, or as an identifier computed by
+//something like to-string
+char *file_name_argument(interp *in, int arg){
+	data *d;
+
+	d = in->data_heap + arg;
+	if(d->type == Q_EXPR && d->num_entries == 1){
+		d = in->data_heap + d->entries[0];
+	}
+	if(d->type != IDENTIFIER){
+		return NULL;
+	}
+
+	return d->identifier_name;
+}
+
+//load's argument isn't evaluated, so it takes the bare name as well
+int load(interp *in, int *args, int num_args, int *tail_call){
+	char *path;
+
+	path = num_args == 1 ? file_name_argument(in, args[0]) : NULL;
+	if(!path){
+		set_error(in, "load expects a file name");
+		return -1;
+	}
+
+	return interp_load(in, path);
+}
+
+int save_image_func(interp *in, int *args, int num_args, int *tail_call){
+	char *path;
+
+	path = num_args == 1 ? file_name_argument(in, args[0]) : NULL;
+	if(!path){
+		set_error(in, "save-image expects a file name");
+		return -1;
+	}
+
+	if(!save_image(in, path)){
+		return -1;
+	}
+
+	increment_references(in, in->global_none);
+	return in->global_none;
+}
+
+int heap_dump(interp *in, int *args, int num_args, int *tail_call){
+	char *path;
+
+	path = num_args == 1 ? file_name_argument(in, args[0]) : NULL;
+	if(!path){
+		set_error(in, "heap-dump expects a file name");
+		return -1;
+	}
+
+	if(!dump_heap(in, path)){
+		return -1;
+	}
+
+	increment_references(in, in->global_none);
+	return in->global_none;
+}
+
+//Appends {name value} to list, where value is already allocated. Takes ownership of value
+static int append_stat(interp *in, int list, char *name, int value){
+	int pair;
+	int identifier;
+
+	if(!push_shadow_stack(in, value)){
+		return 0;
+	}
+	pair = allocate_list(in, 2);
+	if(pair == -1){
+		return 0;
+	}
+	in->data_heap[list].entries[in->data_heap[list].num_entries] = pair;
+	in->data_heap[list].num_entries++;
+	identifier = allocate(in);
+	if(identifier == -1){
+		return 0;
+	}
+	in->data_heap[identifier].identifier_name = malloc(sizeof(char)*(strlen(name) + 1));
+	if(!in->data_heap[identifier].identifier_name){
+		decrement_references(in, identifier);
+		set_error(in, "malloc returned NULL");
+		return 0;
+	}
+	strcpy(in->data_heap[identifier].identifier_name, name);
+	in->data_heap[identifier].type = IDENTIFIER;
+	in->data_heap[pair].entries[0] = identifier;
+	in->data_heap[pair].entries[1] = pop_shadow_stack(in);
+	in->data_heap[pair].num_entries = 2;
+
+	return 1;
+}
+
+static int append_int_stat(interp *in, int list, char *name, unsigned long value){
+	int output_index;
+
+	output_index = allocate(in);
+	if(output_index == -1){
+		return 0;
+	}
+	in->data_heap[output_index].type = INT_DATA;
+	in->data_heap[output_index].int_value = value;
+
+	return append_stat(in, list, name, output_index);
+}
+
+//Returns {{name value} ...} for the counters in metrics.h, with builtin calls and GC pauses as nested lists
+int stats(interp *in, int *args, int num_args, int *tail_call){
+	metrics m;
+	int output_index;
+	int calls;
+	int pauses;
+	int num_builtins;
+	int i;
+
+	if(num_args){
+		set_error(in, "stats expects no arguments");
+		return -1;
+	}
+	get_metrics(in, &m);
+	output_index = allocate_list(in, 18);
+	if(output_index == -1){
+		return -1;
+	}
+	if(!push_shadow_stack(in, output_index)){
+		return -1;
+	}
+	if(!append_int_stat(in, output_index, "allocations", m.allocations) ||
+	   !append_int_stat(in, output_index, "frees", m.frees) ||
+	   !append_int_stat(in, output_index, "live-cells", m.live_cells) ||
+	   !append_int_stat(in, output_index, "peak-live-cells", m.peak_live_cells) ||
+	   !append_int_stat(in, output_index, "collections", m.collections) ||
+	   !append_int_stat(in, output_index, "collection-microseconds", m.collection_nanoseconds/1000) ||
+	   !append_int_stat(in, output_index, "compactions", m.compactions) ||
+	   !append_int_stat(in, output_index, "scopes-created", m.scopes_created) ||
+	   !append_int_stat(in, output_index, "dictionary-lookups", m.dictionary_lookups) ||
+	   !append_int_stat(in, output_index, "dictionary-probes", m.dictionary_probes) ||
+	   !append_int_stat(in, output_index, "max-probe-length", m.max_probe_length) ||
+	   !append_int_stat(in, output_index, "intern-hits", m.intern_hits) ||
+	   !append_int_stat(in, output_index, "compiled-evals", m.compiled_evals) ||
+	   !append_int_stat(in, output_index, "temporaries", m.temporaries) ||
+	   !append_int_stat(in, output_index, "reused-cells", m.reused_cells) ||
+	   !append_int_stat(in, output_index, "deferred-releases", m.deferred_releases)){
+		return -1;
+	}
+
+	pauses = allocate_list(in, PAUSE_BUCKETS);
+	if(pauses == -1 || !append_stat(in, output_index, "pause-histogram", pauses)){
+		return -1;
+	}
+	for(i = 0; i < PAUSE_BUCKETS; i++){
+		in->data_heap[pauses].entries[i] = allocate(in);
+		if(in->data_heap[pauses].entries[i] == -1){
+			return -1;
+		}
+		in->data_heap[in->data_heap[pauses].entries[i]].type = INT_DATA;
+		in->data_heap[in->data_heap[pauses].entries[i]].int_value = m.pause_histogram[i];
+		in->data_heap[pauses].num_entries++;
+	}
+
+	num_builtins = 0;
+	for(i = 0; builtin_name(i); i++){
+		if(m.builtin_calls[i]){
+			num_builtins++;
+		}
+	}
+	calls = allocate_list(in, num_builtins);
+	if(calls == -1 || !append_stat(in, output_index, "builtin-calls", calls)){
+		return -1;
+	}
+	for(i = 0; builtin_name(i); i++){
+		if(m.builtin_calls[i] && !append_int_stat(in, calls, builtin_name(i), m.builtin_calls[i])){
+			return -1;
+		}
+	}
+
+	pop_shadow_stack(in);
+	return output_index;
+}
+
+//Images refer to builtin functions by these names, so entries should not be renamed
+static builtin builtins[] = {
+	{"print", STRICT_BUILTIN, print, BUILTIN_READS_ARGUMENTS},
+	{"+", STRICT_BUILTIN, add, BUILTIN_READS_ARGUMENTS | BUILTIN_RETURNS_INT | BUILTIN_PURE | BUILTIN_REUSES_ARGUMENTS},
+	{"-", STRICT_BUILTIN, subtract, BUILTIN_READS_ARGUMENTS | BUILTIN_RETURNS_INT | BUILTIN_PURE | BUILTIN_REUSES_ARGUMENTS},
+	{"*", STRICT_BUILTIN, multiply, BUILTIN_READS_ARGUMENTS | BUILTIN_RETURNS_INT | BUILTIN_PURE | BUILTIN_REUSES_ARGUMENTS},
+	{"if", IF_FORM, NULL, BUILTIN_READS_ARGUMENTS},
+	{"=", STRICT_BUILTIN, equal, BUILTIN_READS_ARGUMENTS | BUILTIN_RETURNS_INT | BUILTIN_PURE | BUILTIN_REUSES_ARGUMENTS},
+	{"set", SET_FORM, NULL},
+	{"lambda", STRICT_BUILTIN, lambda},
+	{":", COLON_FORM, NULL},
+	{"eval", STRICT_BUILTIN, eval},
+	{"list", STRICT_BUILTIN, list, BUILTIN_PURE},
+	{"head", STRICT_BUILTIN, head, BUILTIN_PURE},
+	{"tail", STRICT_BUILTIN, tail, BUILTIN_PURE | BUILTIN_REUSES_ARGUMENTS},
+	{"join", STRICT_BUILTIN, join, BUILTIN_PURE | BUILTIN_REUSES_ARGUMENTS},
+	{"len", STRICT_BUILTIN, len, BUILTIN_READS_ARGUMENTS | BUILTIN_RETURNS_INT | BUILTIN_PURE},
+	{"load", RAW_BUILTIN, load},
+	{"save-image", STRICT_BUILTIN, save_image_func},
+	{"stats", STRICT_BUILTIN, stats},
+	{"heap-dump", STRICT_BUILTIN, heap_dump},
+	{"memo", STRICT_BUILTIN, memo},
+	{"delay", STRICT_BUILTIN, delay},
+	{"force", STRICT_BUILTIN, force},
+	{"range", STRICT_BUILTIN, range},
+	{"map", STRICT_BUILTIN, map},
+	{"filter", STRICT_BUILTIN, filter},
+	{"take", STRICT_BUILTIN, take},
+	{"fold", STRICT_BUILTIN, fold},
+	{"collect", STRICT_BUILTIN, collect},
+	{"lines", STRICT_BUILTIN, lines},
+	{"range-next", STRICT_BUILTIN, range_next, BUILTIN_INTERNAL},
+	{"map-next", STRICT_BUILTIN, map_next, BUILTIN_INTERNAL},
+	{"filter-next", STRICT_BUILTIN, filter_next, BUILTIN_INTERNAL},
+	{"take-next", STRICT_BUILTIN, take_next, BUILTIN_INTERNAL},
+	{"lines-next", STRICT_BUILTIN, lines_next, BUILTIN_INTERNAL},
+	{"to-string", STRICT_BUILTIN, to_string, BUILTIN_READS_ARGUMENTS},
+	{"serialize", STRICT_BUILTIN, serialize},
+	{"deserialize", STRICT_BUILTIN, deserialize},
+	{"compact", STRICT_BUILTIN, compact},
+	{"for-range", STRICT_BUILTIN, for_range},
+	{"while", STRICT_BUILTIN, while_loop},
+	{"pmap", STRICT_BUILTIN, pmap},
+	{"psort", STRICT_BUILTIN, psort},
+	{"spawn", STRICT_BUILTIN, spawn_isolate},
+	{"send", STRICT_BUILTIN, send_message},
+	{"receive", STRICT_BUILTIN, receive_message},
+	{"self", STRICT_BUILTIN, self_isolate},
+	{"go", STRICT_BUILTIN, go_task},
+	{"yield", STRICT_BUILTIN, yield_task},
+	{"await", STRICT_BUILTIN, await_task},
+	{NULL, 0, NULL}
+};
+
+//Builtin ids index builtin_calls in struct metrics too
+_Static_assert(sizeof(builtins)/sizeof(builtin) - 1 <= MAX_BUILTINS, "the builtin table has more entries than MAX_BUILTINS");
+
+//Builtin ids index the table above. They are only stable within one build
+char *builtin_name(int builtin_id){
+	if(builtin_id < 0 || builtin_id >= (int) (sizeof(builtins)/sizeof(builtin)) - 1){
+		return NULL;
+	}
+
+	return builtins[builtin_id].name;
+}
+
+static builtin *get_builtin(int builtin_id){
+	return builtins + builtin_id;
+}
+
+int builtin_flags(int builtin_id){
+	return builtins[builtin_id].flags;
+}
+
+int (*builtin_function(int builtin_id))(interp *, int *, int, int *){
+	return builtins[builtin_id].builtin_function;
+}
+
+int lookup_builtin(char *name){
+	int i;
+
+	for(i = 0; builtins[i].name; i++){
+		if(!strcmp(builtins[i].name, name)){
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+//A cell for a builtin that isn't bound to any name
+int allocate_builtin(interp *in, int builtin_id){
+	int data_index;
+
+	data_index = allocate(in);
+	if(data_index == -1){
+		return -1;
+	}
+	in->data_heap[data_index].type = BUILTIN_FUNCTION;
+	in->data_heap[data_index].builtin_function = builtins[builtin_id].builtin_function;
+	in->data_heap[data_index].builtin_id = builtin_id;
+
+	return data_index;
+}
+
+int register_builtin_function(interp *in, int builtin_id){
+	char *name;
+	int data_index;
+	variable *var;
+
+	name = builtins[builtin_id].name;
+	data_index = allocate_builtin(in, builtin_id);
+	if(data_index == -1){
+		return -1;
+	}
+	mark_shared(in, data_index);
+	var = malloc(sizeof(variable));
+	if(!var){
+		set_error(in, "malloc returned NULL");
+		decrement_references(in, data_index);
+		return -1;
+	}
+	var->name = malloc(sizeof(char)*(strlen(name) + 1));
+	if(!var->name){
+		set_error(in, "malloc returned NULL");
+		free(var);
+		decrement_references(in, data_index);
+		return -1;
+	}
+	strcpy(var->name, name);
+	var->data_index = data_index;
+
+	write_lock_global_scope(in);
+	write_dictionary(&(in->heap->global_scope->variables), name, var, 0);
+	unlock_global_scope(in);
+	return data_index;
+}
+
+interp *create_interp(int heap_size){
+	heap *h;
+	interp *in;
 	int data;
-	int result;
+	int i;
 
-	if(!initialize_heap(10000)){
-		fprintf(stderr, "Error: failed to initialize heap\n");
-		return 1;
+	h = create_heap(heap_size);
+	if(!h){
+		return NULL;
 	}
-	if(!create_global_scope()){
-		fprintf(stderr, "Error: failed to create global scope\n");
-		return 1;
+	if(!create_global_scope(h)){
+		free_heap(h);
+		return NULL;
 	}
-	data = allocate();
+	in = register_thread(h);
+	if(!in){
+		free_heap(h);
+		return NULL;
+	}
+	data = allocate(in);
 	if(data == -1){
-		fprintf(stderr, "Error: %s\n", error_message);
-		return 1;
+		destroy_interp(in);
+		return NULL;
+	}
+	in->data_heap[data].type = NONE_DATA;
+	mark_shared(in, data);
+	h->global_none = data;
+	in->global_none = data;
+	for(i = 0; builtins[i].name; i++){
+		if(!(builtins[i].flags&BUILTIN_INTERNAL)){
+			register_builtin_function(in, i);
+		}
 	}
-	data_heap[data].type = NONE_DATA;
-	push_shadow_stack(data);
-	global_none = data;
-	register_builtin_function("print", print);
-	register_builtin_function("+", add);
-	register_builtin_function("-", subtract);
-	register_builtin_function("*", multiply);
-	register_builtin_function("if", if_func);
-	register_builtin_function("=", equal);
-	register_builtin_function("set", set);
-	register_builtin_function("lambda", lambda);
-	register_builtin_function(":", colon);
-	register_builtin_function("eval", eval);
 
-	while(1){
-		printf("lisp> ");
-		fgets(input, 256, stdin);
-		input_pointer = input;
-		data = get_quoted_value(&input_pointer);
-		push_shadow_stack(data);
+	return in;
+}
+
+//Returns an interp for another thread to evaluate on the same heap and global scope
+interp *attach_interp(interp *parent){
+	return register_thread(parent->heap);
+}
+
+void detach_interp(interp *in){
+	unregister_thread(in);
+}
+
+//Every interp attached to the same heap must have been detached first
+void destroy_interp(interp *in){
+	heap *h;
+
+	h = in->heap;
+	stop_metrics_on_signal(in);
+	unregister_thread(in);
+	if(!h->num_threads){
+		free_heap(h);
+	}
+}
+
+//Drops whatever a failed evaluation left on the shadow stack and scope chain. Data it still
+//references is reclaimed by the next collection
+static void unwind(interp *in, shadow_stack *stack, scope *eval_scope){
+	while(get_shadow_stack(in) != stack){
+		pop_shadow_stack(in);
+	}
+	while(in->current_scope != eval_scope){
+		previous_scope(in);
+	}
+}
+
+//Evaluates every expression in source and returns the value of the last one
+int interp_eval(interp *in, char *source){
+	shadow_stack *stack;
+	scope *eval_scope;
+	int data = 0;
+	int result;
+
+	stack = get_shadow_stack(in);
+	eval_scope = in->current_scope;
+	result = in->global_none;
+	increment_references(in, result);
+	skip_whitespace(&source);
+	while(*source){
+		data = get_quoted_value(in, &source);
 		if(data == -1){
-			fprintf(stderr, "Error: %s\n", error_message);
-			clear_shadow_stack();
-			push_shadow_stack(global_none);
-			continue;
+			break;
+		}
+		if(!push_shadow_stack(in, data)){
+			set_error(in, "malloc returned NULL");
+			decrement_references(in, data);
+			data = -1;
+			break;
 		}
-		result = evaluate_q_expression(data, 0);
+		decrement_references(in, result);
+		//Nothing but the shadow stack holds a value here, so the heap can be compacted
+		maybe_compact(in);
+		data = get_shadow_stack(in)->data_index;
+		result = evaluate_q_expression(in, data, 0);
 		if(result == -1){
-			fprintf(stderr, "Error: %s\n", error_message);
-			clear_shadow_stack();
-			push_shadow_stack(global_none);
-			decrement_references(data);
-			continue;
+			break;
 		}
+		decrement_references(in, pop_shadow_stack(in));
+	}
+
+	if(data == -1 || result == -1){
+		unwind(in, stack, eval_scope);
+		return -1;
+	}
+
+	return result;
+}
 
-		if(data_heap[result].type != NONE_DATA){
-			print_value(result);
-			printf("\n");
+//Parses every expression in source into one Q expression
+static int parse_forms(interp *in, char *source){
+	shadow_stack *stack;
+	int forms;
+	int value;
+	int *next_entries;
+
+	stack = get_shadow_stack(in);
+	forms = allocate(in);
+	if(forms == -1){
+		return -1;
+	}
+	if(!push_shadow_stack(in, forms)){
+		decrement_references(in, forms);
+		set_error(in, "malloc returned NULL");
+		return -1;
+	}
+	in->data_heap[forms].num_entries = 0;
+	in->data_heap[forms].entries = NULL;
+	in->data_heap[forms].type = Q_EXPR;
+
+	skip_whitespace(&source);
+	while(*source){
+		value = get_quoted_value(in, &source);
+		if(value == -1){
+			unwind(in, stack, in->current_scope);
+			return -1;
+		}
+		next_entries = resize_entries(in->data_heap + forms, in->data_heap[forms].num_entries + 1);
+		if(!next_entries){
+			decrement_references(in, value);
+			unwind(in, stack, in->current_scope);
+			set_error(in, "malloc returned NULL");
+			return -1;
 		}
-		pop_shadow_stack();
-		decrement_references(data);
-		decrement_references(result);
-		printf("num_allocated: %d\n", num_allocated);
+		in->data_heap[forms].entries = next_entries;
+		in->data_heap[forms].entries[in->data_heap[forms].num_entries] = value;
+		in->data_heap[forms].num_entries++;
 	}
+	pop_shadow_stack(in);
+
+	return forms;
 }
 
+static char *read_file(interp *in, char *path, size_t *length){
+	FILE *fp;
+	char *output;
+	long size;
+
+	fp = fopen(path, "rb");
+	if(!fp){
+		set_error(in, "failed to open file");
+		return NULL;
+	}
+	if(fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET)){
+		fclose(fp);
+		set_error(in, "failed to read file");
+		return NULL;
+	}
+	output = malloc(sizeof(char)*(size + 1));
+	if(!output){
+		fclose(fp);
+		set_error(in, "malloc returned NULL");
+		return NULL;
+	}
+	if(fread(output, sizeof(char), size, fp) != (size_t) size){
+		free(output);
+		fclose(fp);
+		set_error(in, "failed to read file");
+		return NULL;
+	}
+	fclose(fp);
+	output[size] = '\0';
+	*length = size;
+
+	return output;
+}
+
+//Evaluates every expression in a file. The parsed file is cached beside it in a file with a c
+//appended to the name, and the cache is reused as long as the source hash matches
+int interp_load(interp *in, char *path){
+	shadow_stack *stack;
+	scope *eval_scope;
+	char *source;
+	char *cache_path;
+	size_t length;
+	uint64_t source_hash;
+	int forms;
+	int result;
+	int i;
+
+	source = read_file(in, path, &length);
+	if(!source){
+		return -1;
+	}
+	source_hash = hash_source(source, length);
+	cache_path = malloc(sizeof(char)*(strlen(path) + 2));
+	if(!cache_path){
+		free(source);
+		set_error(in, "malloc returned NULL");
+		return -1;
+	}
+	sprintf(cache_path, "%sc", path);
+
+	forms = load_module_cache(in, cache_path, source_hash);
+	if(forms == -1){
+		forms = parse_forms(in, source);
+		//A cache that can't be written only costs a reparse next time
+		if(forms != -1){
+			save_module_cache(in, cache_path, source_hash, forms);
+		}
+	} else if(in->heap->intern_buckets){
+		forms = intern_tree(in, forms);
+	}
+	free(source);
+	free(cache_path);
+	if(forms == -1){
+		return -1;
+	}
+
+	stack = get_shadow_stack(in);
+	eval_scope = in->current_scope;
+	if(!push_shadow_stack(in, forms)){
+		decrement_references(in, forms);
+		set_error(in, "malloc returned NULL");
+		return -1;
+	}
+	result = in->global_none;
+	increment_references(in, result);
+	for(i = 0; i < in->data_heap[forms].num_entries; i++){
+		decrement_references(in, result);
+		maybe_compact(in);
+		forms = get_shadow_stack(in)->data_index;
+		result = evaluate_q_expression(in, in->data_heap[forms].entries[i], 0);
+		if(result == -1){
+			unwind(in, stack, eval_scope);
+			return -1;
+		}
+	}
+	decrement_references(in, pop_shadow_stack(in));
+
+	return result;
+}
+
+char *interp_error(interp *in){
+	return in->error_message;
+}
+
+int is_none(interp *in, int value){
+	return in->data_heap[value].type == NONE_DATA;
+}
+
+void release_value(interp *in, int value){
+	decrement_references(in, value);
+}
+
+//Applies to every thread on the heap
+void set_stack_limit(interp *in, unsigned long bytes){
+	in->heap->stack_limit = bytes;
+}
+
+void interp_block(interp *in){
+	enter_safe_region(in);
+}
+
+void interp_unblock(interp *in){
+	leave_safe_region(in);
+}
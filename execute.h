@@ -0,0 +1,91 @@
+#ifndef EXECUTE_INCLUDED
+#define EXECUTE_INCLUDED
+#include "allocate.h"
+
+typedef enum builtin_kind builtin_kind;
+
+//Strict builtins get their arguments evaluated. Raw builtins get the argument expressions as written.
+//The special forms are run by the evaluator itself and have no builtin_function
+enum builtin_kind{
+	STRICT_BUILTIN,
+	RAW_BUILTIN,
+	IF_FORM,
+	COLON_FORM,
+	SET_FORM
+};
+
+typedef enum frame_state frame_state;
+
+enum frame_state{
+	EVAL_FUNCTION,
+	EVAL_ARGUMENTS,
+	IF_CONDITION,
+	COLON_SEQUENCE,
+	SET_VALUE,
+	MEMO_RESULT
+};
+
+//The builtin only reads its arguments, and never keeps or returns them, unless it rebuilds one that
+//isn't a temporary into its result. For if, only the condition
+#define BUILTIN_READS_ARGUMENTS 1
+//The builtin returns a new integer made with allocate_int()
+#define BUILTIN_RETURNS_INT 2
+//The builtin's result depends on nothing but its arguments, so compile.c can call it ahead of time
+#define BUILTIN_PURE 4
+//The builtin can build its result in an argument nothing else refers to, see reuse_argument()
+#define BUILTIN_REUSES_ARGUMENTS 8
+//The builtin is only called from the expressions of native lazy sequences, which reach it by id, so no
+//variable is bound to it
+#define BUILTIN_INTERNAL 16
+
+typedef struct builtin builtin;
+
+//args points into the value stack or the calling expression, so a builtin must not keep it across
+//anything that evaluates. A builtin returns a new reference, or sets *tail_call and returns an
+//expression for the evaluator to run in its place
+struct builtin{
+	char *name;
+	builtin_kind kind;
+	int (*builtin_function)(interp *in, int *args, int num_args, int *tail_call);
+	int flags;
+};
+
+#define MAX_REPEATED_ARGS 2
+
+typedef struct repeated_call repeated_call;
+
+//A function that a builtin calls once for each element of something. A Lisp function gets one scope
+//for all of the calls, and each call rebinds its parameters in place
+struct repeated_call{
+	int function;
+	int num_args;
+	int made_scope;
+	//How many variables the scope holds with only the parameters bound
+	unsigned int num_variables;
+	//Passed to a builtin as owned_arguments
+	unsigned int owned_arguments;
+	variable *parameters[MAX_REPEATED_ARGS];
+};
+
+void skip_whitespace(char **c);
+int get_quoted_value(interp *in, char **c);
+int set_variable(interp *in, char *var_name, int data_index);
+int execute_s_expr(interp *in, int data_index);
+int evaluate_q_expression(interp *in, int data_index, int expand_q_expr);
+int call_function(interp *in, int function, int *args, int num_args);
+int start_repeated_call(interp *in, repeated_call *call, int function, int num_args);
+int repeat_call(interp *in, repeated_call *call, int *args);
+void end_repeated_call(interp *in, repeated_call *call);
+int allocate_int(interp *in, int value);
+int allocate_list(interp *in, int num_entries);
+int allocate_builtin(interp *in, int builtin_id);
+char *file_name_argument(interp *in, int arg);
+int data_equal(interp *in, int b, int a);
+unsigned long hash_data(interp *in, int data_index);
+int register_builtin_function(interp *in, int builtin_id);
+char *builtin_name(int builtin_id);
+int (*builtin_function(int builtin_id))(interp *, int *, int, int *);
+int lookup_builtin(char *name);
+int names_builtin(interp *in, char *name, int builtin_id);
+int builtin_flags(int builtin_id);
+#endif
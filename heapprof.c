@@ -0,0 +1,514 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "allocate.h"
+#include "execute.h"
+#include "heapprof.h"
+#include "task.h"
+
+static char *type_names[] = {"none", "int", "identifier", "s-expr", "q-expr", "builtin", "function", "memo", "promise"};
+
+//Cells allocated from now on are tagged with the site that allocated them. Older cells stay untagged
+int track_allocation_sites(interp *in){
+	heap *h;
+	int *sites;
+	unsigned int *generations;
+	unsigned int i;
+
+	h = in->heap;
+	if(h->allocation_sites){
+		return 1;
+	}
+	sites = malloc(sizeof(int)*h->data_heap_size);
+	generations = calloc(h->data_heap_size, sizeof(unsigned int));
+	if(!sites || !generations){
+		free(sites);
+		free(generations);
+		set_error(in, "malloc returned NULL");
+		return 0;
+	}
+	for(i = 0; i < h->data_heap_size; i++){
+		sites[i] = -1;
+	}
+	pthread_mutex_lock(&h->heap_lock);
+	h->cell_generations = generations;
+	h->allocation_sites = sites;
+	pthread_mutex_unlock(&h->heap_lock);
+
+	return 1;
+}
+
+static void append_text(char *text, size_t *length, char *next){
+	size_t next_length;
+
+	next_length = strlen(next);
+	if(*length + next_length > MAX_SITE_FORM){
+		next_length = MAX_SITE_FORM - *length;
+	}
+	memcpy(text + *length, next, next_length);
+	*length += next_length;
+	text[*length] = '\0';
+}
+
+//Like print_value(), but into a bounded buffer so that it can run inside allocate()
+static void format_form(heap *h, int data_index, char *text, size_t *length){
+	char number[16];
+	int i;
+
+	if(*length >= MAX_SITE_FORM){
+		return;
+	}
+	switch(h->data_heap[data_index].type){
+		case NONE_DATA:
+			append_text(text, length, "none");
+			break;
+		case INT_DATA:
+			sprintf(number, "%d", h->data_heap[data_index].int_value);
+			append_text(text, length, number);
+			break;
+		case IDENTIFIER:
+			append_text(text, length, h->data_heap[data_index].identifier_name);
+			break;
+		case S_EXPR:
+		case Q_EXPR:
+			append_text(text, length, h->data_heap[data_index].type == S_EXPR ? "(" : "{");
+			for(i = 0; i < h->data_heap[data_index].num_entries; i++){
+				if(i){
+					append_text(text, length, " ");
+				}
+				format_form(h, h->data_heap[data_index].entries[i], text, length);
+			}
+			append_text(text, length, h->data_heap[data_index].type == S_EXPR ? ")" : "}");
+			break;
+		case BUILTIN_FUNCTION:
+			append_text(text, length, builtin_name(h->data_heap[data_index].builtin_id));
+			break;
+		case FUNCTION:
+			append_text(text, length, "<lambda>");
+			break;
+		case MEMO_FUNCTION:
+			append_text(text, length, "<memo>");
+			break;
+		case PROMISE:
+			append_text(text, length, "<promise>");
+			break;
+	}
+}
+
+static unsigned int hash_site(char *name, int builtin_id, int expr, unsigned int generation){
+	unsigned int hash = 2166136261u;
+
+	while(*name){
+		hash = (hash^(unsigned char) *name)*16777619u;
+		name++;
+	}
+	hash = (hash^(unsigned int) builtin_id)*16777619u;
+	hash = (hash^(unsigned int) expr)*16777619u;
+	hash = (hash^generation)*16777619u;
+
+	return hash;
+}
+
+static int site_matches(allocation_site *site, char *name, int builtin_id, int expr, unsigned int generation){
+	return site->expr == expr && site->generation == generation && site->builtin_id == builtin_id && !strcmp(site->name, name);
+}
+
+//Doubles the bucket table, or makes the first one
+static int grow_site_buckets(heap *h){
+	int *buckets;
+	unsigned int num_buckets;
+	unsigned int bucket;
+	allocation_site *site;
+	int i;
+
+	num_buckets = h->num_site_buckets ? h->num_site_buckets*2 : 256;
+	buckets = malloc(sizeof(int)*num_buckets);
+	if(!buckets){
+		return 0;
+	}
+	memset(buckets, 0xff, sizeof(int)*num_buckets);
+	for(i = 0; i < h->num_sites; i++){
+		site = h->sites[i];
+		bucket = hash_site(site->name, site->builtin_id, site->expr, site->generation)&(num_buckets - 1);
+		while(buckets[bucket] != -1){
+			bucket = (bucket + 1)&(num_buckets - 1);
+		}
+		buckets[bucket] = i;
+	}
+	free(h->site_buckets);
+	h->site_buckets = buckets;
+	h->num_site_buckets = num_buckets;
+
+	return 1;
+}
+
+//Adds the site of frame, or of the top level without one, printing its form only now. Called with
+//heap_lock held
+static int add_site(heap *h, call_frame *frame, unsigned int generation){
+	char text[MAX_FRAME_NAME*2 + MAX_SITE_FORM + 8];
+	size_t length;
+	size_t form_length = 0;
+	allocation_site **next_sites;
+	allocation_site *site;
+	char *name;
+	int sites_size;
+
+	if(h->num_sites == h->sites_size){
+		sites_size = h->sites_size ? h->sites_size*2 : 64;
+		next_sites = realloc(h->sites, sizeof(allocation_site *)*sites_size);
+		if(!next_sites){
+			return -1;
+		}
+		h->sites = next_sites;
+		h->sites_size = sites_size;
+	}
+	if((unsigned int) h->num_sites*2 >= h->num_site_buckets && !grow_site_buckets(h)){
+		return -1;
+	}
+
+	text[0] = '\0';
+	if(frame){
+		strcat(text, frame->name);
+		name = builtin_name(frame->builtin_id);
+		if(name){
+			if(text[0]){
+				strcat(text, ":");
+			}
+			strncat(text, name, MAX_FRAME_NAME - 1);
+		}
+		if(text[0]){
+			strcat(text, " ");
+		}
+		length = strlen(text);
+		format_form(h, frame->expr, text + length, &form_length);
+	} else {
+		strcat(text, "<toplevel>");
+	}
+	site = malloc(sizeof(allocation_site));
+	if(!site || !(site->text = strdup(text))){
+		free(site);
+		return -1;
+	}
+	site->id = h->num_sites;
+	strcpy(site->name, frame ? frame->name : "");
+	site->builtin_id = frame ? frame->builtin_id : -1;
+	site->expr = frame ? frame->expr : -1;
+	site->generation = generation;
+	h->sites[h->num_sites] = site;
+	h->num_sites++;
+
+	return site->id;
+}
+
+//frame is NULL for the top level
+static int find_site(heap *h, call_frame *frame){
+	char *name = "";
+	int builtin_id = -1;
+	int expr = -1;
+	unsigned int generation = 0;
+	unsigned int bucket;
+	int id;
+
+	if(frame){
+		name = frame->name;
+		builtin_id = frame->builtin_id;
+		expr = frame->expr;
+		generation = h->cell_generations[expr];
+	}
+	pthread_mutex_lock(&h->heap_lock);
+	id = -1;
+	if(h->num_site_buckets){
+		bucket = hash_site(name, builtin_id, expr, generation)&(h->num_site_buckets - 1);
+		while(h->site_buckets[bucket] != -1 && !site_matches(h->sites[h->site_buckets[bucket]], name, builtin_id, expr, generation)){
+			bucket = (bucket + 1)&(h->num_site_buckets - 1);
+		}
+		id = h->site_buckets[bucket];
+	}
+	if(id == -1){
+		id = add_site(h, frame, generation);
+		if(id != -1){
+			bucket = hash_site(name, builtin_id, expr, generation)&(h->num_site_buckets - 1);
+			while(h->site_buckets[bucket] != -1){
+				bucket = (bucket + 1)&(h->num_site_buckets - 1);
+			}
+			h->site_buckets[bucket] = id;
+		}
+	}
+	pthread_mutex_unlock(&h->heap_lock);
+
+	return id;
+}
+
+//Sites are cached in the innermost call frame until it moves on to another expression. A step of a
+//lazy sequence is counted at the site that made the sequence, which is the one its form was tagged with
+int current_allocation_site(interp *in){
+	heap *h;
+	call_frame *frame;
+
+	h = in->heap;
+	if(!in->num_frames){
+		return find_site(h, NULL);
+	}
+	frame = in->call_frames + in->num_frames - 1;
+	if(frame->site != -1){
+		return frame->site;
+	}
+	if(frame->builtin_id != -1 && builtin_flags(frame->builtin_id)&BUILTIN_INTERNAL && h->allocation_sites[frame->expr] != -1){
+		frame->site = h->allocation_sites[frame->expr];
+	} else {
+		frame->site = find_site(h, frame);
+	}
+
+	return frame->site;
+}
+
+//Compaction moved the form cells, along with their generations
+void forward_allocation_sites(heap *h, int *forward){
+	int i;
+
+	for(i = 0; i < h->num_sites; i++){
+		if(h->sites[i]->expr != -1){
+			h->sites[i]->expr = forward[h->sites[i]->expr];
+		}
+	}
+	free(h->site_buckets);
+	h->site_buckets = NULL;
+	h->num_site_buckets = 0;
+	if(h->num_sites){
+		grow_site_buckets(h);
+	}
+}
+
+void free_allocation_sites(heap *h){
+	int i;
+
+	for(i = 0; i < h->num_sites; i++){
+		free(h->sites[i]->text);
+		free(h->sites[i]);
+	}
+	free(h->sites);
+	free(h->site_buckets);
+	free(h->allocation_sites);
+	free(h->cell_generations);
+}
+
+typedef struct dump_state dump_state;
+
+struct dump_state{
+	heap *heap;
+	FILE *fp;
+	char *visited;
+	//Cells reached but not written yet. Each is only queued once, so it needs no more than the heap
+	int *pending;
+	unsigned int num_pending;
+	char *owner;
+	int level;
+};
+
+static unsigned long cell_bytes(heap *h, int data_index){
+	memo_table *table;
+	unsigned long bytes;
+
+	bytes = sizeof(data);
+	if(h->data_heap[data_index].type == IDENTIFIER){
+		bytes += strlen(h->data_heap[data_index].identifier_name) + 1;
+	} else if(h->data_heap[data_index].type == S_EXPR || h->data_heap[data_index].type == Q_EXPR){
+		bytes += sizeof(int)*h->data_heap[data_index].num_entries;
+	} else if(h->data_heap[data_index].type == MEMO_FUNCTION){
+		table = h->data_heap[data_index].memo_table;
+		bytes += sizeof(memo_table) + sizeof(memo_entry *)*table->num_buckets + sizeof(memo_entry)*table->num_entries;
+	}
+
+	return bytes;
+}
+
+//Queues a cell to be written the first time it is reached
+static void visit_cell(dump_state *state, int data_index){
+	if(state->visited[data_index]){
+		return;
+	}
+	state->visited[data_index] = 1;
+	state->pending[state->num_pending] = data_index;
+	state->num_pending++;
+}
+
+//Writes a cell's line and queues its children
+static void write_cell(dump_state *state, int data_index){
+	memo_table *table;
+	memo_entry *entry;
+	heap *h;
+	int children[2];
+	int num_children;
+	int site;
+	int i;
+
+	h = state->heap;
+	site = h->allocation_sites ? h->allocation_sites[data_index] : -1;
+	fprintf(state->fp, "cell %d %s %lu %d", data_index, type_names[h->data_heap[data_index].type], cell_bytes(h, data_index), site);
+	if(h->data_heap[data_index].type == S_EXPR || h->data_heap[data_index].type == Q_EXPR){
+		fprintf(state->fp, " %d", h->data_heap[data_index].num_entries);
+		for(i = 0; i < h->data_heap[data_index].num_entries; i++){
+			fprintf(state->fp, " %d", h->data_heap[data_index].entries[i]);
+		}
+		fprintf(state->fp, "\n");
+		for(i = 0; i < h->data_heap[data_index].num_entries; i++){
+			visit_cell(state, h->data_heap[data_index].entries[i]);
+		}
+	} else if(h->data_heap[data_index].type == FUNCTION){
+		fprintf(state->fp, " 2 %d %d\n", h->data_heap[data_index].var_list, h->data_heap[data_index].source);
+		visit_cell(state, h->data_heap[data_index].var_list);
+		visit_cell(state, h->data_heap[data_index].source);
+	} else if(h->data_heap[data_index].type == MEMO_FUNCTION){
+		table = h->data_heap[data_index].memo_table;
+		fprintf(state->fp, " %u %d", 1 + 2*table->num_entries, h->data_heap[data_index].memo_function);
+		for(entry = table->newest; entry; entry = entry->older){
+			fprintf(state->fp, " %d %d", entry->key, entry->value);
+		}
+		fprintf(state->fp, "\n");
+		visit_cell(state, h->data_heap[data_index].memo_function);
+		for(entry = table->newest; entry; entry = entry->older){
+			visit_cell(state, entry->key);
+			visit_cell(state, entry->value);
+		}
+	} else if(h->data_heap[data_index].type == PROMISE){
+		num_children = 0;
+		children[0] = h->data_heap[data_index].promise_expr;
+		children[1] = h->data_heap[data_index].promise_value;
+		for(i = 0; i < 2; i++){
+			if(children[i] != -1){
+				children[num_children++] = children[i];
+			}
+		}
+		fprintf(state->fp, " %d", num_children);
+		for(i = 0; i < num_children; i++){
+			fprintf(state->fp, " %d", children[i]);
+		}
+		fprintf(state->fp, "\n");
+		for(i = 0; i < num_children; i++){
+			visit_cell(state, children[i]);
+		}
+	} else {
+		fprintf(state->fp, " 0\n");
+	}
+}
+
+//Follows the same edges as mark_allocated_recursive(), from the pending stack rather than recursively
+static void dump_cell(dump_state *state, int data_index){
+	visit_cell(state, data_index);
+	while(state->num_pending){
+		state->num_pending--;
+		write_cell(state, state->pending[state->num_pending]);
+	}
+}
+
+static void dump_root(dump_state *state, char *name, int data_index){
+	fprintf(state->fp, "root %s %d %s %d\n", state->owner, state->level, name, data_index);
+	dump_cell(state, data_index);
+}
+
+static void dump_variable(void *v, void *context){
+	variable *var;
+
+	var = v;
+	dump_root(context, var->name, var->data_index);
+}
+
+//The roots of one evaluation, a thread's or a waiting task's
+static void dump_evaluation(dump_state *state, scope *current_scope, shadow_stack *stack, eval_frame *frames, unsigned int num_frames, int *values, unsigned int num_values){
+	scope *search_scope;
+	shadow_stack *stack_place;
+	unsigned int i;
+
+	search_scope = current_scope;
+	while(search_scope != state->heap->global_scope){
+		state->level = search_scope->level;
+		iterate_dictionary(search_scope->variables, dump_variable, state);
+		search_scope = search_scope->previous;
+	}
+	state->level = -1;
+	for(stack_place = stack; stack_place; stack_place = stack_place->previous){
+		dump_root(state, "<stack>", stack_place->data_index);
+	}
+	for(i = 0; i < num_frames; i++){
+		dump_root(state, "<stack>", frames[i].expr);
+	}
+	for(i = 0; i < num_values; i++){
+		dump_root(state, "<stack>", values[i]);
+	}
+}
+
+//Writes every cell reachable from a root, for tools/heapreport. The format is line based:
+//  site ID TEXT
+//  root OWNER LEVEL NAME CELL     (OWNER is global, threadN or threadN-taskM; LEVEL is -1 for the
+//                                  shadow stack)
+//  cell ID TYPE BYTES SITE NUM_CHILDREN CHILD...
+int dump_heap(interp *in, char *path){
+	char owner[48];
+	dump_state state;
+	interp *thread;
+	task *t;
+	heap *h;
+	int num_threads;
+	unsigned int i;
+	int success;
+
+	h = in->heap;
+	state.fp = fopen(path, "w");
+	if(!state.fp){
+		set_error(in, "failed to open heap dump file");
+		return 0;
+	}
+	state.visited = calloc(h->data_heap_size, sizeof(char));
+	state.pending = malloc(sizeof(int)*h->data_heap_size);
+	if(!state.visited || !state.pending){
+		free(state.visited);
+		free(state.pending);
+		fclose(state.fp);
+		set_error(in, "malloc returned NULL");
+		return 0;
+	}
+	state.heap = h;
+	state.num_pending = 0;
+
+	lock_world(in);
+	fprintf(state.fp, "lisp-heap-dump 1\n");
+	for(i = 0; i < (unsigned int) h->num_sites; i++){
+		fprintf(state.fp, "site %d %s\n", i, h->sites[i]->text);
+	}
+	state.owner = "global";
+	state.level = 0;
+	iterate_dictionary(h->global_scope->variables, dump_variable, &state);
+	num_threads = 0;
+	for(thread = h->threads; thread; thread = thread->next){
+		sprintf(owner, "thread%d", num_threads);
+		state.owner = owner;
+		dump_evaluation(&state, thread->current_scope, thread->stack, thread->frames, thread->num_frames, thread->values, thread->num_values);
+		for(i = 0; i < thread->num_tasks; i++){
+			t = thread->tasks[i];
+			if(!t || t == running_task(thread)){
+				continue;
+			}
+			sprintf(owner, "thread%d-task%d", num_threads, t->id);
+			state.level = -1;
+			if(t->expr != -1){
+				dump_root(&state, "<task>", t->expr);
+			}
+			if(t->state == TASK_FINISHED && t->result != -1){
+				dump_root(&state, "<task>", t->result);
+			}
+			dump_evaluation(&state, t->current_scope, t->stack, t->frames, t->num_frames, t->values, t->num_values);
+		}
+		num_threads++;
+	}
+	unlock_world(in);
+
+	free(state.visited);
+	free(state.pending);
+	success = !ferror(state.fp);
+	if(fclose(state.fp) || !success){
+		set_error(in, "failed to write heap dump");
+		return 0;
+	}
+
+	return 1;
+}
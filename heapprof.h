@@ -0,0 +1,27 @@
+#ifndef HEAPPROF_INCLUDED
+#define HEAPPROF_INCLUDED
+#include "lisp.h"
+#include "profile.h"
+
+//Forms in site descriptions are cut off after this many characters
+#define MAX_SITE_FORM 80
+
+struct heap;
+
+typedef struct allocation_site allocation_site;
+
+//Where cells were allocated: the running Lisp function and builtin, and the form being evaluated.
+//The form is identified by its cell and that cell's generation, and text describes it for dumps
+struct allocation_site{
+	int id;
+	char name[MAX_FRAME_NAME];
+	int builtin_id;
+	int expr;
+	unsigned int generation;
+	char *text;
+};
+
+int current_allocation_site(interp *in);
+void forward_allocation_sites(struct heap *h, int *forward);
+void free_allocation_sites(struct heap *h);
+#endif
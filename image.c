@@ -0,0 +1,682 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "allocate.h"
+#include "execute.h"
+#include "image.h"
+
+//An image is a header followed by the cell, entry, binding and string tables, in that order.
+//Module caches use the same layout with a single unnamed binding holding the parsed forms
+#define IMAGE_MAGIC 0x474d494c
+#define MODULE_MAGIC 0x444f4d4c
+
+//Bump whenever the layout or the meaning of parsed data changes, so stale caches are rebuilt
+#define IMAGE_VERSION 4
+
+typedef struct image_header image_header;
+
+struct image_header{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t source_hash;
+	uint32_t num_cells;
+	uint32_t num_entries;
+	uint32_t num_bindings;
+	uint32_t string_size;
+};
+
+//For INT_DATA a is the value, for IDENTIFIER and BUILTIN_FUNCTION a is a string offset,
+//for S_EXPR and Q_EXPR a is an entry offset and b a count, for FUNCTION a and b are cells, and
+//for MEMO_FUNCTION a is the function's cell and b the capacity (cached results aren't saved), and
+//for PROMISE a and b are the expression and value cells, or -1
+typedef struct image_cell image_cell;
+
+struct image_cell{
+	int32_t type;
+	int32_t a;
+	int32_t b;
+};
+
+typedef struct image_binding image_binding;
+
+struct image_binding{
+	uint32_t name;
+	uint32_t cell;
+};
+
+typedef struct image_writer image_writer;
+
+struct image_writer{
+	interp *in;
+	int *cell_ids;
+	//Cells numbered but not filled in yet. Each is only numbered once, so it needs no more than the heap
+	int *pending;
+	unsigned int num_pending;
+	image_cell *cells;
+	uint32_t num_cells;
+	uint32_t cells_size;
+	int32_t *entries;
+	uint32_t num_entries;
+	uint32_t entries_size;
+	image_binding *bindings;
+	uint32_t num_bindings;
+	uint32_t bindings_size;
+	char *strings;
+	uint32_t string_size;
+	uint32_t strings_size;
+	int failed;
+};
+
+static void *grow(void *array, uint32_t *size, uint32_t needed, size_t element_size){
+	uint32_t next_size;
+
+	if(needed <= *size){
+		return array;
+	}
+	next_size = *size ? *size : 64;
+	while(next_size < needed){
+		next_size *= 2;
+	}
+	array = realloc(array, element_size*next_size);
+	if(array){
+		*size = next_size;
+	}
+
+	return array;
+}
+
+static int32_t add_string(image_writer *w, char *string){
+	uint32_t length;
+	char *next_strings;
+	int32_t output;
+
+	length = strlen(string) + 1;
+	next_strings = grow(w->strings, &w->strings_size, w->string_size + length, sizeof(char));
+	if(!next_strings){
+		w->failed = 1;
+		return 0;
+	}
+	w->strings = next_strings;
+	output = w->string_size;
+	memcpy(w->strings + output, string, length);
+	w->string_size += length;
+
+	return output;
+}
+
+//Numbers a cell the first time it is reached, and queues it to be filled in by add_cell()
+static int32_t cell_id(image_writer *w, int data_index){
+	image_cell *next_cells;
+	int32_t cell;
+
+	if(w->cell_ids[data_index] != -1){
+		return w->cell_ids[data_index];
+	}
+
+	next_cells = grow(w->cells, &w->cells_size, w->num_cells + 1, sizeof(image_cell));
+	if(!next_cells){
+		w->failed = 1;
+		return 0;
+	}
+	w->cells = next_cells;
+	cell = w->num_cells;
+	w->num_cells++;
+	w->cell_ids[data_index] = cell;
+	w->pending[w->num_pending] = data_index;
+	w->num_pending++;
+
+	return cell;
+}
+
+static void fill_image_cell(image_writer *w, int data_index){
+	data *d;
+	int32_t *next_entries;
+	int32_t cell;
+	int32_t offset;
+	int32_t child;
+	int i;
+
+	cell = w->cell_ids[data_index];
+	d = w->in->data_heap + data_index;
+	w->cells[cell].type = d->type;
+	w->cells[cell].a = 0;
+	w->cells[cell].b = 0;
+	switch(d->type){
+		case INT_DATA:
+			w->cells[cell].a = d->int_value;
+			break;
+		case IDENTIFIER:
+			w->cells[cell].a = add_string(w, d->identifier_name);
+			break;
+		case S_EXPR:
+		case Q_EXPR:
+			next_entries = grow(w->entries, &w->entries_size, w->num_entries + d->num_entries, sizeof(int32_t));
+			if(!next_entries){
+				w->failed = 1;
+				return;
+			}
+			w->entries = next_entries;
+			offset = w->num_entries;
+			w->num_entries += d->num_entries;
+			w->cells[cell].a = offset;
+			w->cells[cell].b = d->num_entries;
+			for(i = 0; i < d->num_entries; i++){
+				child = cell_id(w, d->entries[i]);
+				w->entries[offset + i] = child;
+			}
+			break;
+		case BUILTIN_FUNCTION:
+			w->cells[cell].a = add_string(w, builtin_name(d->builtin_id));
+			break;
+		case FUNCTION:
+			child = cell_id(w, d->var_list);
+			w->cells[cell].a = child;
+			child = cell_id(w, d->source);
+			w->cells[cell].b = child;
+			break;
+		case MEMO_FUNCTION:
+			child = cell_id(w, d->memo_function);
+			w->cells[cell].a = child;
+			w->cells[cell].b = d->memo_table->capacity;
+			break;
+		case PROMISE:
+			w->cells[cell].a = -1;
+			w->cells[cell].b = -1;
+			if(d->promise_expr != -1){
+				child = cell_id(w, d->promise_expr);
+				w->cells[cell].a = child;
+			}
+			if(d->promise_value != -1){
+				child = cell_id(w, d->promise_value);
+				w->cells[cell].b = child;
+			}
+			break;
+		case NONE_DATA:
+			break;
+	}
+}
+
+//Adds a cell and everything reachable from it. Cells are filled in from the pending stack rather than
+//recursively, so nesting depth doesn't use up the C stack
+static int32_t add_cell(image_writer *w, int data_index){
+	int32_t cell;
+
+	cell = cell_id(w, data_index);
+	while(w->num_pending && !w->failed){
+		w->num_pending--;
+		fill_image_cell(w, w->pending[w->num_pending]);
+	}
+
+	return cell;
+}
+
+static void add_binding(void *v, void *context){
+	image_writer *w;
+	variable *var;
+	image_binding *next_bindings;
+
+	w = context;
+	var = v;
+	next_bindings = grow(w->bindings, &w->bindings_size, w->num_bindings + 1, sizeof(image_binding));
+	if(!next_bindings){
+		w->failed = 1;
+		return;
+	}
+	w->bindings = next_bindings;
+	w->bindings[w->num_bindings].name = add_string(w, var->name);
+	w->bindings[w->num_bindings].cell = add_cell(w, var->data_index);
+	w->num_bindings++;
+}
+
+//Numbers the temporary files this process writes images to
+static unsigned int temp_counter = 0;
+
+static int write_image(interp *in, image_writer *w, char *path, uint32_t magic, uint64_t source_hash){
+	image_header header;
+	char *temp_path;
+	FILE *fp;
+	int fd;
+
+	if(w->failed){
+		set_error(in, "failed to build image");
+		return 0;
+	}
+
+	//Write next to the destination and rename so a partial image is never seen. Every writer gets a
+	//file of its own, so processes and threads saving the same image don't write into each other's
+	temp_path = malloc(strlen(path) + 40);
+	if(!temp_path){
+		set_error(in, "malloc returned NULL");
+		return 0;
+	}
+	do {
+		sprintf(temp_path, "%s.%ld.%u.tmp", path, (long) getpid(), __atomic_fetch_add(&temp_counter, 1, __ATOMIC_RELAXED));
+		fd = open(temp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	} while(fd < 0 && errno == EEXIST);
+	fp = fd < 0 ? NULL : fdopen(fd, "wb");
+	if(!fp){
+		if(fd >= 0){
+			close(fd);
+			remove(temp_path);
+		}
+		free(temp_path);
+		set_error(in, "failed to open image file");
+		return 0;
+	}
+	header.magic = magic;
+	header.version = IMAGE_VERSION;
+	header.source_hash = source_hash;
+	header.num_cells = w->num_cells;
+	header.num_entries = w->num_entries;
+	header.num_bindings = w->num_bindings;
+	header.string_size = w->string_size;
+	if(fwrite(&header, sizeof(image_header), 1, fp) != 1 ||
+			fwrite(w->cells, sizeof(image_cell), w->num_cells, fp) != w->num_cells ||
+			fwrite(w->entries, sizeof(int32_t), w->num_entries, fp) != w->num_entries ||
+			fwrite(w->bindings, sizeof(image_binding), w->num_bindings, fp) != w->num_bindings ||
+			fwrite(w->strings, sizeof(char), w->string_size, fp) != w->string_size){
+		fclose(fp);
+		remove(temp_path);
+		free(temp_path);
+		set_error(in, "failed to write image file");
+		return 0;
+	}
+	if(fclose(fp) || rename(temp_path, path)){
+		remove(temp_path);
+		free(temp_path);
+		set_error(in, "failed to write image file");
+		return 0;
+	}
+	free(temp_path);
+
+	return 1;
+}
+
+static int create_writer(interp *in, image_writer *w){
+	unsigned int i;
+
+	memset(w, 0, sizeof(image_writer));
+	w->in = in;
+	w->cell_ids = malloc(sizeof(int)*in->heap->data_heap_size);
+	w->pending = malloc(sizeof(int)*in->heap->data_heap_size);
+	if(!w->cell_ids || !w->pending){
+		free(w->cell_ids);
+		free(w->pending);
+		set_error(in, "malloc returned NULL");
+		return 0;
+	}
+	for(i = 0; i < in->heap->data_heap_size; i++){
+		w->cell_ids[i] = -1;
+	}
+
+	return 1;
+}
+
+static void free_writer(image_writer *w){
+	free(w->cell_ids);
+	free(w->pending);
+	free(w->cells);
+	free(w->entries);
+	free(w->bindings);
+	free(w->strings);
+}
+
+//Writes every global binding and the data reachable from it
+int save_image(interp *in, char *path){
+	image_writer w;
+	int success;
+
+	if(!create_writer(in, &w)){
+		return 0;
+	}
+	read_lock_global_scope(in);
+	iterate_dictionary(in->heap->global_scope->variables, add_binding, &w);
+	unlock_global_scope(in);
+	success = write_image(in, &w, path, IMAGE_MAGIC, 0);
+	free_writer(&w);
+
+	return success;
+}
+
+uint64_t hash_source(char *source, size_t length){
+	uint64_t hash = 0xcbf29ce484222325;
+	size_t i;
+
+	//FNV-1a
+	for(i = 0; i < length; i++){
+		hash ^= (unsigned char) source[i];
+		hash *= 0x100000001b3;
+	}
+
+	return hash;
+}
+
+int save_module_cache(interp *in, char *path, uint64_t source_hash, int forms){
+	image_writer w;
+	image_binding *next_bindings;
+	int success;
+
+	if(!create_writer(in, &w)){
+		return 0;
+	}
+	next_bindings = grow(w.bindings, &w.bindings_size, 1, sizeof(image_binding));
+	if(!next_bindings){
+		free_writer(&w);
+		set_error(in, "malloc returned NULL");
+		return 0;
+	}
+	w.bindings = next_bindings;
+	w.bindings[0].name = add_string(&w, "");
+	w.bindings[0].cell = add_cell(&w, forms);
+	w.num_bindings = 1;
+	success = write_image(in, &w, path, MODULE_MAGIC, source_hash);
+	free_writer(&w);
+
+	return success;
+}
+
+static int valid_string(image_header *header, int32_t offset){
+	return offset >= 0 && (uint32_t) offset < header->string_size;
+}
+
+static int valid_cell(image_header *header, int32_t cell){
+	return cell >= 0 && (uint32_t) cell < header->num_cells;
+}
+
+static int fill_cell(interp *in, image_header *header, image_cell *cells, image_cell *cell, int32_t *entries, char *strings, int *cell_ids, int data_index){
+	data *d;
+	int i;
+
+	d = in->data_heap + data_index;
+	switch(cell->type){
+		case INT_DATA:
+			d->int_value = cell->a;
+			break;
+		case IDENTIFIER:
+			if(!valid_string(header, cell->a)){
+				return 0;
+			}
+			d->identifier_name = strdup(strings + cell->a);
+			if(!d->identifier_name){
+				return 0;
+			}
+			break;
+		case S_EXPR:
+		case Q_EXPR:
+			if(cell->a < 0 || cell->b < 0 || (uint32_t) cell->a + cell->b > header->num_entries){
+				return 0;
+			}
+			for(i = 0; i < cell->b; i++){
+				if(!valid_cell(header, entries[cell->a + i])){
+					return 0;
+				}
+			}
+			d->entries = NULL;
+			d->num_entries = 0;
+			if(!resize_entries(d, cell->b)){
+				return 0;
+			}
+			d->num_entries = cell->b;
+			for(i = 0; i < cell->b; i++){
+				d->entries[i] = cell_ids[entries[cell->a + i]];
+				increment_references(in, d->entries[i]);
+			}
+			break;
+		case BUILTIN_FUNCTION:
+			if(!valid_string(header, cell->a)){
+				return 0;
+			}
+			//Builtin function pointers differ between builds, so they are relocated by name
+			d->builtin_id = lookup_builtin(strings + cell->a);
+			if(d->builtin_id == -1){
+				return 0;
+			}
+			d->builtin_function = builtin_function(d->builtin_id);
+			break;
+		case FUNCTION:
+			if(!valid_cell(header, cell->a) || !valid_cell(header, cell->b)){
+				return 0;
+			}
+			d->var_list = cell_ids[cell->a];
+			d->source = cell_ids[cell->b];
+			increment_references(in, d->var_list);
+			increment_references(in, d->source);
+			break;
+		case MEMO_FUNCTION:
+			if(!valid_cell(header, cell->a) || cells[cell->a].type != FUNCTION || cell->b <= 0){
+				return 0;
+			}
+			d->memo_table = create_memo_table(cell->b);
+			if(!d->memo_table){
+				return 0;
+			}
+			d->memo_function = cell_ids[cell->a];
+			increment_references(in, d->memo_function);
+			break;
+		case PROMISE:
+			if((cell->a != -1 && !valid_cell(header, cell->a)) || (cell->b != -1 && !valid_cell(header, cell->b)) || (cell->a == -1 && cell->b == -1)){
+				return 0;
+			}
+			d->promise_expr = cell->a == -1 ? -1 : cell_ids[cell->a];
+			d->promise_value = cell->b == -1 ? -1 : cell_ids[cell->b];
+			if(d->promise_expr != -1){
+				increment_references(in, d->promise_expr);
+			}
+			if(d->promise_value != -1){
+				increment_references(in, d->promise_value);
+			}
+			break;
+		case NONE_DATA:
+			return 1;
+		default:
+			return 0;
+	}
+	d->type = cell->type;
+
+	return 1;
+}
+
+typedef struct mapped_image mapped_image;
+
+struct mapped_image{
+	char *map;
+	size_t size;
+	image_header *header;
+	image_cell *cells;
+	int32_t *entries;
+	image_binding *bindings;
+	char *strings;
+};
+
+static int map_image(interp *in, char *path, uint32_t magic, mapped_image *m){
+	int fd;
+	struct stat st;
+	image_header *header;
+	size_t expected_size;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0){
+		set_error(in, "failed to open image file");
+		return 0;
+	}
+	if(fstat(fd, &st) || (size_t) st.st_size < sizeof(image_header)){
+		close(fd);
+		set_error(in, "invalid image file");
+		return 0;
+	}
+	m->size = st.st_size;
+	m->map = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(m->map == MAP_FAILED){
+		set_error(in, "failed to map image file");
+		return 0;
+	}
+
+	header = (image_header *) m->map;
+	expected_size = sizeof(image_header) + (size_t) header->num_cells*sizeof(image_cell) + (size_t) header->num_entries*sizeof(int32_t) + (size_t) header->num_bindings*sizeof(image_binding) + header->string_size;
+	if(header->magic != magic || header->version != IMAGE_VERSION || expected_size != m->size || (header->string_size && m->map[m->size - 1] != '\0')){
+		munmap(m->map, m->size);
+		set_error(in, "invalid image file");
+		return 0;
+	}
+	m->header = header;
+	m->cells = (image_cell *) (m->map + sizeof(image_header));
+	m->entries = (int32_t *) (m->cells + header->num_cells);
+	m->bindings = (image_binding *) (m->entries + header->num_entries);
+	m->strings = (char *) (m->bindings + header->num_bindings);
+
+	return 1;
+}
+
+//Rebuilds the image's cells in the heap, taking them from it in one go. The cells are only counted
+//from each other, so the caller must reference the ones it keeps before it reaches a safepoint. If
+//the image is invalid, the cells filled so far are left for the collector
+static int *load_cells(interp *in, mapped_image *m, int flags){
+	int *cell_ids;
+	int *cells;
+	uint32_t num_cells = 0;
+	uint32_t i;
+
+	cell_ids = malloc(sizeof(int)*(m->header->num_cells + 1));
+	cells = malloc(sizeof(int)*(m->header->num_cells + 1));
+	if(!cell_ids || !cells){
+		free(cell_ids);
+		free(cells);
+		set_error(in, "malloc returned NULL");
+		return NULL;
+	}
+	for(i = 0; i < m->header->num_cells; i++){
+		if(m->cells[i].type != NONE_DATA){
+			num_cells++;
+		}
+	}
+	if(!allocate_cells(in, cells, num_cells)){
+		free(cell_ids);
+		free(cells);
+		return NULL;
+	}
+	num_cells = 0;
+	for(i = 0; i < m->header->num_cells; i++){
+		if(m->cells[i].type == NONE_DATA){
+			cell_ids[i] = in->global_none;
+		} else {
+			cell_ids[i] = cells[num_cells];
+			in->data_heap[cell_ids[i]].flags = flags;
+			num_cells++;
+		}
+	}
+	free(cells);
+	for(i = 0; i < m->header->num_cells; i++){
+		if(!fill_cell(in, m->header, m->cells, m->cells + i, m->entries, m->strings, cell_ids, cell_ids[i])){
+			free(cell_ids);
+			set_error(in, "invalid image file");
+			return NULL;
+		}
+	}
+
+	return cell_ids;
+}
+
+//Expects the global scope to be write locked
+static int bind_global(interp *in, char *name, int data_index){
+	variable *var;
+
+	var = read_dictionary(in->heap->global_scope->variables, name, 0);
+	if(var){
+		decrement_references(in, var->data_index);
+	} else {
+		var = malloc(sizeof(variable));
+		if(!var){
+			set_error(in, "malloc returned NULL");
+			return 0;
+		}
+		var->name = strdup(name);
+		if(!var->name){
+			free(var);
+			set_error(in, "malloc returned NULL");
+			return 0;
+		}
+		write_dictionary(&(in->heap->global_scope->variables), name, var, 0);
+	}
+	var->data_index = data_index;
+	increment_references(in, data_index);
+
+	return 1;
+}
+
+//Binds everything saved in the image in the global scope. The cells are loaded already shared and
+//bound under one lock, since everything in an image is reachable from a global
+int load_image(interp *in, char *path){
+	mapped_image m;
+	int *cell_ids;
+	uint32_t i;
+	int success;
+
+	if(!map_image(in, path, IMAGE_MAGIC, &m)){
+		return 0;
+	}
+	for(i = 0; i < m.header->num_bindings; i++){
+		if(!valid_string(m.header, m.bindings[i].name) || !valid_cell(m.header, m.bindings[i].cell)){
+			munmap(m.map, m.size);
+			set_error(in, "invalid image file");
+			return 0;
+		}
+	}
+	cell_ids = load_cells(in, &m, DATA_SHARED);
+	if(!cell_ids){
+		munmap(m.map, m.size);
+		return 0;
+	}
+
+	write_lock_global_scope(in);
+	for(i = 0; i < m.header->num_bindings; i++){
+		if(!bind_global(in, m.strings + m.bindings[i].name, cell_ids[m.bindings[i].cell])){
+			break;
+		}
+	}
+	unlock_global_scope(in);
+	success = i == m.header->num_bindings;
+
+	free(cell_ids);
+	munmap(m.map, m.size);
+
+	return success;
+}
+
+//Returns the cached forms, or -1 if the cache is missing or was built from different source
+int load_module_cache(interp *in, char *path, uint64_t source_hash){
+	mapped_image m;
+	int *cell_ids;
+	int forms;
+
+	if(!map_image(in, path, MODULE_MAGIC, &m)){
+		return -1;
+	}
+	if(m.header->source_hash != source_hash || m.header->num_bindings != 1 || !valid_cell(m.header, m.bindings[0].cell)){
+		munmap(m.map, m.size);
+		return -1;
+	}
+	cell_ids = load_cells(in, &m, 0);
+	if(!cell_ids){
+		munmap(m.map, m.size);
+		return -1;
+	}
+	forms = cell_ids[m.bindings[0].cell];
+	increment_references(in, forms);
+
+	free(cell_ids);
+	munmap(m.map, m.size);
+
+	if(in->data_heap[forms].type != Q_EXPR){
+		decrement_references(in, forms);
+		return -1;
+	}
+
+	return forms;
+}
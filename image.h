@@ -0,0 +1,10 @@
+#ifndef IMAGE_INCLUDED
+#define IMAGE_INCLUDED
+#include <stdint.h>
+#include <stddef.h>
+#include "allocate.h"
+
+uint64_t hash_source(char *source, size_t length);
+int save_module_cache(interp *in, char *path, uint64_t source_hash, int forms);
+int load_module_cache(interp *in, char *path, uint64_t source_hash);
+#endif
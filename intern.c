@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <string.h>
+#include "allocate.h"
+#include "intern.h"
+
+//Hash consing: quoted values read by the parser are looked up in a table of interned cells, and
+//structurally equal ones share a cell. The table doesn't hold references. Cells leave it when their
+//count reaches zero or a collection finds them unreachable. Interned cells are never modified, so
+//two of them are equal exactly when they are the same cell
+
+int enable_hash_consing(interp *in){
+	heap *h;
+	int *buckets;
+	int *next;
+	unsigned int num_buckets;
+	unsigned int i;
+
+	h = in->heap;
+	if(h->intern_buckets){
+		return 1;
+	}
+	num_buckets = 64;
+	while(num_buckets < h->data_heap_size){
+		num_buckets *= 2;
+	}
+	buckets = malloc(sizeof(int)*num_buckets);
+	next = malloc(sizeof(int)*h->data_heap_size);
+	if(!buckets || !next){
+		free(buckets);
+		free(next);
+		set_error(in, "malloc returned NULL");
+		return 0;
+	}
+	for(i = 0; i < num_buckets; i++){
+		buckets[i] = -1;
+	}
+	pthread_mutex_lock(&h->intern_lock);
+	h->intern_next = next;
+	h->num_intern_buckets = num_buckets;
+	h->intern_buckets = buckets;
+	pthread_mutex_unlock(&h->intern_lock);
+
+	return 1;
+}
+
+//Entries of interned expressions are interned themselves, so they hash and compare by index
+static unsigned long shallow_hash(data *d){
+	unsigned long hash;
+	char *c;
+	int i;
+
+	hash = (d->type + 1)*0x9e3779b97f4a7c15UL;
+	switch(d->type){
+		case INT_DATA:
+			hash = (hash ^ (unsigned int) d->int_value)*0x100000001b3UL;
+			break;
+		case IDENTIFIER:
+			for(c = d->identifier_name; *c; c++){
+				hash = (hash ^ (unsigned char) *c)*0x100000001b3UL;
+			}
+			break;
+		case S_EXPR:
+		case Q_EXPR:
+			for(i = 0; i < d->num_entries; i++){
+				hash = (hash ^ (unsigned int) d->entries[i])*0x100000001b3UL;
+			}
+			break;
+		default:
+			break;
+	}
+
+	return hash ^ (hash >> 29);
+}
+
+static int shallow_equal(data *a, data *b){
+	if(a->type != b->type){
+		return 0;
+	}
+	switch(a->type){
+		case INT_DATA:
+			return a->int_value == b->int_value;
+		case IDENTIFIER:
+			return !strcmp(a->identifier_name, b->identifier_name);
+		case S_EXPR:
+		case Q_EXPR:
+			return a->num_entries == b->num_entries && (!a->num_entries || !memcmp(a->entries, b->entries, sizeof(int)*a->num_entries));
+		default:
+			return 0;
+	}
+}
+
+static int is_internable(interp *in, int data_index){
+	data *d;
+	int i;
+
+	d = in->data_heap + data_index;
+	switch(d->type){
+		case INT_DATA:
+		case IDENTIFIER:
+			return 1;
+		case S_EXPR:
+		case Q_EXPR:
+			for(i = 0; i < d->num_entries; i++){
+				if(!(in->data_heap[d->entries[i]].flags&DATA_INTERNED)){
+					return 0;
+				}
+			}
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+//Takes a reference unless the count already reached zero, in which case the cell is on its way out
+static int try_reference(interp *in, int data_index){
+	int num_references;
+
+	num_references = __atomic_load_n(&in->data_heap[data_index].num_references, __ATOMIC_RELAXED);
+	while(num_references > 0){
+		if(__atomic_compare_exchange_n(&in->data_heap[data_index].num_references, &num_references, num_references + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+//Takes ownership of a reference to data_index and returns a reference to its interned equivalent
+int intern_value(interp *in, int data_index){
+	heap *h;
+	unsigned long bucket;
+	int cell;
+
+	h = in->heap;
+	if(!h->intern_buckets || !is_internable(in, data_index)){
+		return data_index;
+	}
+	bucket = shallow_hash(in->data_heap + data_index)&(h->num_intern_buckets - 1);
+	pthread_mutex_lock(&h->intern_lock);
+	for(cell = h->intern_buckets[bucket]; cell != -1; cell = h->intern_next[cell]){
+		if(shallow_equal(in->data_heap + cell, in->data_heap + data_index) && try_reference(in, cell)){
+			pthread_mutex_unlock(&h->intern_lock);
+			in->metrics.intern_hits++;
+			decrement_references(in, data_index);
+			return cell;
+		}
+	}
+	//Any thread parsing the same text gets this cell. One that can't be shared just isn't interned
+	if(!mark_shared(in, data_index)){
+		pthread_mutex_unlock(&h->intern_lock);
+		return data_index;
+	}
+	in->data_heap[data_index].flags |= DATA_INTERNED;
+	h->intern_next[data_index] = h->intern_buckets[bucket];
+	h->intern_buckets[bucket] = data_index;
+	pthread_mutex_unlock(&h->intern_lock);
+
+	return data_index;
+}
+
+//Interns every value in a tree that was built without going through the parser, such as a loaded
+//module cache. Fresh expressions get their entries replaced by interned ones before they are interned
+int intern_tree(interp *in, int data_index){
+	int i;
+
+	if(in->data_heap[data_index].flags&DATA_INTERNED){
+		return data_index;
+	}
+	if(in->data_heap[data_index].type == S_EXPR || in->data_heap[data_index].type == Q_EXPR){
+		for(i = 0; i < in->data_heap[data_index].num_entries; i++){
+			in->data_heap[data_index].entries[i] = intern_tree(in, in->data_heap[data_index].entries[i]);
+		}
+	}
+
+	return intern_value(in, data_index);
+}
+
+//Called when an interned cell's count reaches zero, before its contents are released
+void release_interned(interp *in, int data_index){
+	heap *h;
+	int *place;
+
+	h = in->heap;
+	pthread_mutex_lock(&h->intern_lock);
+	place = h->intern_buckets + (shallow_hash(in->data_heap + data_index)&(h->num_intern_buckets - 1));
+	while(*place != -1 && *place != data_index){
+		place = h->intern_next + *place;
+	}
+	if(*place == data_index){
+		*place = h->intern_next[data_index];
+	}
+	in->data_heap[data_index].flags &= ~DATA_INTERNED;
+	pthread_mutex_unlock(&h->intern_lock);
+}
+
+//Puts every interned cell back in the table after compact_heap() renumbered the cells, since the hash
+//of an expression is taken over the indices of its entries. Expects the world to be stopped
+void rebuild_intern_table(heap *h){
+	unsigned long bucket;
+	unsigned int i;
+
+	for(i = 0; i < h->num_intern_buckets; i++){
+		h->intern_buckets[i] = -1;
+	}
+	for(i = 0; i < h->num_allocated; i++){
+		if(h->data_heap[i].flags&DATA_INTERNED){
+			bucket = shallow_hash(h->data_heap + i)&(h->num_intern_buckets - 1);
+			h->intern_next[i] = h->intern_buckets[bucket];
+			h->intern_buckets[bucket] = i;
+		}
+	}
+}
+
+//Drops cells the collector didn't mark. Expects the world to be stopped
+void sweep_intern_table(heap *h){
+	unsigned int i;
+	int *place;
+
+	for(i = 0; i < h->num_intern_buckets; i++){
+		place = h->intern_buckets + i;
+		while(*place != -1){
+			if(h->data_heap_locations[*place] >= h->num_allocated){
+				h->data_heap[*place].flags &= ~DATA_INTERNED;
+				*place = h->intern_next[*place];
+			} else {
+				place = h->intern_next + *place;
+			}
+		}
+	}
+}
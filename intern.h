@@ -0,0 +1,10 @@
+#ifndef INTERN_INCLUDED
+#define INTERN_INCLUDED
+#include "allocate.h"
+
+int intern_value(interp *in, int data_index);
+int intern_tree(interp *in, int data_index);
+void release_interned(interp *in, int data_index);
+void sweep_intern_table(heap *h);
+void rebuild_intern_table(heap *h);
+#endif
@@ -0,0 +1,389 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include "allocate.h"
+#include "execute.h"
+#include "serialize.h"
+#include "isolate.h"
+
+//An isolate is a heap of its own, evaluating on a thread of its own, that shares nothing with
+//other isolates but the messages sent to its mailbox. A cell index means nothing outside its heap,
+//so a message is encoded once by serialize.c into a single buffer, which is handed through the
+//mailbox as it is and decoded straight into the receiving heap
+
+//Isolates rarely recurse in C, so their threads don't need the default stack
+#define ISOLATE_STACK_SIZE (1<<20)
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+//Isolates by id. Ids aren't reused, and an isolate's slot is cleared when its heap goes away
+static isolate **registry = NULL;
+static int registry_size = 0;
+static int num_ids = 0;
+
+static void push_message(mailbox *m, message *msg){
+	message *previous;
+
+	msg->next = NULL;
+	previous = __atomic_exchange_n(&m->head, msg, __ATOMIC_SEQ_CST);
+	//Until this store the queue looks empty from the receiving end
+	__atomic_store_n(&previous->next, msg, __ATOMIC_RELEASE);
+}
+
+//Expects lock to be held. Returns NULL if the queue is empty. A push that is halfway done, with the
+//head swapped but the link not stored yet, is waited out rather than taken for an empty queue
+static message *pop_message(mailbox *m){
+	message *tail;
+	message *next;
+
+	for(;;){
+		tail = m->tail;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+		if(tail == &m->stub){
+			if(!next){
+				if(tail == __atomic_load_n(&m->head, __ATOMIC_SEQ_CST)){
+					return NULL;
+				}
+				sched_yield();
+				continue;
+			}
+			m->tail = next;
+			tail = next;
+			next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+		}
+		if(next){
+			m->tail = next;
+			return tail;
+		}
+		if(tail == __atomic_load_n(&m->head, __ATOMIC_SEQ_CST)){
+			//The last message can only be taken once something follows it
+			push_message(m, &m->stub);
+		} else {
+			sched_yield();
+		}
+	}
+}
+
+static void free_message(message *msg){
+	free(msg->bytes);
+	free(msg);
+}
+
+//Expects registry_lock to be held
+static isolate *register_isolate(){
+	isolate **next_registry;
+	isolate *iso;
+	int next_size;
+
+	if(num_ids == registry_size){
+		next_size = registry_size ? registry_size*2 : 16;
+		next_registry = realloc(registry, sizeof(isolate *)*next_size);
+		if(!next_registry){
+			return NULL;
+		}
+		registry = next_registry;
+		registry_size = next_size;
+	}
+	iso = malloc(sizeof(isolate));
+	if(!iso){
+		return NULL;
+	}
+	iso->num_references = 1;
+	iso->mailbox.stub.next = NULL;
+	iso->mailbox.head = &iso->mailbox.stub;
+	iso->mailbox.tail = &iso->mailbox.stub;
+	iso->mailbox.waiting = 0;
+	pthread_mutex_init(&iso->mailbox.lock, NULL);
+	pthread_cond_init(&iso->mailbox.cond, NULL);
+	iso->id = num_ids++;
+	registry[iso->id] = iso;
+
+	return iso;
+}
+
+//Messages nobody received are dropped with the mailbox
+static void release_isolate(isolate *iso){
+	message *msg;
+
+	if(__atomic_sub_fetch(&iso->num_references, 1, __ATOMIC_ACQ_REL)){
+		return;
+	}
+	while((msg = pop_message(&iso->mailbox))){
+		free_message(msg);
+	}
+	pthread_mutex_destroy(&iso->mailbox.lock);
+	pthread_cond_destroy(&iso->mailbox.cond);
+	free(iso);
+}
+
+//Called when the heap is freed. Later sends to the isolate fail
+void leave_isolate(isolate *iso){
+	pthread_mutex_lock(&registry_lock);
+	registry[iso->id] = NULL;
+	pthread_mutex_unlock(&registry_lock);
+	release_isolate(iso);
+}
+
+//An interpreter becomes an isolate the first time it spawns or uses messages
+static isolate *current_isolate(interp *in){
+	isolate *iso;
+
+	iso = __atomic_load_n(&in->heap->isolate, __ATOMIC_ACQUIRE);
+	if(iso){
+		return iso;
+	}
+	pthread_mutex_lock(&registry_lock);
+	iso = in->heap->isolate;
+	if(!iso){
+		iso = register_isolate();
+		__atomic_store_n(&in->heap->isolate, iso, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&registry_lock);
+	if(!iso){
+		set_error(in, "malloc returned NULL");
+	}
+
+	return iso;
+}
+
+static message *encode_message(interp *in, int value){
+	message *msg;
+	encoder e;
+
+	msg = malloc(sizeof(message));
+	if(!msg){
+		set_error(in, "malloc returned NULL");
+		return NULL;
+	}
+	init_encoder(&e, -1);
+	if(!encode_value(in, &e, value)){
+		free_encoder(&e);
+		free(msg);
+		return NULL;
+	}
+	//The buffer becomes the message's
+	msg->bytes = e.output.text;
+	msg->length = e.output.length;
+	e.output.text = NULL;
+	free_encoder(&e);
+
+	return msg;
+}
+
+//Frees the message, whether or not it decodes
+static int decode_message(interp *in, message *msg){
+	decoder d;
+	char *bytes;
+	size_t length;
+	int value;
+
+	init_decoder(&d);
+	bytes = msg->bytes;
+	length = msg->length;
+	value = decode_value(in, &d, &bytes, &length);
+	if(value == DECODE_MORE){
+		set_error(in, "serialized value is truncated");
+		value = -1;
+	}
+	free_decoder(in, &d);
+	free_message(msg);
+
+	return value;
+}
+
+typedef struct isolate_start isolate_start;
+
+struct isolate_start{
+	isolate *iso;
+	message *program;
+	int heap_size;
+	unsigned long stack_limit;
+	unsigned int parallel_workers;
+};
+
+static void *run_isolate(void *arg){
+	isolate_start *start;
+	interp *in;
+	int program;
+	int result = -1;
+
+	start = arg;
+	in = create_interp(start->heap_size);
+	if(!in){
+		fprintf(stderr, "Error: isolate %d: failed to create interpreter\n", start->iso->id);
+		free_message(start->program);
+		leave_isolate(start->iso);
+		free(start);
+		return NULL;
+	}
+	in->heap->stack_limit = start->stack_limit;
+	in->heap->parallel_workers = start->parallel_workers;
+	in->heap->isolate = start->iso;
+	program = decode_message(in, start->program);
+	if(program != -1){
+		result = evaluate_q_expression(in, program, 1);
+		decrement_references(in, program);
+	}
+	if(result == -1){
+		fprintf(stderr, "Error: isolate %d: %s\n", start->iso->id, interp_error(in));
+	} else {
+		release_value(in, result);
+	}
+	free(start);
+	destroy_interp(in);
+
+	return NULL;
+}
+
+//(spawn {EXPR}) evaluates EXPR in a new isolate with a heap the size of this one, and returns the
+//isolate's id. Functions in EXPR go with it, but nothing it refers to by name
+int spawn_isolate(interp *in, int *args, int num_args, int *tail_call){
+	isolate_start *start;
+	pthread_attr_t attributes;
+	pthread_t thread;
+	int id;
+	int result;
+
+	if(num_args != 1){
+		set_error(in, "spawn expects an expression");
+		return -1;
+	}
+	start = malloc(sizeof(isolate_start));
+	if(!start){
+		set_error(in, "malloc returned NULL");
+		return -1;
+	}
+	start->program = encode_message(in, args[0]);
+	if(!start->program){
+		free(start);
+		return -1;
+	}
+	//The spawner gets its id first, so a program that spawns before asking (self) still gets the
+	//lower one, and the first heap to spawn is always isolate 0
+	if(!current_isolate(in)){
+		free_message(start->program);
+		free(start);
+		return -1;
+	}
+	pthread_mutex_lock(&registry_lock);
+	start->iso = register_isolate();
+	pthread_mutex_unlock(&registry_lock);
+	if(!start->iso){
+		free_message(start->program);
+		free(start);
+		set_error(in, "malloc returned NULL");
+		return -1;
+	}
+	start->heap_size = in->heap->data_heap_size;
+	start->stack_limit = in->heap->stack_limit;
+	start->parallel_workers = in->heap->parallel_workers;
+	//The isolate can finish and go away as soon as the thread starts
+	id = start->iso->id;
+
+	pthread_attr_init(&attributes);
+	pthread_attr_setstacksize(&attributes, ISOLATE_STACK_SIZE);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	result = pthread_create(&thread, &attributes, run_isolate, start);
+	pthread_attr_destroy(&attributes);
+	if(result){
+		free_message(start->program);
+		leave_isolate(start->iso);
+		free(start);
+		set_error(in, "failed to start isolate");
+		return -1;
+	}
+
+	return allocate_int(in, id);
+}
+
+//(send ID VALUE) returns 1 once VALUE is in the isolate's mailbox, or 0 if the isolate has finished
+int send_message(interp *in, int *args, int num_args, int *tail_call){
+	isolate *iso = NULL;
+	message *msg;
+	int id;
+
+	if(num_args != 2 || in->data_heap[args[0]].type != INT_DATA){
+		set_error(in, "send expects an isolate id and a value");
+		return -1;
+	}
+	id = in->data_heap[args[0]].int_value;
+	msg = encode_message(in, args[1]);
+	if(!msg){
+		return -1;
+	}
+	pthread_mutex_lock(&registry_lock);
+	if(id >= 0 && id < num_ids){
+		iso = registry[id];
+	}
+	if(iso){
+		__atomic_add_fetch(&iso->num_references, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&registry_lock);
+	if(!iso){
+		free_message(msg);
+		return allocate_int(in, 0);
+	}
+
+	push_message(&iso->mailbox, msg);
+	//Orders the link before the load of waiting. A receiver orders its increment before looking at
+	//the queue the same way, so at least one of the two sees the other
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&iso->mailbox.waiting, __ATOMIC_SEQ_CST)){
+		pthread_mutex_lock(&iso->mailbox.lock);
+		pthread_cond_broadcast(&iso->mailbox.cond);
+		pthread_mutex_unlock(&iso->mailbox.lock);
+	}
+	release_isolate(iso);
+
+	return allocate_int(in, 1);
+}
+
+//(receive) returns the oldest message in this isolate's mailbox, waiting for one if it is empty
+int receive_message(interp *in, int *args, int num_args, int *tail_call){
+	isolate *iso;
+	mailbox *m;
+	message *msg;
+
+	if(num_args){
+		set_error(in, "receive expects no arguments");
+		return -1;
+	}
+	iso = current_isolate(in);
+	if(!iso){
+		return -1;
+	}
+	m = &iso->mailbox;
+	pthread_mutex_lock(&m->lock);
+	msg = pop_message(m);
+	pthread_mutex_unlock(&m->lock);
+	if(!msg){
+		//Other threads on this heap can collect while this one sleeps
+		enter_safe_region(in);
+		pthread_mutex_lock(&m->lock);
+		__atomic_add_fetch(&m->waiting, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		while(!(msg = pop_message(m))){
+			pthread_cond_wait(&m->cond, &m->lock);
+		}
+		__atomic_sub_fetch(&m->waiting, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&m->lock);
+		leave_safe_region(in);
+	}
+
+	return decode_message(in, msg);
+}
+
+int self_isolate(interp *in, int *args, int num_args, int *tail_call){
+	isolate *iso;
+
+	if(num_args){
+		set_error(in, "self expects no arguments");
+		return -1;
+	}
+	iso = current_isolate(in);
+	if(!iso){
+		return -1;
+	}
+
+	return allocate_int(in, iso->id);
+}
@@ -0,0 +1,43 @@
+#ifndef ISOLATE_INCLUDED
+#define ISOLATE_INCLUDED
+#include <stddef.h>
+#include <pthread.h>
+#include "allocate.h"
+
+typedef struct message message;
+
+//An encoded value, moved from the sender to the receiver without being copied
+struct message{
+	message *next;
+	char *bytes;
+	size_t length;
+};
+
+typedef struct mailbox mailbox;
+
+//An intrusive queue that any number of threads push onto without locking. Receivers take turns
+//holding lock, and one that finds the queue empty sets waiting and sleeps on cond until a sender
+//sees the flag and wakes it
+struct mailbox{
+	message *head;
+	message *tail;
+	message stub;
+	int waiting;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+//A heap with a mailbox. The registry and the heap each hold a reference, as does a sender while
+//it pushes, so the mailbox outlives whoever is using it
+struct isolate{
+	int id;
+	int num_references;
+	mailbox mailbox;
+};
+
+void leave_isolate(isolate *iso);
+int spawn_isolate(interp *in, int *args, int num_args, int *tail_call);
+int send_message(interp *in, int *args, int num_args, int *tail_call);
+int receive_message(interp *in, int *args, int num_args, int *tail_call);
+int self_isolate(interp *in, int *args, int num_args, int *tail_call);
+#endif
@@ -0,0 +1,37 @@
+#ifndef LISP_INCLUDED
+#define LISP_INCLUDED
+#include "metrics.h"
+
+typedef struct interp interp;
+
+interp *create_interp(int heap_size);
+interp *attach_interp(interp *parent);
+void detach_interp(interp *in);
+void destroy_interp(interp *in);
+int interp_eval(interp *in, char *source);
+int interp_load(interp *in, char *path);
+char *interp_error(interp *in);
+int is_none(interp *in, int value);
+void print_value(interp *in, int value);
+int write_value(interp *in, int value, int fd);
+void release_value(interp *in, int value);
+void get_metrics(interp *in, metrics *m);
+int dump_metrics(interp *in, char *path, int fd);
+int dump_metrics_on_signal(interp *in, char *path, int fd);
+void stop_metrics_on_signal(interp *in);
+int start_profiler(interp *in, int frequency);
+void stop_profiler(interp *in);
+int write_profile(interp *in, char *path);
+int track_allocation_sites(interp *in);
+int enable_hash_consing(interp *in);
+void enable_compaction(interp *in);
+int dump_heap(interp *in, char *path);
+void set_stack_limit(interp *in, unsigned long bytes);
+void set_parallel_workers(interp *in, int num_workers);
+void interp_block(interp *in);
+void interp_unblock(interp *in);
+void set_error(interp *in, char *err);
+int save_image(interp *in, char *path);
+int load_image(interp *in, char *path);
+int serve(char *path, int num_workers, int heap_size, unsigned long stack_limit);
+#endif
@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "lisp.h"
+
+static void usage(char *name){
+	fprintf(stderr, "Usage: %s [--heap CELLS] [--stack BYTES] [--image FILE] [--metrics FILE | --metrics-fd FD] [--profile FILE [--profile-hz HZ]] [--heap-sites] [--hash-cons] [--compact] [--parallel N] [--serve SOCKET [--workers N]] [SCRIPT...]\n", name);
+}
+
+static char *metrics_path = NULL;
+static int metrics_fd = -1;
+static char *profile_path = NULL;
+
+static void finish(interp *in){
+	if(profile_path){
+		stop_profiler(in);
+		if(!write_profile(in, profile_path)){
+			fprintf(stderr, "Error: %s\n", interp_error(in));
+		}
+	}
+	stop_metrics_on_signal(in);
+	if((metrics_path || metrics_fd >= 0) && !dump_metrics(in, metrics_path, metrics_fd)){
+		fprintf(stderr, "Error: %s\n", interp_error(in));
+	}
+	destroy_interp(in);
+}
+
+int main(int argc, char **argv){
+	char input[1024];
+	interp *in;
+	int heap_size = 10000;
+	long stack_limit = 0;
+	char *image_path = NULL;
+	int profile_frequency = 1000;
+	int heap_sites = 0;
+	int hash_cons = 0;
+	int compact = 0;
+	int parallel_workers = 0;
+	char *serve_path = NULL;
+	int num_workers = 0;
+	int first_script = 0;
+	int result;
+	int i;
+
+	for(i = 1; i < argc; i++){
+		if(!strcmp(argv[i], "--heap") && i + 1 < argc){
+			heap_size = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "--stack") && i + 1 < argc){
+			stack_limit = atol(argv[++i]);
+		} else if(!strcmp(argv[i], "--image") && i + 1 < argc){
+			image_path = argv[++i];
+		} else if(!strcmp(argv[i], "--metrics") && i + 1 < argc){
+			metrics_path = argv[++i];
+		} else if(!strcmp(argv[i], "--metrics-fd") && i + 1 < argc){
+			metrics_fd = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "--profile") && i + 1 < argc){
+			profile_path = argv[++i];
+		} else if(!strcmp(argv[i], "--profile-hz") && i + 1 < argc){
+			profile_frequency = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "--heap-sites")){
+			heap_sites = 1;
+		} else if(!strcmp(argv[i], "--hash-cons")){
+			hash_cons = 1;
+		} else if(!strcmp(argv[i], "--compact")){
+			compact = 1;
+		} else if(!strcmp(argv[i], "--parallel") && i + 1 < argc){
+			parallel_workers = atoi(argv[++i]);
+			if(parallel_workers <= 0){
+				usage(argv[0]);
+				return 1;
+			}
+		} else if(!strcmp(argv[i], "--serve") && i + 1 < argc){
+			serve_path = argv[++i];
+		} else if(!strcmp(argv[i], "--workers") && i + 1 < argc){
+			num_workers = atoi(argv[++i]);
+			if(num_workers <= 0){
+				usage(argv[0]);
+				return 1;
+			}
+		} else if(argv[i][0] != '-'){
+			first_script = i;
+			break;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(heap_size <= 0 || stack_limit < 0){
+		usage(argv[0]);
+		return 1;
+	}
+
+	//Each connection gets its own interpreter with only the heap and stack limits set, so options for
+	//this one are refused rather than ignored
+	if(serve_path){
+		if(image_path || metrics_path || metrics_fd >= 0 || profile_path || heap_sites || hash_cons || compact || parallel_workers || first_script){
+			fprintf(stderr, "Error: --serve only takes --heap, --stack and --workers\n");
+			return 1;
+		}
+		if(!num_workers){
+			num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+		}
+		return serve(serve_path, num_workers, heap_size, stack_limit) ? 0 : 1;
+	}
+
+	in = create_interp(heap_size);
+	if(!in){
+		fprintf(stderr, "Error: failed to create interpreter\n");
+		return 1;
+	}
+	if(stack_limit){
+		set_stack_limit(in, stack_limit);
+	}
+	if(parallel_workers){
+		set_parallel_workers(in, parallel_workers);
+	}
+	//Metrics are written at exit and whenever SIGUSR1 arrives
+	if((metrics_path || metrics_fd >= 0) && !dump_metrics_on_signal(in, metrics_path, metrics_fd)){
+		fprintf(stderr, "Error: %s\n", interp_error(in));
+		destroy_interp(in);
+		return 1;
+	}
+	//Folded call stacks are written at exit
+	if(profile_path && !start_profiler(in, profile_frequency)){
+		fprintf(stderr, "Error: %s\n", interp_error(in));
+		destroy_interp(in);
+		return 1;
+	}
+	//Tags cells with where they were allocated, for heap-dump
+	if(heap_sites && !track_allocation_sites(in)){
+		fprintf(stderr, "Error: %s\n", interp_error(in));
+		destroy_interp(in);
+		return 1;
+	}
+	//Structurally equal quoted values share one cell
+	if(hash_cons && !enable_hash_consing(in)){
+		fprintf(stderr, "Error: %s\n", interp_error(in));
+		destroy_interp(in);
+		return 1;
+	}
+	//The heap is compacted between top level forms after each collection
+	if(compact){
+		enable_compaction(in);
+	}
+	if(image_path && !load_image(in, image_path)){
+		fprintf(stderr, "Error: %s\n", interp_error(in));
+		destroy_interp(in);
+		return 1;
+	}
+
+	//Scripts run in order and replace the REPL
+	if(first_script){
+		for(i = first_script; i < argc; i++){
+			result = interp_load(in, argv[i]);
+			if(result == -1){
+				fprintf(stderr, "Error: %s: %s\n", argv[i], interp_error(in));
+				finish(in);
+				return 1;
+			}
+			release_value(in, result);
+		}
+		finish(in);
+		return 0;
+	}
+
+	while(1){
+		printf("lisp> ");
+		if(!fgets(input, sizeof(input), stdin)){
+			break;
+		}
+		result = interp_eval(in, input);
+		if(result == -1){
+			fprintf(stderr, "Error: %s\n", interp_error(in));
+			continue;
+		}
+
+		if(!is_none(in, result)){
+			print_value(in, result);
+			printf("\n");
+		}
+		release_value(in, result);
+	}
+
+	finish(in);
+	return 0;
+}
@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <string.h>
+#include "allocate.h"
+#include "execute.h"
+#include "memo.h"
+
+#define INITIAL_MEMO_BUCKETS 64
+
+memo_table *create_memo_table(unsigned int capacity){
+	memo_table *table;
+
+	table = malloc(sizeof(memo_table));
+	if(!table){
+		return NULL;
+	}
+	table->buckets = calloc(INITIAL_MEMO_BUCKETS, sizeof(memo_entry *));
+	if(!table->buckets){
+		free(table);
+		return NULL;
+	}
+	table->num_buckets = INITIAL_MEMO_BUCKETS;
+	table->num_entries = 0;
+	table->capacity = capacity;
+	table->newest = NULL;
+	table->oldest = NULL;
+	pthread_mutex_init(&table->lock, NULL);
+
+	return table;
+}
+
+static unsigned long hash_arguments(interp *in, int *args, int num_args){
+	unsigned long hash;
+	int i;
+
+	hash = num_args;
+	for(i = 0; i < num_args; i++){
+		hash = (hash ^ hash_data(in, args[i]))*0x100000001b3UL;
+	}
+
+	return hash;
+}
+
+static void unlink_entry(memo_table *table, memo_entry *entry){
+	if(entry->newer){
+		entry->newer->older = entry->older;
+	} else {
+		table->newest = entry->older;
+	}
+	if(entry->older){
+		entry->older->newer = entry->newer;
+	} else {
+		table->oldest = entry->newer;
+	}
+}
+
+static void link_newest(memo_table *table, memo_entry *entry){
+	entry->newer = NULL;
+	entry->older = table->newest;
+	if(table->newest){
+		table->newest->newer = entry;
+	} else {
+		table->oldest = entry;
+	}
+	table->newest = entry;
+}
+
+//Returns a new reference to the cached result, or -1 if these arguments haven't been seen
+int memo_lookup(interp *in, int memo, int *args, int num_args){
+	memo_table *table;
+	memo_entry *entry;
+	unsigned long hash;
+	int key;
+	int i;
+
+	table = in->data_heap[memo].memo_table;
+	hash = hash_arguments(in, args, num_args);
+	pthread_mutex_lock(&table->lock);
+	for(entry = table->buckets[hash&(table->num_buckets - 1)]; entry; entry = entry->next){
+		key = entry->key;
+		if(entry->hash != hash || in->data_heap[key].num_entries != num_args){
+			continue;
+		}
+		//Arguments that can't be compared are treated as a miss
+		for(i = 0; i < num_args; i++){
+			if(data_equal(in, in->data_heap[key].entries[i], args[i]) != 1){
+				break;
+			}
+		}
+		if(i == num_args){
+			unlink_entry(table, entry);
+			link_newest(table, entry);
+			increment_references(in, entry->value);
+			pthread_mutex_unlock(&table->lock);
+			return entry->value;
+		}
+	}
+	pthread_mutex_unlock(&table->lock);
+
+	return -1;
+}
+
+static void grow_buckets(memo_table *table){
+	memo_entry **next_buckets;
+	memo_entry *entry;
+	memo_entry *next;
+	unsigned int i;
+
+	next_buckets = calloc(table->num_buckets*2, sizeof(memo_entry *));
+	if(!next_buckets){
+		return;
+	}
+	for(i = 0; i < table->num_buckets; i++){
+		for(entry = table->buckets[i]; entry; entry = next){
+			next = entry->next;
+			entry->next = next_buckets[entry->hash&(table->num_buckets*2 - 1)];
+			next_buckets[entry->hash&(table->num_buckets*2 - 1)] = entry;
+		}
+	}
+	free(table->buckets);
+	table->buckets = next_buckets;
+	table->num_buckets *= 2;
+}
+
+static void remove_entry(memo_table *table, memo_entry *entry){
+	memo_entry **place;
+
+	place = table->buckets + (entry->hash&(table->num_buckets - 1));
+	while(*place != entry){
+		place = &(*place)->next;
+	}
+	*place = entry->next;
+	unlink_entry(table, entry);
+	table->num_entries--;
+}
+
+//Caches value for these arguments, evicting the least recently used result if the table is full
+int memo_insert(interp *in, int memo, int *args, int num_args, int value){
+	memo_table *table;
+	memo_entry *entry;
+	memo_entry *evicted = NULL;
+	int key;
+	int i;
+
+	key = allocate(in);
+	if(key == -1){
+		return 0;
+	}
+	in->data_heap[key].entries = NULL;
+	in->data_heap[key].num_entries = 0;
+	entry = malloc(sizeof(memo_entry));
+	if(!resize_entries(in->data_heap + key, num_args) || !entry){
+		free(entry);
+		decrement_references(in, key);
+		set_error(in, "malloc returned NULL");
+		return 0;
+	}
+	in->data_heap[key].type = Q_EXPR;
+	in->data_heap[key].num_entries = num_args;
+	for(i = 0; i < num_args; i++){
+		in->data_heap[key].entries[i] = args[i];
+		increment_references(in, args[i]);
+	}
+	increment_references(in, value);
+	//Other threads can look the entry up once it's in a shared table
+	if(in->data_heap[memo].flags&DATA_SHARED && (!mark_shared(in, key) || !mark_shared(in, value))){
+		free(entry);
+		decrement_references(in, key);
+		decrement_references(in, value);
+		return 0;
+	}
+	entry->hash = hash_arguments(in, args, num_args);
+	entry->key = key;
+	entry->value = value;
+
+	table = in->data_heap[memo].memo_table;
+	pthread_mutex_lock(&table->lock);
+	if(table->num_entries >= table->capacity){
+		evicted = table->oldest;
+		remove_entry(table, evicted);
+	}
+	if(table->num_entries >= table->num_buckets){
+		grow_buckets(table);
+	}
+	entry->next = table->buckets[entry->hash&(table->num_buckets - 1)];
+	table->buckets[entry->hash&(table->num_buckets - 1)] = entry;
+	link_newest(table, entry);
+	table->num_entries++;
+	pthread_mutex_unlock(&table->lock);
+
+	if(evicted){
+		decrement_references(in, evicted->key);
+		decrement_references(in, evicted->value);
+		free(evicted);
+	}
+
+	return 1;
+}
+
+//Hashes every entry again after compact_heap() renumbered the cells, since memo functions and
+//promises hash by index
+void rehash_memo_table(interp *in, memo_table *table){
+	memo_entry *entry;
+	unsigned long bucket;
+
+	pthread_mutex_lock(&table->lock);
+	memset(table->buckets, 0, sizeof(memo_entry *)*table->num_buckets);
+	for(entry = table->newest; entry; entry = entry->older){
+		entry->hash = hash_arguments(in, in->data_heap[entry->key].entries, in->data_heap[entry->key].num_entries);
+		bucket = entry->hash&(table->num_buckets - 1);
+		entry->next = table->buckets[bucket];
+		table->buckets[bucket] = entry;
+	}
+	pthread_mutex_unlock(&table->lock);
+}
+
+//Frees the table and releases everything it caches
+void release_memo_table(interp *in, memo_table *table){
+	memo_entry *entry;
+
+	for(entry = table->newest; entry; entry = entry->older){
+		decrement_references(in, entry->key);
+		decrement_references(in, entry->value);
+	}
+	discard_memo_table(table);
+}
+
+//Frees the table without touching the heap, for when the collector already reclaimed its contents
+void discard_memo_table(memo_table *table){
+	memo_entry *entry;
+	memo_entry *older;
+
+	for(entry = table->newest; entry; entry = older){
+		older = entry->older;
+		free(entry);
+	}
+	pthread_mutex_destroy(&table->lock);
+	free(table->buckets);
+	free(table);
+}
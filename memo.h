@@ -0,0 +1,39 @@
+#ifndef MEMO_INCLUDED
+#define MEMO_INCLUDED
+#include <pthread.h>
+#include "lisp.h"
+
+#define DEFAULT_MEMO_CAPACITY 4096
+
+typedef struct memo_entry memo_entry;
+
+//key is a Q expression of the arguments. The table holds a reference to key and value
+struct memo_entry{
+	unsigned long hash;
+	int key;
+	int value;
+	memo_entry *next;
+	memo_entry *newer;
+	memo_entry *older;
+};
+
+typedef struct memo_table memo_table;
+
+//Results of one memoized function, hashed on the arguments and evicted least recently used first
+struct memo_table{
+	memo_entry **buckets;
+	unsigned int num_buckets;
+	unsigned int num_entries;
+	unsigned int capacity;
+	memo_entry *newest;
+	memo_entry *oldest;
+	pthread_mutex_t lock;
+};
+
+memo_table *create_memo_table(unsigned int capacity);
+int memo_lookup(interp *in, int memo, int *args, int num_args);
+int memo_insert(interp *in, int memo, int *args, int num_args, int value);
+void rehash_memo_table(interp *in, memo_table *table);
+void release_memo_table(interp *in, memo_table *table);
+void discard_memo_table(memo_table *table);
+#endif
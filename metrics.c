@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "allocate.h"
+#include "execute.h"
+#include "metrics.h"
+
+//Where SIGUSR1 dumps go, and the thread that writes them. Signals are process wide, so only one
+//interpreter can be the target
+static interp *signal_interp = NULL;
+static char *signal_path;
+static int signal_fd;
+static pthread_t signal_thread;
+static int signal_stopping = 0;
+
+void add_metrics(metrics *total, metrics *m){
+	int i;
+
+	total->allocations += m->allocations;
+	total->frees += m->frees;
+	total->scopes_created += m->scopes_created;
+	total->dictionary_lookups += m->dictionary_lookups;
+	total->dictionary_probes += m->dictionary_probes;
+	total->intern_hits += m->intern_hits;
+	total->compiled_evals += m->compiled_evals;
+	total->temporaries += m->temporaries;
+	total->reused_cells += m->reused_cells;
+	total->deferred_releases += m->deferred_releases;
+	if(m->max_probe_length > total->max_probe_length){
+		total->max_probe_length = m->max_probe_length;
+	}
+	for(i = 0; i < MAX_BUILTINS; i++){
+		total->builtin_calls[i] += m->builtin_calls[i];
+	}
+	total->collections += m->collections;
+	total->collection_nanoseconds += m->collection_nanoseconds;
+	total->compactions += m->compactions;
+	for(i = 0; i < PAUSE_BUCKETS; i++){
+		total->pause_histogram[i] += m->pause_histogram[i];
+	}
+	total->live_cells += m->live_cells;
+	if(m->peak_live_cells > total->peak_live_cells){
+		total->peak_live_cells = m->peak_live_cells;
+	}
+}
+
+void record_pause(metrics *m, unsigned long nanoseconds){
+	unsigned long microseconds;
+	int bucket = 0;
+
+	m->collections++;
+	m->collection_nanoseconds += nanoseconds;
+	microseconds = nanoseconds/1000;
+	while(bucket < PAUSE_BUCKETS - 1 && microseconds >= 1UL<<bucket){
+		bucket++;
+	}
+	m->pause_histogram[bucket]++;
+}
+
+void get_metrics(interp *in, metrics *m){
+	interp *thread;
+
+	memset(m, 0, sizeof(metrics));
+	pthread_mutex_lock(&in->heap->heap_lock);
+	add_metrics(m, &in->heap->metrics);
+	for(thread = in->heap->threads; thread; thread = thread->next){
+		add_metrics(m, &thread->metrics);
+	}
+	m->live_cells = in->heap->num_allocated;
+	pthread_mutex_unlock(&in->heap->heap_lock);
+}
+
+typedef struct json_buffer json_buffer;
+
+struct json_buffer{
+	char *text;
+	size_t length;
+	size_t size;
+	int failed;
+};
+
+static void append(json_buffer *b, char *format, ...){
+	va_list args;
+	char *next_text;
+	int length;
+
+	if(b->failed){
+		return;
+	}
+	va_start(args, format);
+	length = vsnprintf(b->text + b->length, b->size - b->length, format, args);
+	va_end(args);
+	if(length < 0){
+		b->failed = 1;
+		return;
+	}
+	if(b->length + length >= b->size){
+		b->size = (b->length + length + 1)*2;
+		next_text = realloc(b->text, b->size);
+		if(!next_text){
+			b->failed = 1;
+			return;
+		}
+		b->text = next_text;
+		va_start(args, format);
+		vsnprintf(b->text + b->length, b->size - b->length, format, args);
+		va_end(args);
+	}
+	b->length += length;
+}
+
+//Builtin names are plain identifiers, but quotes and backslashes are escaped to be safe
+static void append_name(json_buffer *b, char *name){
+	append(b, "\"");
+	for(; *name; name++){
+		if(*name == '"' || *name == '\\'){
+			append(b, "\\%c", *name);
+		} else {
+			append(b, "%c", *name);
+		}
+	}
+	append(b, "\"");
+}
+
+static int write_all(int fd, char *text, size_t length){
+	ssize_t written;
+
+	while(length){
+		written = write(fd, text, length);
+		if(written < 0){
+			return 0;
+		}
+		text += written;
+		length -= written;
+	}
+
+	return 1;
+}
+
+//Only reads the heap and its threads' counters, so any thread can call it. Returns 0 with error set
+//if it fails
+static int write_metrics(interp *in, char *path, int fd, char **error){
+	json_buffer b = {0};
+	metrics m;
+	int first;
+	int i;
+	int success;
+
+	get_metrics(in, &m);
+	append(&b, "{\"allocations\": %lu, \"frees\": %lu, \"live_cells\": %lu, \"peak_live_cells\": %lu, ", m.allocations, m.frees, m.live_cells, m.peak_live_cells);
+	append(&b, "\"collections\": %lu, \"collection_nanoseconds\": %lu, \"compactions\": %lu, \"pause_histogram_us\": {", m.collections, m.collection_nanoseconds, m.compactions);
+	for(i = 0; i < PAUSE_BUCKETS; i++){
+		if(i < PAUSE_BUCKETS - 1){
+			append(&b, "\"<%lu\": %lu, ", 1UL<<i, m.pause_histogram[i]);
+		} else {
+			append(&b, "\">=%lu\": %lu}, ", 1UL<<(i - 1), m.pause_histogram[i]);
+		}
+	}
+	append(&b, "\"scopes_created\": %lu, \"dictionary_lookups\": %lu, \"dictionary_probes\": %lu, \"max_probe_length\": %lu, \"intern_hits\": %lu, \"compiled_evals\": %lu, \"temporaries\": %lu, \"reused_cells\": %lu, \"deferred_releases\": %lu, \"builtin_calls\": {", m.scopes_created, m.dictionary_lookups, m.dictionary_probes, m.max_probe_length, m.intern_hits, m.compiled_evals, m.temporaries, m.reused_cells, m.deferred_releases);
+	first = 1;
+	for(i = 0; i < MAX_BUILTINS && builtin_name(i); i++){
+		if(!m.builtin_calls[i]){
+			continue;
+		}
+		if(!first){
+			append(&b, ", ");
+		}
+		append_name(&b, builtin_name(i));
+		append(&b, ": %lu", m.builtin_calls[i]);
+		first = 0;
+	}
+	append(&b, "}}\n");
+	if(b.failed){
+		free(b.text);
+		*error = "malloc returned NULL";
+		return 0;
+	}
+
+	if(path){
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0){
+			free(b.text);
+			*error = "failed to open metrics file";
+			return 0;
+		}
+	}
+	success = write_all(fd, b.text, b.length);
+	if(path){
+		close(fd);
+	}
+	free(b.text);
+	if(!success){
+		*error = "failed to write metrics";
+	}
+
+	return success;
+}
+
+//Writes the metrics as one JSON object to path if it is given, otherwise to fd
+int dump_metrics(interp *in, char *path, int fd){
+	char *error;
+
+	if(!write_metrics(in, path, fd, &error)){
+		set_error(in, error);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void *wait_for_metrics_signal(void *argument){
+	sigset_t signals;
+	char *error;
+	int signal;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	while(1){
+		if(sigwait(&signals, &signal)){
+			continue;
+		}
+		if(__atomic_load_n(&signal_stopping, __ATOMIC_ACQUIRE)){
+			break;
+		}
+		write_metrics(signal_interp, signal_path, signal_fd, &error);
+	}
+
+	return NULL;
+}
+
+//SIGUSR1 is blocked in the calling thread, and so in the threads it starts later, and a thread of its
+//own waits for it, so a dump happens even while the interpreter is blocked, e.g. on REPL input.
+//Call it before starting any other threads
+int dump_metrics_on_signal(interp *in, char *path, int fd){
+	sigset_t signals;
+
+	if(signal_interp){
+		set_error(in, "metrics are already dumped on SIGUSR1");
+		return 0;
+	}
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	if(pthread_sigmask(SIG_BLOCK, &signals, NULL)){
+		set_error(in, "failed to block SIGUSR1");
+		return 0;
+	}
+	signal_interp = in;
+	signal_path = path;
+	signal_fd = fd;
+	if(pthread_create(&signal_thread, NULL, wait_for_metrics_signal, NULL)){
+		signal_interp = NULL;
+		set_error(in, "failed to start metrics thread");
+		return 0;
+	}
+
+	return 1;
+}
+
+//Stops the dumps dump_metrics_on_signal() started for this interpreter's heap. destroy_interp() calls it
+void stop_metrics_on_signal(interp *in){
+	if(!signal_interp || signal_interp->heap != in->heap){
+		return;
+	}
+	__atomic_store_n(&signal_stopping, 1, __ATOMIC_RELEASE);
+	pthread_kill(signal_thread, SIGUSR1);
+	pthread_join(signal_thread, NULL);
+	signal_stopping = 0;
+	signal_interp = NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef METRICS_INCLUDED
+#define METRICS_INCLUDED
+
+//Builtins that can have call counters. execute.c fails to compile if the builtin table outgrows it
+#define MAX_BUILTINS 64
+
+//Bucket i counts collections that paused for less than 2^i microseconds; the last bucket is unbounded
+#define PAUSE_BUCKETS 20
+
+typedef struct metrics metrics;
+
+//Each thread counts its own events and the heap counts collections, so nothing needs to be atomic.
+//get_metrics() sums them
+struct metrics{
+	unsigned long allocations;
+	unsigned long frees;
+	unsigned long scopes_created;
+	unsigned long dictionary_lookups;
+	unsigned long dictionary_probes;
+	unsigned long max_probe_length;
+	unsigned long intern_hits;
+	unsigned long compiled_evals;
+	unsigned long temporaries;
+	unsigned long reused_cells;
+	unsigned long deferred_releases;
+	unsigned long builtin_calls[MAX_BUILTINS];
+	unsigned long collections;
+	unsigned long collection_nanoseconds;
+	unsigned long compactions;
+	unsigned long pause_histogram[PAUSE_BUCKETS];
+	unsigned long live_cells;
+	unsigned long peak_live_cells;
+};
+
+void add_metrics(metrics *total, metrics *m);
+void record_pause(metrics *m, unsigned long nanoseconds);
+#endif
@@ -0,0 +1,484 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "allocate.h"
+#include "execute.h"
+#include "parallel.h"
+
+//pmap and psort split a list between worker threads attached to the caller's heap. Each worker
+//starts with an equal share of the items and works through it a chunk at a time; one that runs out
+//steals half of what another has left, so a few slow items don't leave the rest of the workers idle.
+//Results go straight into a list allocated at its final size before the workers start, each worker
+//filling its own slots from its own local cells
+
+//Items a pmap worker maps between checks of the ranges
+#define PMAP_GRAIN 64
+//psort sorts blocks of this many integers on their own, then merges them pairwise
+#define SORT_BLOCK 4096
+//Integers a psort worker allocates between checks of the ranges
+#define BUILD_GRAIN 1024
+
+typedef struct worker_start worker_start;
+
+struct worker_start{
+	parallel_job *job;
+	unsigned int index;
+	pthread_t thread;
+	int started;
+};
+
+//Only the first error is kept
+static void fail_job(parallel_job *job, char *error_message){
+	char *expected = NULL;
+
+	__atomic_compare_exchange_n(&job->error_message, &expected, error_message, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	__atomic_store_n(&job->failed, 1, __ATOMIC_RELEASE);
+}
+
+static int take_chunk(parallel_job *job, work_range *range, unsigned int *begin, unsigned int *end){
+	int found = 0;
+
+	pthread_mutex_lock(&range->lock);
+	if(range->next < range->end){
+		*begin = range->next;
+		if(range->end - range->next > job->grain){
+			*end = range->next + job->grain;
+		} else {
+			*end = range->end;
+		}
+		range->next = *end;
+		found = 1;
+	}
+	pthread_mutex_unlock(&range->lock);
+
+	return found;
+}
+
+//Moves the back half of another worker's range, or all of it if it is down to one chunk, to this
+//worker's range. Returns 0 once every range is empty
+static int steal_range(parallel_job *job, unsigned int index){
+	work_range *victim;
+	unsigned int remaining;
+	unsigned int begin = 0;
+	unsigned int end = 0;
+	unsigned int i;
+
+	for(i = 1; i < job->num_workers; i++){
+		victim = job->ranges + (index + i)%job->num_workers;
+		pthread_mutex_lock(&victim->lock);
+		remaining = victim->end - victim->next;
+		if(remaining){
+			end = victim->end;
+			if(remaining > job->grain){
+				begin = end - remaining/2;
+			} else {
+				begin = victim->next;
+			}
+			victim->end = begin;
+		}
+		pthread_mutex_unlock(&victim->lock);
+		if(remaining){
+			pthread_mutex_lock(&job->ranges[index].lock);
+			job->ranges[index].next = begin;
+			job->ranges[index].end = end;
+			pthread_mutex_unlock(&job->ranges[index].lock);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void run_worker(interp *in, parallel_job *job, unsigned int index){
+	unsigned int begin;
+	unsigned int end;
+
+	while(!__atomic_load_n(&job->failed, __ATOMIC_ACQUIRE)){
+		if(!take_chunk(job, job->ranges + index, &begin, &end)){
+			if(!steal_range(job, index)){
+				break;
+			}
+			continue;
+		}
+		if(!job->run(in, job, begin, end)){
+			fail_job(job, in->error_message);
+			break;
+		}
+	}
+}
+
+//A worker that can't attach leaves its range for the others to steal
+static void *start_worker(void *arg){
+	worker_start *start;
+	interp *in;
+
+	start = arg;
+	in = attach_interp(start->job->parent);
+	if(!in){
+		return NULL;
+	}
+	in->current_scope = start->job->scope;
+	run_worker(in, start->job, start->index);
+	//The scopes are the parent's to free
+	in->current_scope = in->heap->global_scope;
+	detach_interp(in);
+
+	return NULL;
+}
+
+//Runs the job on up to the heap's number of parallel workers, the calling thread being one of them.
+//The values the job works on must be reachable from the caller and marked shared
+int parallel_for(interp *in, parallel_job *job){
+	worker_start *starts;
+	unsigned int num_workers;
+	unsigned int max_workers;
+	unsigned int i;
+
+	if(!job->num_items){
+		return 1;
+	}
+	num_workers = in->heap->parallel_workers;
+	if(!num_workers){
+		num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	max_workers = (job->num_items + job->grain - 1)/job->grain;
+	if(num_workers > max_workers){
+		num_workers = max_workers;
+	}
+	if(!num_workers){
+		num_workers = 1;
+	}
+	job->parent = in;
+	job->scope = in->current_scope;
+	job->num_workers = num_workers;
+	job->failed = 0;
+	job->error_message = NULL;
+	job->ranges = malloc(sizeof(work_range)*num_workers);
+	starts = malloc(sizeof(worker_start)*num_workers);
+	if(!job->ranges || !starts){
+		free(job->ranges);
+		free(starts);
+		set_error(in, "malloc returned NULL");
+		return 0;
+	}
+	for(i = 0; i < num_workers; i++){
+		pthread_mutex_init(&job->ranges[i].lock, NULL);
+		job->ranges[i].next = (unsigned long) job->num_items*i/num_workers;
+		job->ranges[i].end = (unsigned long) job->num_items*(i + 1)/num_workers;
+		starts[i].job = job;
+		starts[i].index = i;
+		starts[i].started = 0;
+	}
+	for(i = 1; i < num_workers; i++){
+		starts[i].started = !pthread_create(&starts[i].thread, NULL, start_worker, starts + i);
+	}
+	run_worker(in, job, 0);
+	//The other workers may need to collect while this thread waits for them
+	enter_safe_region(in);
+	for(i = 1; i < num_workers; i++){
+		if(starts[i].started){
+			pthread_join(starts[i].thread, NULL);
+		}
+	}
+	leave_safe_region(in);
+	for(i = 0; i < num_workers; i++){
+		pthread_mutex_destroy(&job->ranges[i].lock);
+	}
+	free(job->ranges);
+	free(starts);
+	job->ranges = NULL;
+	if(job->failed){
+		set_error(in, job->error_message);
+		return 0;
+	}
+
+	return 1;
+}
+
+//Allocates a list of num_entries nones, for workers to replace in any order. Every entry is
+//counted, so the list can be freed however far the workers got
+static int allocate_slots(interp *in, unsigned int num_entries){
+	int output_index;
+	unsigned int i;
+
+	output_index = allocate_list(in, num_entries);
+	if(output_index == -1){
+		return -1;
+	}
+	for(i = 0; i < num_entries; i++){
+		in->data_heap[output_index].entries[i] = in->global_none;
+		increment_references(in, in->global_none);
+	}
+	in->data_heap[output_index].num_entries = num_entries;
+
+	return output_index;
+}
+
+static void fill_slot(interp *in, int list, unsigned int i, int value){
+	in->data_heap[list].entries[i] = value;
+	decrement_references(in, in->global_none);
+}
+
+typedef struct map_context map_context;
+
+struct map_context{
+	int function;
+	int list;
+	int output;
+};
+
+static int map_items(interp *in, parallel_job *job, unsigned int begin, unsigned int end){
+	map_context *context;
+	repeated_call call;
+	int value;
+	unsigned int i;
+
+	context = job->context;
+	if(!start_repeated_call(in, &call, context->function, 1)){
+		end_repeated_call(in, &call);
+		return 0;
+	}
+	for(i = begin; i < end; i++){
+		value = repeat_call(in, &call, in->data_heap[context->list].entries + i);
+		if(value == -1){
+			end_repeated_call(in, &call);
+			return 0;
+		}
+		fill_slot(in, context->output, i, value);
+	}
+	end_repeated_call(in, &call);
+
+	return 1;
+}
+
+typedef struct share_context share_context;
+
+struct share_context{
+	interp *in;
+	int failed;
+};
+
+static void share_variable(void *v, void *context){
+	share_context *c;
+	variable *var;
+
+	c = context;
+	var = v;
+	if(!c->failed && !mark_shared(c->in, var->data_index)){
+		c->failed = 1;
+	}
+}
+
+//Workers read the caller's local variables through its scope chain, so their values are counted
+//by several threads from now on, like those of globals
+static int share_local_variables(interp *in){
+	share_context c;
+	scope *search_scope;
+
+	c.in = in;
+	c.failed = 0;
+	for(search_scope = in->current_scope; search_scope != in->heap->global_scope; search_scope = search_scope->previous){
+		iterate_dictionary(search_scope->variables, share_variable, &c);
+	}
+
+	return !c.failed;
+}
+
+//(pmap f list) is (map f list) with the calls spread over the parallel workers. f sees the caller's
+//variables wherever it runs, so it should only read them
+int pmap(interp *in, int *args, int num_args, int *tail_call){
+	map_context context;
+	parallel_job job;
+
+	if(num_args != 2 || in->data_heap[args[1]].type != Q_EXPR){
+		set_error(in, "pmap expects a function and a Q expression");
+		return -1;
+	}
+	context.function = args[0];
+	context.list = args[1];
+	context.output = allocate_slots(in, in->data_heap[context.list].num_entries);
+	if(context.output == -1 || !push_shadow_stack(in, context.output)){
+		return -1;
+	}
+	//Every worker counts references to the function and the entries
+	if(!mark_shared(in, context.function) || !mark_shared(in, context.list) || !share_local_variables(in)){
+		return -1;
+	}
+	job.run = map_items;
+	job.context = &context;
+	job.num_items = in->data_heap[context.list].num_entries;
+	job.grain = PMAP_GRAIN;
+	if(!parallel_for(in, &job)){
+		return -1;
+	}
+	pop_shadow_stack(in);
+
+	return context.output;
+}
+
+typedef struct sort_context sort_context;
+
+struct sort_context{
+	int *values;
+	int *scratch;
+	unsigned int num_values;
+	//Length of the sorted runs being merged
+	unsigned int width;
+	int output;
+};
+
+static int compare_ints(const void *a, const void *b){
+	int x = *(const int *) a;
+	int y = *(const int *) b;
+
+	return (x > y) - (x < y);
+}
+
+static int sort_blocks(interp *in, parallel_job *job, unsigned int begin, unsigned int end){
+	sort_context *context;
+	unsigned int start;
+	unsigned int length;
+	unsigned int i;
+
+	context = job->context;
+	for(i = begin; i < end; i++){
+		start = i*SORT_BLOCK;
+		length = context->num_values - start < SORT_BLOCK ? context->num_values - start : SORT_BLOCK;
+		qsort(context->values + start, length, sizeof(int), compare_ints);
+	}
+
+	return 1;
+}
+
+//Merges pairs of neighbouring runs from values into scratch
+static int merge_runs(interp *in, parallel_job *job, unsigned int begin, unsigned int end){
+	sort_context *context;
+	unsigned long low;
+	unsigned long middle;
+	unsigned long high;
+	unsigned long left;
+	unsigned long right;
+	unsigned long out;
+	unsigned int i;
+
+	context = job->context;
+	for(i = begin; i < end; i++){
+		low = (unsigned long) i*2*context->width;
+		middle = low + context->width < context->num_values ? low + context->width : context->num_values;
+		high = middle + context->width < context->num_values ? middle + context->width : context->num_values;
+		left = low;
+		right = middle;
+		out = low;
+		while(left < middle && right < high){
+			if(context->values[right] < context->values[left]){
+				context->scratch[out++] = context->values[right++];
+			} else {
+				context->scratch[out++] = context->values[left++];
+			}
+		}
+		while(left < middle){
+			context->scratch[out++] = context->values[left++];
+		}
+		while(right < high){
+			context->scratch[out++] = context->values[right++];
+		}
+	}
+
+	return 1;
+}
+
+static int build_ints(interp *in, parallel_job *job, unsigned int begin, unsigned int end){
+	sort_context *context;
+	int value;
+	unsigned int i;
+
+	context = job->context;
+	for(i = begin; i < end; i++){
+		value = allocate_int(in, context->values[i]);
+		if(value == -1){
+			return 0;
+		}
+		fill_slot(in, context->output, i, value);
+	}
+
+	return 1;
+}
+
+//(psort list) sorts a list of integers with a parallel merge sort
+int psort(interp *in, int *args, int num_args, int *tail_call){
+	sort_context context;
+	parallel_job job;
+	int *swap;
+	unsigned int num_runs;
+	unsigned int i;
+
+	if(num_args != 1 || in->data_heap[args[0]].type != Q_EXPR){
+		set_error(in, "psort expects a Q expression of integers");
+		return -1;
+	}
+	context.num_values = in->data_heap[args[0]].num_entries;
+	for(i = 0; i < context.num_values; i++){
+		if(in->data_heap[in->data_heap[args[0]].entries[i]].type != INT_DATA){
+			set_error(in, "psort expects a Q expression of integers");
+			return -1;
+		}
+	}
+	if(!context.num_values){
+		return allocate_list(in, 0);
+	}
+	context.values = malloc(sizeof(int)*context.num_values);
+	context.scratch = malloc(sizeof(int)*context.num_values);
+	if(!context.values || !context.scratch){
+		free(context.values);
+		free(context.scratch);
+		set_error(in, "malloc returned NULL");
+		return -1;
+	}
+	for(i = 0; i < context.num_values; i++){
+		context.values[i] = in->data_heap[in->data_heap[args[0]].entries[i]].int_value;
+	}
+
+	job.context = &context;
+	job.grain = 1;
+	job.run = sort_blocks;
+	job.num_items = (context.num_values + SORT_BLOCK - 1)/SORT_BLOCK;
+	if(!parallel_for(in, &job)){
+		goto error;
+	}
+	job.run = merge_runs;
+	for(context.width = SORT_BLOCK; context.width < context.num_values; context.width *= 2){
+		num_runs = (context.num_values + context.width - 1)/context.width;
+		job.num_items = (num_runs + 1)/2;
+		if(!parallel_for(in, &job)){
+			goto error;
+		}
+		swap = context.values;
+		context.values = context.scratch;
+		context.scratch = swap;
+	}
+
+	context.output = allocate_slots(in, context.num_values);
+	if(context.output == -1 || !push_shadow_stack(in, context.output)){
+		goto error;
+	}
+	job.run = build_ints;
+	job.grain = BUILD_GRAIN;
+	job.num_items = context.num_values;
+	if(!parallel_for(in, &job)){
+		goto error;
+	}
+	pop_shadow_stack(in);
+	free(context.values);
+	free(context.scratch);
+
+	return context.output;
+
+	error:
+	free(context.values);
+	free(context.scratch);
+	return -1;
+}
+
+void set_parallel_workers(interp *in, int num_workers){
+	in->heap->parallel_workers = num_workers;
+}
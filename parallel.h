@@ -0,0 +1,38 @@
+#ifndef PARALLEL_INCLUDED
+#define PARALLEL_INCLUDED
+#include <pthread.h>
+#include "allocate.h"
+
+typedef struct work_range work_range;
+
+//The items a worker hasn't started. Its owner takes chunks from the front and thieves take half
+//of what is left from the back
+struct work_range{
+	pthread_mutex_t lock;
+	unsigned int next;
+	unsigned int end;
+};
+
+typedef struct parallel_job parallel_job;
+
+//Items 0 to num_items - 1 split between workers, each evaluating on an interp of its own attached
+//to the parent's heap. Workers look variables up through the parent's scope chain, which nobody sets
+//anything in until the job is done. run returns 0 with an error set when an item fails, which stops
+//the job
+struct parallel_job{
+	interp *parent;
+	scope *scope;
+	int (*run)(interp *in, parallel_job *job, unsigned int begin, unsigned int end);
+	void *context;
+	unsigned int num_items;
+	unsigned int grain;
+	unsigned int num_workers;
+	work_range *ranges;
+	int failed;
+	char *error_message;
+};
+
+int parallel_for(interp *in, parallel_job *job);
+int pmap(interp *in, int *args, int num_args, int *tail_call);
+int psort(interp *in, int *args, int num_args, int *tail_call);
+#endif
@@ -0,0 +1,260 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "allocate.h"
+#include "execute.h"
+#include "printer.h"
+
+//Printing builds text in a buffer and hands it to write() in large pieces, walking nested
+//expressions with a stack of its own so that depth is only limited by memory
+
+#define FLUSH_SIZE 65536
+
+void init_output_buffer(output_buffer *b, int fd){
+	b->text = NULL;
+	b->length = 0;
+	b->size = 0;
+	b->fd = fd;
+	b->failed = 0;
+	b->stack = NULL;
+	b->stack_size = 0;
+}
+
+static int reserve_output(output_buffer *b, size_t length){
+	char *next_text;
+	size_t next_size;
+
+	if(b->length + length <= b->size){
+		return 1;
+	}
+	next_size = b->size ? b->size : 4096;
+	while(next_size < b->length + length){
+		next_size *= 2;
+	}
+	next_text = realloc(b->text, next_size);
+	if(!next_text){
+		b->failed = 1;
+		return 0;
+	}
+	b->text = next_text;
+	b->size = next_size;
+
+	return 1;
+}
+
+void append_output(output_buffer *b, char *text, size_t length){
+	if(b->failed || !reserve_output(b, length)){
+		return;
+	}
+	memcpy(b->text + b->length, text, length);
+	b->length += length;
+	if(b->fd >= 0 && b->length >= FLUSH_SIZE){
+		flush_output_buffer(b);
+	}
+}
+
+static void append_int(output_buffer *b, int value){
+	char digits[12];
+	unsigned int magnitude;
+	int start = sizeof(digits);
+
+	magnitude = value < 0 ? -(unsigned int) value : (unsigned int) value;
+	do {
+		digits[--start] = '0' + magnitude%10;
+		magnitude /= 10;
+	} while(magnitude);
+	if(value < 0){
+		digits[--start] = '-';
+	}
+	append_output(b, digits + start, sizeof(digits) - start);
+}
+
+static int num_children(data *d){
+	if(d->type == FUNCTION){
+		return 2;
+	}
+
+	return d->num_entries;
+}
+
+static int get_child(data *d, int i){
+	if(d->type == FUNCTION){
+		return i ? d->source : d->var_list;
+	}
+
+	return d->entries[i];
+}
+
+static void append_close(output_buffer *b, data *d){
+	if(d->type == Q_EXPR){
+		append_output(b, "}", 1);
+	} else {
+		append_output(b, ")", 1);
+	}
+}
+
+static int push_print_frame(output_buffer *b, unsigned int depth, int value){
+	print_frame *next_stack;
+	unsigned int next_size;
+
+	if(depth == b->stack_size){
+		next_size = b->stack_size ? b->stack_size*2 : 64;
+		next_stack = realloc(b->stack, sizeof(print_frame)*next_size);
+		if(!next_stack){
+			b->failed = 1;
+			return 0;
+		}
+		b->stack = next_stack;
+		b->stack_size = next_size;
+	}
+	b->stack[depth].value = value;
+	b->stack[depth].next = 0;
+
+	return 1;
+}
+
+//Returns 0 if the buffer ran out of memory or couldn't be written
+int append_value(interp *in, output_buffer *b, int value){
+	unsigned int depth = 0;
+	print_frame *top;
+	data *d;
+
+	while(1){
+		d = in->data_heap + value;
+		switch(d->type){
+			case INT_DATA:
+				append_int(b, d->int_value);
+				break;
+			case IDENTIFIER:
+				append_output(b, d->identifier_name, strlen(d->identifier_name));
+				break;
+			case S_EXPR:
+			case Q_EXPR:
+			case FUNCTION:
+				if(d->type == S_EXPR){
+					append_output(b, "(", 1);
+				} else if(d->type == Q_EXPR){
+					append_output(b, "{", 1);
+				} else {
+					append_output(b, "[function](", 11);
+				}
+				if(!push_print_frame(b, depth, value)){
+					return 0;
+				}
+				depth++;
+				break;
+			case NONE_DATA:
+				append_output(b, "none", 4);
+				break;
+			case BUILTIN_FUNCTION:
+				append_output(b, "[builtin_function]", 18);
+				break;
+			case MEMO_FUNCTION:
+				append_output(b, "[memo]", 6);
+				break;
+			case PROMISE:
+				append_output(b, "[promise]", 9);
+				break;
+		}
+		if(b->failed){
+			return 0;
+		}
+
+		//Close every expression that has run out of entries, then go on to the next entry
+		while(depth){
+			top = b->stack + depth - 1;
+			d = in->data_heap + top->value;
+			if(top->next < num_children(d)){
+				if(top->next){
+					append_output(b, " ", 1);
+				}
+				value = get_child(d, top->next);
+				top->next++;
+				break;
+			}
+			append_close(b, d);
+			depth--;
+		}
+		if(!depth){
+			return !b->failed;
+		}
+	}
+}
+
+int flush_output_buffer(output_buffer *b){
+	size_t written = 0;
+	ssize_t result;
+
+	if(b->fd < 0){
+		return !b->failed;
+	}
+	while(written < b->length){
+		result = write(b->fd, b->text + written, b->length - written);
+		if(result < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			b->failed = 1;
+			break;
+		}
+		written += result;
+	}
+	b->length = 0;
+
+	return !b->failed;
+}
+
+void free_output_buffer(output_buffer *b){
+	free(b->text);
+	free(b->stack);
+}
+
+//Anything printed with printf() before stays ahead of the value
+int write_value(interp *in, int value, int fd){
+	output_buffer b;
+	int success;
+
+	if(fd == STDOUT_FILENO){
+		fflush(stdout);
+	}
+	init_output_buffer(&b, fd);
+	append_value(in, &b, value);
+	success = flush_output_buffer(&b);
+	free_output_buffer(&b);
+
+	return success;
+}
+
+//There is no string type, so the text is returned as an identifier
+int to_string(interp *in, int *args, int num_args, int *tail_call){
+	output_buffer b;
+	int output_index;
+	int i;
+
+	init_output_buffer(&b, -1);
+	for(i = 0; i < num_args; i++){
+		if(i){
+			append_output(&b, " ", 1);
+		}
+		append_value(in, &b, args[i]);
+	}
+	append_output(&b, "", 1);
+	free(b.stack);
+	if(b.failed){
+		free(b.text);
+		set_error(in, "malloc returned NULL");
+		return -1;
+	}
+
+	output_index = allocate(in);
+	if(output_index == -1){
+		free(b.text);
+		return -1;
+	}
+	in->data_heap[output_index].type = IDENTIFIER;
+	in->data_heap[output_index].identifier_name = b.text;
+
+	return output_index;
+}
@@ -0,0 +1,32 @@
+#ifndef PRINTER_INCLUDED
+#define PRINTER_INCLUDED
+#include "allocate.h"
+
+typedef struct print_frame print_frame;
+
+//An expression being printed and the index of its next entry
+struct print_frame{
+	int value;
+	int next;
+};
+
+typedef struct output_buffer output_buffer;
+
+//Text goes to fd whenever the buffer fills, or stays in memory when fd is -1
+struct output_buffer{
+	char *text;
+	size_t length;
+	size_t size;
+	int fd;
+	int failed;
+	print_frame *stack;
+	unsigned int stack_size;
+};
+
+void init_output_buffer(output_buffer *b, int fd);
+void append_output(output_buffer *b, char *text, size_t length);
+int append_value(interp *in, output_buffer *b, int value);
+int flush_output_buffer(output_buffer *b);
+void free_output_buffer(output_buffer *b);
+int to_string(interp *in, int *args, int num_args, int *tail_call);
+#endif
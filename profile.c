@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "allocate.h"
+#include "execute.h"
+#include "profile.h"
+
+//SIGPROF is process wide, so the timer and these flags are too
+int profiling = 0;
+int profile_ticks = 0;
+
+static void handle_profile_signal(int signal){
+	__atomic_add_fetch(&profile_ticks, 1, __ATOMIC_RELAXED);
+}
+
+//Samples every 1/frequency seconds of CPU time. Ticks are attributed at the next safepoint to
+//whichever thread reaches it first
+int start_profiler(interp *in, int frequency){
+	struct sigaction action;
+	struct itimerval timer;
+
+	if(frequency <= 0 || frequency > 1000000){
+		set_error(in, "profiler frequency must be between 1 and 1000000");
+		return 0;
+	}
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_profile_signal;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	if(sigaction(SIGPROF, &action, NULL)){
+		set_error(in, "failed to install SIGPROF handler");
+		return 0;
+	}
+	profiling = 1;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 1000000/frequency;
+	timer.it_value = timer.it_interval;
+	if(setitimer(ITIMER_PROF, &timer, NULL)){
+		profiling = 0;
+		set_error(in, "failed to start profiling timer");
+		return 0;
+	}
+
+	return 1;
+}
+
+void stop_profiler(interp *in){
+	struct itimerval timer;
+
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, NULL);
+	profiling = 0;
+	__atomic_store_n(&profile_ticks, 0, __ATOMIC_RELAXED);
+}
+
+static void append_frame(char *stack, size_t *length, char *name){
+	size_t name_length;
+
+	name_length = strlen(name);
+	if(*length){
+		stack[(*length)++] = ';';
+	}
+	memcpy(stack + *length, name, name_length);
+	*length += name_length;
+	stack[*length] = '\0';
+}
+
+//Folds the current call chain into "outer;inner;builtin" and adds the pending ticks to its count
+void record_profile_samples(interp *in){
+	char stack[(MAX_CALL_DEPTH + 2)*(MAX_FRAME_NAME + 1)];
+	size_t length = 0;
+	profile_sample *sample;
+	unsigned int first;
+	unsigned int i;
+	char *name;
+	int ticks;
+
+	ticks = __atomic_exchange_n(&profile_ticks, 0, __ATOMIC_RELAXED);
+	if(!ticks){
+		return;
+	}
+	stack[0] = '\0';
+	first = 0;
+	if(in->num_frames > MAX_CALL_DEPTH){
+		first = in->num_frames - MAX_CALL_DEPTH;
+		append_frame(stack, &length, "<truncated>");
+	}
+	for(i = first; i < in->num_frames; i++){
+		if(in->call_frames[i].name[0]){
+			append_frame(stack, &length, in->call_frames[i].name);
+		}
+	}
+	if(in->num_frames && in->call_frames[in->num_frames - 1].builtin_id != -1){
+		name = builtin_name(in->call_frames[in->num_frames - 1].builtin_id);
+		if(name && strlen(name) < MAX_FRAME_NAME){
+			append_frame(stack, &length, name);
+		}
+	}
+	if(!length){
+		append_frame(stack, &length, "<toplevel>");
+	}
+
+	pthread_mutex_lock(&in->heap->heap_lock);
+	sample = read_dictionary(in->heap->profile, stack, 0);
+	if(!sample){
+		sample = malloc(sizeof(profile_sample));
+		if(sample){
+			sample->stack = strdup(stack);
+			sample->count = 0;
+			if(sample->stack){
+				write_dictionary(&in->heap->profile, stack, sample, 0);
+			} else {
+				free(sample);
+				sample = NULL;
+			}
+		}
+	}
+	if(sample){
+		sample->count += ticks;
+	}
+	pthread_mutex_unlock(&in->heap->heap_lock);
+}
+
+void free_profile_sample(void *s, void *context){
+	profile_sample *sample;
+
+	sample = s;
+	free(sample->stack);
+	free(sample);
+}
+
+static void write_sample(void *s, void *context){
+	profile_sample *sample;
+
+	sample = s;
+	fprintf(context, "%s %lu\n", sample->stack, sample->count);
+}
+
+//Writes one "stack count" line per distinct call chain, the folded format flame graph tools read
+int write_profile(interp *in, char *path){
+	FILE *fp;
+	int success;
+
+	fp = fopen(path, "w");
+	if(!fp){
+		set_error(in, "failed to open profile file");
+		return 0;
+	}
+	pthread_mutex_lock(&in->heap->heap_lock);
+	iterate_dictionary(in->heap->profile, write_sample, fp);
+	pthread_mutex_unlock(&in->heap->heap_lock);
+	success = !ferror(fp);
+	if(fclose(fp) || !success){
+		set_error(in, "failed to write profile");
+		return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,33 @@
+#ifndef PROFILE_INCLUDED
+#define PROFILE_INCLUDED
+#include "lisp.h"
+
+//Samples keep the innermost MAX_CALL_DEPTH frames of deeper stacks, under a <truncated> root
+#define MAX_CALL_DEPTH 256
+#define MAX_FRAME_NAME 32
+
+typedef struct call_frame call_frame;
+
+//One for each evaluator frame, see interp.call_frames. name is the Lisp function whose body is running, or empty
+//before a function has been entered. builtin_id is the builtin currently running, or -1.
+//expr is the expression being evaluated and site caches its allocation site, or -1
+struct call_frame{
+	char name[MAX_FRAME_NAME];
+	int builtin_id;
+	int expr;
+	int site;
+};
+
+typedef struct profile_sample profile_sample;
+
+struct profile_sample{
+	char *stack;
+	unsigned long count;
+};
+
+extern int profiling;
+extern int profile_ticks;
+
+void record_profile_samples(interp *in);
+void free_profile_sample(void *s, void *context);
+#endif
@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include "allocate.h"
+#include "execute.h"
+#include "region.h"
+
+//In a function body like (if (= n 0) 1 (+ (* n 2) 1)), the values of (= n 0) and (* n 2) are read
+//once, by if and +, and then dropped. analyze_escapes() finds the expressions whose S expression
+//arguments are only read like this, and the evaluator checks at run time that the function really
+//is such a builtin. Builtins that return a fresh integer then take it from a per thread region
+//instead of the heap. Each scope remembers where the region stood when it was made and gives back
+//everything above that when it ends, so a temporary is never counted, and never freed on its own
+
+//Whether the expression calls a builtin that only reads its arguments, like + or if, by name or as
+//compiled by compile.c
+static int reads_arguments(interp *in, int expr){
+	int name;
+	int builtin_id;
+
+	if(!in->data_heap[expr].num_entries){
+		return 0;
+	}
+	name = in->data_heap[expr].entries[0];
+	if(in->data_heap[name].type == BUILTIN_FUNCTION){
+		builtin_id = in->data_heap[name].builtin_id;
+	} else if(in->data_heap[name].type == IDENTIFIER){
+		builtin_id = lookup_builtin(in->data_heap[name].identifier_name);
+	} else {
+		return 0;
+	}
+
+	return builtin_id != -1 && builtin_flags(builtin_id)&BUILTIN_READS_ARGUMENTS;
+}
+
+//Walks a function body once, marking expressions whose arguments don't escape them. Lists already
+//walked are skipped, so code shared between functions is only walked the first time
+void analyze_escapes(interp *in, int source){
+	unsigned int depth = 0;
+	unsigned int size = 64;
+	int *stack;
+	int *next_stack;
+	int expr;
+	data *d;
+	int i;
+
+	if(in->data_heap[source].flags&DATA_ANALYZED){
+		return;
+	}
+	//Without the analysis the body just runs without temporaries
+	stack = malloc(sizeof(int)*size);
+	if(!stack){
+		return;
+	}
+	stack[depth++] = source;
+	while(depth){
+		expr = stack[--depth];
+		d = in->data_heap + expr;
+		if((d->type != S_EXPR && d->type != Q_EXPR) || d->flags&DATA_ANALYZED){
+			continue;
+		}
+		//A body runs as an S expression although it is written as a Q expression
+		if(reads_arguments(in, expr)){
+			set_flag(in, expr, DATA_NO_ESCAPE);
+		}
+		set_flag(in, expr, DATA_ANALYZED);
+		if(depth + d->num_entries > size){
+			while(depth + d->num_entries > size){
+				size *= 2;
+			}
+			next_stack = realloc(stack, sizeof(int)*size);
+			if(!next_stack){
+				break;
+			}
+			stack = next_stack;
+		}
+		for(i = 0; i < d->num_entries; i++){
+			stack[depth++] = d->entries[i];
+		}
+	}
+	free(stack);
+}
+
+//Returns a cell for a temporary, or a normal cell once the region is as large as it may grow
+int allocate_temporary(interp *in){
+	int *next_cells;
+	unsigned int next_size;
+	unsigned int limit;
+	int data_index;
+
+	if(in->num_temporaries < in->region_size){
+		in->metrics.temporaries++;
+		return in->region_cells[in->num_temporaries++];
+	}
+	//A small heap can't spare many cells
+	limit = in->heap->data_heap_size/16;
+	if(limit > REGION_CELLS){
+		limit = REGION_CELLS;
+	}
+	if(in->region_size >= limit){
+		return allocate(in);
+	}
+
+	next_size = in->region_size ? in->region_size*2 : 64;
+	if(next_size > limit){
+		next_size = limit;
+	}
+	next_cells = realloc(in->region_cells, sizeof(int)*next_size);
+	if(!next_cells){
+		return allocate(in);
+	}
+	in->region_cells = next_cells;
+	while(in->region_size < next_size){
+		data_index = allocate(in);
+		if(data_index == -1){
+			break;
+		}
+		in->data_heap[data_index].type = INT_DATA;
+		in->data_heap[data_index].flags = DATA_TEMPORARY;
+		in->region_cells[in->region_size++] = data_index;
+	}
+	if(in->num_temporaries == in->region_size){
+		return -1;
+	}
+	in->metrics.temporaries++;
+
+	return in->region_cells[in->num_temporaries++];
+}
+
+//Region cells stay reserved whether or not they are in use, like a thread's local cells
+void mark_region(heap *h, interp *thread){
+	unsigned int i;
+
+	for(i = 0; i < thread->region_size; i++){
+		mark_allocated_recursive(h, thread->region_cells[i]);
+	}
+}
+
+//Expects heap_lock to be held
+void free_region(interp *in){
+	while(in->region_size){
+		in->region_size--;
+		mark_deallocated(in->heap, in->region_cells[in->region_size]);
+	}
+	free(in->region_cells);
+	in->region_cells = NULL;
+	in->num_temporaries = 0;
+}
@@ -0,0 +1,9 @@
+#ifndef REGION_INCLUDED
+#define REGION_INCLUDED
+#include "allocate.h"
+
+void analyze_escapes(interp *in, int source);
+int allocate_temporary(interp *in);
+void mark_region(heap *h, interp *thread);
+void free_region(interp *in);
+#endif
@@ -0,0 +1,829 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "allocate.h"
+#include "execute.h"
+#include "sequence.h"
+
+//A lazy sequence is a promise that forces to {} at its end, or to {first rest} where rest is again a
+//lazy sequence. The native sequences keep their state in the promise's expression, a call to one of
+//the *-next builtins on arguments that all evaluate to themselves
+
+//Returns a new reference to the promise's value. A promise forced from inside its own expression
+//keeps the first value stored
+int force_promise(interp *in, int promise, int memoize){
+	data *d;
+	int expr;
+	int value;
+	int expected;
+
+	d = in->data_heap + promise;
+	value = __atomic_load_n(&d->promise_value, __ATOMIC_ACQUIRE);
+	if(value != -1){
+		increment_references(in, value);
+		return value;
+	}
+	expr = d->promise_expr;
+	value = evaluate_q_expression(in, expr, 1);
+	if(value == -1 || !memoize){
+		return value;
+	}
+
+	if(!(d->flags&DATA_SHARED)){
+		if(d->promise_value != -1){
+			decrement_references(in, value);
+			value = d->promise_value;
+			increment_references(in, value);
+			return value;
+		}
+		d->promise_value = value;
+		increment_references(in, value);
+		d->promise_expr = -1;
+		decrement_references(in, expr);
+		return value;
+	}
+
+	//Another thread can force it at the same time, and its expression may still be running there
+	if(!mark_shared(in, value)){
+		decrement_references(in, value);
+		return -1;
+	}
+	increment_references(in, value);
+	expected = -1;
+	if(!__atomic_compare_exchange_n(&d->promise_value, &expected, value, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+		decrement_references(in, value);
+		decrement_references(in, value);
+		value = expected;
+		increment_references(in, value);
+	}
+
+	return value;
+}
+
+//Forces the next cell of a sequence. A promise nothing else refers to can't be forced again, so its
+//value isn't stored, which lets a consumer walk a long sequence without keeping the cells behind it.
+//One a stack has borrowed from a variable may be referred to by it
+static int force_sequence(interp *in, int sequence){
+	int value;
+	int memoize;
+
+	if(in->data_heap[sequence].type != PROMISE){
+		set_error(in, "expected a lazy sequence");
+		return -1;
+	}
+	memoize = in->data_heap[sequence].num_references > 1 || (in->data_heap[sequence].flags&(DATA_SHARED | DATA_STACKED));
+	value = force_promise(in, sequence, memoize);
+	if(value == -1){
+		return -1;
+	}
+	if(in->data_heap[value].type != Q_EXPR || (in->data_heap[value].num_entries != 0 && in->data_heap[value].num_entries != 2)){
+		decrement_references(in, value);
+		set_error(in, "expected a lazy sequence");
+		return -1;
+	}
+
+	return value;
+}
+
+static int is_true(interp *in, int value){
+	return in->data_heap[value].type != INT_DATA || in->data_heap[value].int_value;
+}
+
+static int get_builtin_id(char *name, int *id){
+	if(*id == -1){
+		*id = lookup_builtin(name);
+	}
+
+	return *id;
+}
+
+//A promise of (builtin args...). The caller keeps args reachable
+static int step_promise(interp *in, char *name, int *id, int *args, int num_args){
+	int function;
+	int expr;
+	int promise;
+	int i;
+
+	function = allocate_builtin(in, get_builtin_id(name, id));
+	if(function == -1 || !push_shadow_stack(in, function)){
+		return -1;
+	}
+	expr = allocate_list(in, num_args + 1);
+	pop_shadow_stack(in);
+	if(expr == -1){
+		return -1;
+	}
+	in->data_heap[expr].type = S_EXPR;
+	in->data_heap[expr].entries[0] = function;
+	for(i = 0; i < num_args; i++){
+		in->data_heap[expr].entries[i + 1] = args[i];
+		increment_references(in, args[i]);
+	}
+	in->data_heap[expr].num_entries = num_args + 1;
+
+	if(!push_shadow_stack(in, expr)){
+		return -1;
+	}
+	promise = allocate(in);
+	pop_shadow_stack(in);
+	if(promise == -1){
+		return -1;
+	}
+	in->data_heap[promise].type = PROMISE;
+	in->data_heap[promise].promise_expr = expr;
+	in->data_heap[promise].promise_value = -1;
+
+	return promise;
+}
+
+//The caller releases its own references to first and rest
+static int make_pair(interp *in, int first, int rest){
+	int output_index;
+
+	output_index = allocate_list(in, 2);
+	if(output_index == -1){
+		return -1;
+	}
+	in->data_heap[output_index].entries[0] = first;
+	in->data_heap[output_index].entries[1] = rest;
+	in->data_heap[output_index].num_entries = 2;
+	increment_references(in, first);
+	increment_references(in, rest);
+
+	return output_index;
+}
+
+//Pairs first with a promise of (name args...), releasing first
+static int make_step_pair(interp *in, int first, char *name, int *id, int *args, int num_args){
+	int rest;
+	int output_index;
+
+	if(!push_shadow_stack(in, first)){
+		return -1;
+	}
+	rest = step_promise(in, name, id, args, num_args);
+	if(rest == -1 || !push_shadow_stack(in, rest)){
+		return -1;
+	}
+	output_index = make_pair(in, first, rest);
+	decrement_references(in, pop_shadow_stack(in));
+	decrement_references(in, pop_shadow_stack(in));
+
+	return output_index;
+}
+
+int delay(interp *in, int *args, int num_args, int *tail_call){
+	int output_index;
+
+	if(num_args != 1 || in->data_heap[args[0]].type != Q_EXPR){
+		set_error(in, "delay expects a Q expression");
+		return -1;
+	}
+	output_index = allocate(in);
+	if(output_index == -1){
+		return -1;
+	}
+	in->data_heap[output_index].type = PROMISE;
+	in->data_heap[output_index].promise_expr = args[0];
+	in->data_heap[output_index].promise_value = -1;
+	increment_references(in, args[0]);
+
+	return output_index;
+}
+
+//Anything that isn't a promise is already forced
+int force(interp *in, int *args, int num_args, int *tail_call){
+	if(num_args != 1){
+		set_error(in, "force expects exactly one argument");
+		return -1;
+	}
+	if(in->data_heap[args[0]].type != PROMISE){
+		increment_references(in, args[0]);
+		return args[0];
+	}
+
+	return force_promise(in, args[0], 1);
+}
+
+static int range_next_id = -1;
+
+//(range START [END [STEP]]) counts from START up to but not including END, forever without one
+int range(interp *in, int *args, int num_args, int *tail_call){
+	int step_args[3];
+	int output_index;
+	int i;
+
+	if(num_args < 1 || num_args > 3){
+		set_error(in, "range expects 1 to 3 arguments");
+		return -1;
+	}
+	for(i = 0; i < num_args; i++){
+		if(in->data_heap[args[i]].type != INT_DATA){
+			set_error(in, "range expects integers");
+			return -1;
+		}
+	}
+	if(num_args == 3 && !in->data_heap[args[2]].int_value){
+		set_error(in, "range expects a nonzero step");
+		return -1;
+	}
+	step_args[0] = args[0];
+	step_args[1] = num_args >= 2 ? args[1] : in->global_none;
+	if(num_args == 3){
+		return step_promise(in, "range-next", &range_next_id, args, 3);
+	}
+	step_args[2] = allocate_int(in, 1);
+	if(step_args[2] == -1 || !push_shadow_stack(in, step_args[2])){
+		return -1;
+	}
+	output_index = step_promise(in, "range-next", &range_next_id, step_args, 3);
+	decrement_references(in, pop_shadow_stack(in));
+
+	return output_index;
+}
+
+int range_next(interp *in, int *args, int num_args, int *tail_call){
+	int start;
+	int step;
+	int next_args[3];
+	int output_index;
+
+	if(num_args != 3 || in->data_heap[args[0]].type != INT_DATA || in->data_heap[args[2]].type != INT_DATA){
+		set_error(in, "range-next expects a start, an end and a step");
+		return -1;
+	}
+	start = in->data_heap[args[0]].int_value;
+	step = in->data_heap[args[2]].int_value;
+	if(in->data_heap[args[1]].type == INT_DATA && (step > 0 ? start >= in->data_heap[args[1]].int_value : start <= in->data_heap[args[1]].int_value)){
+		return allocate_list(in, 0);
+	}
+	next_args[0] = allocate_int(in, start + step);
+	if(next_args[0] == -1 || !push_shadow_stack(in, next_args[0])){
+		return -1;
+	}
+	next_args[1] = args[1];
+	next_args[2] = args[2];
+	increment_references(in, args[0]);
+	output_index = make_step_pair(in, args[0], "range-next", &range_next_id, next_args, 3);
+	decrement_references(in, pop_shadow_stack(in));
+
+	return output_index;
+}
+
+static int map_next_id = -1;
+
+//Maps Q expressions right away and lazy sequences as they are forced
+int map(interp *in, int *args, int num_args, int *tail_call){
+	repeated_call call;
+	int output_index;
+	int sequence;
+	int value;
+	int i;
+
+	if(num_args != 2){
+		set_error(in, "map expects 2 arguments");
+		return -1;
+	}
+	if(in->data_heap[args[1]].type == PROMISE){
+		return step_promise(in, "map-next", &map_next_id, args, 2);
+	}
+	if(in->data_heap[args[1]].type != Q_EXPR){
+		set_error(in, "map expects a Q expression or a lazy sequence");
+		return -1;
+	}
+	//args can move when the value stack grows
+	sequence = args[1];
+	output_index = allocate_list(in, in->data_heap[sequence].num_entries);
+	if(output_index == -1 || !push_shadow_stack(in, output_index)){
+		return -1;
+	}
+	if(!start_repeated_call(in, &call, args[0], 1)){
+		end_repeated_call(in, &call);
+		return -1;
+	}
+	for(i = 0; i < in->data_heap[sequence].num_entries; i++){
+		value = repeat_call(in, &call, in->data_heap[sequence].entries + i);
+		if(value == -1){
+			end_repeated_call(in, &call);
+			return -1;
+		}
+		in->data_heap[output_index].entries[i] = value;
+		in->data_heap[output_index].num_entries++;
+	}
+	end_repeated_call(in, &call);
+	pop_shadow_stack(in);
+
+	return output_index;
+}
+
+int map_next(interp *in, int *args, int num_args, int *tail_call){
+	int value;
+	int first;
+	int next_args[2];
+	int output_index;
+
+	if(num_args != 2){
+		set_error(in, "map-next expects 2 arguments");
+		return -1;
+	}
+	value = force_sequence(in, args[1]);
+	if(value == -1 || !in->data_heap[value].num_entries){
+		return value;
+	}
+	if(!push_shadow_stack(in, value)){
+		return -1;
+	}
+	first = call_function(in, args[0], in->data_heap[value].entries, 1);
+	if(first == -1){
+		return -1;
+	}
+	next_args[0] = args[0];
+	next_args[1] = in->data_heap[value].entries[1];
+	output_index = make_step_pair(in, first, "map-next", &map_next_id, next_args, 2);
+	decrement_references(in, pop_shadow_stack(in));
+
+	return output_index;
+}
+
+static int filter_next_id = -1;
+
+int filter(interp *in, int *args, int num_args, int *tail_call){
+	repeated_call call;
+	int output_index;
+	int sequence;
+	int keep;
+	int entry;
+	int i;
+
+	if(num_args != 2){
+		set_error(in, "filter expects 2 arguments");
+		return -1;
+	}
+	if(in->data_heap[args[1]].type == PROMISE){
+		return step_promise(in, "filter-next", &filter_next_id, args, 2);
+	}
+	if(in->data_heap[args[1]].type != Q_EXPR){
+		set_error(in, "filter expects a Q expression or a lazy sequence");
+		return -1;
+	}
+	sequence = args[1];
+	output_index = allocate_list(in, in->data_heap[sequence].num_entries);
+	if(output_index == -1 || !push_shadow_stack(in, output_index)){
+		return -1;
+	}
+	if(!start_repeated_call(in, &call, args[0], 1)){
+		end_repeated_call(in, &call);
+		return -1;
+	}
+	for(i = 0; i < in->data_heap[sequence].num_entries; i++){
+		entry = in->data_heap[sequence].entries[i];
+		keep = repeat_call(in, &call, &entry);
+		if(keep == -1){
+			end_repeated_call(in, &call);
+			return -1;
+		}
+		if(is_true(in, keep)){
+			in->data_heap[output_index].entries[in->data_heap[output_index].num_entries] = entry;
+			in->data_heap[output_index].num_entries++;
+			increment_references(in, entry);
+		}
+		decrement_references(in, keep);
+	}
+	end_repeated_call(in, &call);
+	pop_shadow_stack(in);
+
+	return output_index;
+}
+
+//Skips ahead to the next cell that passes, letting go of each rejected cell before forcing the next
+int filter_next(interp *in, int *args, int num_args, int *tail_call){
+	int sequence;
+	int value;
+	int keep;
+	int next_args[2];
+	int output_index;
+	int have_cell = 0;
+
+	if(num_args != 2){
+		set_error(in, "filter-next expects 2 arguments");
+		return -1;
+	}
+	sequence = args[1];
+	while(1){
+		value = force_sequence(in, sequence);
+		if(value == -1){
+			return -1;
+		}
+		if(have_cell){
+			decrement_references(in, pop_shadow_stack(in));
+		}
+		if(!in->data_heap[value].num_entries){
+			return value;
+		}
+		if(!push_shadow_stack(in, value)){
+			return -1;
+		}
+		have_cell = 1;
+		keep = call_function(in, args[0], in->data_heap[value].entries, 1);
+		if(keep == -1){
+			return -1;
+		}
+		if(is_true(in, keep)){
+			decrement_references(in, keep);
+			break;
+		}
+		decrement_references(in, keep);
+		sequence = in->data_heap[value].entries[1];
+	}
+	next_args[0] = args[0];
+	next_args[1] = in->data_heap[value].entries[1];
+	increment_references(in, in->data_heap[value].entries[0]);
+	output_index = make_step_pair(in, in->data_heap[value].entries[0], "filter-next", &filter_next_id, next_args, 2);
+	decrement_references(in, pop_shadow_stack(in));
+
+	return output_index;
+}
+
+static int take_next_id = -1;
+
+int take(interp *in, int *args, int num_args, int *tail_call){
+	int output_index;
+	int count;
+	int i;
+
+	if(num_args != 2 || in->data_heap[args[0]].type != INT_DATA){
+		set_error(in, "take expects a count and a sequence");
+		return -1;
+	}
+	if(in->data_heap[args[1]].type == PROMISE){
+		return step_promise(in, "take-next", &take_next_id, args, 2);
+	}
+	if(in->data_heap[args[1]].type != Q_EXPR){
+		set_error(in, "take expects a Q expression or a lazy sequence");
+		return -1;
+	}
+	count = in->data_heap[args[0]].int_value;
+	if(count > in->data_heap[args[1]].num_entries){
+		count = in->data_heap[args[1]].num_entries;
+	}
+	if(count < 0){
+		count = 0;
+	}
+	output_index = allocate_list(in, count);
+	if(output_index == -1){
+		return -1;
+	}
+	for(i = 0; i < count; i++){
+		in->data_heap[output_index].entries[i] = in->data_heap[args[1]].entries[i];
+		increment_references(in, in->data_heap[output_index].entries[i]);
+	}
+	in->data_heap[output_index].num_entries = count;
+
+	return output_index;
+}
+
+int take_next(interp *in, int *args, int num_args, int *tail_call){
+	int value;
+	int next_args[2];
+	int output_index;
+
+	if(num_args != 2 || in->data_heap[args[0]].type != INT_DATA){
+		set_error(in, "take-next expects a count and a sequence");
+		return -1;
+	}
+	if(in->data_heap[args[0]].int_value <= 0){
+		return allocate_list(in, 0);
+	}
+	value = force_sequence(in, args[1]);
+	if(value == -1 || !in->data_heap[value].num_entries){
+		return value;
+	}
+	if(!push_shadow_stack(in, value)){
+		return -1;
+	}
+	next_args[0] = allocate_int(in, in->data_heap[args[0]].int_value - 1);
+	if(next_args[0] == -1 || !push_shadow_stack(in, next_args[0])){
+		return -1;
+	}
+	next_args[1] = in->data_heap[value].entries[1];
+	increment_references(in, in->data_heap[value].entries[0]);
+	output_index = make_step_pair(in, in->data_heap[value].entries[0], "take-next", &take_next_id, next_args, 2);
+	decrement_references(in, pop_shadow_stack(in));
+	decrement_references(in, pop_shadow_stack(in));
+
+	return output_index;
+}
+
+//Replaces the accumulator on top of the shadow stack, below the current cell if there is one
+static int step_fold(interp *in, repeated_call *call, int *acc, int entry, int have_cell){
+	int call_args[2];
+	int next_acc;
+	int cell = -1;
+
+	call_args[0] = *acc;
+	call_args[1] = entry;
+	next_acc = repeat_call(in, call, call_args);
+	if(next_acc == -1){
+		return 0;
+	}
+	if(have_cell){
+		cell = pop_shadow_stack(in);
+	}
+	decrement_references(in, pop_shadow_stack(in));
+	*acc = next_acc;
+	push_shadow_stack(in, next_acc);
+	if(have_cell){
+		push_shadow_stack(in, cell);
+	}
+
+	return 1;
+}
+
+//(fold f init sequence) calls (f acc entry) on each entry in turn
+int fold(interp *in, int *args, int num_args, int *tail_call){
+	repeated_call call;
+	int acc;
+	int sequence;
+	int value;
+	int have_cell = 0;
+	int i;
+
+	if(num_args != 3){
+		set_error(in, "fold expects 3 arguments");
+		return -1;
+	}
+	if(in->data_heap[args[2]].type != Q_EXPR && in->data_heap[args[2]].type != PROMISE){
+		set_error(in, "fold expects a Q expression or a lazy sequence");
+		return -1;
+	}
+	acc = args[1];
+	sequence = args[2];
+	increment_references(in, acc);
+	if(!push_shadow_stack(in, acc)){
+		return -1;
+	}
+	if(!start_repeated_call(in, &call, args[0], 2)){
+		end_repeated_call(in, &call);
+		return -1;
+	}
+	//The accumulator is only fold's, so a builtin like + or join can build the next one in it
+	call.owned_arguments = 1;
+	if(in->data_heap[sequence].type == Q_EXPR){
+		for(i = 0; i < in->data_heap[sequence].num_entries; i++){
+			if(!step_fold(in, &call, &acc, in->data_heap[sequence].entries[i], 0)){
+				end_repeated_call(in, &call);
+				return -1;
+			}
+		}
+		end_repeated_call(in, &call);
+		pop_shadow_stack(in);
+		return acc;
+	}
+
+	while(1){
+		value = force_sequence(in, sequence);
+		if(value == -1){
+			end_repeated_call(in, &call);
+			return -1;
+		}
+		if(have_cell){
+			decrement_references(in, pop_shadow_stack(in));
+		}
+		if(!in->data_heap[value].num_entries){
+			decrement_references(in, value);
+			break;
+		}
+		if(!push_shadow_stack(in, value)){
+			end_repeated_call(in, &call);
+			return -1;
+		}
+		have_cell = 1;
+		if(!step_fold(in, &call, &acc, in->data_heap[value].entries[0], 1)){
+			end_repeated_call(in, &call);
+			return -1;
+		}
+		sequence = in->data_heap[value].entries[1];
+	}
+	end_repeated_call(in, &call);
+	pop_shadow_stack(in);
+
+	return acc;
+}
+
+//Forces a whole lazy sequence into a Q expression
+int collect(interp *in, int *args, int num_args, int *tail_call){
+	int output_index;
+	int sequence;
+	int value;
+	int *next_entries;
+	int entries_size = 0;
+	int have_cell = 0;
+
+	if(num_args != 1 || (in->data_heap[args[0]].type != Q_EXPR && in->data_heap[args[0]].type != PROMISE)){
+		set_error(in, "collect expects a Q expression or a lazy sequence");
+		return -1;
+	}
+	if(in->data_heap[args[0]].type == Q_EXPR){
+		increment_references(in, args[0]);
+		return args[0];
+	}
+	output_index = allocate_list(in, 0);
+	if(output_index == -1 || !push_shadow_stack(in, output_index)){
+		return -1;
+	}
+	sequence = args[0];
+	while(1){
+		value = force_sequence(in, sequence);
+		if(value == -1){
+			return -1;
+		}
+		if(have_cell){
+			decrement_references(in, pop_shadow_stack(in));
+		}
+		if(!in->data_heap[value].num_entries){
+			decrement_references(in, value);
+			break;
+		}
+		if(!push_shadow_stack(in, value)){
+			return -1;
+		}
+		have_cell = 1;
+		if(in->data_heap[output_index].num_entries == entries_size){
+			entries_size = entries_size ? entries_size*2 : 16;
+			next_entries = resize_entries(in->data_heap + output_index, entries_size);
+			if(!next_entries){
+				set_error(in, "malloc returned NULL");
+				return -1;
+			}
+			in->data_heap[output_index].entries = next_entries;
+		}
+		in->data_heap[output_index].entries[in->data_heap[output_index].num_entries] = in->data_heap[value].entries[0];
+		in->data_heap[output_index].num_entries++;
+		increment_references(in, in->data_heap[value].entries[0]);
+		sequence = in->data_heap[value].entries[1];
+	}
+	pop_shadow_stack(in);
+
+	return output_index;
+}
+
+static int lines_next_id = -1;
+
+//Reading the next line of the file read last doesn't reopen it
+static FILE *seek_lines(interp *in, char *path, long offset){
+	FILE *fp;
+	char *name;
+
+	if(in->lines_file && !strcmp(in->lines_path, path) && in->lines_offset == offset){
+		return in->lines_file;
+	}
+	if(in->lines_file){
+		fclose(in->lines_file);
+		free(in->lines_path);
+		in->lines_file = NULL;
+		in->lines_path = NULL;
+	}
+	fp = fopen(path, "r");
+	if(!fp){
+		set_error(in, "failed to open file");
+		return NULL;
+	}
+	if(fseek(fp, offset, SEEK_SET)){
+		fclose(fp);
+		set_error(in, "failed to seek file");
+		return NULL;
+	}
+	name = malloc(sizeof(char)*(strlen(path) + 1));
+	if(!name){
+		fclose(fp);
+		set_error(in, "malloc returned NULL");
+		return NULL;
+	}
+	strcpy(name, path);
+	in->lines_file = fp;
+	in->lines_path = name;
+	in->lines_offset = offset;
+
+	return fp;
+}
+
+//Reads the values on one line into a Q expression
+static int parse_line(interp *in, char *line){
+	int output_index;
+	int value;
+	int *next_entries;
+
+	output_index = allocate_list(in, 0);
+	if(output_index == -1 || !push_shadow_stack(in, output_index)){
+		return -1;
+	}
+	skip_whitespace(&line);
+	while(*line){
+		value = get_quoted_value(in, &line);
+		if(value == -1){
+			return -1;
+		}
+		next_entries = resize_entries(in->data_heap + output_index, in->data_heap[output_index].num_entries + 1);
+		if(!next_entries){
+			decrement_references(in, value);
+			set_error(in, "malloc returned NULL");
+			return -1;
+		}
+		in->data_heap[output_index].entries = next_entries;
+		in->data_heap[output_index].entries[in->data_heap[output_index].num_entries] = value;
+		in->data_heap[output_index].num_entries++;
+	}
+	pop_shadow_stack(in);
+
+	return output_index;
+}
+
+//(lines {FILE}) is the lines of a file, each read as a Q expression of the values on it
+int lines(interp *in, int *args, int num_args, int *tail_call){
+	int step_args[2];
+	int name;
+	int output_index;
+
+	if(num_args != 1 || !file_name_argument(in, args[0])){
+		set_error(in, "lines expects a file name");
+		return -1;
+	}
+	name = in->data_heap[args[0]].type == Q_EXPR ? in->data_heap[args[0]].entries[0] : args[0];
+	if(!seek_lines(in, in->data_heap[name].identifier_name, 0)){
+		return -1;
+	}
+	//The name is wrapped so that evaluating the step expression doesn't look it up as a variable
+	step_args[0] = allocate_list(in, 1);
+	if(step_args[0] == -1){
+		return -1;
+	}
+	in->data_heap[step_args[0]].entries[0] = name;
+	in->data_heap[step_args[0]].num_entries = 1;
+	increment_references(in, name);
+	if(!push_shadow_stack(in, step_args[0])){
+		return -1;
+	}
+	step_args[1] = allocate_int(in, 0);
+	if(step_args[1] == -1 || !push_shadow_stack(in, step_args[1])){
+		return -1;
+	}
+	output_index = step_promise(in, "lines-next", &lines_next_id, step_args, 2);
+	decrement_references(in, pop_shadow_stack(in));
+	decrement_references(in, pop_shadow_stack(in));
+
+	return output_index;
+}
+
+int lines_next(interp *in, int *args, int num_args, int *tail_call){
+	FILE *fp;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t length;
+	long next_offset;
+	int next_args[2];
+	int value;
+	int output_index;
+
+	if(num_args != 2 || in->data_heap[args[0]].type != Q_EXPR || in->data_heap[args[0]].num_entries != 1 || in->data_heap[in->data_heap[args[0]].entries[0]].type != IDENTIFIER || in->data_heap[args[1]].type != INT_DATA){
+		set_error(in, "lines-next expects a file name and an offset");
+		return -1;
+	}
+	fp = seek_lines(in, in->data_heap[in->data_heap[args[0]].entries[0]].identifier_name, in->data_heap[args[1]].int_value);
+	if(!fp){
+		return -1;
+	}
+	length = getline(&line, &line_size, fp);
+	if(length < 0){
+		free(line);
+		if(ferror(fp)){
+			set_error(in, "failed to read file");
+			return -1;
+		}
+		return allocate_list(in, 0);
+	}
+	in->lines_offset += length;
+	next_offset = in->lines_offset;
+	if(next_offset > INT_MAX){
+		free(line);
+		set_error(in, "file too large for lines");
+		return -1;
+	}
+	value = parse_line(in, line);
+	free(line);
+	if(value == -1){
+		return -1;
+	}
+	if(!push_shadow_stack(in, value)){
+		return -1;
+	}
+	next_args[0] = args[0];
+	next_args[1] = allocate_int(in, next_offset);
+	if(next_args[1] == -1 || !push_shadow_stack(in, next_args[1])){
+		return -1;
+	}
+	output_index = make_step_pair(in, value, "lines-next", &lines_next_id, next_args, 2);
+	decrement_references(in, pop_shadow_stack(in));
+	pop_shadow_stack(in);
+
+	return output_index;
+}
@@ -0,0 +1,20 @@
+#ifndef SEQUENCE_INCLUDED
+#define SEQUENCE_INCLUDED
+#include "allocate.h"
+
+int force_promise(interp *in, int promise, int memoize);
+int delay(interp *in, int *args, int num_args, int *tail_call);
+int force(interp *in, int *args, int num_args, int *tail_call);
+int range(interp *in, int *args, int num_args, int *tail_call);
+int range_next(interp *in, int *args, int num_args, int *tail_call);
+int map(interp *in, int *args, int num_args, int *tail_call);
+int map_next(interp *in, int *args, int num_args, int *tail_call);
+int filter(interp *in, int *args, int num_args, int *tail_call);
+int filter_next(interp *in, int *args, int num_args, int *tail_call);
+int take(interp *in, int *args, int num_args, int *tail_call);
+int take_next(interp *in, int *args, int num_args, int *tail_call);
+int fold(interp *in, int *args, int num_args, int *tail_call);
+int collect(interp *in, int *args, int num_args, int *tail_call);
+int lines(interp *in, int *args, int num_args, int *tail_call);
+int lines_next(interp *in, int *args, int num_args, int *tail_call);
+#endif
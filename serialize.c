@@ -0,0 +1,698 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "allocate.h"
+#include "execute.h"
+#include "serialize.h"
+
+//A stream is a version byte followed by values written in preorder. Every value starts with a
+//header byte holding a tag in its low 3 bits and an operand in the rest. Operands below 31 fit in
+//the header; otherwise the rest is 31 and operand - 31 follows as a little endian base 128 varint.
+//Integers are zigzag coded, so small negative numbers stay small. An identifier is written out the
+//first time, as its length and bytes, and by number after that. Lists give their length up front,
+//so the decoder allocates each one once, at its final size
+#define SERIAL_VERSION 1
+
+#define TAG_NONE 0
+#define TAG_INT 1
+#define TAG_SYMBOL 2
+#define TAG_SYMBOL_REF 3
+#define TAG_S_EXPR 4
+#define TAG_Q_EXPR 5
+#define TAG_FUNCTION 6
+#define TAG_BUILTIN 7
+
+#define INLINE_OPERANDS 31
+#define MAX_HEADER_SIZE 6
+#define MAX_SYMBOL_LENGTH (16U<<20)
+#define READ_SIZE 65536
+
+void init_encoder(encoder *e, int fd){
+	init_output_buffer(&e->output, fd);
+	e->symbols = NULL;
+	e->symbols_size = 0;
+	e->num_symbols = 0;
+	e->started = 0;
+	e->stack = NULL;
+	e->stack_size = 0;
+}
+
+void free_encoder(encoder *e){
+	unsigned int i;
+
+	free_output_buffer(&e->output);
+	for(i = 0; i < e->symbols_size; i++){
+		free(e->symbols[i].name);
+	}
+	free(e->symbols);
+	free(e->stack);
+}
+
+static void write_header(encoder *e, int tag, uint32_t operand){
+	unsigned char header[MAX_HEADER_SIZE];
+	int length = 1;
+
+	if(operand < INLINE_OPERANDS){
+		header[0] = tag | operand<<3;
+	} else {
+		header[0] = tag | INLINE_OPERANDS<<3;
+		operand -= INLINE_OPERANDS;
+		while(operand >= 0x80){
+			header[length++] = (operand&0x7f) | 0x80;
+			operand >>= 7;
+		}
+		header[length++] = operand;
+	}
+	append_output(&e->output, (char *) header, length);
+}
+
+static unsigned long hash_name(char *name){
+	unsigned long hash = 0xcbf29ce484222325;
+
+	//FNV-1a
+	while(*name){
+		hash ^= (unsigned char) *name;
+		hash *= 0x100000001b3;
+		name++;
+	}
+
+	return hash;
+}
+
+//Keeps the table at most half full
+static int grow_symbols(encoder *e){
+	symbol_slot *next_symbols;
+	unsigned int next_size;
+	unsigned int i;
+	unsigned int j;
+
+	next_size = e->symbols_size ? e->symbols_size*2 : 256;
+	next_symbols = calloc(next_size, sizeof(symbol_slot));
+	if(!next_symbols){
+		return 0;
+	}
+	for(i = 0; i < e->symbols_size; i++){
+		if(!e->symbols[i].name){
+			continue;
+		}
+		j = e->symbols[i].hash&(next_size - 1);
+		while(next_symbols[j].name){
+			j = (j + 1)&(next_size - 1);
+		}
+		next_symbols[j] = e->symbols[i];
+	}
+	free(e->symbols);
+	e->symbols = next_symbols;
+	e->symbols_size = next_size;
+
+	return 1;
+}
+
+static void write_symbol(encoder *e, char *name){
+	unsigned long hash;
+	symbol_slot *slot;
+	size_t length;
+	unsigned int i;
+
+	if(e->num_symbols*2 >= e->symbols_size && !grow_symbols(e)){
+		e->output.failed = 1;
+		return;
+	}
+	hash = hash_name(name);
+	i = hash&(e->symbols_size - 1);
+	while(e->symbols[i].name){
+		slot = e->symbols + i;
+		if(slot->hash == hash && !strcmp(slot->name, name)){
+			write_header(e, TAG_SYMBOL_REF, slot->number);
+			return;
+		}
+		i = (i + 1)&(e->symbols_size - 1);
+	}
+
+	//The name is copied, since the encoder can outlive the cell it came from
+	slot = e->symbols + i;
+	slot->name = strdup(name);
+	if(!slot->name){
+		e->output.failed = 1;
+		return;
+	}
+	slot->hash = hash;
+	slot->number = e->num_symbols++;
+	length = strlen(name);
+	write_header(e, TAG_SYMBOL, length);
+	append_output(&e->output, name, length);
+}
+
+static int push_encode_frame(encoder *e, unsigned int depth, int value){
+	encode_frame *next_stack;
+	unsigned int next_size;
+
+	if(depth == e->stack_size){
+		next_size = e->stack_size ? e->stack_size*2 : 64;
+		next_stack = realloc(e->stack, sizeof(encode_frame)*next_size);
+		if(!next_stack){
+			return 0;
+		}
+		e->stack = next_stack;
+		e->stack_size = next_size;
+	}
+	e->stack[depth].value = value;
+	e->stack[depth].next = 0;
+
+	return 1;
+}
+
+static int num_children(data *d){
+	if(d->type == FUNCTION){
+		return 2;
+	}
+
+	return d->num_entries;
+}
+
+static int get_child(data *d, int i){
+	if(d->type == FUNCTION){
+		return i ? d->source : d->var_list;
+	}
+
+	return d->entries[i];
+}
+
+//Walks the value with a stack of its own, like the printer. Returns 0 and sets the error if the
+//value holds something that can't be written, or if the output failed
+int encode_value(interp *in, encoder *e, int value){
+	unsigned int depth = 0;
+	encode_frame *top;
+	char *name;
+	data *d;
+
+	if(!e->started){
+		append_output(&e->output, (char []) {SERIAL_VERSION}, 1);
+		e->started = 1;
+	}
+	while(1){
+		d = in->data_heap + value;
+		switch(d->type){
+			case NONE_DATA:
+				write_header(e, TAG_NONE, 0);
+				break;
+			case INT_DATA:
+				write_header(e, TAG_INT, (uint32_t) d->int_value<<1 ^ -(uint32_t) (d->int_value < 0));
+				break;
+			case IDENTIFIER:
+				write_symbol(e, d->identifier_name);
+				break;
+			case BUILTIN_FUNCTION:
+				name = builtin_name(d->builtin_id);
+				write_header(e, TAG_BUILTIN, strlen(name));
+				append_output(&e->output, name, strlen(name));
+				break;
+			case S_EXPR:
+			case Q_EXPR:
+			case FUNCTION:
+				if(d->type == FUNCTION){
+					write_header(e, TAG_FUNCTION, 0);
+				} else {
+					write_header(e, d->type == S_EXPR ? TAG_S_EXPR : TAG_Q_EXPR, d->num_entries);
+				}
+				if(!push_encode_frame(e, depth, value)){
+					e->output.failed = 1;
+				}
+				depth++;
+				break;
+			case MEMO_FUNCTION:
+			case PROMISE:
+				set_error(in, "memo functions and promises can't be serialized");
+				return 0;
+		}
+		if(e->output.failed){
+			set_error(in, "failed to write serialized value");
+			return 0;
+		}
+
+		while(depth){
+			top = e->stack + depth - 1;
+			d = in->data_heap + top->value;
+			if(top->next < num_children(d)){
+				value = get_child(d, top->next);
+				top->next++;
+				break;
+			}
+			depth--;
+		}
+		if(!depth){
+			return 1;
+		}
+	}
+}
+
+void init_decoder(decoder *d){
+	memset(d, 0, sizeof(decoder));
+}
+
+//Releases the value being built, if any. It is still on top of the shadow stack
+static void drop_partial_value(interp *in, decoder *d){
+	if(d->rooted){
+		decrement_references(in, pop_shadow_stack(in));
+		d->rooted = 0;
+	}
+	d->depth = 0;
+}
+
+void free_decoder(interp *in, decoder *d){
+	unsigned int i;
+
+	drop_partial_value(in, d);
+	for(i = 0; i < d->num_symbols; i++){
+		free(d->symbols[i]);
+	}
+	free(d->symbols);
+	free(d->stack);
+	free(d->pending);
+}
+
+//Returns the size of the header, 0 if it isn't all there yet, or -1 if it is malformed
+static int read_header(unsigned char *bytes, size_t length, int *tag, uint32_t *operand){
+	uint32_t value = 0;
+	int shift = 0;
+	int i;
+
+	if(!length){
+		return 0;
+	}
+	*tag = bytes[0]&7;
+	*operand = bytes[0]>>3;
+	if(*operand < INLINE_OPERANDS){
+		return 1;
+	}
+	for(i = 1; i < MAX_HEADER_SIZE; i++){
+		if((size_t) i >= length){
+			return 0;
+		}
+		value |= (uint32_t) (bytes[i]&0x7f)<<shift;
+		if(!(bytes[i]&0x80)){
+			if(value > UINT32_MAX - INLINE_OPERANDS || (i == MAX_HEADER_SIZE - 1 && bytes[i] > 0x0f)){
+				return -1;
+			}
+			*operand += value;
+			return i + 1;
+		}
+		shift += 7;
+	}
+
+	return -1;
+}
+
+//Returns the size of the token, 0 if it isn't all there yet, or -1 if it is malformed
+static long token_size(char *bytes, size_t length){
+	uint32_t operand;
+	int header_size;
+	int tag;
+
+	header_size = read_header((unsigned char *) bytes, length, &tag, &operand);
+	if(header_size <= 0){
+		return header_size;
+	}
+	if(tag == TAG_SYMBOL || tag == TAG_BUILTIN){
+		if(operand > MAX_SYMBOL_LENGTH){
+			return -1;
+		}
+		return header_size + operand;
+	}
+
+	return header_size;
+}
+
+static char *copy_name(char *name, uint32_t length){
+	char *output;
+
+	output = malloc(length + 1);
+	if(output){
+		memcpy(output, name, length);
+		output[length] = '\0';
+	}
+
+	return output;
+}
+
+static int add_symbol(decoder *d, char *name){
+	char **next_symbols;
+	unsigned int next_size;
+
+	if(d->num_symbols == d->symbols_size){
+		next_size = d->symbols_size ? d->symbols_size*2 : 64;
+		next_symbols = realloc(d->symbols, sizeof(char *)*next_size);
+		if(!next_symbols){
+			return 0;
+		}
+		d->symbols = next_symbols;
+		d->symbols_size = next_size;
+	}
+	d->symbols[d->num_symbols++] = name;
+
+	return 1;
+}
+
+static int push_decode_frame(decoder *d, int value, uint32_t remaining, int is_function){
+	decode_frame *next_stack;
+	unsigned int next_size;
+
+	if(d->depth == d->stack_size){
+		next_size = d->stack_size ? d->stack_size*2 : 64;
+		next_stack = realloc(d->stack, sizeof(decode_frame)*next_size);
+		if(!next_stack){
+			return 0;
+		}
+		d->stack = next_stack;
+		d->stack_size = next_size;
+	}
+	d->stack[d->depth].value = value;
+	d->stack[d->depth].remaining = remaining;
+	d->stack[d->depth].is_function = is_function;
+	d->depth++;
+
+	return 1;
+}
+
+//Makes the cell a token describes. A function is built as a list of two entries and turned into a
+//function once both are in
+static int make_cell(interp *in, decoder *d, int tag, uint32_t operand, char *text){
+	char *name;
+	int builtin_id;
+	int output_index;
+
+	switch(tag){
+		case TAG_NONE:
+			increment_references(in, in->global_none);
+			return in->global_none;
+		case TAG_INT:
+			return allocate_int(in, (int) (operand>>1 ^ -(operand&1)));
+		case TAG_SYMBOL:
+		case TAG_SYMBOL_REF:
+			if(tag == TAG_SYMBOL_REF && operand >= d->num_symbols){
+				set_error(in, "serialized value refers to an unknown identifier");
+				return -1;
+			}
+			if(tag == TAG_SYMBOL){
+				name = copy_name(text, operand);
+				if(!name || !add_symbol(d, name)){
+					free(name);
+					set_error(in, "malloc returned NULL");
+					return -1;
+				}
+				operand = d->num_symbols - 1;
+			}
+			output_index = allocate(in);
+			if(output_index == -1){
+				return -1;
+			}
+			in->data_heap[output_index].identifier_name = strdup(d->symbols[operand]);
+			if(!in->data_heap[output_index].identifier_name){
+				decrement_references(in, output_index);
+				set_error(in, "malloc returned NULL");
+				return -1;
+			}
+			in->data_heap[output_index].type = IDENTIFIER;
+			return output_index;
+		case TAG_BUILTIN:
+			name = copy_name(text, operand);
+			if(!name){
+				set_error(in, "malloc returned NULL");
+				return -1;
+			}
+			builtin_id = lookup_builtin(name);
+			free(name);
+			if(builtin_id == -1 || builtin_flags(builtin_id)&BUILTIN_INTERNAL){
+				set_error(in, "serialized value refers to an unknown builtin");
+				return -1;
+			}
+			return allocate_builtin(in, builtin_id);
+		case TAG_FUNCTION:
+			operand = 2;
+			//Fall through
+		default:
+			//Every entry is a distinct cell, or none, so no real list is longer than the heap
+			if(operand > in->heap->data_heap_size){
+				set_error(in, "serialized list is longer than the heap");
+				return -1;
+			}
+			output_index = allocate_list(in, operand);
+			if(output_index != -1){
+				in->data_heap[output_index].type = tag == TAG_Q_EXPR ? Q_EXPR : S_EXPR;
+			}
+			return output_index;
+	}
+}
+
+//Adds one token to the value being built. Returns the value if this token completed it
+static int take_token(interp *in, decoder *d, char *token){
+	uint32_t operand;
+	decode_frame *top;
+	data *parent;
+	data *cell;
+	int header_size;
+	int value;
+	int tag;
+	int first;
+
+	header_size = read_header((unsigned char *) token, MAX_HEADER_SIZE, &tag, &operand);
+	value = make_cell(in, d, tag, operand, token + header_size);
+	if(value == -1){
+		return -1;
+	}
+
+	if(d->depth){
+		top = d->stack + d->depth - 1;
+		parent = in->data_heap + top->value;
+		parent->entries[parent->num_entries++] = value;
+		top->remaining--;
+	} else if(tag >= TAG_S_EXPR && tag <= TAG_FUNCTION && (operand || tag == TAG_FUNCTION)){
+		if(!push_shadow_stack(in, value)){
+			decrement_references(in, value);
+			return -1;
+		}
+		d->rooted = 1;
+	}
+	if(tag >= TAG_S_EXPR && tag <= TAG_FUNCTION && (operand || tag == TAG_FUNCTION)){
+		if(!push_decode_frame(d, value, tag == TAG_FUNCTION ? 2 : operand, tag == TAG_FUNCTION)){
+			set_error(in, "malloc returned NULL");
+			return -1;
+		}
+		return DECODE_MORE;
+	}
+
+	//Finish every list that this token filled
+	while(d->depth && !d->stack[d->depth - 1].remaining){
+		top = d->stack + d->depth - 1;
+		if(top->is_function){
+			cell = in->data_heap + top->value;
+			first = cell->entries[0];
+			value = cell->entries[1];
+			free_entries(cell);
+			cell->type = FUNCTION;
+			cell->var_list = first;
+			cell->source = value;
+		}
+		value = top->value;
+		d->depth--;
+	}
+	if(d->depth){
+		return DECODE_MORE;
+	}
+	if(d->rooted){
+		pop_shadow_stack(in);
+		d->rooted = 0;
+	}
+
+	return value;
+}
+
+static int keep_pending(interp *in, decoder *d, char *bytes, size_t length){
+	char *next_pending;
+	size_t next_size;
+
+	if(d->pending_length + length > d->pending_size){
+		next_size = d->pending_size ? d->pending_size : 64;
+		while(next_size < d->pending_length + length){
+			next_size *= 2;
+		}
+		next_pending = realloc(d->pending, next_size);
+		if(!next_pending){
+			set_error(in, "malloc returned NULL");
+			return 0;
+		}
+		d->pending = next_pending;
+		d->pending_size = next_size;
+	}
+	memcpy(d->pending + d->pending_length, bytes, length);
+	d->pending_length += length;
+
+	return 1;
+}
+
+//Consumes input from *bytes until a value is complete, and returns it. Returns DECODE_MORE once
+//all of the input is consumed without completing one, or -1 on malformed input, after which the
+//decoder is reset
+int decode_value(interp *in, decoder *d, char **bytes, size_t *length){
+	size_t take;
+	long size;
+	int result;
+
+	if(!d->started){
+		if(!*length){
+			return DECODE_MORE;
+		}
+		if(**bytes != SERIAL_VERSION){
+			set_error(in, "unrecognized serialized value version");
+			return -1;
+		}
+		++*bytes;
+		--*length;
+		d->started = 1;
+	}
+
+	//Finish the token that the last piece of input ended in the middle of
+	while(d->pending_length){
+		size = token_size(d->pending, d->pending_length);
+		if(size < 0){
+			goto malformed;
+		}
+		if(size && (size_t) size == d->pending_length){
+			d->pending_length = 0;
+			result = take_token(in, d, d->pending);
+			if(result != DECODE_MORE){
+				if(result == -1){
+					drop_partial_value(in, d);
+				}
+				return result;
+			}
+			break;
+		}
+		if(!*length){
+			return DECODE_MORE;
+		}
+		take = size ? size - d->pending_length : 1;
+		if(take > *length){
+			take = *length;
+		}
+		if(!keep_pending(in, d, *bytes, take)){
+			drop_partial_value(in, d);
+			return -1;
+		}
+		*bytes += take;
+		*length -= take;
+	}
+
+	while(*length){
+		size = token_size(*bytes, *length);
+		if(size < 0){
+			goto malformed;
+		}
+		if(!size || (size_t) size > *length){
+			if(!keep_pending(in, d, *bytes, *length)){
+				drop_partial_value(in, d);
+				return -1;
+			}
+			*bytes += *length;
+			*length = 0;
+			return DECODE_MORE;
+		}
+		result = take_token(in, d, *bytes);
+		*bytes += size;
+		*length -= size;
+		if(result != DECODE_MORE){
+			if(result == -1){
+				drop_partial_value(in, d);
+			}
+			return result;
+		}
+	}
+
+	return DECODE_MORE;
+
+	malformed:
+	drop_partial_value(in, d);
+	set_error(in, "malformed serialized value");
+	return -1;
+}
+
+int serialize(interp *in, int *args, int num_args, int *tail_call){
+	encoder e;
+	char *path;
+	int success;
+	int fd;
+
+	path = num_args == 2 ? file_name_argument(in, args[0]) : NULL;
+	if(!path){
+		set_error(in, "serialize expects a file name and a value");
+		return -1;
+	}
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd < 0){
+		set_error(in, "failed to open serialized value file");
+		return -1;
+	}
+	init_encoder(&e, fd);
+	success = encode_value(in, &e, args[1]);
+	if(success && !flush_output_buffer(&e.output)){
+		set_error(in, "failed to write serialized value");
+		success = 0;
+	}
+	free_encoder(&e);
+	if(close(fd) && success){
+		set_error(in, "failed to write serialized value");
+		success = 0;
+	}
+	if(!success){
+		return -1;
+	}
+
+	increment_references(in, in->global_none);
+	return in->global_none;
+}
+
+//Reads the file a piece at a time through the streaming decoder
+int deserialize(interp *in, int *args, int num_args, int *tail_call){
+	char buffer[READ_SIZE];
+	decoder d;
+	char *bytes;
+	char *path;
+	size_t length;
+	ssize_t result;
+	int output_index = DECODE_MORE;
+	int fd;
+
+	path = num_args == 1 ? file_name_argument(in, args[0]) : NULL;
+	if(!path){
+		set_error(in, "deserialize expects a file name");
+		return -1;
+	}
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0){
+		set_error(in, "failed to open serialized value file");
+		return -1;
+	}
+	init_decoder(&d);
+	while(output_index == DECODE_MORE){
+		result = read(fd, buffer, sizeof(buffer));
+		if(result < 0 && errno == EINTR){
+			continue;
+		}
+		if(result <= 0){
+			set_error(in, result ? "failed to read serialized value file" : "serialized value is truncated");
+			output_index = -1;
+			break;
+		}
+		bytes = buffer;
+		length = result;
+		output_index = decode_value(in, &d, &bytes, &length);
+	}
+	free_decoder(in, &d);
+	close(fd);
+
+	return output_index;
+}
@@ -0,0 +1,75 @@
+#ifndef SERIALIZE_INCLUDED
+#define SERIALIZE_INCLUDED
+#include <stddef.h>
+#include "allocate.h"
+#include "printer.h"
+
+//Returned by decode_value when the input ran out before a value was complete
+#define DECODE_MORE -2
+
+typedef struct encode_frame encode_frame;
+
+struct encode_frame{
+	int value;
+	int next;
+};
+
+typedef struct symbol_slot symbol_slot;
+
+struct symbol_slot{
+	char *name;
+	unsigned long hash;
+	unsigned int number;
+};
+
+typedef struct encoder encoder;
+
+//Writes values to output. Identifiers are numbered as they are first written, and later
+//occurrences refer to them by number, for as long as the encoder lives. symbols is an open
+//addressed table of the names written so far
+struct encoder{
+	output_buffer output;
+	symbol_slot *symbols;
+	unsigned int symbols_size;
+	unsigned int num_symbols;
+	int started;
+	encode_frame *stack;
+	unsigned int stack_size;
+};
+
+typedef struct decode_frame decode_frame;
+
+//A list being filled in and how many of its entries are still to come
+struct decode_frame{
+	int value;
+	unsigned int remaining;
+	int is_function;
+};
+
+typedef struct decoder decoder;
+
+//Reads values from input that can arrive in pieces of any size. A token split between pieces is
+//kept in pending. The value being built is held on the shadow stack between calls
+struct decoder{
+	char **symbols;
+	unsigned int num_symbols;
+	unsigned int symbols_size;
+	decode_frame *stack;
+	unsigned int depth;
+	unsigned int stack_size;
+	char *pending;
+	size_t pending_length;
+	size_t pending_size;
+	int started;
+	int rooted;
+};
+
+void init_encoder(encoder *e, int fd);
+int encode_value(interp *in, encoder *e, int value);
+void free_encoder(encoder *e);
+void init_decoder(decoder *d);
+int decode_value(interp *in, decoder *d, char **bytes, size_t *length);
+void free_decoder(interp *in, decoder *d);
+int serialize(interp *in, int *args, int num_args, int *tail_call);
+int deserialize(interp *in, int *args, int num_args, int *tail_call);
+#endif
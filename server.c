@@ -0,0 +1,587 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "allocate.h"
+#include "execute.h"
+#include "printer.h"
+
+//serve() answers requests on a Unix domain socket. Every connection gets an interpreter and heap of
+//its own, so sessions can't see each other's bindings. One thread runs an epoll loop that accepts,
+//reads and writes, and a pool of workers evaluates. A connection's requests are evaluated one at a
+//time in order, by whichever worker is free.
+//
+//Requests and responses are frames: a 4 byte big endian length, then that many bytes. A request is
+//source text, evaluated like a line of the REPL. A response is '+' and the printed value of the
+//last form, or '-' and an error message
+
+#define MAX_REQUEST_SIZE (16U<<20)
+#define READ_SIZE 65536
+#define MAX_EVENTS 64
+
+typedef struct request request;
+
+struct request{
+	char *source;
+	request *next;
+};
+
+typedef struct connection connection;
+
+//Lock order is the server's lock, then a connection's
+struct connection{
+	int fd;
+	interp *in;
+	char *input;
+	size_t input_length;
+	size_t input_size;
+	//Guarded by lock
+	output_buffer output;
+	size_t output_sent;
+	request *requests;
+	request *last_request;
+	int busy;
+	int closed;
+	pthread_mutex_t lock;
+	//Guarded by the server's lock
+	int flush_pending;
+	connection *next_ready;
+	connection *next_flush;
+	//Only used by the event loop
+	int writing;
+	connection *previous;
+	connection *next;
+};
+
+typedef struct server server;
+
+struct server{
+	int listen_fd;
+	int epoll_fd;
+	int wake_fd;
+	int heap_size;
+	unsigned long stack_limit;
+	connection *connections;
+	pthread_mutex_t lock;
+	pthread_cond_t ready_cond;
+	connection *ready_head;
+	connection *ready_tail;
+	connection *flush_list;
+	int stopping;
+	pthread_t *workers;
+	int num_workers;
+};
+
+static volatile sig_atomic_t stop_signalled;
+
+static void signal_stop(int signal_number){
+	stop_signalled = 1;
+}
+
+static void put_length(char *bytes, uint32_t length){
+	bytes[0] = length>>24;
+	bytes[1] = length>>16;
+	bytes[2] = length>>8;
+	bytes[3] = length;
+}
+
+static uint32_t get_length(char *bytes){
+	unsigned char *b;
+
+	b = (unsigned char *) bytes;
+	return (uint32_t) b[0]<<24 | (uint32_t) b[1]<<16 | (uint32_t) b[2]<<8 | b[3];
+}
+
+static void wake_loop(server *s){
+	uint64_t one = 1;
+
+	while(write(s->wake_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+//Expects the server's lock to be held
+static void push_ready(server *s, connection *c){
+	c->next_ready = NULL;
+	if(s->ready_tail){
+		s->ready_tail->next_ready = c;
+	} else {
+		s->ready_head = c;
+	}
+	s->ready_tail = c;
+	pthread_cond_signal(&s->ready_cond);
+}
+
+//Expects the server's lock to be held
+static void push_flush(server *s, connection *c){
+	if(!c->flush_pending){
+		c->flush_pending = 1;
+		c->next_flush = s->flush_list;
+		s->flush_list = c;
+	}
+}
+
+static void respond(connection *c, char *source){
+	output_buffer response;
+	char header[4];
+	char *message;
+	int result;
+
+	init_output_buffer(&response, -1);
+	result = interp_eval(c->in, source);
+	if(result == -1){
+		append_output(&response, "-", 1);
+		message = interp_error(c->in);
+		append_output(&response, message, strlen(message));
+	} else {
+		append_output(&response, "+", 1);
+		append_value(c->in, &response, result);
+		release_value(c->in, result);
+	}
+	if(response.failed){
+		response.length = 0;
+		append_output(&response, "-malloc returned NULL", 21);
+	}
+
+	put_length(header, response.length);
+	pthread_mutex_lock(&c->lock);
+	append_output(&c->output, header, 4);
+	append_output(&c->output, response.text, response.length);
+	pthread_mutex_unlock(&c->lock);
+	free_output_buffer(&response);
+}
+
+static void *run_worker(void *arg){
+	server *s;
+	connection *c;
+	request *r;
+
+	s = arg;
+	while(1){
+		pthread_mutex_lock(&s->lock);
+		while(!s->ready_head && !s->stopping){
+			pthread_cond_wait(&s->ready_cond, &s->lock);
+		}
+		if(!s->ready_head){
+			pthread_mutex_unlock(&s->lock);
+			return NULL;
+		}
+		c = s->ready_head;
+		s->ready_head = c->next_ready;
+		if(!s->ready_head){
+			s->ready_tail = NULL;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		pthread_mutex_lock(&c->lock);
+		r = c->requests;
+		c->requests = r->next;
+		if(!c->requests){
+			c->last_request = NULL;
+		}
+		pthread_mutex_unlock(&c->lock);
+		if(!c->closed){
+			respond(c, r->source);
+		}
+		free(r->source);
+		free(r);
+
+		//Going idle and asking for a flush happen together, so the event loop never sees an idle
+		//connection that it won't hear from again
+		pthread_mutex_lock(&s->lock);
+		pthread_mutex_lock(&c->lock);
+		if(c->requests && !c->closed){
+			push_ready(s, c);
+		} else {
+			c->busy = 0;
+		}
+		pthread_mutex_unlock(&c->lock);
+		push_flush(s, c);
+		pthread_mutex_unlock(&s->lock);
+		wake_loop(s);
+	}
+}
+
+static void free_requests(request *r){
+	request *next;
+
+	while(r){
+		next = r->next;
+		free(r->source);
+		free(r);
+		r = next;
+	}
+}
+
+static void destroy_connection(server *s, connection *c){
+	if(c->previous){
+		c->previous->next = c->next;
+	} else {
+		s->connections = c->next;
+	}
+	if(c->next){
+		c->next->previous = c->previous;
+	}
+	close(c->fd);
+	destroy_interp(c->in);
+	free_requests(c->requests);
+	free(c->input);
+	free_output_buffer(&c->output);
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+//The connection is freed once no worker has it
+static void close_connection(server *s, connection *c){
+	int idle;
+
+	if(c->closed){
+		return;
+	}
+	epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	pthread_mutex_lock(&s->lock);
+	pthread_mutex_lock(&c->lock);
+	c->closed = 1;
+	idle = !c->busy && !c->flush_pending;
+	pthread_mutex_unlock(&c->lock);
+	pthread_mutex_unlock(&s->lock);
+	if(idle){
+		destroy_connection(s, c);
+	}
+}
+
+static void accept_connections(server *s){
+	struct epoll_event event;
+	connection *c;
+	int fd;
+
+	while(1){
+		fd = accept(s->listen_fd, NULL, NULL);
+		if(fd < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return;
+		}
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		c = calloc(1, sizeof(connection));
+		if(!c){
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->in = create_interp(s->heap_size);
+		if(!c->in){
+			close(fd);
+			free(c);
+			continue;
+		}
+		if(s->stack_limit){
+			set_stack_limit(c->in, s->stack_limit);
+		}
+		init_output_buffer(&c->output, -1);
+		pthread_mutex_init(&c->lock, NULL);
+		c->next = s->connections;
+		if(s->connections){
+			s->connections->previous = c;
+		}
+		s->connections = c;
+		event.events = EPOLLIN;
+		event.data.ptr = c;
+		if(epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &event)){
+			destroy_connection(s, c);
+		}
+	}
+}
+
+static int add_request(server *s, connection *c, char *source, uint32_t length){
+	request *r;
+
+	r = malloc(sizeof(request));
+	if(!r){
+		return 0;
+	}
+	r->source = malloc(length + 1);
+	if(!r->source){
+		free(r);
+		return 0;
+	}
+	memcpy(r->source, source, length);
+	r->source[length] = '\0';
+	r->next = NULL;
+
+	pthread_mutex_lock(&s->lock);
+	pthread_mutex_lock(&c->lock);
+	if(c->last_request){
+		c->last_request->next = r;
+	} else {
+		c->requests = r;
+	}
+	c->last_request = r;
+	if(!c->busy){
+		c->busy = 1;
+		push_ready(s, c);
+	}
+	pthread_mutex_unlock(&c->lock);
+	pthread_mutex_unlock(&s->lock);
+
+	return 1;
+}
+
+static void read_requests(server *s, connection *c){
+	char *next_input;
+	size_t next_size;
+	size_t offset;
+	uint32_t length;
+	ssize_t result;
+
+	while(1){
+		if(c->input_size - c->input_length < READ_SIZE){
+			next_size = c->input_size ? c->input_size*2 : READ_SIZE*2;
+			next_input = realloc(c->input, next_size);
+			if(!next_input){
+				close_connection(s, c);
+				return;
+			}
+			c->input = next_input;
+			c->input_size = next_size;
+		}
+		result = read(c->fd, c->input + c->input_length, c->input_size - c->input_length);
+		if(result < 0 && errno == EINTR){
+			continue;
+		}
+		if(result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			break;
+		}
+		if(result <= 0){
+			close_connection(s, c);
+			return;
+		}
+		c->input_length += result;
+	}
+
+	offset = 0;
+	while(c->input_length - offset >= 4){
+		length = get_length(c->input + offset);
+		if(length > MAX_REQUEST_SIZE){
+			close_connection(s, c);
+			return;
+		}
+		if(c->input_length - offset - 4 < length){
+			break;
+		}
+		if(!add_request(s, c, c->input + offset + 4, length)){
+			close_connection(s, c);
+			return;
+		}
+		offset += 4 + length;
+	}
+	memmove(c->input, c->input + offset, c->input_length - offset);
+	c->input_length -= offset;
+}
+
+//Writes what it can without blocking, and waits for the socket to drain if that isn't everything
+static void write_responses(server *s, connection *c){
+	struct epoll_event event;
+	ssize_t result = 0;
+	int pending;
+
+	pthread_mutex_lock(&c->lock);
+	while(c->output_sent < c->output.length){
+		result = send(c->fd, c->output.text + c->output_sent, c->output.length - c->output_sent, MSG_NOSIGNAL);
+		if(result < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			break;
+		}
+		c->output_sent += result;
+	}
+	if(result < 0 && errno != EAGAIN && errno != EWOULDBLOCK && c->output_sent < c->output.length){
+		pthread_mutex_unlock(&c->lock);
+		close_connection(s, c);
+		return;
+	}
+	if(c->output_sent == c->output.length){
+		c->output.length = 0;
+		c->output_sent = 0;
+	}
+	pending = c->output.length != 0;
+	pthread_mutex_unlock(&c->lock);
+
+	if(pending != c->writing){
+		c->writing = pending;
+		event.events = pending ? EPOLLIN | EPOLLOUT : EPOLLIN;
+		event.data.ptr = c;
+		epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+	}
+}
+
+static void flush_connections(server *s){
+	connection *c;
+	connection *next;
+	uint64_t count;
+	int idle;
+
+	while(read(s->wake_fd, &count, sizeof(count)) < 0 && errno == EINTR);
+	pthread_mutex_lock(&s->lock);
+	c = s->flush_list;
+	s->flush_list = NULL;
+	for(next = c; next; next = next->next_flush){
+		next->flush_pending = 0;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	for(; c; c = next){
+		next = c->next_flush;
+		if(!c->closed){
+			write_responses(s, c);
+			continue;
+		}
+		pthread_mutex_lock(&c->lock);
+		idle = !c->busy;
+		pthread_mutex_unlock(&c->lock);
+		if(idle){
+			destroy_connection(s, c);
+		}
+	}
+}
+
+static int listen_on(server *s, char *path){
+	struct sockaddr_un address;
+
+	if(strlen(path) >= sizeof(address.sun_path)){
+		fprintf(stderr, "Error: socket path too long\n");
+		return 0;
+	}
+	s->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(s->listen_fd < 0){
+		perror("socket");
+		return 0;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	unlink(path);
+	if(bind(s->listen_fd, (struct sockaddr *) &address, sizeof(address)) || listen(s->listen_fd, SOMAXCONN)){
+		perror(path);
+		close(s->listen_fd);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void run_loop(server *s){
+	struct epoll_event events[MAX_EVENTS];
+	connection *c;
+	int num_events;
+	int i;
+
+	while(!stop_signalled){
+		num_events = epoll_wait(s->epoll_fd, events, MAX_EVENTS, -1);
+		if(num_events < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			perror("epoll_wait");
+			return;
+		}
+		for(i = 0; i < num_events; i++){
+			if(events[i].data.ptr == &s->listen_fd){
+				accept_connections(s);
+			} else if(events[i].data.ptr == &s->wake_fd){
+				flush_connections(s);
+			} else {
+				c = events[i].data.ptr;
+				if(events[i].events&EPOLLOUT){
+					write_responses(s, c);
+				}
+				if(!c->closed && events[i].events&(EPOLLIN | EPOLLHUP | EPOLLERR)){
+					read_requests(s, c);
+				}
+			}
+		}
+	}
+}
+
+//Serves until SIGINT or SIGTERM. Returns 0 if the server couldn't start
+int serve(char *path, int num_workers, int heap_size, unsigned long stack_limit){
+	struct sigaction action;
+	struct epoll_event event;
+	server s;
+	int started = 0;
+	int i;
+
+	memset(&s, 0, sizeof(server));
+	s.heap_size = heap_size;
+	s.stack_limit = stack_limit;
+	s.num_workers = num_workers > 0 ? num_workers : 1;
+	if(!listen_on(&s, path)){
+		return 0;
+	}
+	s.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	s.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	s.workers = malloc(sizeof(pthread_t)*s.num_workers);
+	if(s.epoll_fd < 0 || s.wake_fd < 0 || !s.workers){
+		fprintf(stderr, "Error: failed to set up the event loop\n");
+		goto cleanup;
+	}
+	event.events = EPOLLIN;
+	event.data.ptr = &s.listen_fd;
+	epoll_ctl(s.epoll_fd, EPOLL_CTL_ADD, s.listen_fd, &event);
+	event.data.ptr = &s.wake_fd;
+	epoll_ctl(s.epoll_fd, EPOLL_CTL_ADD, s.wake_fd, &event);
+
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.ready_cond, NULL);
+	for(started = 0; started < s.num_workers; started++){
+		if(pthread_create(s.workers + started, NULL, run_worker, &s)){
+			break;
+		}
+	}
+
+	stop_signalled = 0;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = signal_stop;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	if(started){
+		run_loop(&s);
+	}
+
+	pthread_mutex_lock(&s.lock);
+	s.stopping = 1;
+	pthread_cond_broadcast(&s.ready_cond);
+	pthread_mutex_unlock(&s.lock);
+	for(i = 0; i < started; i++){
+		pthread_join(s.workers[i], NULL);
+	}
+	while(s.connections){
+		destroy_connection(&s, s.connections);
+	}
+	pthread_mutex_destroy(&s.lock);
+	pthread_cond_destroy(&s.ready_cond);
+
+	cleanup:
+	free(s.workers);
+	if(s.epoll_fd >= 0){
+		close(s.epoll_fd);
+	}
+	if(s.wake_fd >= 0){
+		close(s.wake_fd);
+	}
+	close(s.listen_fd);
+	unlink(path);
+
+	return started > 0;
+}
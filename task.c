@@ -0,0 +1,428 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include "allocate.h"
+#include "execute.h"
+#include "task.h"
+
+//Tasks are green threads on one interp. Each has a C stack of its own, so a task can be switched out
+//wherever the evaluator counts a step, even inside a builtin like map or while that calls back into
+//it, and the interp's frame and value stacks, scope chain and shadow stack are swapped along with
+//it. The scheduler is round robin: the running task gets quota steps, then the next task in the ring
+//gets a turn. Nothing here runs on another thread, so none of it is locked. Collections, zero count
+//reconciliation and compaction find the stacks of waiting tasks through the interp's task table
+
+//The collector, releases, comparisons, hashing and the image and heap dump writers walk nested data
+//from stacks on the heap, so their depth doesn't depend on this size. The parser and the compiler
+//still recurse, the compiler no deeper than MAX_COMPILE_DEPTH. A guard page below each stack turns an
+//overflow into a crash instead of corrupting the stack next to it
+#define TASK_STACK_SIZE (256<<10)
+
+//The interp a task that hasn't run yet is starting on. makecontext() can't pass it a pointer
+static __thread interp *starting_interp;
+
+//The task whose state is in the interp. While only task 0 is unfinished the scheduler is off, and
+//current_task is NULL
+task *running_task(interp *in){
+	if(in->current_task){
+		return in->current_task;
+	}
+
+	return in->num_tasks ? in->tasks[0] : NULL;
+}
+
+static void save_state(interp *in, task *t){
+	t->current_scope = in->current_scope;
+	t->stack = in->stack;
+	t->shadow_stack_size = in->shadow_stack_size;
+	t->frames = in->frames;
+	t->call_frames = in->call_frames;
+	t->num_frames = in->num_frames;
+	t->frames_size = in->frames_size;
+	t->values = in->values;
+	t->borrowed = in->borrowed;
+	t->num_values = in->num_values;
+	t->values_size = in->values_size;
+}
+
+static void load_state(interp *in, task *t){
+	in->current_scope = t->current_scope;
+	in->stack = t->stack;
+	in->shadow_stack_size = t->shadow_stack_size;
+	in->frames = t->frames;
+	in->call_frames = t->call_frames;
+	in->num_frames = t->num_frames;
+	in->frames_size = t->frames_size;
+	in->values = t->values;
+	in->borrowed = t->borrowed;
+	in->num_values = t->num_values;
+	in->values_size = t->values_size;
+}
+
+static void *allocate_stack(){
+	void *memory;
+
+	memory = mmap(NULL, TASK_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(memory == MAP_FAILED){
+		return NULL;
+	}
+	if(mprotect(memory, sysconf(_SC_PAGESIZE), PROT_NONE)){
+		munmap(memory, TASK_STACK_SIZE);
+		return NULL;
+	}
+
+	return memory;
+}
+
+//Runs first thing on whichever task gets a turn
+static void resumed(interp *in){
+	//A finished task can't unmap the stack it is running on, so the next one does
+	if(in->finished_stack){
+		munmap(in->finished_stack, TASK_STACK_SIZE);
+		in->finished_stack = NULL;
+	}
+	if(in->current_task->next == in->current_task){
+		in->current_task = NULL;
+	}
+}
+
+//Returns once the current task gets its next turn
+static void switch_task(interp *in, task *next){
+	task *current;
+
+	current = in->current_task;
+	save_state(in, current);
+	load_state(in, next);
+	in->current_task = next;
+	in->steps_left = next->quota;
+	if(next->state == TASK_STARTING){
+		starting_interp = in;
+	}
+	swapcontext(&current->context, &next->context);
+	resumed(in);
+}
+
+//Gives the next task in the ring a turn. Called when the running task has used up its quota
+void next_task(interp *in){
+	switch_task(in, in->current_task->next);
+}
+
+//The bottom of a task's C stack. It never returns: a finished task leaves the ring and hands its
+//turn on, and nothing switches back to it
+static void run_task(){
+	interp *in;
+	task *t;
+	task *next;
+
+	in = starting_interp;
+	t = in->current_task;
+	resumed(in);
+	t->state = TASK_RUNNING;
+	t->result = evaluate_q_expression(in, t->expr, 1);
+	if(t->result == -1){
+		t->error_message = in->error_message;
+	}
+	decrement_references(in, t->expr);
+	t->expr = -1;
+	t->state = TASK_FINISHED;
+
+	//Whatever a failed evaluation left behind is reclaimed by the next collection
+	clear_shadow_stack(in);
+	while(in->current_scope != in->heap->global_scope){
+		previous_scope(in);
+	}
+	in->num_frames = 0;
+	in->num_values = 0;
+	free(in->frames);
+	free(in->call_frames);
+	free(in->values);
+	free(in->borrowed);
+	in->frames = NULL;
+	in->call_frames = NULL;
+	in->frames_size = 0;
+	in->values = NULL;
+	in->borrowed = NULL;
+	in->values_size = 0;
+
+	next = t->next;
+	t->previous->next = t->next;
+	t->next->previous = t->previous;
+	in->finished_stack = t->stack_memory;
+	t->stack_memory = NULL;
+	switch_task(in, next);
+}
+
+static int add_task(interp *in, task *t){
+	task **next_tasks;
+	unsigned int next_size;
+
+	if(in->num_tasks == in->tasks_size){
+		next_size = in->tasks_size ? in->tasks_size*2 : 16;
+		next_tasks = realloc(in->tasks, sizeof(task *)*next_size);
+		if(!next_tasks){
+			return 0;
+		}
+		in->tasks = next_tasks;
+		in->tasks_size = next_size;
+	}
+	t->id = in->num_tasks;
+	in->tasks[in->num_tasks] = t;
+	in->num_tasks++;
+
+	return 1;
+}
+
+static task *create_task(unsigned long quota){
+	task *t;
+
+	t = calloc(1, sizeof(task));
+	if(!t){
+		return NULL;
+	}
+	t->expr = -1;
+	t->result = -1;
+	t->quota = quota;
+	t->previous = t;
+	t->next = t;
+
+	return t;
+}
+
+//Task 0 stands for the evaluation already running on the interp, on the thread's own stack
+static int start_scheduler(interp *in){
+	task *t;
+
+	if(in->num_tasks){
+		return 1;
+	}
+	t = create_task(DEFAULT_TASK_QUOTA);
+	if(!t){
+		return 0;
+	}
+	t->state = TASK_RUNNING;
+	if(!add_task(in, t)){
+		free(t);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void free_task_state(interp *in, task *t){
+	scope *current_scope;
+	shadow_stack *stack;
+
+	current_scope = in->current_scope;
+	stack = in->stack;
+	in->current_scope = t->current_scope;
+	in->stack = t->stack;
+	clear_shadow_stack(in);
+	while(in->current_scope != in->heap->global_scope){
+		previous_scope(in);
+	}
+	in->current_scope = current_scope;
+	in->stack = stack;
+	free(t->frames);
+	free(t->call_frames);
+	free(t->values);
+	free(t->borrowed);
+}
+
+//Called as the interp goes away, from task 0. Tasks that haven't finished are dropped where they are
+void free_tasks(interp *in){
+	task *t;
+	unsigned int i;
+
+	for(i = 1; i < in->num_tasks; i++){
+		t = in->tasks[i];
+		if(!t){
+			continue;
+		}
+		if(t->state == TASK_RUNNING){
+			free_task_state(in, t);
+		}
+		if(t->expr != -1){
+			decrement_references(in, t->expr);
+		}
+		if(t->state == TASK_FINISHED && t->result != -1){
+			decrement_references(in, t->result);
+		}
+		if(t->stack_memory){
+			munmap(t->stack_memory, TASK_STACK_SIZE);
+		}
+		free(t);
+	}
+	if(in->num_tasks){
+		free(in->tasks[0]);
+	}
+	if(in->finished_stack){
+		munmap(in->finished_stack, TASK_STACK_SIZE);
+	}
+	free(in->tasks);
+	in->tasks = NULL;
+	in->num_tasks = 0;
+	in->tasks_size = 0;
+	in->current_task = NULL;
+	in->finished_stack = NULL;
+}
+
+//Expects the world to be stopped. The running task's state is marked with its thread's
+void mark_tasks(heap *h, interp *thread){
+	task *running;
+	task *t;
+	scope *search_scope;
+	shadow_stack *stack_place;
+	unsigned int i;
+	unsigned int j;
+
+	running = running_task(thread);
+	for(i = 0; i < thread->num_tasks; i++){
+		t = thread->tasks[i];
+		if(!t || t == running){
+			continue;
+		}
+		if(t->expr != -1){
+			mark_allocated_recursive(h, t->expr);
+		}
+		if(t->state == TASK_FINISHED){
+			if(t->result != -1){
+				mark_allocated_recursive(h, t->result);
+			}
+			continue;
+		}
+		for(search_scope = t->current_scope; search_scope != h->global_scope; search_scope = search_scope->previous){
+			iterate_dictionary(search_scope->variables, mark_variable_data, h);
+		}
+		for(stack_place = t->stack; stack_place; stack_place = stack_place->previous){
+			mark_allocated_recursive(h, stack_place->data_index);
+		}
+		for(j = 0; j < t->num_frames; j++){
+			mark_allocated_recursive(h, t->frames[j].expr);
+		}
+		for(j = 0; j < t->num_values; j++){
+			mark_allocated_recursive(h, t->values[j]);
+		}
+	}
+}
+
+//(go {EXPR} [QUOTA]) starts evaluating EXPR in a new task at the top level, and returns the task's id.
+//The task gets QUOTA steps per turn
+int go_task(interp *in, int *args, int num_args, int *tail_call){
+	unsigned long quota = DEFAULT_TASK_QUOTA;
+	task *running;
+	task *t;
+
+	if((num_args != 1 && num_args != 2) || in->data_heap[args[0]].type != Q_EXPR){
+		set_error(in, "go expects an expression and an optional quota");
+		return -1;
+	}
+	if(num_args == 2){
+		if(in->data_heap[args[1]].type != INT_DATA || in->data_heap[args[1]].int_value < 1){
+			set_error(in, "go expects a positive quota");
+			return -1;
+		}
+		quota = in->data_heap[args[1]].int_value;
+	}
+	if(!start_scheduler(in)){
+		set_error(in, "malloc returned NULL");
+		return -1;
+	}
+	t = create_task(quota);
+	if(!t){
+		set_error(in, "malloc returned NULL");
+		return -1;
+	}
+	t->stack_memory = allocate_stack();
+	if(!t->stack_memory || !add_task(in, t)){
+		if(t->stack_memory){
+			munmap(t->stack_memory, TASK_STACK_SIZE);
+		}
+		free(t);
+		set_error(in, "failed to start task");
+		return -1;
+	}
+	getcontext(&t->context);
+	t->context.uc_stack.ss_sp = t->stack_memory;
+	t->context.uc_stack.ss_size = TASK_STACK_SIZE;
+	t->context.uc_link = NULL;
+	makecontext(&t->context, run_task, 0);
+	t->state = TASK_STARTING;
+	t->expr = args[0];
+	increment_references(in, t->expr);
+	t->current_scope = in->heap->global_scope;
+
+	//The new task's first turn comes after every other task has had one
+	running = running_task(in);
+	if(!in->current_task){
+		in->current_task = running;
+		in->steps_left = running->quota;
+	}
+	t->previous = running->previous;
+	t->next = running;
+	running->previous->next = t;
+	running->previous = t;
+
+	return allocate_int(in, t->id);
+}
+
+//(yield) ends the current task's turn
+int yield_task(interp *in, int *args, int num_args, int *tail_call){
+	if(num_args){
+		set_error(in, "yield expects no arguments");
+		return -1;
+	}
+	if(in->current_task){
+		next_task(in);
+	}
+	increment_references(in, in->global_none);
+
+	return in->global_none;
+}
+
+//(await ID) lets other tasks run until task ID finishes, and returns its value or fails with its error.
+//A task can be awaited once
+int await_task(interp *in, int *args, int num_args, int *tail_call){
+	task *running;
+	task *waiting;
+	task *t;
+	int id;
+	int value;
+
+	if(num_args != 1 || in->data_heap[args[0]].type != INT_DATA){
+		set_error(in, "await expects a task id");
+		return -1;
+	}
+	id = in->data_heap[args[0]].int_value;
+	if(id < 1 || (unsigned int) id >= in->num_tasks || !in->tasks[id]){
+		set_error(in, "await expects a task that hasn't been awaited");
+		return -1;
+	}
+	t = in->tasks[id];
+	running = running_task(in);
+	if(t == running){
+		set_error(in, "a task can't await itself");
+		return -1;
+	}
+	while(t->state != TASK_FINISHED){
+		for(waiting = t; waiting; waiting = waiting->waiting_for){
+			if(waiting == running){
+				set_error(in, "tasks are awaiting each other");
+				return -1;
+			}
+		}
+		//An unfinished task is in the ring with this one, so there is a next task
+		running->waiting_for = t;
+		next_task(in);
+		running->waiting_for = NULL;
+	}
+
+	value = t->result;
+	if(value == -1){
+		set_error(in, t->error_message);
+	}
+	in->tasks[id] = NULL;
+	free(t);
+
+	return value;
+}
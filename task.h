@@ -0,0 +1,58 @@
+#ifndef TASK_INCLUDED
+#define TASK_INCLUDED
+#include <stddef.h>
+#include <ucontext.h>
+#include "allocate.h"
+
+//Evaluation steps a task runs before the next one gets a turn, unless go is given a quota
+#define DEFAULT_TASK_QUOTA 1000
+
+typedef enum task_state task_state;
+
+enum task_state{
+	TASK_STARTING,
+	TASK_RUNNING,
+	TASK_FINISHED
+};
+
+//A green thread: an evaluation with its own C stack, value and frame stacks, scope chain and shadow
+//stack, taking turns with the other tasks of its interp. Task 0 is whatever was evaluating on the
+//interp when the first task started. While a task runs its evaluation state is in the interp, and
+//the copy here is stale
+struct task{
+	int id;
+	task_state state;
+	//The Q expression the task evaluates, until it finishes
+	int expr;
+	//Once finished, the value, or -1 with error_message set
+	int result;
+	char *error_message;
+	unsigned long quota;
+	//The task this one is awaiting, to catch tasks awaiting each other
+	task *waiting_for;
+	ucontext_t context;
+	void *stack_memory;
+	scope *current_scope;
+	shadow_stack *stack;
+	unsigned int shadow_stack_size;
+	eval_frame *frames;
+	call_frame *call_frames;
+	unsigned int num_frames;
+	unsigned int frames_size;
+	int *values;
+	unsigned char *borrowed;
+	unsigned int num_values;
+	unsigned int values_size;
+	//The ring of unfinished tasks, in the order they get turns
+	task *previous;
+	task *next;
+};
+
+task *running_task(interp *in);
+void next_task(interp *in);
+void mark_tasks(heap *h, interp *thread);
+void free_tasks(interp *in);
+int go_task(interp *in, int *args, int num_args, int *tail_call);
+int yield_task(interp *in, int *args, int num_args, int *tail_call);
+int await_task(interp *in, int *args, int num_args, int *tail_call);
+#endif
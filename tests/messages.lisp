@@ -0,0 +1,5 @@
+(set a (spawn {: (set n 0) (while {- 2000 n} {: (send 0 (receive)) (set n (+ n 1))})}))
+(set n 0)
+(set total 0)
+(while {- 2000 n} {: (send a n) (set total (+ total (receive))) (set n (+ n 1))})
+(print total)
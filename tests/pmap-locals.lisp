@@ -0,0 +1,5 @@
+(set g (lambda {k xs} {pmap (lambda {x} {+ x k}) xs}))
+(print (fold + 0 (g 10 (collect (range 0 5000)))))
+(print (g 10 {1 2 3}))
+(set h (lambda {k} {pmap (lambda {x} {len (pmap (lambda {y} {+ y k x}) {1 2})}) (collect (range 0 1000))}))
+(print (fold + 0 (h 1)))
@@ -0,0 +1,3 @@
+(set a (spawn {send 0 (self)}))
+(print a (self))
+(print (receive))
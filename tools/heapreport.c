@@ -0,0 +1,324 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+//Reads a heap dump written by the heap-dump builtin and reports, for every root variable, how much
+//of the heap it retains: the cells that only it reaches, and so would be freed if it were unbound.
+//Shadow stack entries of one thread are reported together as a single root.
+
+#define UNVISITED -1
+#define SHARED -2
+
+typedef struct cell cell;
+
+struct cell{
+	int present;
+	unsigned long bytes;
+	int site;
+	int num_children;
+	long children;
+	int owner;
+};
+
+typedef struct root root;
+
+struct root{
+	char *name;
+	unsigned long cells;
+	unsigned long bytes;
+};
+
+typedef struct site site;
+
+struct site{
+	char *text;
+	unsigned long cells;
+	unsigned long bytes;
+};
+
+static cell *cells;
+static int num_cells;
+static int *children;
+static long num_children;
+static long children_size;
+static root *roots;
+static int num_roots;
+static int *root_cells;
+static int *root_ids;
+static int num_root_cells;
+static site *sites;
+static int num_sites;
+
+static void *grow(void *array, size_t element_size, long *size, long needed){
+	void *next_array;
+	long next_size;
+
+	if(needed <= *size){
+		return array;
+	}
+	next_size = *size ? *size : 256;
+	while(next_size < needed){
+		next_size *= 2;
+	}
+	next_array = realloc(array, element_size*next_size);
+	if(!next_array){
+		fprintf(stderr, "Error: out of memory\n");
+		exit(1);
+	}
+	memset((char *) next_array + element_size**size, 0, element_size*(next_size - *size));
+	*size = next_size;
+
+	return next_array;
+}
+
+static int find_root(char *name){
+	static long roots_size;
+	int i;
+
+	for(i = num_roots - 1; i >= 0; i--){
+		if(!strcmp(roots[i].name, name)){
+			return i;
+		}
+	}
+	roots = grow(roots, sizeof(root), &roots_size, num_roots + 1);
+	roots[num_roots].name = strdup(name);
+	num_roots++;
+
+	return num_roots - 1;
+}
+
+static void read_site(char *line){
+	static long sites_size;
+	char *text;
+	int id;
+
+	id = strtol(line, &text, 10);
+	if(id < 0){
+		return;
+	}
+	while(*text == ' '){
+		text++;
+	}
+	text[strcspn(text, "\n")] = '\0';
+	sites = grow(sites, sizeof(site), &sites_size, id + 1);
+	sites[id].text = strdup(text);
+	if(id >= num_sites){
+		num_sites = id + 1;
+	}
+}
+
+static void read_root(char *line){
+	static long root_cells_size;
+	static long root_ids_size;
+	char owner[64];
+	char name[256];
+	char key[512];
+	int level;
+	int data_index;
+
+	if(sscanf(line, "%63s %d %255s %d", owner, &level, name, &data_index) != 4){
+		return;
+	}
+	if(level == -1){
+		snprintf(key, sizeof(key), "%s %s", owner, name);
+	} else {
+		snprintf(key, sizeof(key), "%s %d %s", owner, level, name);
+	}
+	root_cells = grow(root_cells, sizeof(int), &root_cells_size, num_root_cells + 1);
+	root_ids = grow(root_ids, sizeof(int), &root_ids_size, num_root_cells + 1);
+	root_cells[num_root_cells] = data_index;
+	root_ids[num_root_cells] = find_root(key);
+	num_root_cells++;
+}
+
+static void read_cell(char *line){
+	static long cells_size;
+	char type[32];
+	char *c;
+	int data_index;
+	int i;
+	cell *d;
+
+	data_index = strtol(line, &c, 10);
+	if(data_index < 0 || sscanf(c, "%31s", type) != 1){
+		return;
+	}
+	c = strstr(c, type) + strlen(type);
+	cells = grow(cells, sizeof(cell), &cells_size, data_index + 1);
+	if(data_index >= num_cells){
+		num_cells = data_index + 1;
+	}
+	d = cells + data_index;
+	d->present = 1;
+	d->bytes = strtoul(c, &c, 10);
+	d->site = strtol(c, &c, 10);
+	d->num_children = strtol(c, &c, 10);
+	d->children = num_children;
+	children = grow(children, sizeof(int), &children_size, num_children + d->num_children);
+	for(i = 0; i < d->num_children; i++){
+		children[num_children++] = strtol(c, &c, 10);
+	}
+}
+
+static int read_dump(char *path){
+	char *line = NULL;
+	size_t line_size = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if(!fp){
+		fprintf(stderr, "Error: failed to open %s\n", path);
+		return 0;
+	}
+	if(getline(&line, &line_size, fp) < 0 || strcmp(line, "lisp-heap-dump 1\n")){
+		fprintf(stderr, "Error: %s is not a heap dump\n", path);
+		free(line);
+		fclose(fp);
+		return 0;
+	}
+	while(getline(&line, &line_size, fp) >= 0){
+		if(!strncmp(line, "site ", 5)){
+			read_site(line + 5);
+		} else if(!strncmp(line, "root ", 5)){
+			read_root(line + 5);
+		} else if(!strncmp(line, "cell ", 5)){
+			read_cell(line + 5);
+		}
+	}
+	free(line);
+	fclose(fp);
+
+	return 1;
+}
+
+typedef struct visit visit;
+
+struct visit{
+	int data_index;
+	int owner;
+};
+
+//Each cell is owned by the first root to reach it until a second root reaches it, after which it
+//and everything below it is shared. A cell changes state at most twice, so this is linear
+static void assign_owners(){
+	visit *stack = NULL;
+	long stack_size = 0;
+	long depth;
+	visit next;
+	cell *d;
+	int i;
+	int j;
+
+	for(i = 0; i < num_cells; i++){
+		cells[i].owner = UNVISITED;
+	}
+	for(i = 0; i < num_root_cells; i++){
+		stack = grow(stack, sizeof(visit), &stack_size, 1);
+		stack[0].data_index = root_cells[i];
+		stack[0].owner = root_ids[i];
+		depth = 1;
+		while(depth){
+			next = stack[--depth];
+			if(next.data_index < 0 || next.data_index >= num_cells || !cells[next.data_index].present){
+				continue;
+			}
+			d = cells + next.data_index;
+			if(d->owner == next.owner || d->owner == SHARED){
+				continue;
+			}
+			if(d->owner != UNVISITED){
+				next.owner = SHARED;
+			}
+			d->owner = next.owner;
+			stack = grow(stack, sizeof(visit), &stack_size, depth + d->num_children);
+			for(j = 0; j < d->num_children; j++){
+				stack[depth].data_index = children[d->children + j];
+				stack[depth].owner = next.owner;
+				depth++;
+			}
+		}
+	}
+	free(stack);
+}
+
+static int compare_roots(const void *a, const void *b){
+	const root *x = a;
+	const root *y = b;
+
+	return (y->bytes > x->bytes) - (y->bytes < x->bytes);
+}
+
+static int compare_sites(const void *a, const void *b){
+	const site *x = a;
+	const site *y = b;
+
+	return (y->bytes > x->bytes) - (y->bytes < x->bytes);
+}
+
+int main(int argc, char **argv){
+	unsigned long live_cells = 0;
+	unsigned long live_bytes = 0;
+	unsigned long shared_cells = 0;
+	unsigned long shared_bytes = 0;
+	unsigned long untagged_cells = 0;
+	unsigned long untagged_bytes = 0;
+	int limit = 20;
+	int i;
+
+	if(argc == 4 && !strcmp(argv[1], "-n")){
+		limit = atoi(argv[2]);
+		argv += 2;
+		argc -= 2;
+	}
+	if(argc != 2){
+		fprintf(stderr, "Usage: %s [-n ROWS] DUMP\n", argv[0]);
+		return 1;
+	}
+	if(!read_dump(argv[1])){
+		return 1;
+	}
+
+	assign_owners();
+	for(i = 0; i < num_cells; i++){
+		if(!cells[i].present){
+			continue;
+		}
+		live_cells++;
+		live_bytes += cells[i].bytes;
+		if(cells[i].owner == SHARED){
+			shared_cells++;
+			shared_bytes += cells[i].bytes;
+		} else if(cells[i].owner >= 0){
+			roots[cells[i].owner].cells++;
+			roots[cells[i].owner].bytes += cells[i].bytes;
+		}
+		if(cells[i].site >= 0 && cells[i].site < num_sites){
+			sites[cells[i].site].cells++;
+			sites[cells[i].site].bytes += cells[i].bytes;
+		} else {
+			untagged_cells++;
+			untagged_bytes += cells[i].bytes;
+		}
+	}
+
+	printf("live: %lu cells, %lu bytes; shared by several roots: %lu cells, %lu bytes\n\n", live_cells, live_bytes, shared_cells, shared_bytes);
+	qsort(roots, num_roots, sizeof(root), compare_roots);
+	printf("%12s %12s  %s\n", "retained", "bytes", "root (owner level name)");
+	for(i = 0; i < num_roots && i < limit; i++){
+		printf("%12lu %12lu  %s\n", roots[i].cells, roots[i].bytes, roots[i].name);
+	}
+
+	if(num_sites){
+		qsort(sites, num_sites, sizeof(site), compare_sites);
+		printf("\n%12s %12s  %s\n", "live", "bytes", "allocation site");
+		for(i = 0; i < num_sites && i < limit; i++){
+			if(sites[i].cells){
+				printf("%12lu %12lu  %s\n", sites[i].cells, sites[i].bytes, sites[i].text ? sites[i].text : "?");
+			}
+		}
+		printf("%12lu %12lu  %s\n", untagged_cells, untagged_bytes, "<untagged>");
+	}
+
+	return 0;
+}
@@ -0,0 +1,243 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//Drives a server started with --serve. Each connection is a client thread that sends a request,
+//waits for the response and sends the next, so the offered load is set by the number of
+//connections. Reports throughput and the latency distribution over all requests.
+
+typedef struct client client;
+
+struct client{
+	pthread_t thread;
+	int fd;
+	int num_requests;
+	double *latencies;
+	int completed;
+	int errors;
+};
+
+static char *request_text = "(+ 1 2)";
+static char *socket_path;
+
+static double now(){
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+static int write_all(int fd, char *bytes, size_t length){
+	ssize_t result;
+
+	while(length){
+		result = write(fd, bytes, length);
+		if(result < 0 && errno == EINTR){
+			continue;
+		}
+		if(result <= 0){
+			return 0;
+		}
+		bytes += result;
+		length -= result;
+	}
+
+	return 1;
+}
+
+static int read_all(int fd, char *bytes, size_t length){
+	ssize_t result;
+
+	while(length){
+		result = read(fd, bytes, length);
+		if(result < 0 && errno == EINTR){
+			continue;
+		}
+		if(result <= 0){
+			return 0;
+		}
+		bytes += result;
+		length -= result;
+	}
+
+	return 1;
+}
+
+static int connect_to(char *path){
+	struct sockaddr_un address;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0){
+		return -1;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+	if(connect(fd, (struct sockaddr *) &address, sizeof(address))){
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void *run_client(void *arg){
+	client *c;
+	char *frame;
+	char *response = NULL;
+	size_t response_size = 0;
+	size_t request_length;
+	unsigned char header[4];
+	uint32_t length;
+	double start;
+	int i;
+
+	c = arg;
+	request_length = strlen(request_text);
+	frame = malloc(request_length + 4);
+	if(!frame){
+		return NULL;
+	}
+	frame[0] = request_length>>24;
+	frame[1] = request_length>>16;
+	frame[2] = request_length>>8;
+	frame[3] = request_length;
+	memcpy(frame + 4, request_text, request_length);
+
+	for(i = 0; i < c->num_requests; i++){
+		start = now();
+		if(!write_all(c->fd, frame, request_length + 4) || !read_all(c->fd, (char *) header, 4)){
+			break;
+		}
+		length = (uint32_t) header[0]<<24 | (uint32_t) header[1]<<16 | (uint32_t) header[2]<<8 | header[3];
+		if(length > response_size){
+			free(response);
+			response = malloc(length);
+			response_size = length;
+			if(!response){
+				break;
+			}
+		}
+		if(!read_all(c->fd, response, length)){
+			break;
+		}
+		c->latencies[c->completed++] = now() - start;
+		if(!length || response[0] != '+'){
+			if(!c->errors){
+				fprintf(stderr, "Error response: %.*s\n", (int) (length > 200 ? 200 : length), response);
+			}
+			c->errors++;
+		}
+	}
+	free(frame);
+	free(response);
+
+	return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b){
+	const double *x = a;
+	const double *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+static double percentile(double *sorted, long count, double p){
+	long i;
+
+	i = (long) (p*count);
+	if(i >= count){
+		i = count - 1;
+	}
+	return sorted[i];
+}
+
+int main(int argc, char **argv){
+	int num_clients = 4;
+	int num_requests = 10000;
+	client *clients;
+	double *latencies;
+	long completed = 0;
+	long errors = 0;
+	double start;
+	double elapsed;
+	int i;
+
+	for(i = 1; i < argc - 1; i++){
+		if(!strcmp(argv[i], "-c") && i + 2 < argc){
+			num_clients = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "-n") && i + 2 < argc){
+			num_requests = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "-e") && i + 2 < argc){
+			request_text = argv[++i];
+		} else {
+			break;
+		}
+	}
+	if(i != argc - 1 || num_clients <= 0 || num_requests <= 0){
+		fprintf(stderr, "Usage: %s [-c CONNECTIONS] [-n REQUESTS] [-e EXPRESSION] SOCKET\n", argv[0]);
+		return 1;
+	}
+	socket_path = argv[i];
+
+	//Requests are split evenly, with the remainder going to the first connections
+	clients = calloc(num_clients, sizeof(client));
+	latencies = malloc(sizeof(double)*num_requests);
+	if(!clients || !latencies){
+		fprintf(stderr, "Error: out of memory\n");
+		return 1;
+	}
+	completed = 0;
+	for(i = 0; i < num_clients; i++){
+		clients[i].num_requests = num_requests/num_clients + (i < num_requests%num_clients);
+		clients[i].latencies = latencies + completed;
+		completed += clients[i].num_requests;
+		clients[i].fd = connect_to(socket_path);
+		if(clients[i].fd < 0){
+			fprintf(stderr, "Error: failed to connect to %s\n", socket_path);
+			return 1;
+		}
+	}
+
+	start = now();
+	for(i = 0; i < num_clients; i++){
+		pthread_create(&clients[i].thread, NULL, run_client, clients + i);
+	}
+	for(i = 0; i < num_clients; i++){
+		pthread_join(clients[i].thread, NULL);
+	}
+	elapsed = now() - start;
+
+	//Compacts the completed latencies before sorting
+	completed = 0;
+	for(i = 0; i < num_clients; i++){
+		memmove(latencies + completed, clients[i].latencies, sizeof(double)*clients[i].completed);
+		completed += clients[i].completed;
+		errors += clients[i].errors;
+		close(clients[i].fd);
+	}
+	if(!completed){
+		fprintf(stderr, "Error: no requests completed\n");
+		return 1;
+	}
+	qsort(latencies, completed, sizeof(double), compare_doubles);
+
+	printf("%ld requests over %d connections in %.3f s: %.0f requests/s, %ld errors\n", completed, num_clients, elapsed, completed/elapsed, errors);
+	printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+		percentile(latencies, completed, 0.5)*1e6, percentile(latencies, completed, 0.9)*1e6,
+		percentile(latencies, completed, 0.99)*1e6, percentile(latencies, completed, 0.999)*1e6,
+		latencies[completed - 1]*1e6);
+	free(latencies);
+	free(clients);
+
+	return completed == num_requests ? 0 : 1;
+}